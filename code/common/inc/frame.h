@@ -0,0 +1,60 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Serial link framing, shared by the firmware and the GUI.
+ *
+ * A packet is a sequence number, a command, the payload and the CRC-16
+ * of all three, low byte first. It is COBS encoded, so it holds no zero
+ * byte, and sent between two zeros. A receiver loses at most the frame
+ * a glitch hits and resyncs on the next zero, the leading one also ends
+ * any debug output sent in between. The length comes from the
+ * delimiters, payloads are only limited by the buffers. A reply carries
+ * the sequence number of its request.
+ */
+
+#define FRAME_DELIMITER 0x00
+#define FRAME_HEADER 2                  /* Sequence number and command */
+#define FRAME_CRC 2
+#define FRAME_PACKET(len) ((len) + FRAME_HEADER + FRAME_CRC)
+/* Delimiters, one COBS code per 254 bytes and the packet */
+#define FRAME_ENCODED_MAX(len) (FRAME_PACKET(len) + FRAME_PACKET(len) / 254 + 3)
+
+/* frameDecode() results */
+#define FRAME_PENDING 0
+#define FRAME_OK 1
+#define FRAME_ERROR 2                   /* Bad CRC, too short or too long */
+
+struct __frame_decoder {
+    uint8_t* buf;                       /* Decoded packet */
+    uint16_t size;
+    uint16_t pos;                       /* Bytes decoded in the current frame */
+    uint16_t len;                       /* Packet length after FRAME_OK */
+    uint8_t code;                       /* COBS code of the current block, 0 before the first */
+    uint8_t left;                       /* Bytes left in the block */
+    uint8_t overflow;
+};
+typedef struct __frame_decoder frame_decoder_t;
+
+/* Fields of the packet, valid after FRAME_OK until the next byte */
+#define frameSeq(d) ((d)->buf[0])
+#define frameCmd(d) ((d)->buf[1])
+#define framePayload(d) (&(d)->buf[FRAME_HEADER])
+#define framePayloadLen(d) ((d)->len - FRAME_HEADER - FRAME_CRC)
+
+uint16_t frameCrc(uint16_t crc, const uint8_t* data, uint16_t len);
+uint16_t frameEncode(uint8_t* out, uint8_t seq, uint8_t cmd, const uint8_t* payload, uint16_t len);
+void frameDecoderInit(frame_decoder_t* d, uint8_t* buf, uint16_t size);
+uint8_t frameDecode(frame_decoder_t* d, uint8_t byte);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
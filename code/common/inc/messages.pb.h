@@ -46,6 +46,51 @@ typedef struct _Settings_data {
     Settings_data_tc_gear_trim_t tc_gear_trim;
 } Settings_data;
 
+typedef struct {
+    size_t size;
+    uint8_t bytes[6];
+} gears_t_ratio_t;
+
+typedef struct {
+    size_t size;
+    uint8_t bytes[6];
+} gears_t_confidence_t;
+
+typedef struct _gears_t {
+    gears_t_ratio_t ratio;
+    gears_t_confidence_t confidence;
+    uint32_t samples;
+} gears_t;
+
+typedef struct {
+    size_t size;
+    uint8_t bytes[48];
+} record_t_data_t;
+
+typedef struct _record_t {
+    uint32_t block;
+    uint32_t blocks;
+    uint32_t trigger;
+    uint32_t reason;
+    record_t_data_t data;
+} record_t;
+
+typedef struct _link_t {
+    uint32_t baud;
+} link_t;
+
+typedef struct _subscribe_t {
+    uint32_t streams;
+    uint32_t period;
+} subscribe_t;
+
+typedef struct _cut_t {
+    uint32_t count;
+    uint32_t time;
+    uint32_t reason;
+    uint32_t duration;
+} cut_t;
+
 typedef struct _light_settings_t {
     uint32_t state;
     uint32_t duration;
@@ -86,6 +131,21 @@ typedef struct _settings_t {
 #define Settings_data_gears_ratio_tag            9
 #define Settings_data_gears_cut_time_tag         10
 #define Settings_data_tc_gear_trim_tag           11
+#define gears_t_ratio_tag                        1
+#define gears_t_confidence_tag                   2
+#define gears_t_samples_tag                      3
+#define record_t_block_tag                       1
+#define record_t_blocks_tag                      2
+#define record_t_trigger_tag                     3
+#define record_t_reason_tag                      4
+#define record_t_data_tag                        5
+#define link_t_baud_tag                          1
+#define subscribe_t_streams_tag                  1
+#define subscribe_t_period_tag                   2
+#define cut_t_count_tag                          1
+#define cut_t_time_tag                           2
+#define cut_t_reason_tag                         3
+#define cut_t_duration_tag                       4
 #define light_settings_t_state_tag               1
 #define light_settings_t_duration_tag            2
 #define sensors_t_rpm_tag                        1
@@ -106,6 +166,11 @@ extern const pb_field_t sensors_t_fields[6];
 extern const pb_field_t Settings_data_fields[12];
 extern const pb_field_t settings_t_fields[3];
 extern const pb_field_t status_t_fields[5];
+extern const pb_field_t gears_t_fields[4];
+extern const pb_field_t record_t_fields[6];
+extern const pb_field_t link_t_fields[2];
+extern const pb_field_t subscribe_t_fields[3];
+extern const pb_field_t cut_t_fields[5];
 extern const pb_field_t light_settings_t_fields[3];
 
 /* Maximum encoded size of messages (where known) */
@@ -114,6 +179,11 @@ extern const pb_field_t light_settings_t_fields[3];
 #define Settings_data_size                       71
 #define settings_t_size                          79
 #define status_t_size                            16
+#define gears_t_size                             22
+#define record_t_size                            74
+#define link_t_size                              6
+#define subscribe_t_size                         12
+#define cut_t_size                               24
 #define light_settings_t_size                    12
 
 #ifdef __cplusplus
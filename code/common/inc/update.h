@@ -0,0 +1,90 @@
+#ifndef _UPDATE_H_
+#define _UPDATE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-application update over the serial link, shared by the firmware,
+ * its resident update stage and the GUI.
+ *
+ * The update stage sits in the first pages of the flash and starts on
+ * every reset. It runs the application behind it, unless the
+ * application asked it to stay with CMD_UPDATE or is not valid. The
+ * settings page is never touched.
+ *
+ * The stage speaks the framed protocol at the rate the application was
+ * using. The image goes in order, one block a request, and every
+ * request waits for its reply, the CPU stalls while the flash is
+ * written. The first page of the application is kept in RAM and
+ * programmed once the CRC unit has checked the whole image, then the
+ * record of the image, its size and CRC, in the last page of the stage.
+ *
+ * The stage checks the CRC of a recorded image on every start. An
+ * update cut at any point leaves no valid record and the stage waits
+ * for the next one. An image flashed by the ROM bootloader has an
+ * erased record, only its vectors are checked.
+ */
+
+#define UPDATE_FLASH_ADDR 0x08000000
+#define UPDATE_FLASH_SIZE 0x8000        /* STM32F050K6 */
+#define UPDATE_PAGE_SIZE 1024
+#define UPDATE_STAGE_SIZE 0x1000        /* 3 pages of code and the record */
+#define UPDATE_APP_ADDR (UPDATE_FLASH_ADDR + UPDATE_STAGE_SIZE)
+#define UPDATE_APP_SIZE (UPDATE_FLASH_SIZE - UPDATE_STAGE_SIZE - UPDATE_PAGE_SIZE) /* Up to the settings */
+
+/* Words of the record page, the size and CRC are only written once the image checked */
+#define UPDATE_RECORD_ADDR (UPDATE_APP_ADDR - UPDATE_PAGE_SIZE)
+#define UPDATE_RECORD_STATE 0
+#define UPDATE_RECORD_SIZE 1
+#define UPDATE_RECORD_CRC 2
+#define UPDATE_RECORD_ERASED 0xFFFFFFFF /* State as the ROM bootloader leaves it */
+#define UPDATE_RECORD_STARTED 0         /* State from the first CMD_UPDATE_BEGIN on */
+
+/*
+ * The Cortex-M0 has no vector table offset, the application copies its
+ * 48 vectors to the start of SRAM and maps SRAM at 0. Behind them, the
+ * words the application leaves to the stage across the reset.
+ */
+#define UPDATE_RAM_ADDR 0x20000000
+#define UPDATE_RAM_SIZE 0x1000
+#define UPDATE_VECTORS_SIZE 0xC0
+#define UPDATE_HANDOFF_ADDR (UPDATE_RAM_ADDR + UPDATE_VECTORS_SIZE)
+#define UPDATE_HANDOFF_SIZE 8           /* Magic and rate */
+#define UPDATE_MAGIC 0x54445055         /* "UPDT" */
+
+/* To the application, the reply is a link_t with the rate the stage answers at */
+#define CMD_UPDATE 0x0C
+
+/* To the stage, each reply is a status byte */
+#define CMD_UPDATE_BEGIN 0x10           /* Size and CRC of the image, 32 bit little endian */
+#define CMD_UPDATE_BLOCK 0x11           /* Offset, 32 bit little endian, and the data */
+#define CMD_UPDATE_END 0x12             /* Checks the CRC, then commits and restarts */
+
+#define UPDATE_BLOCK_SIZE 256           /* Largest block, a multiple of 4 */
+#define UPDATE_BEGIN_LEN 8
+#define UPDATE_BLOCK_HEADER 4
+#define UPDATE_PAYLOAD_MAX (UPDATE_BLOCK_HEADER + UPDATE_BLOCK_SIZE)
+
+#define UPDATE_OK 0
+#define UPDATE_ERROR_SIZE 1             /* Image too large, or not words */
+#define UPDATE_ERROR_OFFSET 2           /* Block out of order */
+#define UPDATE_ERROR_FLASH 3            /* Erase, program or read back failed */
+#define UPDATE_ERROR_CRC 4
+#define UPDATE_ERROR_STATE 5            /* Block or end before begin */
+
+/* CRC-32 of the STM32 CRC unit, on 32 bit words as the CPU reads them */
+#define UPDATE_CRC_INIT 0xFFFFFFFF
+uint32_t updateCrc(uint32_t crc, const uint8_t* data, uint32_t len);
+
+uint32_t updateGet32(const uint8_t* buf);
+void updatePut32(uint8_t* buf, uint32_t val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
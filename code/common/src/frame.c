@@ -0,0 +1,168 @@
+#include "frame.h"
+
+#define FRAME_CRC_INIT 0xFFFF
+
+/* CRC-16/CCITT-FALSE, 0x1021, a nibble at a time */
+static const uint16_t crc_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+struct __cobs {
+    uint8_t* out;
+    uint16_t n;                         /* Bytes written */
+    uint16_t code_pos;                  /* Where the code of the current block goes */
+    uint8_t code;
+};
+typedef struct __cobs cobs_t;
+
+uint16_t frameCrc(uint16_t crc, const uint8_t* data, uint16_t len)
+{
+    while (len--)
+    {
+        const uint8_t b = *data++;
+
+        crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (b >> 4)];
+        crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (b & 0x0F)];
+    }
+
+    return crc;
+}
+
+static void cobsPut(cobs_t* c, uint8_t b)
+{
+    if (b != 0)
+    {
+        c->out[c->n++] = b;
+        if (++c->code < 0xFF)
+        {
+            return;
+        }
+    }
+
+    /* A zero, or a full block that implies none */
+    c->out[c->code_pos] = c->code;
+    c->code_pos = c->n++;
+    c->code = 1;
+}
+
+static void cobsPutBuf(cobs_t* c, const uint8_t* data, uint16_t len)
+{
+    while (len--)
+    {
+        cobsPut(c, *data++);
+    }
+}
+
+/*
+ * Encodes a packet into out, delimiters included, and returns its size.
+ * out must hold FRAME_ENCODED_MAX(len) bytes.
+ */
+uint16_t frameEncode(uint8_t* out, uint8_t seq, uint8_t cmd, const uint8_t* payload, uint16_t len)
+{
+    const uint8_t header[FRAME_HEADER] = {seq, cmd};
+    uint8_t crc[FRAME_CRC];
+    uint16_t v;
+    cobs_t c;
+
+    v = frameCrc(FRAME_CRC_INIT, header, FRAME_HEADER);
+    v = frameCrc(v, payload, len);
+    crc[0] = v & 0xFF;
+    crc[1] = v >> 8;
+
+    out[0] = FRAME_DELIMITER;
+    c.out = out;
+    c.code_pos = 1;
+    c.n = 2;
+    c.code = 1;
+
+    cobsPutBuf(&c, header, FRAME_HEADER);
+    cobsPutBuf(&c, payload, len);
+    cobsPutBuf(&c, crc, FRAME_CRC);
+
+    out[c.code_pos] = c.code;
+    out[c.n++] = FRAME_DELIMITER;
+
+    return c.n;
+}
+
+void frameDecoderInit(frame_decoder_t* d, uint8_t* buf, uint16_t size)
+{
+    d->buf = buf;
+    d->size = size;
+    d->pos = d->len = 0;
+    d->code = d->left = d->overflow = 0;
+}
+
+static void frameDecodePut(frame_decoder_t* d, uint8_t b)
+{
+    if (d->pos < d->size)
+    {
+        d->buf[d->pos++] = b;
+    }
+    else
+    {
+        d->overflow = 1;
+    }
+}
+
+/* Checks the frame ended by a delimiter */
+static uint8_t frameDecodeEnd(frame_decoder_t* d)
+{
+    uint16_t crc;
+
+    if (d->code == 0)
+    {
+        return FRAME_PENDING;           /* Back to back delimiters */
+    }
+    if (d->overflow || d->left || d->pos < FRAME_PACKET(0))
+    {
+        return FRAME_ERROR;
+    }
+
+    crc = d->buf[d->pos-2] | (d->buf[d->pos-1] << 8);
+    if (frameCrc(FRAME_CRC_INIT, d->buf, d->pos - FRAME_CRC) != crc)
+    {
+        return FRAME_ERROR;
+    }
+
+    d->len = d->pos;
+
+    return FRAME_OK;
+}
+
+/*
+ * Feeds one received byte. Returns FRAME_OK when it completes a valid
+ * packet, FRAME_ERROR when it ends a damaged one.
+ */
+uint8_t frameDecode(frame_decoder_t* d, uint8_t byte)
+{
+    uint8_t res;
+
+    if (byte == FRAME_DELIMITER)
+    {
+        res = frameDecodeEnd(d);
+        d->pos = 0;
+        d->code = d->left = d->overflow = 0;
+
+        return res;
+    }
+
+    if (d->left)
+    {
+        frameDecodePut(d, byte);
+        d->left--;
+    }
+    else
+    {
+        /* New block, the previous one ended with an implied zero */
+        if (d->code && d->code < 0xFF)
+        {
+            frameDecodePut(d, 0);
+        }
+        d->code = byte;
+        d->left = byte - 1;
+    }
+
+    return FRAME_PENDING;
+}
@@ -48,6 +48,41 @@ const pb_field_t status_t_fields[5] = {
     PB_LAST_FIELD
 };
 
+const pb_field_t gears_t_fields[4] = {
+    PB_FIELD2(  1, BYTES   , REQUIRED, STATIC, FIRST, gears_t, ratio, ratio, 0),
+    PB_FIELD2(  2, BYTES   , REQUIRED, STATIC, OTHER, gears_t, confidence, ratio, 0),
+    PB_FIELD2(  3, UINT32  , REQUIRED, STATIC, OTHER, gears_t, samples, confidence, 0),
+    PB_LAST_FIELD
+};
+
+const pb_field_t record_t_fields[6] = {
+    PB_FIELD2(  1, UINT32  , REQUIRED, STATIC, FIRST, record_t, block, block, 0),
+    PB_FIELD2(  2, UINT32  , REQUIRED, STATIC, OTHER, record_t, blocks, block, 0),
+    PB_FIELD2(  3, UINT32  , REQUIRED, STATIC, OTHER, record_t, trigger, blocks, 0),
+    PB_FIELD2(  4, UINT32  , REQUIRED, STATIC, OTHER, record_t, reason, trigger, 0),
+    PB_FIELD2(  5, BYTES   , REQUIRED, STATIC, OTHER, record_t, data, reason, 0),
+    PB_LAST_FIELD
+};
+
+const pb_field_t link_t_fields[2] = {
+    PB_FIELD2(  1, UINT32  , REQUIRED, STATIC, FIRST, link_t, baud, baud, 0),
+    PB_LAST_FIELD
+};
+
+const pb_field_t subscribe_t_fields[3] = {
+    PB_FIELD2(  1, UINT32  , REQUIRED, STATIC, FIRST, subscribe_t, streams, streams, 0),
+    PB_FIELD2(  2, UINT32  , REQUIRED, STATIC, OTHER, subscribe_t, period, streams, 0),
+    PB_LAST_FIELD
+};
+
+const pb_field_t cut_t_fields[5] = {
+    PB_FIELD2(  1, UINT32  , REQUIRED, STATIC, FIRST, cut_t, count, count, 0),
+    PB_FIELD2(  2, UINT32  , REQUIRED, STATIC, OTHER, cut_t, time, count, 0),
+    PB_FIELD2(  3, UINT32  , REQUIRED, STATIC, OTHER, cut_t, reason, time, 0),
+    PB_FIELD2(  4, UINT32  , REQUIRED, STATIC, OTHER, cut_t, duration, reason, 0),
+    PB_LAST_FIELD
+};
+
 const pb_field_t light_settings_t_fields[3] = {
     PB_FIELD2(  1, UINT32  , REQUIRED, STATIC, FIRST, light_settings_t, state, state, 0),
     PB_FIELD2(  2, UINT32  , REQUIRED, STATIC, OTHER, light_settings_t, duration, state, 0),
@@ -57,10 +92,10 @@ const pb_field_t light_settings_t_fields[3] = {
 
 /* Check that field information fits in pb_field_t */
 #if !defined(PB_FIELD_16BIT) && !defined(PB_FIELD_32BIT)
-STATIC_ASSERT((pb_membersize(settings_t, data) < 256), YOU_MUST_DEFINE_PB_FIELD_16BIT_FOR_MESSAGES_Info_sensors_t_Settings_data_settings_t_status_t_light_settings_t)
+STATIC_ASSERT((pb_membersize(settings_t, data) < 256), YOU_MUST_DEFINE_PB_FIELD_16BIT_FOR_MESSAGES_Info_sensors_t_Settings_data_settings_t_status_t_gears_t_record_t_link_t_subscribe_t_cut_t_light_settings_t)
 #endif
 
 #if !defined(PB_FIELD_32BIT)
-STATIC_ASSERT((pb_membersize(settings_t, data) < 65536), YOU_MUST_DEFINE_PB_FIELD_32BIT_FOR_MESSAGES_Info_sensors_t_Settings_data_settings_t_status_t_light_settings_t)
+STATIC_ASSERT((pb_membersize(settings_t, data) < 65536), YOU_MUST_DEFINE_PB_FIELD_32BIT_FOR_MESSAGES_Info_sensors_t_Settings_data_settings_t_status_t_gears_t_record_t_link_t_subscribe_t_cut_t_light_settings_t)
 #endif
 
@@ -0,0 +1,38 @@
+#include "update.h"
+
+#define UPDATE_CRC_POLY 0x04C11DB7
+
+/*
+ * CRC-32/MPEG-2, what the CRC unit computes after a reset of its data
+ * register: each word is fed most significant bit first, the word being
+ * the 4 bytes read little endian. len is a multiple of 4.
+ */
+uint32_t updateCrc(uint32_t crc, const uint8_t* data, uint32_t len)
+{
+    uint8_t bit;
+
+    for (; len >= 4; len -= 4, data += 4)
+    {
+        crc ^= updateGet32(data);
+
+        for (bit = 0; bit < 32; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ UPDATE_CRC_POLY : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+uint32_t updateGet32(const uint8_t* buf)
+{
+    return buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void updatePut32(uint8_t* buf, uint32_t val)
+{
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+}
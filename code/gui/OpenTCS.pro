@@ -16,21 +16,31 @@ SOURCES += src/main.cpp\
         src/mainwindow.cpp \
     src/ftdi.cpp \
     src/tcscom.cpp \
+    src/tcsworker.cpp \
     src/bootloader.cpp \
+    src/tcsupdate.cpp \
     ../common/src/pb_encode.c \
     ../common/src/pb_decode.c \
     ../common/src/nanopb.pb.c \
-    ../common/src/messages.pb.c
+    ../common/src/messages.pb.c \
+    ../common/src/frame.c \
+    ../common/src/update.c
 
 HEADERS  += inc/mainwindow.h \
+    inc/transport.h \
     inc/ftdi.h \
     inc/tcscom.h \
+    inc/tcsworker.h \
+    inc/spscqueue.h \
     inc/bootloader.h \
+    inc/tcsupdate.h \
     ../common/inc/pb_encode.h \
     ../common/inc/pb_decode.h \
     ../common/inc/pb.h \
     ../common/inc/nanopb.pb.h \
     ../common/inc/messages.pb.h \
+    ../common/inc/frame.h \
+    ../common/inc/update.h \
     inc/ftd2xx.h \
     inc/compat.h
 
@@ -39,6 +49,8 @@ FORMS    += ui/mainwindow.ui
 INCLUDEPATH += inc ../common/inc
 
 unix {
+    SOURCES += src/serialport.cpp
+    HEADERS += inc/serialport.h
     LIBS += -L/usr/local/lib -lftd2xx
 }
  win32 {
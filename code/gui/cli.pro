@@ -0,0 +1,63 @@
+#-------------------------------------------------
+#
+# Headless flashing and configuration of a batch of boards
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = opentcs-cli
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += src/cli.cpp \
+    src/tcsunit.cpp \
+    src/ftdi.cpp \
+    src/loopback.cpp \
+    src/stm32emu.cpp \
+    src/tcsemu.cpp \
+    src/tcscom.cpp \
+    src/bootloader.cpp \
+    src/tcsupdate.cpp \
+    ../common/src/pb_encode.c \
+    ../common/src/pb_decode.c \
+    ../common/src/nanopb.pb.c \
+    ../common/src/messages.pb.c \
+    ../common/src/frame.c \
+    ../common/src/update.c
+
+HEADERS  += inc/tcsunit.h \
+    inc/transport.h \
+    inc/ftdi.h \
+    inc/loopback.h \
+    inc/emulator.h \
+    inc/stm32emu.h \
+    inc/tcsemu.h \
+    inc/tcscom.h \
+    inc/bootloader.h \
+    inc/tcsupdate.h \
+    ../common/inc/pb_encode.h \
+    ../common/inc/pb_decode.h \
+    ../common/inc/pb.h \
+    ../common/inc/nanopb.pb.h \
+    ../common/inc/messages.pb.h \
+    ../common/inc/frame.h \
+    ../common/inc/update.h \
+    inc/ftd2xx.h \
+    inc/compat.h
+
+INCLUDEPATH += inc ../common/inc
+
+unix {
+    SOURCES += src/serialport.cpp
+    HEADERS += inc/serialport.h
+    LIBS += -L/usr/local/lib -lftd2xx
+}
+ win32 {
+     DEFINES += FTD2XX_EXPORTS
+     INCLUDEPATH += inc/win32
+     CONFIG += embed_manifest_exe
+ }
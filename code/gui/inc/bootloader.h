@@ -3,8 +3,9 @@
 
 #include <QObject>
 #include <QtEndian>
-#include <ftdi.h>
+#include "transport.h"
 #include <QFile>
+#include <QVector>
 
 #define STM32_ACK       0x79
 #define STM32_NACK      0x1F
@@ -12,7 +13,23 @@
 #define STM32_CMD_GET   0x00    /* get the version and command supported */
 #define STM32_CMD_EE    0x44    /* extended erase */
 
-#define STM32_FLASH_ADDR 0x80000000
+#define STM32_FLASH_ADDR 0x08000000
+#define STM32_UID_ADDR  0x1FFFF7AC  /* 96 bits, unique per device */
+#define STM32_UID_SIZE  12
+#define STM32_PAGE_SIZE 1024
+#define STM32_BLOCK_SIZE 256    /* Largest Write and Read Memory */
+#define STM32_BAUD      115200  /* Highest autobaud rate, 8E1 */
+#define STM32_ACK_TIMEOUT 100   /* ms */
+#define STM32_WRITE_TIMEOUT 100 /* ms to program a block */
+#define STM32_ERASE_TIMEOUT 40  /* ms per page */
+
+/* progress() stages */
+#define BOOTLOADER_ERASE 0
+#define BOOTLOADER_WRITE 1
+#define BOOTLOADER_VERIFY 2
+#define BOOTLOADER_COMPARE 3    /* Reading back pages, no manifest for the device */
+
+#define BOOTLOADER_MANIFEST "flashed"   /* QSettings group, page hashes per device */
 
 class bootloader : public QObject
 {
@@ -32,25 +49,32 @@ struct {
 } cmd;
 
 public:
-    explicit bootloader(ftdi* device, QObject *parent = 0);
+    explicit bootloader(transport* device, QObject *parent = 0);
     ~bootloader();
-    bool writeFile(QFile * file);
+    bool writeFile(QFile * file, bool delta = true);
 
 public slots:
 
 signals:
+    void progress(int stage, quint32 done, quint32 total);
+    void flashed(quint32 bytes, quint32 skipped, quint32 ms);
 
 private slots:
     bool init(void);
     bool sendCommand(quint8 cmd);
-    bool unlockFlash(void);
+    bool readAck(quint32 timeout);
     bool readMem(quint32 address, quint8 * data, quint32 len);
-    bool writeMem(quint32 address, quint8 * data, quint32 len);
-    bool eraseMem(void);
+    bool writeMem(quint32 address, const quint8 * data, quint32 len);
+    bool eraseMem(const QVector<quint16>& pages);
+    bool verifyMem(quint32 address, const quint8 * data, quint32 len);
+    quint16 buildWrite(quint32 address, const quint8 * data, quint32 len);
     quint8 calcChecksum(const quint32 val);
+    bool readUid(QString* uid);
+    bool changedPages(const QString& uid, const QByteArray& data, QVector<quint16>* pages);
+    static QByteArray hashPages(const QByteArray& data);
 
 private:
-    ftdi*           ftdi_device;
+    transport*      device;
     quint8          rx_buff[1024];
     quint8          tx_buff[1024];
     quint8          bl_version;
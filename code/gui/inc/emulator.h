@@ -0,0 +1,33 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <QByteArray>
+
+/* Serial time of bytes with their start, stop and parity bits, in us */
+#define EMULATOR_LINK_US(bytes, baud, parity) ((quint64)(bytes) * ((parity) ? 11 : 10) * 1000000 / (baud))
+
+/*
+ * Far end of a loopback transport, a model of what runs on the device.
+ * It is called in the thread of the transport, with the time of the
+ * link in us, and appends what the device sends to reply. Bytes the
+ * device would not receive, at the wrong rate or parity, are dropped
+ * by it.
+ */
+class emulator
+{
+public:
+    virtual ~emulator() {}
+
+    /* NRST released */
+    virtual void reset(void) = 0;
+    /*
+     * Bytes the host sent at baud and parity, the last one received at
+     * now. Returns the us the device works before its reply goes out.
+     */
+    virtual quint32 receive(const quint8* data, quint32 len, quint32 baud, quint8 parity,
+                            quint64 now, QByteArray* reply) = 0;
+    /* Time passes without the host sending, for what the device sends on its own */
+    virtual void tick(quint64 now, QByteArray* reply) { Q_UNUSED(now); Q_UNUSED(reply); }
+};
+
+#endif // EMULATOR_H
@@ -1,33 +1,44 @@
 #ifndef FTDI_H
 #define FTDI_H
 
-#include <QObject>
-#include <QDebug>
-
-#include "compat.h"
+#include <QString>
+#include <QStringList>
+#include <QMutex>
+#include "transport.h"
 #include "ftd2xx.h"
 
+#define FTDI_TIMEOUT TRANSPORT_TIMEOUT /* ms, FT_Read and FT_Write */
+#define FTDI_LATENCY 2 /* ms before a partial packet is sent to the host, 16 by default */
+
 #define CBUS2MASK(a, b, c, d) (0xF0|(0x0F&((1&a)|(2&(b<<1))|(4&(c<<2))|(8&(d<<3)))))
 
-class ftdi : public QObject
+/*
+ * FT-X adapter through ftd2xx, BOOT0 and NRST on CBUS0 and CBUS3. Opens
+ * the adapter with the given serial number, the first one found without.
+ */
+class ftdi : public transport
 {
     Q_OBJECT
 public:
-    explicit ftdi(QObject *parent = 0);
+    explicit ftdi(const QString& serial = QString(), QObject *parent = 0);
     ~ftdi();
+    static QStringList list(void);
     bool connect(void);
     bool disconnect(void);
-    bool write(quint8 * buf, quint32 len = 1);
+    bool write(quint8 * buf, quint32 len = 1, bool purge = true);
     bool read(quint8 * buf, quint32 len = 1);
     bool readAll(quint8 * buf, quint32 max_len);
+    quint32 queued(void);
+    bool waitEvent(quint32 ms);
+    void wake(void);
+    bool setBaudRate(quint32 baud);
+    bool setParity(quint8 parity);
 
     bool setCBUSMux(bool en);
     bool setCBUS(int mask);
     bool resetBootloader(void);
     bool resetNormal(void);
 
-    bool isConnected(void) { return connected; }
-    
 signals:
     
 public slots:
@@ -36,14 +47,18 @@ private slots:
     bool purge(void);
 
 private:
-    bool                connected;
-    qint32              iNumDevs;
-    qint8 *             pcBufLD[1];
-    qint8               cBufLD[64];
+    static QMutex       driver;         /* Listing and opening, one adapter at a time */
+
+    QString             serial;
     FT_STATUS           ftStatus;
     FT_HANDLE           ftHandle;
     FT_EEPROM_HEADER    ftEepromHeader;
     FT_EEPROM_X_SERIES  eepromDATA;
+#ifdef WIN32
+    HANDLE              event;          /* Set on received bytes and by wake() */
+#else
+    EVENT_HANDLE        event;
+#endif
 };
 
 #endif // FTDI_H
@@ -0,0 +1,71 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include "transport.h"
+#include "emulator.h"
+
+#define LOOPBACK_LATENCY 1000   /* us each way, a USB frame and the adapter latency timer */
+
+/*
+ * Transport to emulators in the same process: the firmware after
+ * resetNormal() and connect(), the ROM bootloader after
+ * resetBootloader(). Bytes written reach the emulator at once and its
+ * reply is queued before write() returns.
+ *
+ * Besides wall time it keeps the time the exchanges would take on a
+ * real link, elapsed(), from the bytes sent each way at the current
+ * rate, the adapter latency and the time the emulator works. It is
+ * deterministic, so throughput and latency can be compared run to run.
+ * waitEvent() also sleeps for real, only when there is nothing to read.
+ * Paced, the calls return once the link time went by on the wall clock,
+ * as they would on a device.
+ */
+class loopback : public transport
+{
+    Q_OBJECT
+public:
+    explicit loopback(emulator* firmware, emulator* rom, QObject *parent = 0);
+    ~loopback();
+    bool connect(void);
+    bool disconnect(void);
+    bool write(quint8 * buf, quint32 len = 1, bool purge = true);
+    bool read(quint8 * buf, quint32 len = 1);
+    quint32 queued(void);
+    bool waitEvent(quint32 ms);
+    void wake(void);
+    bool setBaudRate(quint32 baud);
+    bool setParity(quint8 parity);
+    bool resetBootloader(void);
+    bool resetNormal(void);
+
+    quint64 elapsed(void) { return now; }   /* Link time in us */
+    quint64 bytesSent(void) { return sent; }
+    quint64 bytesReceived(void) { return received; }
+    void setPaced(bool paced);
+
+private:
+    void advance(quint64 us);
+    void deliver(const QByteArray& reply);
+    void pace(void);
+
+    emulator*           firmware;
+    emulator*           rom;
+    emulator*           device;         /* The one running */
+    quint8              parity;
+    QByteArray          rx;             /* Sent by the device, not read yet */
+    quint64             now;
+    quint64             sent;
+    quint64             received;
+
+    bool                paced;
+    quint64             paced_from;     /* Link time when pacing started */
+    QElapsedTimer       clock;
+
+    QMutex              mutex;          /* Guards woken */
+    QWaitCondition      event;
+    bool                woken;
+};
+
+#endif // LOOPBACK_H
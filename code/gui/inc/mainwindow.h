@@ -3,8 +3,9 @@
 
 #include <QMainWindow>
 #include <QFileDialog>
-#include "bootloader.h"
-#include "tcscom.h"
+#include "tcsworker.h"
+
+#define PUSH_PERIOD 10 /* ms between pushes asked for */
 
 namespace Ui {
 class MainWindow;
@@ -30,11 +31,19 @@ private slots:
     void getData(void);
     void applyConfig(void);
 
+    void requestFinished(int type, bool error);
+    void showSettings(const settings_t& settings);
+    void showState(const sensors_t& sensors, const status_t& status);
+    void readTelemetry(void);
+    void showSensors(const sensors_t& sensors);
+    void showStatus(const status_t& status);
+    void showCut(const cut_t& cut);
+    void showFlashProgress(int stage, quint32 done, quint32 total);
+    void showFlashed(quint32 bytes, quint32 skipped, quint32 ms);
+
 private:
     Ui::MainWindow *ui;
-    ftdi ftdi_device;
-    bootloader bl;
-    tcscom tcs;
+    tcsworker worker;
     bool connected;
 
     settings_t settings;
@@ -0,0 +1,43 @@
+#ifndef SERIALPORT_H
+#define SERIALPORT_H
+
+#include <QString>
+#include "transport.h"
+
+/*
+ * POSIX tty: a USB serial adapter under its kernel driver, or a pty
+ * with an emulator on the other side. RTS drives BOOT0 and DTR drives
+ * NRST, asserted means BOOT0 high and NRST low, the wiring stm32flash
+ * expects. A pty has no modem lines and no parity, resets and parity
+ * are skipped on it.
+ */
+class serialport : public transport
+{
+    Q_OBJECT
+public:
+    explicit serialport(const QString& path, QObject *parent = 0);
+    ~serialport();
+    bool connect(void);
+    bool disconnect(void);
+    bool write(quint8 * buf, quint32 len = 1, bool purge = true);
+    bool read(quint8 * buf, quint32 len = 1);
+    quint32 queued(void);
+    bool waitEvent(quint32 ms);
+    void wake(void);
+    bool setBaudRate(quint32 baud);
+    bool setParity(quint8 parity);
+    bool resetBootloader(void);
+    bool resetNormal(void);
+
+private:
+    bool setLines(bool boot0, bool reset);
+    bool setAttributes(quint32 baud, quint8 parity);
+
+    QString             path;
+    int                 fd;
+    int                 wake_pipe[2];   /* wake() writes a byte, waitEvent() polls it with fd */
+    quint8              parity;
+    bool                pty;            /* No modem lines */
+};
+
+#endif // SERIALPORT_H
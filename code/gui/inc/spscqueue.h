@@ -0,0 +1,51 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QAtomicInt>
+
+/*
+ * Lock free ring between one producer thread and one consumer thread.
+ * Each index is written by one side only, the release store publishes
+ * the slot it moves over and the acquire load on the other side sees
+ * it. N must be a power of two, one slot is left empty.
+ */
+template <typename T, unsigned N>
+class spscqueue
+{
+public:
+    spscqueue() : head(0), tail(0) {}
+
+    /* Producer side, false when full */
+    bool push(const T& item)
+    {
+        const int h = head.loadAcquire();
+        const int next = (h + 1) & (N - 1);
+
+        if (next == tail.loadAcquire())
+            return false;
+
+        ring[h] = item;
+        head.storeRelease(next);
+        return true;
+    }
+
+    /* Consumer side, false when empty */
+    bool pop(T* item)
+    {
+        const int t = tail.loadAcquire();
+
+        if (t == head.loadAcquire())
+            return false;
+
+        *item = ring[t];
+        tail.storeRelease((t + 1) & (int)(N - 1));
+        return true;
+    }
+
+private:
+    T           ring[N];
+    QAtomicInt  head;               /* Next slot to write */
+    QAtomicInt  tail;               /* Next slot to read */
+};
+
+#endif // SPSCQUEUE_H
@@ -0,0 +1,71 @@
+#ifndef STM32EMU_H
+#define STM32EMU_H
+
+#include "emulator.h"
+
+#define STM32EMU_FLASH_ADDR 0x08000000
+#define STM32EMU_FLASH_SIZE 32768   /* STM32F050K6 */
+#define STM32EMU_PAGE_SIZE 1024
+#define STM32EMU_SECTOR_PAGES 4     /* Pages per write protection bit */
+#define STM32EMU_UID_ADDR 0x1FFFF7AC
+#define STM32EMU_UID_SIZE 12
+#define STM32EMU_SYNC_BYTE 0x7F
+#define STM32EMU_BAUD_MAX 115200    /* Autobaud range of the ROM bootloader */
+#define STM32EMU_VERSION 0x31
+#define STM32EMU_PID 0x0440         /* STM32F05x */
+
+/* Datasheet times */
+#define STM32EMU_PROGRAM_US 53      /* Half word */
+#define STM32EMU_ERASE_US 30000     /* Page */
+
+#define STM32EMU_ACK 0x79
+#define STM32EMU_NACK 0x1F
+
+/*
+ * The USART ROM bootloader of an STM32F05x, AN3155 v3.1: autobaud on
+ * 0x7F at 8E1, then GET, GV, GID, RM, GO, WM, ER or EE, WP, UW, RP and
+ * UR. Programming fails on a half word that is not erased and on a
+ * protected page, like the flash interface would. WP, UW, RP and UR
+ * reset the device, the host syncs again. GO is acknowledged, the jump
+ * is not modeled.
+ */
+class stm32emu : public emulator
+{
+public:
+    explicit stm32emu(quint32 seed = 0, bool extended_erase = true);
+
+    void reset(void);
+    quint32 receive(const quint8* data, quint32 len, quint32 baud, quint8 parity,
+                    quint64 now, QByteArray* reply);
+
+    quint8* flash(void) { return memory; }
+    const quint8* uid(void) { return id; }
+    quint32 pagesErased(void) { return erased; }
+    quint32 bytesProgrammed(void) { return programmed; }
+
+private:
+    quint32 command(QByteArray* reply);
+    quint32 payload(QByteArray* reply);
+    bool validAddress(quint32 address, quint32 len, bool writing);
+    bool erasePage(quint16 page);
+    void expect(quint8 state, quint16 len);
+
+    quint8              memory[STM32EMU_FLASH_SIZE];
+    quint8              id[STM32EMU_UID_SIZE];
+    quint8              wrp;            /* Protected sectors, survives resets */
+    bool                rdp;
+    bool                extended_erase;
+
+    quint32             baud;           /* Found by autobaud, 0 before */
+    quint8              state;
+    quint8              cmd;
+    quint32             address;
+    quint8              buf[2 * 256 + 3];
+    quint16             pos;
+    quint16             len;            /* Bytes the state waits for */
+
+    quint32             erased;
+    quint32             programmed;
+};
+
+#endif // STM32EMU_H
@@ -7,25 +7,41 @@
 #include "pb_decode.h"
 #include "pb_encode.h"
 #include "messages.pb.h"
-
-#define SER_MAGIC1 0xAB
-#define SER_MAGIC2 0xCD
-
-#define CMD_OFFSET_CMD 2
-#define CMD_OFFSET_LEN 3
+#include "frame.h"
+#include "update.h"
 
 #define CMD_SEND_DIAG 0x01
 #define CMD_SEND_INFO 0x02
 #define CMD_SEND_SETTINGS 0x03
 #define CMD_SAVE_SETTINGS 0x04
+#define CMD_SEND_GEARS 0x05
+#define CMD_SEND_RECORD 0x06
+#define CMD_CLEAR_RECORD 0x07
+#define CMD_SET_BAUD 0x08
+#define CMD_LINK_CHECK 0x09
+#define CMD_SUBSCRIBE 0x0A
+#define CMD_CUT_EVENT 0x0B
+#define CMD_LINK_TEST 0x0D
+#define CMD_PUSH 0x80 /* Set in the command of frames the device sends on its own */
+
+/* Streams for subscribe() */
+#define PUSH_SENSORS 0x01
+#define PUSH_STATUS 0x02
+#define PUSH_CUTS 0x04
+
+#define LINK_SWITCH_DELAY 5 /* ms for the device to send its answer and switch */
+#define LINK_CHECK_TIMEOUT 200 /* ms the device waits at a new rate */
+#define LINK_REPLY_TIMEOUT 50 /* ms for each reply at a new rate */
 
 #define SETTINGS_FUNCTION_TC 0x1
 #define SETTINGS_FUNCTION_SHIFTER 0x2
 #define SETTINGS_FUNCTION_LED 0x4
+#define SETTINGS_FUNCTION_SHIFTER_AWD 0x8
 
 #define SETTINGS_CUT_DISABLED 0x0
 #define SETTINGS_CUT_NORMAL 0x1
 #define SETTINGS_CUT_PROGRESSIVE 0x2
+#define SETTINGS_CUT_SYNC 0x3
 
 #define SETTINGS_SENSOR_NORMAL 0
 #define SETTINGS_SENSOR_REVERSE 1
@@ -34,27 +50,50 @@ class tcscom : public QObject
 {
     Q_OBJECT
 public:
-    explicit tcscom(ftdi* device, QObject *parent = 0);
+    explicit tcscom(transport* device, QObject *parent = 0);
     ~tcscom();
     
 signals:
-    
+    void sensorsReceived(const sensors_t& sensors);
+    void statusReceived(const status_t& status);
+    void cutReceived(const cut_t& cut);
+
 public slots:
     bool setSettings(const settings_t* settings);
     bool getSettings(settings_t* settings);
 
     bool getInfo(status_t* status);
     bool getDiag(sensors_t* sensors);
-
-private slots:
-    quint8 doChecksum(quint8 * buf, quint8 len);
+    bool getGears(gears_t* gears);
+    bool getState(sensors_t* sensors, status_t* status, settings_t* settings);
+    bool getRecord(quint8 block, record_t* record);
+    bool clearRecord();
+    bool setBaudRate(quint32 baud);
+    bool negotiateBaudRate();
+    quint32 subscribe(quint8 streams, quint32 period);
+    bool readPush();
+    quint32 enterUpdate();
 
 private:
-    ftdi*        ftdi_device;
-    quint8       pb_obuffer[256];
-    quint8       pb_ibuffer[256];
-    pb_ostream_t pb_ostream;
-    pb_istream_t pb_istream;
+    bool readByte(quint8* byte, quint32 timeout);
+    bool readReply(quint8 seq, quint8 cmd, const pb_field_t fields[], void* msg,
+                   quint32 timeout = TRANSPORT_TIMEOUT);
+    quint32 link(quint8 cmd, quint32 baud, quint32 timeout = TRANSPORT_TIMEOUT);
+    bool linkTest();
+    bool request(quint8 cmd, const quint8* payload, quint8 size, const pb_field_t fields[], void* msg,
+                 quint32 timeout = TRANSPORT_TIMEOUT);
+    void dispatchPush();
+
+    transport*      device;
+    quint8          seq;            /* Of the next request */
+    quint8          push_seq;       /* Expected in the next push */
+    quint32         push_lost;
+    frame_decoder_t decoder;
+    quint8          pb_obuffer[3 * FRAME_ENCODED_MAX(settings_t_size)];
+    quint8          pb_ibuffer[FRAME_PACKET(256)];
+    quint8          rx_buffer[256];   /* Received, not decoded yet */
+    quint32         rx_pos;
+    quint32         rx_len;
 };
 
 #endif // TCSCOM_H
@@ -0,0 +1,86 @@
+#ifndef TCSEMU_H
+#define TCSEMU_H
+
+#include "emulator.h"
+#include "pb.h"
+#include "messages.pb.h"
+#include "frame.h"
+#include "update.h"
+
+#define TCSEMU_BAUD_MAX 3000000     /* USART1 at 48 MHz, oversampling by 16 */
+#define TCSEMU_REQUEST_US 50        /* Decoding a request and encoding the reply */
+#define TCSEMU_SAVE_US 40000        /* Erasing and programming the settings page */
+#define TCSEMU_PAYLOAD_MAX settings_t_size
+
+/*
+ * The serial protocol of the firmware, as serial_protocol.c answers it:
+ * framed requests with pipelining, the rate switch with its fallback,
+ * and pushes every period once subscribed. The state the host reads is
+ * public, the caller sets it and adds cuts as the test needs.
+ *
+ * Settings live in the last flash page when one is given, so they
+ * survive resets and firmware updates like on the device. Given the
+ * whole flash too, CMD_UPDATE restarts in the update stage, which
+ * writes the application and its record there as updater.c does. The
+ * image itself is not run, only an update left unfinished keeps the
+ * emulator in the stage after a reset.
+ */
+class tcsemu : public emulator
+{
+public:
+    explicit tcsemu(quint8* settings_page = 0, quint8* flash = 0);
+
+    void reset(void);
+    quint32 receive(const quint8* data, quint32 len, quint32 baud, quint8 parity,
+                    quint64 now, QByteArray* reply);
+    void tick(quint64 now, QByteArray* reply);
+
+    void cutEvent(quint8 reason, quint32 duration, quint64 now);
+
+    quint32 baudRate(void) { return baud; }
+    quint32 frameErrors(void) { return errors; }
+    quint32 requests(void) { return handled; }
+
+    sensors_t           sensors;
+    status_t            status;
+    settings_t          settings;
+    gears_t             gears;
+    cut_t               cut;
+
+private:
+    quint32 process(quint8 seq, quint8 cmd, const quint8* payload, quint16 len,
+                    quint64 now, QByteArray* reply);
+    void send(quint8 seq, quint8 cmd, const pb_field_t fields[], const void* msg, QByteArray* reply);
+    void subscribe(quint8 seq, const quint8* payload, quint16 len, quint64 now, QByteArray* reply);
+    quint32 update(quint8 seq, quint8 cmd, const quint8* payload, quint16 len, QByteArray* reply);
+    quint8 updateBlock(const quint8* payload, quint16 len, quint32* us);
+    quint8 updateEnd(quint32* us);
+    bool updateValid(void);
+    quint8* at(quint32 address) { return flash + address - UPDATE_FLASH_ADDR; }
+
+    quint8*             settings_page;
+    quint32             baud;
+    frame_decoder_t     decoder;
+    quint8              frame[FRAME_PACKET(UPDATE_PAYLOAD_MAX)]; /* Blocks of the stage are the largest */
+    quint32             errors;
+    quint32             handled;
+
+    quint32             link_fallback;  /* Rate to go back to, 0 once confirmed */
+    quint64             link_start;
+
+    quint8              push_streams;
+    quint64             push_period;    /* us */
+    quint64             push_last;
+    quint8              push_seq;
+    quint32             push_cuts;
+
+    quint8*             flash;
+    bool                stage;          /* Serving the update requests */
+    quint32             update_size;    /* 0 before CMD_UPDATE_BEGIN */
+    quint32             update_crc;
+    quint32             update_next;
+    quint16             update_erased;
+    quint8              update_first[UPDATE_PAGE_SIZE];
+};
+
+#endif // TCSEMU_H
@@ -0,0 +1,59 @@
+#ifndef TCSUNIT_H
+#define TCSUNIT_H
+
+#include <QThread>
+#include <QString>
+#include "transport.h"
+#include "bootloader.h"
+#include "tcsupdate.h"
+#include "tcscom.h"
+
+/* Steps, in the order they run */
+#define TCSUNIT_CONNECT 0
+#define TCSUNIT_FLASH 1
+#define TCSUNIT_CONFIGURE 2
+#define TCSUNIT_VERIFY 3    /* Settings read back, compared when configured */
+#define TCSUNIT_STEPS 4
+
+/*
+ * One board of a batch: flashes the image, writes the settings and
+ * reads them back, in a thread of its own so the boards of a rack are
+ * done side by side. The first step that fails ends the run, flashing
+ * and configuring are skipped without an image or settings.
+ *
+ * Owns the device, the results are read once the thread is finished.
+ */
+class tcsunit : public QThread
+{
+public:
+    tcsunit(const QString& name, transport* device, const QString& image, bool delta,
+            const settings_t* settings, QObject *parent = 0);
+    ~tcsunit();
+
+    const QString& unitName(void) { return name; }
+    bool stepRun(int step) { return done[step]; }
+    quint32 stepTime(int step) { return ms[step]; }
+    int failedStep(void) { return failed; }     /* -1 when every step passed */
+    quint32 totalTime(void);
+
+    static bool sameSettings(const settings_t* a, const settings_t* b);
+
+protected:
+    void run();
+
+private:
+    bool execute(int step);
+
+    QString             name;
+    transport*          device;
+    QString             image;
+    bool                delta;
+    settings_t          settings;
+    bool                configure;
+
+    bool                done[TCSUNIT_STEPS];
+    quint32             ms[TCSUNIT_STEPS];
+    int                 failed;
+};
+
+#endif // TCSUNIT_H
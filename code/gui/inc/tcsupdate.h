@@ -0,0 +1,49 @@
+#ifndef TCSUPDATE_H
+#define TCSUPDATE_H
+
+#include <QObject>
+#include <QFile>
+#include "transport.h"
+#include "frame.h"
+#include "update.h"
+
+#define TCSUPDATE_RESTART_DELAY 20  /* ms for the firmware to reset into the stage */
+#define TCSUPDATE_TIMEOUT 200       /* ms per request, a page erase and a block at most */
+#define TCSUPDATE_RETRIES 3
+#define TCSUPDATE_NO_REPLY 0xFF
+
+/*
+ * Flashes the application through the update stage of the firmware, on
+ * the framed link at the rate already negotiated, without the ROM
+ * bootloader and its reset lines. The layout and the requests are in
+ * update.h.
+ *
+ * Takes the same full image as the ROM bootloader and sends what is
+ * behind the stage. writeFile() fails without touching the flash when
+ * the firmware has no stage or the image has none, the caller falls
+ * back to the bootloader then.
+ */
+class tcsupdate : public QObject
+{
+    Q_OBJECT
+public:
+    explicit tcsupdate(transport* device, QObject *parent = 0);
+    ~tcsupdate();
+    bool writeFile(QFile * file);
+
+signals:
+    void progress(int stage, quint32 done, quint32 total);
+    void flashed(quint32 bytes, quint32 skipped, quint32 ms);
+
+private:
+    quint8 request(quint8 cmd, const quint8 * payload, quint16 len);
+    quint8 readStatus(quint8 seq, quint8 cmd);
+
+    transport*      device;
+    quint8          seq;
+    frame_decoder_t decoder;
+    quint8          rx_buff[FRAME_PACKET(UPDATE_PAYLOAD_MAX)];
+    quint8          tx_buff[FRAME_ENCODED_MAX(UPDATE_PAYLOAD_MAX)];
+};
+
+#endif // TCSUPDATE_H
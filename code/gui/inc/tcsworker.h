@@ -0,0 +1,122 @@
+#ifndef TCSWORKER_H
+#define TCSWORKER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QQueue>
+#include <QFuture>
+#include <QFutureInterface>
+#include <QMetaType>
+#include "ftdi.h"
+#include "bootloader.h"
+#include "tcsupdate.h"
+#include "tcscom.h"
+#include "spscqueue.h"
+
+#define TCSWORKER_IDLE 20       /* ms between checks for pushes missed by the event */
+#define TCSWORKER_TELEMETRY 64  /* Pushes waiting for the UI, power of two */
+
+#define TCSWORKER_CONNECT 0
+#define TCSWORKER_DISCONNECT 1
+#define TCSWORKER_NEGOTIATE 2   /* Faster link rate, if still at TRANSPORT_BAUD */
+#define TCSWORKER_GET_SETTINGS 3
+#define TCSWORKER_SET_SETTINGS 4
+#define TCSWORKER_GET_STATE 5
+#define TCSWORKER_SUBSCRIBE 6
+#define TCSWORKER_FLASH 7
+
+Q_DECLARE_METATYPE(settings_t)
+Q_DECLARE_METATYPE(sensors_t)
+Q_DECLARE_METATYPE(status_t)
+
+/* One push, type is the PUSH_x stream it came from */
+struct telemetry_t {
+    quint8 type;
+    union {
+        sensors_t sensors;
+        status_t status;
+        cut_t cut;
+    };
+};
+
+struct tcsrequest {
+    quint8 type;
+    settings_t settings;
+    quint8 streams;
+    quint32 period;
+    QString filename;
+    QFutureInterface<bool> result;  /* true on error, like the calls it runs */
+};
+
+/*
+ * Owns the device, the FTDI adapter unless given another transport,
+ * and runs every exchange with it in its own thread, the UI only posts
+ * requests.
+ *
+ * Requests run one at a time, in the order they were posted. Each one
+ * returns a future that finishes with its result, requestFinished() is
+ * emitted as well, results carrying data come with their own signal.
+ * All of them are queued to the thread that connected to them.
+ *
+ * Between requests the thread sleeps on the receive event of the
+ * adapter and decodes pushes as they come in. They are handed to the
+ * UI through a lock free ring, telemetryReady() is emitted once until
+ * takeTelemetry() has emptied it, so a busy UI is not flooded with
+ * signals. Pushes are dropped when the UI falls that far behind.
+ */
+class tcsworker : public QThread
+{
+    Q_OBJECT
+public:
+    explicit tcsworker(transport *device = 0, QObject *parent = 0);
+    ~tcsworker();
+
+    QFuture<bool> connectDevice();
+    QFuture<bool> disconnectDevice();
+    QFuture<bool> negotiateBaudRate();
+    QFuture<bool> getSettings();
+    QFuture<bool> setSettings(const settings_t& settings);
+    QFuture<bool> getState();
+    QFuture<bool> subscribe(quint8 streams, quint32 period);
+    QFuture<bool> flash(const QString& filename);
+
+    bool takeTelemetry(telemetry_t* telemetry);
+    quint32 telemetryDropped() { return dropped.loadAcquire(); }
+
+signals:
+    void requestFinished(int type, bool error);
+    void settingsReceived(const settings_t& settings);
+    void stateReceived(const sensors_t& sensors, const status_t& status);
+    void telemetryReady();
+    void flashProgress(int stage, quint32 done, quint32 total);
+    void flashed(quint32 bytes, quint32 skipped, quint32 ms);
+
+private slots:
+    void queueSensors(const sensors_t& sensors);
+    void queueStatus(const status_t& status);
+    void queueCut(const cut_t& cut);
+
+protected:
+    void run();
+
+private:
+    QFuture<bool> post(tcsrequest* request);
+    bool execute(tcsrequest* request);
+    void queueTelemetry(const telemetry_t& telemetry);
+
+    transport*      device;         /* Used by the thread only, but for wake() */
+    tcscom          tcs;
+    bootloader      bl;
+    tcsupdate       up;
+    bool            subscribed;
+
+    QMutex          mutex;          /* Guards requests and stopping */
+    QQueue<tcsrequest*> requests;
+    bool            stopping;
+
+    spscqueue<telemetry_t, TCSWORKER_TELEMETRY> telemetry;
+    QAtomicInt      notified;       /* telemetryReady() sent, not drained yet */
+    QAtomicInt      dropped;
+};
+
+#endif // TCSWORKER_H
@@ -0,0 +1,62 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <QObject>
+#include <QDebug>
+
+#include "compat.h"
+
+#define TRANSPORT_BAUD 115200   /* The device starts at this rate */
+#define TRANSPORT_TIMEOUT 2000  /* ms, read() and write() */
+
+/* setParity(), the values of FT_PARITY_x */
+#define TRANSPORT_PARITY_NONE 0
+#define TRANSPORT_PARITY_EVEN 2
+
+/*
+ * Byte link to the device, 8 data bits and one stop bit. The bootloader
+ * and the protocol only go through this, so they run the same over the
+ * FTDI adapter, a serial port or an emulator in the same process.
+ *
+ * Every call returns true on error, like the rest of the GUI, but
+ * disconnect() that returns true once closed, as ftdi always did. A
+ * transport is used by one thread at a time, but for wake().
+ */
+class transport : public QObject
+{
+    Q_OBJECT
+public:
+    explicit transport(QObject *parent = 0) : QObject(parent), connected(false), baud(TRANSPORT_BAUD) {}
+    virtual ~transport() {}
+
+    virtual bool connect(void) = 0;
+    virtual bool disconnect(void) = 0;
+    /* purge drops what was received and not read yet, keep it for pushed frames */
+    virtual bool write(quint8 * buf, quint32 len = 1, bool purge = true) = 0;
+    /* Exactly len bytes, waits up to TRANSPORT_TIMEOUT for them */
+    virtual bool read(quint8 * buf, quint32 len = 1) = 0;
+    /* Bytes received and not read yet, 0 on error */
+    virtual quint32 queued(void) = 0;
+    /*
+     * Waits up to ms for bytes to come in or for wake(), true on
+     * timeout. May wake up for no reason, callers check queued().
+     */
+    virtual bool waitEvent(quint32 ms) = 0;
+    /* Ends a waitEvent() from another thread, or the next one */
+    virtual void wake(void) = 0;
+    virtual bool setBaudRate(quint32 baud) = 0;
+    virtual bool setParity(quint8 parity) = 0;
+
+    /* Restart the device in the ROM bootloader, or in the firmware */
+    virtual bool resetBootloader(void) = 0;
+    virtual bool resetNormal(void) = 0;
+
+    quint32 baudRate(void) { return baud; }
+    bool isConnected(void) { return connected; }
+
+protected:
+    bool                connected;
+    quint32             baud;
+};
+
+#endif // TRANSPORT_H
@@ -0,0 +1,48 @@
+#-------------------------------------------------
+#
+# GUI link code against the firmware and bootloader emulators
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = opentcs-linkbench
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += src/linkbench.cpp \
+    src/loopback.cpp \
+    src/stm32emu.cpp \
+    src/tcsemu.cpp \
+    src/tcscom.cpp \
+    src/bootloader.cpp \
+    src/tcsupdate.cpp \
+    ../common/src/pb_encode.c \
+    ../common/src/pb_decode.c \
+    ../common/src/nanopb.pb.c \
+    ../common/src/messages.pb.c \
+    ../common/src/frame.c \
+    ../common/src/update.c
+
+HEADERS  += inc/transport.h \
+    inc/loopback.h \
+    inc/emulator.h \
+    inc/stm32emu.h \
+    inc/tcsemu.h \
+    inc/tcscom.h \
+    inc/bootloader.h \
+    inc/tcsupdate.h \
+    inc/spscqueue.h \
+    ../common/inc/pb_encode.h \
+    ../common/inc/pb_decode.h \
+    ../common/inc/pb.h \
+    ../common/inc/nanopb.pb.h \
+    ../common/inc/messages.pb.h \
+    ../common/inc/frame.h \
+    ../common/inc/update.h \
+    inc/compat.h
+
+INCLUDEPATH += inc ../common/inc
@@ -1,9 +1,12 @@
+#include <string.h> // memcmp
+#include <QSettings>
+#include <QCryptographicHash>
 #include "bootloader.h"
 
-bootloader::bootloader(ftdi *device, QObject *parent) :
+bootloader::bootloader(transport *device, QObject *parent) :
     QObject(parent)
 {
-    this->ftdi_device = device;
+    this->device = device;
 }
 
 bootloader::~bootloader()
@@ -11,148 +14,418 @@ bootloader::~bootloader()
 
 }
 
-bool bootloader::writeFile(QFile *file)
+/*
+ * Flashes the image at the start of the flash. Only the pages that
+ * differ from what the device holds are erased, written and read back:
+ * the page hashes of the last image flashed to it are kept per device
+ * unique ID, without them the pages are read back and compared. The
+ * manifest is dropped before erasing, so an update that fails halfway
+ * is compared again next time. The settings in the last page are never
+ * touched. delta false rewrites every page of the image.
+ */
+bool bootloader::writeFile(QFile *file, bool delta)
 {
+    QElapsedTimer timer;
+    QByteArray data;
+    QVector<quint16> pages;
+    QString uid;
+    QSettings manifest("OpenTCS", "OpenTCS");
+    quint32 written = 0;
+    quint16 total, i;
     bool res;
-    file->open(QIODevice::ReadOnly);
-    QByteArray data = file->readAll();
+
+    if (!file->open(QIODevice::ReadOnly))
+    {
+        qWarning("stm32::writeFile Cannot open the image");
+        return true;
+    }
+    data = file->readAll();
     file->close();
 
-    this->ftdi_device->resetBootloader();
+    if (data.isEmpty())
+        return true;
+
+    total = (data.length() + STM32_PAGE_SIZE - 1) / STM32_PAGE_SIZE;
+    manifest.beginGroup(BOOTLOADER_MANIFEST);
+
+    /* The ROM bootloader finds the rate from the first byte, with even parity */
+    this->device->setBaudRate(STM32_BAUD);
+    this->device->setParity(TRANSPORT_PARITY_EVEN);
+    this->device->resetBootloader();
+
+    timer.start();
+    res = this->init() || this->readUid(&uid);
+
+    if (!res)
+    {
+        if (!delta)
+            for (i = 0; i < total; i++)
+                pages.append(i);
+        else
+            res = this->changedPages(uid, data, &pages);
+    }
+
+    if (!res && !pages.isEmpty())
+    {
+        manifest.remove(uid);
+        manifest.sync();
+
+        res = this->eraseMem(pages);
+
+        for (i = 0; !res && i < pages.size(); i++)
+        {
+            const quint32 offset = pages[i] * STM32_PAGE_SIZE;
+            const quint32 len = qMin<quint32>(STM32_PAGE_SIZE, data.length() - offset);
+
+            res = this->writeMem(STM32_FLASH_ADDR + offset, (const quint8*)data.constData() + offset, len);
+            written += len;
+            emit progress(BOOTLOADER_WRITE, i + 1, pages.size());
+        }
+
+        for (i = 0; !res && i < pages.size(); i++)
+        {
+            const quint32 offset = pages[i] * STM32_PAGE_SIZE;
+            const quint32 len = qMin<quint32>(STM32_PAGE_SIZE, data.length() - offset);
+
+            res = this->verifyMem(STM32_FLASH_ADDR + offset, (const quint8*)data.constData() + offset, len);
+            emit progress(BOOTLOADER_VERIFY, i + 1, pages.size());
+        }
+    }
+
+    if (!res)
+    {
+        const quint32 ms = timer.elapsed();
 
-    this->unlockFlash();
+        manifest.setValue(uid, this->hashPages(data));
 
-    res = this->writeMem(STM32_FLASH_ADDR, (quint8*)data.data(), data.length());
+        qDebug("stm32::writeFile %s: %d of %d pages, %d bytes saved, %d ms",
+               qPrintable(uid), (int)pages.size(), total, (int)(data.length() - written), (int)ms);
+        emit flashed(data.length(), data.length() - written, ms);
+    }
 
-    this->ftdi_device->resetNormal();
+    this->device->setParity(TRANSPORT_PARITY_NONE);
+    this->device->setBaudRate(TRANSPORT_BAUD);
+    this->device->resetNormal();
 
     return res;
 }
 
+/* The 96 bit unique ID, in hex, names the device in the manifest */
+bool bootloader::readUid(QString *uid)
+{
+    quint8 id[STM32_UID_SIZE];
+    quint8 i;
+
+    if (this->readMem(STM32_UID_ADDR, id, STM32_UID_SIZE))
+        return true;
+
+    uid->clear();
+    for (i = 0; i < STM32_UID_SIZE; i++)
+        uid->append(QString("%1").arg(id[i], 2, 16, QChar('0')));
+
+    return false;
+}
+
+/* One MD5 per page of the image, the last one over what the image has of it */
+QByteArray bootloader::hashPages(const QByteArray &data)
+{
+    QByteArray hashes;
+    int offset;
+
+    for (offset = 0; offset < data.length(); offset += STM32_PAGE_SIZE)
+        hashes.append(QCryptographicHash::hash(data.mid(offset, STM32_PAGE_SIZE), QCryptographicHash::Md5));
+
+    return hashes;
+}
+
+/*
+ * Pages of the image that differ from the device, against its manifest
+ * if there is one, by reading them back otherwise. Reading a page back
+ * costs as much link time as writing it, but saves erasing and
+ * programming it.
+ */
+bool bootloader::changedPages(const QString &uid, const QByteArray &data, QVector<quint16> *pages)
+{
+    QSettings manifest("OpenTCS", "OpenTCS");
+    const QByteArray hashes = this->hashPages(data);
+    const quint16 total = hashes.length() / 16;
+    QByteArray flashed;
+    quint16 i;
+
+    manifest.beginGroup(BOOTLOADER_MANIFEST);
+    flashed = manifest.value(uid).toByteArray();
+
+    for (i = 0; i < total; i++)
+    {
+        const quint32 offset = i * STM32_PAGE_SIZE;
+        const quint32 len = qMin<quint32>(STM32_PAGE_SIZE, data.length() - offset);
+        quint32 done, n;
+        bool same = true;
+
+        /* A page the last image did not reach has no hash, it is written */
+        if (!flashed.isEmpty())
+        {
+            if (flashed.mid(i * 16, 16) != hashes.mid(i * 16, 16))
+                pages->append(i);
+            continue;
+        }
+
+        for (done = 0; same && done < len; done += n)
+        {
+            n = qMin<quint32>(STM32_BLOCK_SIZE, len - done);
+
+            if (this->readMem(STM32_FLASH_ADDR + offset + done, rx_buff, n))
+                return true;
+            same = (memcmp(rx_buff, data.constData() + offset + done, n) == 0);
+        }
+
+        if (!same)
+            pages->append(i);
+        emit progress(BOOTLOADER_COMPARE, i + 1, total);
+    }
+
+    return false;
+}
+
 bool bootloader::init()
 {
-    quint8 len, dummy, ack;
+    quint8 len, dummy, ack, sync = STM32_CMD_INIT;
 
-    this->sendCommand(STM32_CMD_GET);
+    /* Autobaud, a NACK means it already ran */
+    if (device->write(&sync) || device->read(&ack)
+            || (ack != STM32_ACK && ack != STM32_NACK))
+    {
+        qWarning("stm32::init No answer from the bootloader");
+        return true;
+    }
+
+    if (this->sendCommand(STM32_CMD_GET))
+        return true;
 
-    ftdi_device->read(&len); len++;
-    ftdi_device->read(&this->bl_version); len--;
-    ftdi_device->read(&cmd.get); len--;
-    ftdi_device->read(&cmd.gvr); len--;
-    ftdi_device->read(&cmd.gid); len--;
-    ftdi_device->read(&cmd.rm); len--;
-    ftdi_device->read(&cmd.go); len--;
-    ftdi_device->read(&cmd.wm); len--;
-    ftdi_device->read(&cmd.er); len--;
-    ftdi_device->read(&cmd.wp); len--;
-    ftdi_device->read(&cmd.uw); len--;
-    ftdi_device->read(&cmd.rp); len--;
-    ftdi_device->read(&cmd.ur); len--;
+    device->read(&len); len++;
+    device->read(&this->bl_version); len--;
+    device->read(&cmd.get); len--;
+    device->read(&cmd.gvr); len--;
+    device->read(&cmd.gid); len--;
+    device->read(&cmd.rm); len--;
+    device->read(&cmd.go); len--;
+    device->read(&cmd.wm); len--;
+    device->read(&cmd.er); len--;
+    device->read(&cmd.wp); len--;
+    device->read(&cmd.uw); len--;
+    device->read(&cmd.rp); len--;
+    device->read(&cmd.ur); len--;
 
-    while(len-- > 0) ftdi_device->read(&dummy);
+    while(len-- > 0) device->read(&dummy);
 
-    ftdi_device->read(&ack);
+    device->read(&ack);
 
     return (ack != STM32_ACK);
 }
 
 bool bootloader::sendCommand(quint8 cmd)
 {
-    quint8 cmd_xor = cmd^0xFF;
-    quint8 ack;
-    ftdi_device->write(&cmd);
-    ftdi_device->write(&cmd_xor);
+    quint8 buf[2] = {cmd, (quint8)(cmd ^ 0xFF)};
 
-    ftdi_device->read(&ack);
+    if (device->write(buf, 2, false))
+        return true;
 
-    return (ack != STM32_ACK);
+    return this->readAck(STM32_ACK_TIMEOUT);
 }
 
-bool bootloader::unlockFlash()
+/* Waits on the receive event, erasing and programming take longer than TRANSPORT_TIMEOUT */
+bool bootloader::readAck(quint32 timeout)
 {
-    this->sendCommand(cmd.uw);
+    QElapsedTimer timer;
+    quint8 ack;
+
+    timer.start();
+    while (device->queued() == 0)
+    {
+        const qint64 elapsed = timer.elapsed();
 
-    return this->sendCommand(0x8C);
+        if (elapsed >= timeout)
+            return true;
+        device->waitEvent((quint32)(timeout - elapsed));
+    }
+
+    if (device->read(&ack))
+        return true;
+
+    return (ack != STM32_ACK);
 }
 
+/* Up to STM32_BLOCK_SIZE bytes */
 bool bootloader::readMem(quint32 address, quint8 *data, quint32 len)
 {
-    quint8 checksum, ack, len2;
-    quint8 addr[4];
+    quint8 addr[5], n[2];
 
-    if (address % 4 == 0)
+    if (address % 4 != 0)
     {
         qWarning("stm32::readMem Address is not 32b aligned");
         return true;
     }
+    if (len == 0 || len > STM32_BLOCK_SIZE)
+        return true;
 
     qToBigEndian(address, addr);
-    checksum = this->calcChecksum(address);
+    addr[4] = this->calcChecksum(address);
+    n[0] = len - 1;
+    n[1] = n[0] ^ 0xFF;
 
-    this->sendCommand(cmd.rm);
-    ftdi_device->write(addr, 4);
-    ftdi_device->write(&checksum);
+    if (this->sendCommand(cmd.rm)
+            || device->write(addr, 5, false) || this->readAck(STM32_ACK_TIMEOUT)
+            || device->write(n, 2, false) || this->readAck(STM32_ACK_TIMEOUT))
+    {
+        qWarning("stm32::readMem Refused at 0x%08x", address);
+        return true;
+    }
 
-    ftdi_device->read(&ack);
+    return device->read(data, len);
+}
 
-    len2 = len - 1;
-    ftdi_device->write(&len2);
-    len2 ^= 0xFF;
-    ftdi_device->write(&len2);
+/*
+ * Write Memory frame of the block at address into tx_buff: the address
+ * and its checksum, then the length, up to STM32_BLOCK_SIZE bytes padded
+ * to a word with 0xFF and their checksum. Returns the frame size.
+ */
+quint16 bootloader::buildWrite(quint32 address, const quint8 *data, quint32 len)
+{
+    quint8* const block = &tx_buff[5];
+    quint16 n, i;
 
-    ftdi_device->read(&ack);
+    qToBigEndian(address, tx_buff);
+    tx_buff[4] = this->calcChecksum(address);
 
-    ftdi_device->read(data, len);
+    if (len > STM32_BLOCK_SIZE)
+        len = STM32_BLOCK_SIZE;
+    n = (len + 3) & ~3;
 
-    return (ack != STM32_ACK);
+    block[0] = n - 1;
+    block[n + 1] = n - 1;
+    for (i = 0; i < n; i++)
+    {
+        block[i + 1] = (i < len) ? data[i] : 0xFF;
+        block[n + 1] ^= block[i + 1];
+    }
+
+    return 5 + n + 2;
 }
 
-bool bootloader::writeMem(quint32 address, quint8 *data, quint32 len)
+/*
+ * Programs the pages erased before, STM32_BLOCK_SIZE bytes per command.
+ * The ROM bootloader has no receive buffer, nothing can be sent ahead
+ * of an ACK, so the next frame is built while the device programs the
+ * current block and goes out the moment the ACK comes in.
+ */
+bool bootloader::writeMem(quint32 address, const quint8 *data, quint32 len)
 {
-    quint8 checksum, ack;
-    quint8 addr[4];
+    quint32 done = 0;
+    quint16 size;
 
-    if (address % 4 == 0)
+    if (address % 4 != 0)
     {
         qWarning("stm32::writeMem Address is not 32b aligned");
         return true;
     }
 
-    qToBigEndian(address, addr);
-    checksum = this->calcChecksum(address);
+    size = this->buildWrite(address, data, len);
+
+    while (done < len)
+    {
+        const quint32 n = (len - done > STM32_BLOCK_SIZE) ? STM32_BLOCK_SIZE : len - done;
+
+        if (this->sendCommand(cmd.wm)
+                || device->write(tx_buff, 5, false) || this->readAck(STM32_ACK_TIMEOUT)
+                || device->write(&tx_buff[5], size - 5, false))
+        {
+            qWarning("stm32::writeMem Refused at 0x%08x", address + done);
+            return true;
+        }
+
+        done += n;
+        if (done < len)
+            size = this->buildWrite(address + done, data + done, len - done);
+
+        if (this->readAck(STM32_WRITE_TIMEOUT))
+        {
+            qWarning("stm32::writeMem Not programmed at 0x%08x", address + done - n);
+            return true;
+        }
+    }
+
+    return false;
+}
 
-    this->sendCommand(cmd.wm);
-    ftdi_device->write(addr, 4);
-    ftdi_device->write(&checksum);
+/* Erases the pages listed, with Erase or Extended Erase, whichever the device has */
+bool bootloader::eraseMem(const QVector<quint16>& pages)
+{
+    quint16 n = 0, i;
+    quint8 checksum = 0;
 
-    ftdi_device->read(&ack);
+    if (pages.isEmpty())
+        return false;
+    if (pages.size() > 255)
+        return true;
 
-    checksum = len - 1 + (len % 4);
-    ftdi_device->write(&checksum);
+    if (this->sendCommand(cmd.er))
+        return true;
 
-    /* write the data and build the checksum */
-    quint32 i;
-    for(i = 0; i < len; ++i)
-            checksum ^= data[i];
+    if (cmd.er == STM32_CMD_EE)
+    {
+        tx_buff[n++] = (pages.size() - 1) >> 8;
+        tx_buff[n++] = (pages.size() - 1) & 0xFF;
+        for (i = 0; i < pages.size(); i++)
+        {
+            tx_buff[n++] = pages[i] >> 8;
+            tx_buff[n++] = pages[i] & 0xFF;
+        }
+    }
+    else
+    {
+        tx_buff[n++] = pages.size() - 1;
+        for (i = 0; i < pages.size(); i++)
+            tx_buff[n++] = pages[i];
+    }
 
-    ftdi_device->write(data, len);
-    ftdi_device->write(&checksum);
-    ftdi_device->read(&ack);
+    for (i = 0; i < n; i++)
+        checksum ^= tx_buff[i];
+    tx_buff[n++] = checksum;
 
-    return (ack != STM32_ACK);
+    emit progress(BOOTLOADER_ERASE, 0, pages.size());
+
+    if (device->write(tx_buff, n, false)
+            || this->readAck(STM32_ACK_TIMEOUT + pages.size() * STM32_ERASE_TIMEOUT))
+    {
+        qWarning("stm32::eraseMem %d pages from %d not erased", (int)pages.size(), pages[0]);
+        return true;
+    }
+
+    emit progress(BOOTLOADER_ERASE, pages.size(), pages.size());
+
+    return false;
 }
 
-bool bootloader::eraseMem()
+/* Reads back what was written, a whole STM32_BLOCK_SIZE per Read Memory */
+bool bootloader::verifyMem(quint32 address, const quint8 *data, quint32 len)
 {
-    quint8 pages[3] = {0xFF, 0xFF, 0x00};
-    quint8 ack;
+    quint32 done, n;
 
-    this->sendCommand(cmd.er);
+    for (done = 0; done < len; done += n)
+    {
+        n = (len - done > STM32_BLOCK_SIZE) ? STM32_BLOCK_SIZE : len - done;
 
-    ftdi_device->write(pages, 3);
-    ftdi_device->read(&ack);
+        if (this->readMem(address + done, rx_buff, n))
+            return true;
 
-    return (ack != STM32_ACK);
+        if (memcmp(rx_buff, data + done, n) != 0)
+        {
+            qWarning("stm32::verifyMem Mismatch in 0x%08x to 0x%08x", address + done, address + done + n - 1);
+            return true;
+        }
+    }
+
+    return false;
 }
 
 quint8 bootloader::calcChecksum(const quint32 val)
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <string.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QSettings>
+#include <QFile>
+#include <QList>
+#include "ftdi.h"
+#ifndef WIN32
+#include "serialport.h"
+#endif
+#include "loopback.h"
+#include "stm32emu.h"
+#include "tcsemu.h"
+#include "tcsunit.h"
+
+/*
+ * opentcs-cli, flashes and configures a batch of boards without the
+ * GUI, one worker thread per board, and ends with a report of the time
+ * each step took on each board. Without boards on the command line it
+ * takes every FTDI adapter present. Returns 1 when a board failed.
+ *
+ * The settings file is an INI file, one key per field of Settings_data
+ * in a [settings] group, the byte fields in hex:
+ *
+ *   [settings]
+ *   functions=3
+ *   cut_type=2
+ *   sensor_threshold=1200
+ *   gears_ratio=1a2b3c4d5e6f
+ */
+
+#define CLI_EMULATOR_SEED 0x4F544353
+
+static const char* steps[TCSUNIT_STEPS] = {"connect", "flash", "configure", "verify"};
+
+static void usage(void)
+{
+    printf("usage: opentcs-cli [-f image.bin] [-F] [-s settings.ini] [-l]\n"
+#ifndef WIN32
+           "                   [-t tty]...\n"
+#endif
+           "                   [-e count] [serial]...\n"
+           "  -f  flash the image through the update stage, or only the pages\n"
+           "      that changed through the ROM bootloader\n"
+           "  -F  flash every page of the image through the ROM bootloader\n"
+           "  -s  write the settings, and compare them once read back\n"
+           "  -l  list the FTDI adapters and exit\n"
+#ifndef WIN32
+           "  -t  a board on a serial port, RTS on BOOT0 and DTR on NRST\n"
+#endif
+           "  -e  boards emulated in this process at link speed, to try a batch\n"
+           "  serial  FTDI adapters to use, all of them without any board\n");
+}
+
+static bool loadBytes(QSettings* ini, const char* key, quint8* bytes, size_t* size, size_t max)
+{
+    QByteArray value = QByteArray::fromHex(ini->value(key).toByteArray());
+
+    if ((size_t)value.length() > max)
+    {
+        printf("%s: %d bytes, at most %d\n", key, (int)value.length(), (int)max);
+        return true;
+    }
+
+    memcpy(bytes, value.constData(), value.length());
+    *size = value.length();
+    return false;
+}
+
+/* Fields missing from the file are 0 */
+static bool loadSettings(const QString& path, settings_t* settings)
+{
+    QSettings ini(path, QSettings::IniFormat);
+    Settings_data* data = &settings->data;
+
+    memset(settings, 0, sizeof(*settings));
+
+    if (!QFile::exists(path) || ini.status() != QSettings::NoError)
+        return true;
+
+    ini.beginGroup("settings");
+    data->functions = ini.value("functions").toUInt();
+    data->cut_type = ini.value("cut_type").toUInt();
+    data->sensor_threshold = ini.value("sensor_threshold").toUInt();
+    data->slip_threshold = ini.value("slip_threshold").toUInt();
+    data->sensor_gain = ini.value("sensor_gain").toUInt();
+    data->sensor_direction = ini.value("sensor_direction").toUInt();
+    data->min_speed = ini.value("min_speed").toUInt();
+    data->min_rpm = ini.value("min_rpm").toUInt();
+
+    return loadBytes(&ini, "gears_ratio", data->gears_ratio.bytes, &data->gears_ratio.size,
+                     sizeof(data->gears_ratio.bytes))
+        || loadBytes(&ini, "gears_cut_time", data->gears_cut_time.bytes, &data->gears_cut_time.size,
+                     sizeof(data->gears_cut_time.bytes))
+        || loadBytes(&ini, "tc_gear_trim", data->tc_gear_trim.bytes, &data->tc_gear_trim.size,
+                     sizeof(data->tc_gear_trim.bytes));
+}
+
+static void report(QList<tcsunit*>& units, quint32 ms)
+{
+    int i, step, passed = 0;
+
+    printf("\n%-16s", "unit");
+    for (step = 0; step < TCSUNIT_STEPS; step++)
+        printf(" %9s", steps[step]);
+    printf(" %9s  result\n", "total");
+
+    for (i = 0; i < units.size(); i++)
+    {
+        tcsunit* unit = units[i];
+
+        printf("%-16s", qPrintable(unit->unitName()));
+        for (step = 0; step < TCSUNIT_STEPS; step++)
+        {
+            if (unit->stepRun(step))
+                printf(" %8.2fs", unit->stepTime(step) / 1000.0);
+            else
+                printf(" %9s", "-");
+        }
+        printf(" %8.2fs  ", unit->totalTime() / 1000.0);
+
+        if (unit->failedStep() < 0)
+        {
+            printf("pass\n");
+            passed++;
+        }
+        else
+        {
+            printf("FAIL at %s\n", steps[unit->failedStep()]);
+        }
+    }
+
+    printf("\n%d of %d passed in %.2f s\n", passed, (int)units.size(), ms / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    QStringList serials;
+    QStringList ttys;
+    QList<tcsunit*> units;
+    QList<emulator*> emulators;
+    QString image;
+    QElapsedTimer timer;
+    settings_t settings;
+    bool configure = false, delta = true, list = false;
+    int i, emulated = 0, failed = 0;
+
+    for (i = 1; i < args.size(); i++)
+    {
+        const QString& arg = args[i];
+        const bool last = i + 1 >= args.size();
+
+        if ((arg == "-f" || arg == "-F") && !last)
+        {
+            image = args[++i];
+            delta = arg == "-f";
+        }
+        else if (arg == "-s" && !last)
+        {
+            if (loadSettings(args[++i], &settings))
+            {
+                printf("Cannot read the settings from %s\n", qPrintable(args[i]));
+                return 1;
+            }
+            configure = true;
+        }
+        else if (arg == "-l")
+        {
+            list = true;
+        }
+#ifndef WIN32
+        else if (arg == "-t" && !last)
+        {
+            ttys.append(args[++i]);
+        }
+#endif
+        else if (arg == "-e" && !last)
+        {
+            emulated = args[++i].toInt();
+        }
+        else if (!arg.startsWith("-"))
+        {
+            serials.append(arg);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (list || (serials.isEmpty() && ttys.isEmpty() && emulated == 0))
+    {
+        QStringList present = ftdi::list();
+
+        for (i = 0; i < present.size() && list; i++)
+            printf("%s\n", qPrintable(present[i]));
+        if (list)
+            return 0;
+
+        serials = present;
+        if (serials.isEmpty())
+        {
+            printf("No FTDI adapter found\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < serials.size(); i++)
+        units.append(new tcsunit(serials[i], new ftdi(serials[i]), image, delta,
+                                 configure ? &settings : NULL));
+#ifndef WIN32
+    for (i = 0; i < ttys.size(); i++)
+        units.append(new tcsunit(ttys[i], new serialport(ttys[i]), image, delta,
+                                 configure ? &settings : NULL));
+#endif
+
+    /*
+     * Erased chips with their own unique ID, the settings page kept in
+     * their flash, at the pace of a real link
+     */
+    for (i = 0; i < emulated; i++)
+    {
+        stm32emu* chip = new stm32emu(CLI_EMULATOR_SEED + i);
+        tcsemu* firmware = new tcsemu(chip->flash() + STM32EMU_FLASH_SIZE - STM32EMU_PAGE_SIZE,
+                                      chip->flash());
+
+        loopback* link = new loopback(firmware, chip);
+
+        link->setPaced(true);
+        emulators.append(chip);
+        emulators.append(firmware);
+        units.append(new tcsunit(QString("emulated%1").arg(i), link,
+                                 image, delta, configure ? &settings : NULL));
+    }
+
+    printf("%d units", (int)units.size());
+    if (!image.isEmpty())
+        printf(", flashing %s%s", qPrintable(image), delta ? "" : " in full");
+    if (configure)
+        printf(", configuring");
+    printf("\n");
+
+    timer.start();
+    for (i = 0; i < units.size(); i++)
+        units[i]->start();
+    for (i = 0; i < units.size(); i++)
+        units[i]->wait();
+
+    report(units, timer.elapsed());
+
+    for (i = 0; i < units.size(); i++)
+    {
+        if (units[i]->failedStep() >= 0)
+            failed++;
+        delete units[i];
+    }
+    for (i = 0; i < emulators.size(); i++)
+        delete emulators[i];
+
+    return failed ? 1 : 0;
+}
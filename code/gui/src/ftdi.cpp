@@ -1,59 +1,116 @@
+#include <string.h>
 #include "ftdi.h"
 
-ftdi::ftdi(QObject *parent) :
-    QObject(parent)
-{
-    this->connected = false;
-    iNumDevs = 0;
-    pcBufLD[0] = cBufLD;
+QMutex ftdi::driver;
 
+ftdi::ftdi(const QString& serial, QObject *parent) :
+    transport(parent),
+    serial(serial)
+{
     ftEepromHeader.deviceType = FT_DEVICE_X_SERIES;
     eepromDATA.common = ftEepromHeader;
     eepromDATA.common.deviceType = FT_DEVICE_X_SERIES;
+
+#ifdef WIN32
+    event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&event.eMutex, NULL);
+    pthread_cond_init(&event.eCondVar, NULL);
+    event.iVar = 0;
+#endif
 }
 
 ftdi::~ftdi()
 {
     this->disconnect();
+
+#ifdef WIN32
+    CloseHandle(event);
+#else
+    pthread_cond_destroy(&event.eCondVar);
+    pthread_mutex_destroy(&event.eMutex);
+#endif
 }
 
-bool ftdi::connect(void)
+/* Serial numbers of the adapters present, opened ones included */
+QStringList ftdi::list(void)
 {
-    ftStatus = FT_ListDevices(pcBufLD, &iNumDevs, FT_LIST_ALL | FT_OPEN_BY_SERIAL_NUMBER);
+    QStringList serials;
+    DWORD devices = 0, i, flags, type, id, location;
+    FT_HANDLE handle;
+    char serial[16];
+    char description[64];
 
-    if(ftStatus != FT_OK) {
-        qWarning("Error: FT_ListDevices(%d)\n", (int)ftStatus);
-        return true;
+    driver.lock();
+    if (FT_CreateDeviceInfoList(&devices) != FT_OK)
+        devices = 0;
+
+    for (i = 0; i < devices; i++)
+    {
+        memset(serial, 0, sizeof(serial));
+        if (FT_GetDeviceInfoDetail(i, &flags, &type, &id, &location, serial, description, &handle) == FT_OK && serial[0])
+            serials.append(QString(serial));
     }
+    driver.unlock();
+
+    return serials;
+}
 
-    if (!iNumDevs)
+bool ftdi::connect(void)
+{
+    QByteArray name;
+
+    if (this->serial.isEmpty())
     {
-        qWarning("Error: No FTDI devices found\n");
-        return true;
+        QStringList serials = ftdi::list();
+
+        if (serials.isEmpty())
+        {
+            qWarning("Error: No FTDI devices found\n");
+            return true;
+        }
+        name = serials.first().toLatin1();
+    }
+    else
+    {
+        name = this->serial.toLatin1();
     }
 
-    if((ftStatus = FT_OpenEx(cBufLD, FT_OPEN_BY_SERIAL_NUMBER, &ftHandle)) != FT_OK){
+    driver.lock();
+    ftStatus = FT_OpenEx(name.data(), FT_OPEN_BY_SERIAL_NUMBER, &ftHandle);
+    driver.unlock();
+
+    if(ftStatus != FT_OK){
         /*
             This can fail if the ftdi_sio driver is loaded
             use lsmod to check this and rmmod ftdi_sio to remove
             also rmmod usbserial
         */
-        qWarning("Error FT_OpenEx(%d), device %d\n", (int)ftStatus, 0);
+        qWarning("Error FT_OpenEx(%d), device %s\n", (int)ftStatus, name.constData());
         qWarning("Use lsmod to check if ftdi_sio (and usbserial) are present.\n");
         qWarning("If so, unload them using rmmod, as they conflict with ftd2xx.\n");
         return true;
     }
 
-    FT_SetTimeouts(ftHandle, 2000, 2000);	// 2 second read timeout
+    FT_SetTimeouts(ftHandle, FTDI_TIMEOUT, FTDI_TIMEOUT);
+    /* Each answer of the bootloader or the firmware would wait for it */
+    FT_SetLatencyTimer(ftHandle, FTDI_LATENCY);
+
+    /* Received bytes wake waitEvent() */
+#ifdef WIN32
+    FT_SetEventNotification(ftHandle, FT_EVENT_RXCHAR, (PVOID)event);
+#else
+    FT_SetEventNotification(ftHandle, FT_EVENT_RXCHAR, (PVOID)&event);
+#endif
 
-    if((ftStatus = FT_SetBaudRate(ftHandle, 115200)) != FT_OK) {
-        qWarning("Error FT_SetBaudRate(%d), cBufLD[i] = %s\n", (int)ftStatus, cBufLD);
+    this->connected = true;
+    if (this->setBaudRate(TRANSPORT_BAUD)) {
+        this->connected = false;
         return true;
     }
 
     qDebug("Connected");
 
-    this->connected = true;
     this->purge();
     return this->resetBootloader();
 }
@@ -70,13 +127,14 @@ bool ftdi::disconnect()
     return FT_Close(ftHandle) == FT_OK;
 }
 
-bool ftdi::write(quint8 * buf, quint32 len)
+bool ftdi::write(quint8 * buf, quint32 len, bool purge)
 {
     DWORD dwBytesWritten;
     if (!this->connected)
         return true;
 
-    this->purge();
+    if (purge)
+        this->purge();
     ftStatus = FT_Write(ftHandle, buf, len, &dwBytesWritten);
     if (ftStatus != FT_OK) {
         qWarning("Error FT_Write(%d)\n", (int)ftStatus);
@@ -96,6 +154,10 @@ bool ftdi::read(quint8 * buf, quint32 len)
         qWarning("Error FT_Read(%d)\n", (int)ftStatus);
         return true;
     }
+    if (dwBytesRead != len) {
+        qWarning("Error FT_Read timeout, %d of %d bytes\n", (int)dwBytesRead, (int)len);
+        return true;
+    }
     return false;
 }
 
@@ -120,6 +182,90 @@ bool ftdi::readAll(quint8 * buf, quint32 max_len)
     return this->read(buf, len);
 }
 
+quint32 ftdi::queued()
+{
+    DWORD len = 0;
+    if (!this->connected)
+        return 0;
+
+    ftStatus = FT_GetQueueStatus(ftHandle, &len);
+    if (ftStatus != FT_OK) {
+        qWarning("Error FT_GetQueueStatus(%d)\n", (int)ftStatus);
+        return 0;
+    }
+    return len;
+}
+
+/*
+ * An event that fires right before the wait is only seen when the wait
+ * ends, callers check queued() first and keep ms short.
+ */
+bool ftdi::waitEvent(quint32 ms)
+{
+#ifdef WIN32
+    return WaitForSingleObject(event, ms) == WAIT_TIMEOUT;
+#else
+    struct timespec ts;
+    int res = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&event.eMutex);
+    if (!event.iVar)
+        res = pthread_cond_timedwait(&event.eCondVar, &event.eMutex, &ts);
+    event.iVar = 0;
+    pthread_mutex_unlock(&event.eMutex);
+
+    return res != 0;
+#endif
+}
+
+void ftdi::wake()
+{
+#ifdef WIN32
+    SetEvent(event);
+#else
+    pthread_mutex_lock(&event.eMutex);
+    event.iVar = 1;
+    pthread_cond_signal(&event.eCondVar);
+    pthread_mutex_unlock(&event.eMutex);
+#endif
+}
+
+bool ftdi::setBaudRate(quint32 baud)
+{
+    if (!this->connected)
+        return true;
+
+    if((ftStatus = FT_SetBaudRate(ftHandle, baud)) != FT_OK) {
+        qWarning("Error FT_SetBaudRate(%d), baud = %d\n", (int)ftStatus, (int)baud);
+        return true;
+    }
+
+    this->baud = baud;
+    return false;
+}
+
+/* FT_PARITY_x, 8 data bits and one stop bit */
+bool ftdi::setParity(quint8 parity)
+{
+    if (!this->connected)
+        return true;
+
+    if((ftStatus = FT_SetDataCharacteristics(ftHandle, FT_BITS_8, FT_STOP_BITS_1, parity)) != FT_OK) {
+        qWarning("Error FT_SetDataCharacteristics(%d), parity = %d\n", (int)ftStatus, (int)parity);
+        return true;
+    }
+
+    return false;
+}
+
 bool ftdi::purge()
 {
     if (!this->connected)
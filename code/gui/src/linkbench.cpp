@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <string.h>
+#include <QCoreApplication>
+#include <QSettings>
+#include <QTemporaryFile>
+#include <QThread>
+#include "loopback.h"
+#include "stm32emu.h"
+#include "tcsemu.h"
+#include "bootloader.h"
+#include "tcsupdate.h"
+#include "tcscom.h"
+#include "spscqueue.h"
+
+/*
+ * opentcs-linkbench, the GUI side of the serial link against emulators
+ * of the firmware and of the ROM bootloader, through the loopback
+ * transport: round trips of the protocol, the rate negotiation and
+ * flashing, full and delta, then through the update stage. Last the
+ * telemetry ring of the worker, between two threads.
+ *
+ * Times are link times from the loopback model, bytes at the line rate
+ * plus the adapter latency and what the device works, so they do not
+ * depend on the machine and can be compared run to run, not with a real
+ * board: the model is not calibrated against an adapter. The telemetry
+ * ring is timed in host wall time, only its sequence check counts.
+ * Returns 1 when a check fails, for CI.
+ */
+
+#define LINKBENCH_ROUND_TRIPS 200
+#define LINKBENCH_IMAGE_SIZE 24000
+#define LINKBENCH_SEED 0x4F544353
+#define LINKBENCH_QUEUE_ITEMS 2000000
+
+static int failed = 0;
+
+static void check(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        printf("FAILED: %s\n", what);
+        failed++;
+    }
+}
+
+static void benchRequests(loopback* link, tcscom* tcs, const char* name)
+{
+    QElapsedTimer timer;
+    settings_t settings;
+    sensors_t sensors;
+    status_t status;
+    quint64 start;
+    quint32 i, errors = 0;
+
+    start = link->elapsed();
+    timer.start();
+    for (i = 0; i < LINKBENCH_ROUND_TRIPS; i++)
+        errors += tcs->getSettings(&settings);
+    printf("%-28s %7.1f us per getSettings, %5.1f us wall, %u errors\n", name,
+           (double)(link->elapsed() - start) / LINKBENCH_ROUND_TRIPS,
+           timer.nsecsElapsed() / 1000.0 / LINKBENCH_ROUND_TRIPS, errors);
+    check(errors == 0, "getSettings");
+
+    errors = 0;
+    start = link->elapsed();
+    for (i = 0; i < LINKBENCH_ROUND_TRIPS; i++)
+        errors += tcs->getState(&sensors, &status, &settings);
+    printf("%-28s %7.1f us per getState, 3 requests pipelined, %u errors\n", name,
+           (double)(link->elapsed() - start) / LINKBENCH_ROUND_TRIPS, errors);
+    check(errors == 0, "getState");
+}
+
+/* Flashes image, then reports what went over the link and what the flash did */
+static void benchFlash(loopback* link, stm32emu* chip, bootloader* bl, const QString& path,
+                       const QByteArray& image, bool delta, const char* name)
+{
+    const quint32 erased = chip->pagesErased(), programmed = chip->bytesProgrammed();
+    const quint64 start = link->elapsed(), sent = link->bytesSent();
+    QFile file(path);
+    double s;
+    bool error;
+
+    error = !file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(image) != image.length();
+    file.close();
+
+    error = error || bl->writeFile(&file, delta);
+    s = (link->elapsed() - start) / 1e6;
+
+    printf("%-28s %6.2f s, %5.1f KB/s of image, %2u pages erased, %5u bytes programmed, %6u bytes sent\n",
+           name, s, image.length() / 1024.0 / s, chip->pagesErased() - erased,
+           chip->bytesProgrammed() - programmed, (quint32)(link->bytesSent() - sent));
+
+    check(!error, name);
+    check(memcmp(chip->flash(), image.constData(), image.length()) == 0, "flash content");
+}
+
+/* Updates the application of image through the stage, at the rate of the link */
+static void benchUpdate(loopback* link, stm32emu* chip, tcsupdate* up, const QString& path,
+                        const QByteArray& image, const char* name)
+{
+    const quint8* record = chip->flash() + UPDATE_RECORD_ADDR - UPDATE_FLASH_ADDR;
+    const quint64 start = link->elapsed(), sent = link->bytesSent();
+    const QByteArray app = image.mid(UPDATE_STAGE_SIZE);
+    QFile file(path);
+    double s;
+    bool error;
+
+    error = !file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(image) != image.length();
+    file.close();
+
+    error = error || up->writeFile(&file);
+    s = (link->elapsed() - start) / 1e6;
+
+    printf("%-28s %6.2f s, %5.1f KB/s of image, %6u bytes sent\n",
+           name, s, app.length() / 1024.0 / s, (quint32)(link->bytesSent() - sent));
+
+    check(!error, name);
+    check(memcmp(chip->flash() + UPDATE_STAGE_SIZE, app.constData(), app.length()) == 0, "application content");
+    check(updateGet32(record + UPDATE_RECORD_SIZE * 4) == (quint32)app.length()
+          && updateGet32(record + UPDATE_RECORD_CRC * 4)
+          == updateCrc(UPDATE_CRC_INIT, (const quint8*)app.constData(), app.length()), "update record");
+    check(link->baudRate() == TRANSPORT_BAUD, "restarted at the default rate");
+}
+
+/* Producer side of the ring, a sequence the consumer checks for loss and order */
+class queueProducer : public QThread
+{
+public:
+    explicit queueProducer(spscqueue<quint32, 64>* queue) : queue(queue) {}
+
+protected:
+    void run()
+    {
+        quint32 i = 0;
+
+        while (i < LINKBENCH_QUEUE_ITEMS)
+        {
+            if (queue->push(i))
+                i++;
+            else
+                QThread::yieldCurrentThread();
+        }
+    }
+
+private:
+    spscqueue<quint32, 64>* queue;
+};
+
+static void benchQueue(void)
+{
+    static spscqueue<quint32, 64> queue;
+    queueProducer producer(&queue);
+    QElapsedTimer timer;
+    quint32 item, expected = 0, errors = 0;
+
+    timer.start();
+    producer.start();
+    while (expected < LINKBENCH_QUEUE_ITEMS)
+    {
+        if (!queue.pop(&item))
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        if (item != expected)
+            errors++;
+        expected = item + 1;
+    }
+    producer.wait();
+
+    printf("%-28s %u items in %d ms, %u out of sequence\n", "telemetry ring",
+           LINKBENCH_QUEUE_ITEMS, (int)timer.elapsed(), errors);
+    check(errors == 0 && !queue.pop(&item), "telemetry ring");
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    stm32emu chip(LINKBENCH_SEED);
+    tcsemu firmware(chip.flash() + STM32EMU_FLASH_SIZE - STM32EMU_PAGE_SIZE, chip.flash());
+    loopback link(&firmware, &chip);
+    tcscom tcs(&link);
+    bootloader bl(&link);
+    tcsupdate up(&link);
+    QTemporaryFile tmp;
+    QSettings manifest("OpenTCS", "OpenTCS");
+    const QString uid = QByteArray((const char*)chip.uid(), STM32EMU_UID_SIZE).toHex();
+    settings_t settings, saved;
+    QByteArray image;
+    quint32 i, seed = LINKBENCH_SEED;
+
+    check(!link.connect(), "connect");
+
+    /* Protocol */
+    benchRequests(&link, &tcs, "115200 baud");
+
+    memset(&settings, 0, sizeof(settings));
+    settings.data.functions = SETTINGS_FUNCTION_TC | SETTINGS_FUNCTION_SHIFTER;
+    settings.data.cut_type = SETTINGS_CUT_PROGRESSIVE;
+    settings.data.sensor_threshold = 1234;
+    check(!tcs.setSettings(&settings) && !tcs.getSettings(&saved)
+          && saved.data.sensor_threshold == 1234, "settings saved");
+
+    check(!tcs.negotiateBaudRate() && link.baudRate() == TCSEMU_BAUD_MAX, "negotiateBaudRate");
+    printf("%-28s %u baud\n", "negotiated", link.baudRate());
+    benchRequests(&link, &tcs, "negotiated");
+
+    /* Flashing, from an erased device without manifest */
+    for (i = 0; i < LINKBENCH_IMAGE_SIZE; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        image.append((char)(seed >> 24));
+    }
+    check(tmp.open(), "temporary image");
+    tmp.close();
+
+    manifest.beginGroup(BOOTLOADER_MANIFEST);
+    manifest.remove(uid);
+
+    benchFlash(&link, &chip, &bl, tmp.fileName(), image, false, "full");
+    benchFlash(&link, &chip, &bl, tmp.fileName(), image, true, "delta, unchanged");
+
+    image[5 * STM32EMU_PAGE_SIZE + 100] = image[5 * STM32EMU_PAGE_SIZE + 100] ^ 0x55;
+    benchFlash(&link, &chip, &bl, tmp.fileName(), image, true, "delta, 1 page by manifest");
+
+    manifest.remove(uid);
+    image[17 * STM32EMU_PAGE_SIZE] = image[17 * STM32EMU_PAGE_SIZE] ^ 0x55;
+    benchFlash(&link, &chip, &bl, tmp.fileName(), image, true, "delta, 1 page by read back");
+
+    manifest.remove(uid);
+
+    /* Through the update stage, a full image with the application behind the stage */
+    updatePut32((quint8*)image.data() + UPDATE_STAGE_SIZE, UPDATE_RAM_ADDR + UPDATE_RAM_SIZE);
+    updatePut32((quint8*)image.data() + UPDATE_STAGE_SIZE + 4, UPDATE_APP_ADDR + 0x101);
+    benchUpdate(&link, &chip, &up, tmp.fileName(), image, "update stage, 115200 baud");
+
+    check(!tcs.negotiateBaudRate(), "negotiateBaudRate after the update");
+    image[12 * STM32EMU_PAGE_SIZE] = image[12 * STM32EMU_PAGE_SIZE] ^ 0x55;
+    benchUpdate(&link, &chip, &up, tmp.fileName(), image, "update stage, negotiated");
+
+    /* The firmware restarted with the settings it saved before the updates */
+    check(link.baudRate() == TRANSPORT_BAUD && !tcs.getSettings(&saved)
+          && saved.data.sensor_threshold == 1234, "settings kept by the updates");
+
+    benchQueue();
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed ? 1 : 0;
+}
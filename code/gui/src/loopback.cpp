@@ -0,0 +1,199 @@
+#include <string.h>
+#include "loopback.h"
+
+loopback::loopback(emulator* firmware, emulator* rom, QObject *parent) :
+    transport(parent)
+{
+    this->firmware = firmware;
+    this->rom = rom;
+    this->device = firmware;
+    this->parity = TRANSPORT_PARITY_NONE;
+    this->now = this->sent = this->received = 0;
+    this->woken = false;
+    this->paced = false;
+    this->paced_from = 0;
+}
+
+loopback::~loopback()
+{
+
+}
+
+/* Powers the device up in its firmware */
+bool loopback::connect(void)
+{
+    this->connected = true;
+    this->baud = TRANSPORT_BAUD;
+    this->parity = TRANSPORT_PARITY_NONE;
+    this->rx.clear();
+    return this->resetNormal();
+}
+
+bool loopback::disconnect(void)
+{
+    this->connected = false;
+    this->rx.clear();
+    return true;
+}
+
+/*
+ * The bytes go out at the current rate after the adapter latency, the
+ * reply is on the host side once the device worked on them, sent it at
+ * the same rate and the latency went by again. Requests written back to
+ * back are not overlapped with the replies, the time is an upper bound.
+ */
+bool loopback::write(quint8 * buf, quint32 len, bool purge)
+{
+    QByteArray reply;
+    quint32 us;
+
+    if (!this->connected)
+        return true;
+
+    if (purge)
+        this->rx.clear();
+
+    now += LOOPBACK_LATENCY + EMULATOR_LINK_US(len, baud, parity);
+    sent += len;
+
+    us = device->receive(buf, len, baud, parity, now, &reply);
+    now += us;
+    if (!reply.isEmpty())
+        this->deliver(reply);
+    this->pace();
+
+    return false;
+}
+
+void loopback::deliver(const QByteArray& reply)
+{
+    now += EMULATOR_LINK_US(reply.length(), baud, parity) + LOOPBACK_LATENCY;
+    received += reply.length();
+    rx.append(reply);
+}
+
+/* Lets the device run for us, for what it sends on its own */
+void loopback::advance(quint64 us)
+{
+    QByteArray reply;
+
+    now += us;
+    device->tick(now, &reply);
+    if (!reply.isEmpty())
+        this->deliver(reply);
+    this->pace();
+}
+
+void loopback::setPaced(bool paced)
+{
+    this->paced = paced;
+    this->paced_from = now;
+    clock.start();
+}
+
+/* Sleeps until the wall clock catches up with the link time */
+void loopback::pace(void)
+{
+    qint64 ahead;
+
+    if (!paced)
+        return;
+
+    ahead = (qint64)(now - paced_from) / 1000 - clock.elapsed();
+    if (ahead > 0)
+        msleep(ahead);
+}
+
+bool loopback::read(quint8 * buf, quint32 len)
+{
+    if (!this->connected)
+        return true;
+
+    if ((quint32)rx.length() < len)
+        this->advance(TRANSPORT_TIMEOUT * 1000ULL);
+
+    if ((quint32)rx.length() < len)
+    {
+        qWarning("Error loopback read timeout, %d of %d bytes\n", (int)rx.length(), (int)len);
+        return true;
+    }
+
+    memcpy(buf, rx.constData(), len);
+    rx.remove(0, len);
+
+    return false;
+}
+
+quint32 loopback::queued(void)
+{
+    return this->connected ? rx.length() : 0;
+}
+
+/* The link time moves on by ms, the caller sleeps as long unless woken, paced it already did */
+bool loopback::waitEvent(quint32 ms)
+{
+    if (this->connected)
+    {
+        this->advance(ms * 1000ULL);
+        if (!rx.isEmpty() || paced)
+            return rx.isEmpty();
+    }
+
+    mutex.lock();
+    if (!woken)
+        event.wait(&mutex, ms);
+    woken = false;
+    mutex.unlock();
+
+    return rx.isEmpty();
+}
+
+void loopback::wake(void)
+{
+    mutex.lock();
+    woken = true;
+    event.wakeAll();
+    mutex.unlock();
+}
+
+bool loopback::setBaudRate(quint32 baud)
+{
+    if (!this->connected)
+        return true;
+
+    this->baud = baud;
+    return false;
+}
+
+bool loopback::setParity(quint8 parity)
+{
+    if (!this->connected)
+        return true;
+
+    this->parity = parity;
+    return false;
+}
+
+bool loopback::resetBootloader(void)
+{
+    if (!this->connected || rom == NULL)
+        return true;
+
+    device = rom;
+    device->reset();
+    rx.clear();
+
+    return false;
+}
+
+bool loopback::resetNormal(void)
+{
+    if (!this->connected || firmware == NULL)
+        return true;
+
+    device = firmware;
+    device->reset();
+    rx.clear();
+
+    return false;
+}
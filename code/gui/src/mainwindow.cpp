@@ -3,9 +3,7 @@
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow),
-    bl(&ftdi_device, this),
-    tcs(&ftdi_device, this)
+    ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
 
@@ -17,6 +15,14 @@ MainWindow::MainWindow(QWidget *parent) :
     QObject::connect(ui->b_get, SIGNAL(clicked()), this, SLOT(getConfig()));
     QObject::connect(ui->b_set, SIGNAL(clicked()), this, SLOT(applyConfig()));
 
+    /* The device is handled by the worker thread, its answers are queued here */
+    QObject::connect(&worker, SIGNAL(requestFinished(int,bool)), this, SLOT(requestFinished(int,bool)));
+    QObject::connect(&worker, SIGNAL(settingsReceived(settings_t)), this, SLOT(showSettings(settings_t)));
+    QObject::connect(&worker, SIGNAL(stateReceived(sensors_t,status_t)), this, SLOT(showState(sensors_t,status_t)));
+    QObject::connect(&worker, SIGNAL(telemetryReady()), this, SLOT(readTelemetry()));
+    QObject::connect(&worker, SIGNAL(flashProgress(int,quint32,quint32)), this, SLOT(showFlashProgress(int,quint32,quint32)));
+    QObject::connect(&worker, SIGNAL(flashed(quint32,quint32,quint32)), this, SLOT(showFlashed(quint32,quint32,quint32)));
+
     ui->statusBar->showMessage("Welcome");
 
     this->connected = false;
@@ -24,34 +30,20 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
-    ftdi_device.disconnect();
-
     delete ui;
 }
 
 void MainWindow::connect()
 {
     ui->statusBar->showMessage("Connecting...");
+    ui->b_connect->setEnabled(false);
 
-    if (ftdi_device.connect() == 0)
-    {
-        ui->statusBar->showMessage("Connected");
-        this->connected = true;
-
-        ui->b_connect->setEnabled(false);
-        ui->b_disconnect->setEnabled(true);
-        ui->b_set->setEnabled(true);
-        ui->b_get->setEnabled(true);
-        ui->b_update->setEnabled(true);
-
-    }
-    else ui->statusBar->showMessage("Connection failed");
-
+    worker.connectDevice();
 }
 
 void MainWindow::disconnect()
 {
-    tcs.disconnect();
+    worker.disconnectDevice();
 
     ui->b_connect->setEnabled(true);
     ui->b_disconnect->setEnabled(false);
@@ -68,7 +60,12 @@ void MainWindow::update()
 {
     QString filename = QFileDialog::getOpenFileName(this, tr("Open firmware file"), "", tr("BIN Files (*.bin)"));
 
-    QFile file(filename);
+    if (filename.isEmpty())
+        return;
+
+    ui->statusBar->showMessage("Updating...");
+    ui->b_update->setEnabled(false);
+    worker.flash(filename);
 }
 
 void MainWindow::importConfig()
@@ -85,9 +82,21 @@ void MainWindow::exportConfig()
     QFile file(filename);
 }
 
+/* Runs in turn in the worker, the settings come back through showSettings() */
 void MainWindow::getConfig()
 {
-    tcs.getSettings(&this->settings);
+    /* First exchange with the firmware, move the link to a faster rate */
+    worker.negotiateBaudRate();
+
+    /* Then the dashboard follows the pushes instead of polling */
+    worker.subscribe(PUSH_SENSORS | PUSH_STATUS | PUSH_CUTS, PUSH_PERIOD);
+
+    worker.getSettings();
+}
+
+void MainWindow::showSettings(const settings_t& settings)
+{
+    this->settings = settings;
 
     ui->cb_shifter->setChecked((settings.data.functions & SETTINGS_FUNCTION_SHIFTER));
     ui->cb_shiftlight->setChecked((settings.data.functions & SETTINGS_FUNCTION_LED));
@@ -100,8 +109,40 @@ void MainWindow::getConfig()
 
 void MainWindow::getData()
 {
-    tcs.getDiag(&this->sensors);
-    tcs.getInfo(&this->status);
+    worker.getState();
+}
+
+void MainWindow::showState(const sensors_t& sensors, const status_t& status)
+{
+    showSensors(sensors);
+    showStatus(status);
+}
+
+/* Everything pushed since the last call */
+void MainWindow::readTelemetry()
+{
+    telemetry_t t;
+
+    while (worker.takeTelemetry(&t))
+    {
+        switch (t.type)
+        {
+            case PUSH_SENSORS:
+                showSensors(t.sensors);
+                break;
+            case PUSH_STATUS:
+                showStatus(t.status);
+                break;
+            case PUSH_CUTS:
+                showCut(t.cut);
+                break;
+        }
+    }
+}
+
+void MainWindow::showSensors(const sensors_t& sensors)
+{
+    this->sensors = sensors;
 
     ui->le_rpm->setText(QString::number(sensors.rpm));
     ui->le_fspd->setText(QString::number(sensors.speed));
@@ -110,7 +151,64 @@ void MainWindow::getData()
     ui->le_vbat->setText(QString::number(sensors.vbat));
 }
 
+void MainWindow::showStatus(const status_t& status)
+{
+    this->status = status;
+}
+
+void MainWindow::showCut(const cut_t& cut)
+{
+    ui->statusBar->showMessage(QString("Cut %1 at %2 ms: %3, %4 us")
+                               .arg(cut.count).arg(cut.time)
+                               .arg(cut.reason == 1 ? "shift" : "traction control")
+                               .arg(cut.duration));
+}
+
+void MainWindow::showFlashProgress(int stage, quint32 done, quint32 total)
+{
+    static const char* const stages[] = {"Erasing", "Writing", "Verifying", "Comparing"};
+
+    ui->statusBar->showMessage(QString("%1 %2/%3").arg(stages[stage]).arg(done).arg(total));
+}
+
+/* skipped bytes were already on the device */
+void MainWindow::showFlashed(quint32 bytes, quint32 skipped, quint32 ms)
+{
+    ui->statusBar->showMessage(QString("Updated, %1 of %2 bytes written in %3 s")
+                               .arg(bytes - skipped).arg(bytes)
+                               .arg(ms / 1000.0, 0, 'f', 1));
+}
+
 void MainWindow::applyConfig()
 {
-    tcs.setSettings(&this->settings);
+    worker.setSettings(this->settings);
+}
+
+void MainWindow::requestFinished(int type, bool error)
+{
+    switch (type)
+    {
+        case TCSWORKER_CONNECT:
+            if (error)
+            {
+                ui->statusBar->showMessage("Connection failed");
+                ui->b_connect->setEnabled(true);
+                break;
+            }
+            ui->statusBar->showMessage("Connected");
+            this->connected = true;
+
+            ui->b_disconnect->setEnabled(true);
+            ui->b_set->setEnabled(true);
+            ui->b_get->setEnabled(true);
+            ui->b_update->setEnabled(true);
+            break;
+
+        case TCSWORKER_FLASH:
+            /* Success is shown by showFlashed() */
+            if (error)
+                ui->statusBar->showMessage("Update failed");
+            ui->b_update->setEnabled(this->connected);
+            break;
+    }
 }
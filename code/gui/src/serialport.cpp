@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "serialport.h"
+
+#define SERIALPORT_RESET_DELAY 50 /* ms NRST is held low, then for the device to start */
+
+/* Rates the termios headers know, the firmware negotiates up to 3 Mbaud */
+static const struct {
+    quint32 baud;
+    speed_t speed;
+} serialport_rates[] = {
+    {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+    {115200, B115200}, {230400, B230400},
+#ifdef B460800
+    {460800, B460800},
+#endif
+#ifdef B1000000
+    {1000000, B1000000},
+#endif
+#ifdef B2000000
+    {2000000, B2000000},
+#endif
+#ifdef B3000000
+    {3000000, B3000000},
+#endif
+};
+
+serialport::serialport(const QString& path, QObject *parent) :
+    transport(parent)
+{
+    this->path = path;
+    this->fd = -1;
+    this->parity = TRANSPORT_PARITY_NONE;
+    this->pty = false;
+
+    if (pipe(wake_pipe) < 0)
+    {
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+}
+
+serialport::~serialport()
+{
+    if (this->connected)
+        this->disconnect();
+
+    ::close(wake_pipe[0]);
+    ::close(wake_pipe[1]);
+}
+
+/* Raw 8N1 at TRANSPORT_BAUD, the lines released so the firmware runs */
+bool serialport::connect(void)
+{
+    int bits;
+
+    if ((fd = ::open(path.toLocal8Bit().constData(), O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+    {
+        qWarning("Error open(%s): %s\n", qPrintable(path), strerror(errno));
+        return true;
+    }
+
+    this->pty = ioctl(fd, TIOCMGET, &bits) < 0 && (errno == ENOTTY || errno == EINVAL);
+    this->connected = true;
+    if (this->setAttributes(TRANSPORT_BAUD, TRANSPORT_PARITY_NONE) || this->setLines(false, false))
+    {
+        this->disconnect();
+        return true;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+    qDebug("Connected to %s", qPrintable(path));
+
+    return false;
+}
+
+bool serialport::disconnect(void)
+{
+    if (!this->connected)
+        return false;
+
+    this->connected = false;
+    ::close(fd);
+    fd = -1;
+
+    qDebug("Disconnected");
+
+    return true;
+}
+
+bool serialport::write(quint8 * buf, quint32 len, bool purge)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    ssize_t n;
+
+    if (!this->connected)
+        return true;
+
+    if (purge)
+        tcflush(fd, TCIOFLUSH);
+
+    while (len > 0)
+    {
+        if ((n = ::write(fd, buf, len)) > 0)
+        {
+            buf += n;
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            qWarning("Error write(%s): %s\n", qPrintable(path), strerror(errno));
+            return true;
+        }
+        if (poll(&pfd, 1, TRANSPORT_TIMEOUT) == 0)
+        {
+            qWarning("Error write timeout, %d bytes left\n", (int)len);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool serialport::read(quint8 * buf, quint32 len)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    QElapsedTimer timer;
+    quint32 done = 0;
+    ssize_t n;
+
+    if (!this->connected)
+        return true;
+
+    timer.start();
+    while (done < len)
+    {
+        if ((n = ::read(fd, buf + done, len - done)) > 0)
+        {
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            qWarning("Error read(%s): %s\n", qPrintable(path), strerror(errno));
+            return true;
+        }
+        /* Read once, a negative poll() timeout would wait forever */
+        const qint64 elapsed = timer.elapsed();
+
+        if (elapsed >= TRANSPORT_TIMEOUT || poll(&pfd, 1, (int)(TRANSPORT_TIMEOUT - elapsed)) == 0)
+        {
+            qWarning("Error read timeout, %d of %d bytes\n", (int)done, (int)len);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+quint32 serialport::queued(void)
+{
+    int len = 0;
+
+    if (!this->connected)
+        return 0;
+
+    if (ioctl(fd, FIONREAD, &len) < 0)
+    {
+        qWarning("Error FIONREAD(%s): %s\n", qPrintable(path), strerror(errno));
+        return 0;
+    }
+
+    return len;
+}
+
+bool serialport::waitEvent(quint32 ms)
+{
+    struct pollfd pfd[2] = {{wake_pipe[0], POLLIN, 0}, {fd, POLLIN, 0}};
+    char drain[16];
+    int res;
+
+    res = poll(pfd, this->connected ? 2 : 1, ms);
+    if (res > 0 && (pfd[0].revents & POLLIN))
+        while (::read(wake_pipe[0], drain, sizeof(drain)) > 0);
+
+    return res <= 0;
+}
+
+void serialport::wake(void)
+{
+    const char byte = 0;
+
+    if (::write(wake_pipe[1], &byte, 1) < 0)
+        return; /* Full, a wake up is pending anyway */
+}
+
+bool serialport::setBaudRate(quint32 baud)
+{
+    if (!this->connected || this->setAttributes(baud, this->parity))
+        return true;
+
+    this->baud = baud;
+    return false;
+}
+
+bool serialport::setParity(quint8 parity)
+{
+    if (!this->connected || this->setAttributes(this->baud, parity))
+        return true;
+
+    this->parity = parity;
+    return false;
+}
+
+bool serialport::setAttributes(quint32 baud, quint8 parity)
+{
+    struct termios tio;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(serialport_rates) / sizeof(serialport_rates[0]); i++)
+        if (serialport_rates[i].baud == baud)
+            break;
+
+    if (i == sizeof(serialport_rates) / sizeof(serialport_rates[0]))
+    {
+        qWarning("Error %s: %d baud not supported\n", qPrintable(path), (int)baud);
+        return true;
+    }
+
+    if (tcgetattr(fd, &tio) < 0)
+    {
+        qWarning("Error tcgetattr(%s): %s\n", qPrintable(path), strerror(errno));
+        return true;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | PARODD | PARENB);
+    if (parity == TRANSPORT_PARITY_EVEN && !pty)
+        tio.c_cflag |= PARENB;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, serialport_rates[i].speed);
+    cfsetospeed(&tio, serialport_rates[i].speed);
+
+    if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    {
+        qWarning("Error tcsetattr(%s): %s\n", qPrintable(path), strerror(errno));
+        return true;
+    }
+
+    return false;
+}
+
+/* Opening the tty asserts both lines */
+bool serialport::setLines(bool boot0, bool reset)
+{
+    int bits = 0;
+
+    if (!this->connected)
+        return true;
+    if (pty)
+        return false;
+
+    if (ioctl(fd, TIOCMGET, &bits) < 0)
+    {
+        qWarning("Error TIOCMGET(%s): %s\n", qPrintable(path), strerror(errno));
+        return true;
+    }
+
+    bits &= ~(TIOCM_RTS | TIOCM_DTR);
+    if (boot0)
+        bits |= TIOCM_RTS;
+    if (reset)
+        bits |= TIOCM_DTR;
+
+    if (ioctl(fd, TIOCMSET, &bits) < 0)
+    {
+        qWarning("Error TIOCMSET(%s): %s\n", qPrintable(path), strerror(errno));
+        return true;
+    }
+
+    return false;
+}
+
+bool serialport::resetBootloader(void)
+{
+    bool res;
+
+    /* BOOT0 high, Reset low, then Reset high */
+    res = this->setLines(true, true);
+    msleep(SERIALPORT_RESET_DELAY);
+    res |= this->setLines(true, false);
+    msleep(SERIALPORT_RESET_DELAY);
+
+    /* BOOT0 is only sampled at reset */
+    res |= this->setLines(false, false);
+    tcflush(fd, TCIFLUSH);
+
+    return res;
+}
+
+bool serialport::resetNormal(void)
+{
+    bool res;
+
+    /* BOOT0 low, Reset low, then Reset high */
+    res = this->setLines(false, true);
+    msleep(SERIALPORT_RESET_DELAY);
+    res |= this->setLines(false, false);
+    msleep(SERIALPORT_RESET_DELAY);
+    tcflush(fd, TCIFLUSH);
+
+    return res;
+}
@@ -0,0 +1,386 @@
+#include <string.h>
+#include <QtEndian>
+#include "stm32emu.h"
+#include "transport.h"
+
+/* What the bytes received next are */
+#define STM32EMU_SYNC 0         /* Waiting for 0x7F */
+#define STM32EMU_COMMAND 1      /* Command and its complement */
+#define STM32EMU_ADDRESS 2      /* Of RM, GO and WM, with its checksum */
+#define STM32EMU_RM_COUNT 3
+#define STM32EMU_WM_COUNT 4
+#define STM32EMU_WM_DATA 5      /* The data and the checksum */
+#define STM32EMU_ER_COUNT 6
+#define STM32EMU_ER_PAGES 7
+#define STM32EMU_EE_COUNT 8
+#define STM32EMU_EE_PAGES 9
+#define STM32EMU_WP_COUNT 10
+#define STM32EMU_WP_SECTORS 11
+
+#define STM32EMU_PAGES (STM32EMU_FLASH_SIZE / STM32EMU_PAGE_SIZE)
+
+static const quint8 stm32emu_commands[] = {
+    0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x43, 0x63, 0x73, 0x82, 0x92
+};
+
+/* seed makes the unique ID, one per emulated unit */
+stm32emu::stm32emu(quint32 seed, bool extended_erase)
+{
+    quint8 i;
+
+    memset(memory, 0xFF, sizeof(memory));
+    for (i = 0; i < STM32EMU_UID_SIZE; i++)
+        id[i] = (quint8)(seed >> ((i % 4) * 8)) ^ (quint8)(0x5A + i * 0x11);
+
+    this->extended_erase = extended_erase;
+    this->wrp = 0;
+    this->rdp = false;
+    this->erased = this->programmed = 0;
+    this->reset();
+}
+
+/* Flash and option bytes stay, the rate is found again */
+void stm32emu::reset(void)
+{
+    this->baud = 0;
+    this->expect(STM32EMU_SYNC, 1);
+}
+
+void stm32emu::expect(quint8 state, quint16 len)
+{
+    this->state = state;
+    this->len = len;
+    this->pos = 0;
+}
+
+quint32 stm32emu::receive(const quint8* data, quint32 len, quint32 baud, quint8 parity,
+                          quint64 now, QByteArray* reply)
+{
+    quint32 us = 0, i;
+
+    Q_UNUSED(now);
+
+    for (i = 0; i < len; i++)
+    {
+        /* Autobaud locks on the rate of 0x7F, anything else before it is noise */
+        if (state == STM32EMU_SYNC)
+        {
+            if (data[i] == STM32EMU_SYNC_BYTE && parity == TRANSPORT_PARITY_EVEN
+                    && baud <= STM32EMU_BAUD_MAX)
+            {
+                this->baud = baud;
+                reply->append((char)STM32EMU_ACK);
+                this->expect(STM32EMU_COMMAND, 2);
+            }
+            continue;
+        }
+
+        /* Framing or parity errors, the bootloader sees garbage */
+        if (baud != this->baud || parity != TRANSPORT_PARITY_EVEN)
+            return us;
+
+        buf[pos++] = data[i];
+        if (pos < this->len)
+            continue;
+
+        pos = 0;
+        us += (state == STM32EMU_COMMAND) ? this->command(reply) : this->payload(reply);
+    }
+
+    return us;
+}
+
+quint32 stm32emu::command(QByteArray* reply)
+{
+    quint8 i;
+
+    cmd = buf[0];
+    if (buf[1] != (quint8)(cmd ^ 0xFF))
+    {
+        reply->append((char)STM32EMU_NACK);
+        return 0;
+    }
+
+    switch (cmd)
+    {
+        case 0x00: /* GET */
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)(sizeof(stm32emu_commands)));
+            reply->append((char)STM32EMU_VERSION);
+            for (i = 0; i < sizeof(stm32emu_commands); i++)
+                reply->append((char)((i == 6 && extended_erase) ? 0x44 : stm32emu_commands[i]));
+            reply->append((char)STM32EMU_ACK);
+            return 0;
+
+        case 0x01: /* GV, and the option bytes the F0 returns as zeros */
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)STM32EMU_VERSION);
+            reply->append((char)0);
+            reply->append((char)0);
+            reply->append((char)STM32EMU_ACK);
+            return 0;
+
+        case 0x02: /* GID */
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)1);
+            reply->append((char)(STM32EMU_PID >> 8));
+            reply->append((char)(STM32EMU_PID & 0xFF));
+            reply->append((char)STM32EMU_ACK);
+            return 0;
+
+        case 0x11: /* RM */
+        case 0x21: /* GO */
+        case 0x31: /* WM */
+            if (rdp)
+                break;
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_ADDRESS, 5);
+            return 0;
+
+        case 0x43: /* ER */
+            if (rdp || extended_erase)
+                break;
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_ER_COUNT, 1);
+            return 0;
+
+        case 0x44: /* EE */
+            if (rdp || !extended_erase)
+                break;
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_EE_COUNT, 2);
+            return 0;
+
+        case 0x63: /* WP */
+            if (rdp)
+                break;
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_WP_COUNT, 1);
+            return 0;
+
+        case 0x73: /* UW */
+            if (rdp)
+                break;
+            wrp = 0;
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)STM32EMU_ACK);
+            this->reset();
+            return 0;
+
+        case 0x82: /* RP */
+            rdp = true;
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)STM32EMU_ACK);
+            this->reset();
+            return 0;
+
+        case 0x92: /* UR, back to level 0 erases the whole flash */
+            memset(memory, 0xFF, sizeof(memory));
+            erased += STM32EMU_PAGES;
+            rdp = false;
+            wrp = 0;
+            reply->append((char)STM32EMU_ACK);
+            reply->append((char)STM32EMU_ACK);
+            this->reset();
+            return STM32EMU_PAGES * STM32EMU_ERASE_US;
+    }
+
+    reply->append((char)STM32EMU_NACK);
+    return 0;
+}
+
+/* The bytes after a command, returns the us the flash is busy */
+quint32 stm32emu::payload(QByteArray* reply)
+{
+    quint8 checksum = 0;
+    quint16 n, i;
+    quint32 us = 0;
+
+    switch (state)
+    {
+        case STM32EMU_ADDRESS:
+            address = qFromBigEndian<quint32>(buf);
+            if ((buf[0] ^ buf[1] ^ buf[2] ^ buf[3]) != buf[4]
+                    || !this->validAddress(address, 1, cmd == 0x31)
+                    || (cmd == 0x31 && address % 4 != 0))
+                break;
+
+            reply->append((char)STM32EMU_ACK);
+            if (cmd == 0x11)
+                this->expect(STM32EMU_RM_COUNT, 2);
+            else if (cmd == 0x31)
+                this->expect(STM32EMU_WM_COUNT, 1);
+            else
+                this->expect(STM32EMU_COMMAND, 2);
+            return 0;
+
+        case STM32EMU_RM_COUNT:
+            n = buf[0] + 1;
+            if (buf[1] != (quint8)(buf[0] ^ 0xFF) || !this->validAddress(address, n, false))
+                break;
+
+            reply->append((char)STM32EMU_ACK);
+            if (address >= STM32EMU_UID_ADDR)
+                reply->append((const char*)&id[address - STM32EMU_UID_ADDR], n);
+            else
+                reply->append((const char*)&memory[address - STM32EMU_FLASH_ADDR], n);
+            this->expect(STM32EMU_COMMAND, 2);
+            return 0;
+
+        case STM32EMU_WM_COUNT:
+            this->expect(STM32EMU_WM_DATA, buf[0] + 2);
+            return 0;
+
+        case STM32EMU_WM_DATA:
+        {
+            quint8* const flash = &memory[address - STM32EMU_FLASH_ADDR];
+
+            n = len - 1;
+            checksum = n - 1;
+            for (i = 0; i < n; i++)
+                checksum ^= buf[i];
+            if (checksum != buf[n] || n % 4 != 0 || !this->validAddress(address, n, true))
+                break;
+
+            /* The flash interface refuses half words that are not erased */
+            for (i = 0; i < n; i += 2)
+                if ((flash[i] != 0xFF || flash[i + 1] != 0xFF)
+                        && (flash[i] != buf[i] || flash[i + 1] != buf[i + 1]))
+                    break;
+            if (i < n)
+                break;
+
+            memcpy(flash, buf, n);
+            programmed += n;
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_COMMAND, 2);
+            return (n / 2) * STM32EMU_PROGRAM_US;
+        }
+
+        case STM32EMU_ER_COUNT:
+            this->expect(STM32EMU_ER_PAGES, buf[0] == 0xFF ? 1 : buf[0] + 2);
+            return 0;
+
+        case STM32EMU_ER_PAGES:
+            if (len == 1)
+            {
+                /* Global erase, refused with protected sectors */
+                if (buf[0] != 0x00 || wrp)
+                    break;
+                for (i = 0; i < STM32EMU_PAGES; i++)
+                    this->erasePage(i);
+                us = STM32EMU_PAGES * STM32EMU_ERASE_US;
+            }
+            else
+            {
+                n = len - 1;
+                checksum = n - 1;
+                for (i = 0; i < n; i++)
+                    checksum ^= buf[i];
+                if (checksum != buf[n])
+                    break;
+                for (i = 0; i < n; i++)
+                    if (this->erasePage(buf[i]))
+                        break;
+                if (i < n)
+                    break;
+                us = n * STM32EMU_ERASE_US;
+            }
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_COMMAND, 2);
+            return us;
+
+        case STM32EMU_EE_COUNT:
+            n = qFromBigEndian<quint16>(buf);
+            address = n;
+            if (n >= 0xFFF0)
+            {
+                this->expect(STM32EMU_EE_PAGES, 1);
+                return 0;
+            }
+            if (2 * (n + 1) + 1 > (int)sizeof(buf))
+                break;
+            this->expect(STM32EMU_EE_PAGES, 2 * (n + 1) + 1);
+            return 0;
+
+        case STM32EMU_EE_PAGES:
+            checksum = (address >> 8) ^ (address & 0xFF);
+            if (address >= 0xFFF0)
+            {
+                /* Mass erase only, the F0 has one bank */
+                if (address != 0xFFFF || buf[0] != checksum || wrp)
+                    break;
+                for (i = 0; i < STM32EMU_PAGES; i++)
+                    this->erasePage(i);
+                us = STM32EMU_PAGES * STM32EMU_ERASE_US;
+            }
+            else
+            {
+                for (i = 0; i < len - 1; i++)
+                    checksum ^= buf[i];
+                if (checksum != buf[len - 1])
+                    break;
+                for (i = 0; i < len - 1; i += 2)
+                    if (this->erasePage(qFromBigEndian<quint16>(&buf[i])))
+                        break;
+                if (i < len - 1)
+                    break;
+                us = ((len - 1) / 2) * STM32EMU_ERASE_US;
+            }
+            reply->append((char)STM32EMU_ACK);
+            this->expect(STM32EMU_COMMAND, 2);
+            return us;
+
+        case STM32EMU_WP_COUNT:
+            this->expect(STM32EMU_WP_SECTORS, buf[0] + 2);
+            return 0;
+
+        case STM32EMU_WP_SECTORS:
+            n = len - 1;
+            checksum = n - 1;
+            for (i = 0; i < n; i++)
+                checksum ^= buf[i];
+            if (checksum != buf[n])
+                break;
+            for (i = 0; i < n; i++)
+                if (buf[i] < STM32EMU_PAGES / STM32EMU_SECTOR_PAGES)
+                    wrp |= 1 << buf[i];
+            reply->append((char)STM32EMU_ACK);
+            this->reset();
+            return 0;
+    }
+
+    reply->append((char)STM32EMU_NACK);
+    this->expect(STM32EMU_COMMAND, 2);
+    return 0;
+}
+
+/* Flash, and the unique ID for reading */
+bool stm32emu::validAddress(quint32 address, quint32 len, bool writing)
+{
+    if (address >= STM32EMU_FLASH_ADDR && address + len <= STM32EMU_FLASH_ADDR + STM32EMU_FLASH_SIZE)
+    {
+        const quint16 first = (address - STM32EMU_FLASH_ADDR) / STM32EMU_PAGE_SIZE;
+        const quint16 last = (address + len - 1 - STM32EMU_FLASH_ADDR) / STM32EMU_PAGE_SIZE;
+        quint16 page;
+
+        for (page = first; writing && page <= last; page++)
+            if (wrp & (1 << (page / STM32EMU_SECTOR_PAGES)))
+                return false;
+        return true;
+    }
+
+    return !writing && address >= STM32EMU_UID_ADDR
+            && address + len <= STM32EMU_UID_ADDR + STM32EMU_UID_SIZE;
+}
+
+/* true when the page does not exist or is protected */
+bool stm32emu::erasePage(quint16 page)
+{
+    if (page >= STM32EMU_PAGES || (wrp & (1 << (page / STM32EMU_SECTOR_PAGES))))
+        return true;
+
+    memset(&memory[page * STM32EMU_PAGE_SIZE], 0xFF, STM32EMU_PAGE_SIZE);
+    erased++;
+    return false;
+}
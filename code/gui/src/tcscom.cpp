@@ -1,11 +1,15 @@
+#include <string.h>
 #include "tcscom.h"
 
-tcscom::tcscom(ftdi *device, QObject *parent) :
+tcscom::tcscom(transport *device, QObject *parent) :
     QObject(parent)
 {
-    this->ftdi_device = device;
-    pb_istream = pb_istream_from_buffer(pb_ibuffer, sizeof(pb_ibuffer));
-    pb_ostream = pb_ostream_from_buffer(pb_obuffer, sizeof(pb_obuffer));
+    this->device = device;
+    this->seq = 0;
+    this->push_seq = 0;
+    this->push_lost = 0;
+    this->rx_pos = this->rx_len = 0;
+    frameDecoderInit(&decoder, pb_ibuffer, sizeof(pb_ibuffer));
 }
 
 tcscom::~tcscom()
@@ -13,112 +17,348 @@ tcscom::~tcscom()
 
 }
 
+/*
+ * Next received byte, reads whatever the adapter holds at once and
+ * sleeps on its receive event until something comes in. Returns true
+ * when nothing did for timeout ms.
+ */
+bool tcscom::readByte(quint8* byte, quint32 timeout)
+{
+    if (rx_pos == rx_len)
+    {
+        QElapsedTimer timer;
+        quint32 queued;
+
+        /* rx_pos and rx_len stay equal until the read, a timeout leaves nothing behind */
+        timer.start();
+        while ((queued = this->device->queued()) == 0)
+        {
+            const qint64 elapsed = timer.elapsed();
+
+            if (elapsed >= timeout)
+                return true;
+            this->device->waitEvent((quint32)(timeout - elapsed));
+        }
+
+        rx_len = (queued > sizeof(rx_buffer)) ? sizeof(rx_buffer) : queued;
+        rx_pos = 0;
+        if (this->device->read(rx_buffer, rx_len))
+        {
+            rx_len = 0;
+            return true;
+        }
+    }
+
+    *byte = rx_buffer[rx_pos++];
+    return false;
+}
+
+/*
+ * Reads frames until the reply to request seq, replies to requests that
+ * timed out before are skipped and pushes on the way are dispatched.
+ * Gives up when the link stays quiet for timeout ms. Without fields the
+ * payload is left in the decoder as it came.
+ */
+bool tcscom::readReply(quint8 seq, quint8 cmd, const pb_field_t fields[], void* msg, quint32 timeout)
+{
+    quint8 byte, res;
+
+    while (!readByte(&byte, timeout))
+    {
+        res = frameDecode(&decoder, byte);
+        if (res == FRAME_ERROR)
+        {
+            PrintErrorDetails("Damaged frame!");
+        }
+        if (res == FRAME_OK && (frameCmd(&decoder) & CMD_PUSH))
+        {
+            dispatchPush();
+            continue;
+        }
+        if (res != FRAME_OK || frameSeq(&decoder) != seq)
+            continue;
+
+        if (frameCmd(&decoder) != cmd)
+        {
+            PrintErrorDetails("Unexpected reply!");
+            return true;
+        }
+
+        if (fields == NULL)
+            return false;
+
+        pb_istream_t stream = pb_istream_from_buffer(framePayload(&decoder), framePayloadLen(&decoder));
+
+        return !pb_decode(&stream, fields, msg);
+    }
+
+    return true;
+}
+
+/* Sends one request and waits for its reply */
+bool tcscom::request(quint8 cmd, const quint8* payload, quint8 size, const pb_field_t fields[], void* msg,
+                     quint32 timeout)
+{
+    quint8 seq = this->seq++;
+    quint16 len = frameEncode(pb_obuffer, seq, cmd, payload, size);
+
+    if (this->device->write(pb_obuffer, len, false))
+        return true;
+
+    return readReply(seq, cmd, fields, msg, timeout);
+}
+
 bool tcscom::setSettings(const settings_t* settings)
 {
-    quint8 cmd[4] = {SER_MAGIC1, SER_MAGIC2, CMD_SAVE_SETTINGS, 0};
-    quint8 cs;
+    /* Message behind the room its frame needs */
+    quint8* msg = &pb_obuffer[FRAME_ENCODED_MAX(settings_t_size)];
+    pb_ostream_t stream = pb_ostream_from_buffer(msg, settings_t_size);
+    quint16 len;
 
-    pb_encode(&pb_ostream, settings_t_fields, &settings);
-    quint8 len = pb_ostream.bytes_written;
-    cmd[3] = len+4;
-    cs = doChecksum(cmd, sizeof(cmd));
-    cs += doChecksum(pb_obuffer, len);
+    if (!pb_encode(&stream, settings_t_fields, settings))
+        return true;
+
+    len = frameEncode(pb_obuffer, this->seq++, CMD_SAVE_SETTINGS, msg, stream.bytes_written);
+
+    return this->device->write(pb_obuffer, len, false);
+}
+
+bool tcscom::getSettings(settings_t* settings)
+{
+    return request(CMD_SEND_SETTINGS, NULL, 0, settings_t_fields, settings);
+}
+
+bool tcscom::getInfo(status_t* status)
+{
+    return request(CMD_SEND_INFO, NULL, 0, status_t_fields, status);
+}
+
+bool tcscom::getDiag(sensors_t* sensors)
+{
+    return request(CMD_SEND_DIAG, NULL, 0, sensors_t_fields, sensors);
+}
 
+bool tcscom::getGears(gears_t* gears)
+{
+    return request(CMD_SEND_GEARS, NULL, 0, gears_t_fields, gears);
+}
 
-    this->ftdi_device->write(cmd, sizeof(cmd));
-    this->ftdi_device->write(pb_obuffer, len);
-    this->ftdi_device->write(&cs);
+/*
+ * Refreshes any of the three in one round trip: the requests go out
+ * back to back and the device answers them in order. NULL skips one.
+ */
+bool tcscom::getState(sensors_t* sensors, status_t* status, settings_t* settings)
+{
+    quint8 seq = this->seq;
+    quint16 len = 0;
+
+    if (sensors != NULL)
+        len += frameEncode(&pb_obuffer[len], this->seq++, CMD_SEND_DIAG, NULL, 0);
+    if (status != NULL)
+        len += frameEncode(&pb_obuffer[len], this->seq++, CMD_SEND_INFO, NULL, 0);
+    if (settings != NULL)
+        len += frameEncode(&pb_obuffer[len], this->seq++, CMD_SEND_SETTINGS, NULL, 0);
+
+    if (len == 0)
+        return false;
+    if (this->device->write(pb_obuffer, len, false))
+        return true;
+
+    if (sensors != NULL && readReply(seq++, CMD_SEND_DIAG, sensors_t_fields, sensors))
+        return true;
+    if (status != NULL && readReply(seq++, CMD_SEND_INFO, status_t_fields, status))
+        return true;
+    if (settings != NULL && readReply(seq++, CMD_SEND_SETTINGS, settings_t_fields, settings))
+        return true;
 
     return false;
 }
 
-bool tcscom::getSettings(settings_t* settings)
+/* Link rate request or answer, returns the rate in the reply, 0 without one */
+quint32 tcscom::link(quint8 cmd, quint32 baud, quint32 timeout)
 {
-    settings_t settings_tmp;
-    quint8 cmd[5] = {SER_MAGIC1, SER_MAGIC2, CMD_SEND_SETTINGS, sizeof(cmd), 0};
-    quint8 info[4];
-    quint8 cs1, cs2;
+    quint8 payload[link_t_size];
+    pb_ostream_t stream = pb_ostream_from_buffer(payload, sizeof(payload));
+    link_t link = {baud};
 
-    cmd[4] = doChecksum(cmd, sizeof(cmd));
-    this->ftdi_device->write(cmd, sizeof(cmd));
+    if (!pb_encode(&stream, link_t_fields, &link))
+        return 0;
 
-    msleep(100);
-    this->ftdi_device->read(info, sizeof(info));
-    quint8 len = info[3]-4;
+    link.baud = 0;
+    request(cmd, payload, stream.bytes_written, link_t_fields, &link, timeout);
 
-    this->ftdi_device->read(pb_ibuffer, len);
-    this->ftdi_device->read(&cs1);
+    return link.baud;
+}
 
-    cs2 = doChecksum(cmd, sizeof(cmd));
-    cs2 += doChecksum(pb_ibuffer, len);
+/*
+ * Sends a payload as long as the largest message and checks the device
+ * echoes it: a frame of the longest kind each way at the new rate, with
+ * no zero byte so COBS encodes it at its longest. Returns true when the
+ * echo is missing or differs.
+ */
+bool tcscom::linkTest()
+{
+    quint8 pattern[settings_t_size];
+    quint8 seq = this->seq++;
+    quint16 len;
 
-    if (cs1 != cs2)
-    {
-        PrintErrorDetails("Checksum failed!");
+    for (quint8 i = 0; i < sizeof(pattern); i++)
+        pattern[i] = 0x80 | i;
+
+    len = frameEncode(pb_obuffer, seq, CMD_LINK_TEST, pattern, sizeof(pattern));
+    if (this->device->write(pb_obuffer, len, false)
+            || readReply(seq, CMD_LINK_TEST, NULL, NULL, LINK_REPLY_TIMEOUT))
+        return true;
+
+    return framePayloadLen(&decoder) != sizeof(pattern)
+            || memcmp(framePayload(&decoder), pattern, sizeof(pattern)) != 0;
+}
+
+/*
+ * Moves the link to baud: the device answers at the current rate and
+ * switches, full size frames go both ways at the new rate, then both
+ * confirm with CMD_LINK_CHECK. On failure the adapter goes back at once
+ * and waits out what is left of the device's confirmation timeout.
+ */
+bool tcscom::setBaudRate(quint32 baud)
+{
+    quint32 prev = this->device->baudRate();
+    QElapsedTimer timer;
+    qint64 elapsed;
+
+    if (link(CMD_SET_BAUD, baud) != baud)
         return true;
+    timer.start();
+
+    if (!this->device->setBaudRate(baud))
+    {
+        msleep(LINK_SWITCH_DELAY);
+        if (!linkTest() && link(CMD_LINK_CHECK, 0, LINK_REPLY_TIMEOUT) == baud)
+            return false;
     }
 
-    pb_decode(&pb_istream, settings_t_fields, &settings_tmp);
+    PrintErrorDetails("Link rate not confirmed!");
+    this->device->setBaudRate(prev);
 
-    *settings = settings_tmp;
+    /* The device timed from its switch, a little after the answer left */
+    elapsed = timer.elapsed();
+    if (elapsed < LINK_CHECK_TIMEOUT + LINK_SWITCH_DELAY)
+        msleep((quint32)(LINK_CHECK_TIMEOUT + LINK_SWITCH_DELAY - elapsed));
 
-    return false;
+    return true;
 }
 
-bool tcscom::getInfo(status_t* status)
+/* Fastest rate both ends can hold, stays put if the device does not answer */
+bool tcscom::negotiateBaudRate()
 {
-    status_t status_tmp;
-    quint8 cmd[5] = {SER_MAGIC1, SER_MAGIC2, CMD_SEND_SETTINGS, sizeof(cmd), 0};
-    quint8 info[4];
-    quint8 cs;
+    static const quint32 rates[] = {3000000, 2000000, 1000000, 460800};
 
-    cmd[4] = doChecksum(cmd, sizeof(cmd));
-    this->ftdi_device->write(cmd, sizeof(cmd));
+    if (link(CMD_LINK_CHECK, 0) == 0)
+        return true;
 
-    msleep(100);
-    this->ftdi_device->read(info, sizeof(info));
-    quint8 len = info[3]-4;
+    for (quint8 i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+        if (!setBaudRate(rates[i]))
+            return false;
+    }
 
-    this->ftdi_device->read(pb_ibuffer, len);
-    this->ftdi_device->read(&cs);
+    return true;
+}
+
+/*
+ * Restarts the device in its update stage, returns the rate the stage
+ * answers at, 0 when the firmware has no stage to go to.
+ */
+quint32 tcscom::enterUpdate()
+{
+    return link(CMD_UPDATE, 0);
+}
 
-    pb_decode(&pb_istream, status_t_fields, &status_tmp);
+/* Block of the frozen flight recorder window, record->blocks is 0 when none is */
+bool tcscom::getRecord(quint8 block, record_t* record)
+{
+    return request(CMD_SEND_RECORD, &block, 1, record_t_fields, record);
+}
 
-    *status = status_tmp;
+/* Drops the frozen window, the device records the next one */
+bool tcscom::clearRecord()
+{
+    quint16 len = frameEncode(pb_obuffer, this->seq++, CMD_CLEAR_RECORD, NULL, 0);
 
-    return false;
+    return this->device->write(pb_obuffer, len, false);
 }
 
-bool tcscom::getDiag(sensors_t* sensors)
+/*
+ * Asks the device to push the streams every period ms, 0 stops them.
+ * Returns the period the device applied, it is raised to what the link
+ * rate can carry, 0 when nothing will be pushed.
+ */
+quint32 tcscom::subscribe(quint8 streams, quint32 period)
 {
-    sensors_t sensors_tmp;
-    quint8 cmd[5] = {SER_MAGIC1, SER_MAGIC2, CMD_SEND_SETTINGS, sizeof(cmd), 0};
-    quint8 info[4];
-    quint8 cs;
+    quint8 payload[subscribe_t_size];
+    pb_ostream_t stream = pb_ostream_from_buffer(payload, sizeof(payload));
+    subscribe_t sub = {streams, period};
 
-    cmd[4] = doChecksum(cmd, sizeof(cmd));
-    this->ftdi_device->write(cmd, sizeof(cmd));
+    if (!pb_encode(&stream, subscribe_t_fields, &sub))
+        return 0;
 
-    msleep(100);
-    this->ftdi_device->read(info, sizeof(info));
-    quint8 len = info[3]-4;
+    if (request(CMD_SUBSCRIBE, payload, stream.bytes_written, subscribe_t_fields, &sub))
+        return 0;
 
-    this->ftdi_device->read(pb_ibuffer, len);
-    this->ftdi_device->read(&cs);
+    return sub.streams ? sub.period : 0;
+}
 
-    pb_decode(&pb_istream, sensors_t_fields, &sensors_tmp);
+/* Decodes what was pushed since the last call without waiting */
+bool tcscom::readPush()
+{
+    quint8 byte;
 
-    *sensors = sensors_tmp;
+    while (!readByte(&byte, 0))
+    {
+        if (frameDecode(&decoder, byte) == FRAME_OK && (frameCmd(&decoder) & CMD_PUSH))
+            dispatchPush();
+    }
 
     return false;
 }
 
-quint8 tcscom::doChecksum(quint8 *buf, quint8 len)
+/* Emits the frame in the decoder, a gap in the push sequence is a push the device dropped */
+void tcscom::dispatchPush()
 {
-    quint8 sum = 0;
+    pb_istream_t stream = pb_istream_from_buffer(framePayload(&decoder), framePayloadLen(&decoder));
 
-    while (len--)
-        sum += *buf++;
+    if (frameSeq(&decoder) != push_seq)
+    {
+        push_lost += (quint8)(frameSeq(&decoder) - push_seq);
+        PrintErrorDetails("Pushes lost!");
+    }
+    push_seq = frameSeq(&decoder) + 1;
 
-    return sum;
+    switch (frameCmd(&decoder) & ~CMD_PUSH)
+    {
+        case CMD_SEND_DIAG:
+        {
+            sensors_t sensors;
+
+            if (pb_decode(&stream, sensors_t_fields, &sensors))
+                emit sensorsReceived(sensors);
+            break;
+        }
+        case CMD_SEND_INFO:
+        {
+            status_t status;
+
+            if (pb_decode(&stream, status_t_fields, &status))
+                emit statusReceived(status);
+            break;
+        }
+        case CMD_CUT_EVENT:
+        {
+            cut_t cut;
+
+            if (pb_decode(&stream, cut_t_fields, &cut))
+                emit cutReceived(cut);
+            break;
+        }
+    }
 }
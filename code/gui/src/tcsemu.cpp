@@ -0,0 +1,395 @@
+#include <string.h>
+#include "tcsemu.h"
+#include "tcscom.h"
+#include "stm32emu.h"
+
+#define TCSEMU_PUSH_PERIOD_MIN 2    /* ms, as the firmware */
+#define TCSEMU_PUSH_PERIOD_MAX 60000
+
+tcsemu::tcsemu(quint8* settings_page, quint8* flash)
+{
+    this->settings_page = settings_page;
+    this->flash = flash;
+
+    memset(&sensors, 0, sizeof(sensors));
+    memset(&status, 0, sizeof(status));
+    memset(&settings, 0, sizeof(settings));
+    memset(&gears, 0, sizeof(gears));
+    memset(&cut, 0, sizeof(cut));
+    this->errors = this->handled = 0;
+
+    this->reset();
+}
+
+/* Starts at TRANSPORT_BAUD with the saved settings, nothing pushed */
+void tcsemu::reset(void)
+{
+    static const quint8 erased[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+
+    if (settings_page != NULL && memcmp(settings_page, erased, sizeof(erased)) != 0)
+        memcpy(&settings, settings_page, sizeof(settings));
+
+    /* The stage answers at UPDATER_BAUD, the same rate */
+    this->stage = flash != NULL && !this->updateValid();
+    this->update_size = 0;
+    this->baud = TRANSPORT_BAUD;
+    this->link_fallback = 0;
+    this->push_streams = 0;
+    this->push_seq = 0;
+    frameDecoderInit(&decoder, frame, sizeof(frame));
+}
+
+quint32 tcsemu::receive(const quint8* data, quint32 len, quint32 baud, quint8 parity,
+                        quint64 now, QByteArray* reply)
+{
+    quint32 us = 0, i;
+    quint8 res;
+
+    this->tick(now, reply);
+
+    /* At another rate the USART only sees garbage, the frame it hits is lost */
+    if (baud != this->baud || parity != TRANSPORT_PARITY_NONE)
+    {
+        frameDecoderInit(&decoder, frame, sizeof(frame));
+        errors++;
+        return 0;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        res = frameDecode(&decoder, data[i]);
+        if (res == FRAME_OK)
+        {
+            us += this->process(frameSeq(&decoder), frameCmd(&decoder),
+                                framePayload(&decoder), framePayloadLen(&decoder), now + us, reply);
+        }
+        else if (res == FRAME_ERROR)
+        {
+            errors++;
+        }
+    }
+
+    return us;
+}
+
+/* Goes back to the previous rate unless confirmed in time, and pushes what is due */
+void tcsemu::tick(quint64 now, QByteArray* reply)
+{
+    if (link_fallback && now - link_start >= LINK_CHECK_TIMEOUT * 1000ULL)
+    {
+        baud = link_fallback;
+        link_fallback = 0;
+        frameDecoderInit(&decoder, frame, sizeof(frame));
+    }
+
+    while (push_streams && now - push_last >= push_period)
+    {
+        /* Late by a whole period, the missed pushes are skipped */
+        push_last += push_period;
+        if (now - push_last >= push_period)
+            push_last = now;
+
+        if (push_streams & PUSH_SENSORS)
+            this->send(push_seq++, CMD_SEND_DIAG | CMD_PUSH, sensors_t_fields, &sensors, reply);
+        if (push_streams & PUSH_STATUS)
+            this->send(push_seq++, CMD_SEND_INFO | CMD_PUSH, status_t_fields, &status, reply);
+        if ((push_streams & PUSH_CUTS) && cut.count != push_cuts)
+        {
+            this->send(push_seq++, CMD_CUT_EVENT | CMD_PUSH, cut_t_fields, &cut, reply);
+            push_cuts = cut.count;
+        }
+    }
+}
+
+/* A new cut, as ignition.c counts them */
+void tcsemu::cutEvent(quint8 reason, quint32 duration, quint64 now)
+{
+    cut.count++;
+    cut.time = now / 1000;
+    cut.reason = reason;
+    cut.duration = duration;
+}
+
+void tcsemu::send(quint8 seq, quint8 cmd, const pb_field_t fields[], const void* msg, QByteArray* reply)
+{
+    quint8 payload[TCSEMU_PAYLOAD_MAX];
+    quint8 out[FRAME_ENCODED_MAX(TCSEMU_PAYLOAD_MAX)];
+    pb_ostream_t stream = pb_ostream_from_buffer(payload, sizeof(payload));
+    quint16 len;
+
+    if (!pb_encode(&stream, fields, msg))
+        return;
+
+    len = frameEncode(out, seq, cmd, payload, stream.bytes_written);
+    reply->append((const char*)out, len);
+}
+
+/* Same period limits as the firmware, half the link is left to the replies */
+void tcsemu::subscribe(quint8 seq, const quint8* payload, quint16 len, quint64 now, QByteArray* reply)
+{
+    pb_istream_t stream = pb_istream_from_buffer((quint8*)payload, len);
+    quint32 bytes = 0, min;
+    subscribe_t sub;
+
+    if (!pb_decode(&stream, subscribe_t_fields, &sub))
+        sub.streams = 0;
+    sub.streams &= PUSH_SENSORS | PUSH_STATUS | PUSH_CUTS;
+
+    if (sub.streams & PUSH_SENSORS)
+        bytes += FRAME_ENCODED_MAX(sensors_t_size);
+    if (sub.streams & PUSH_STATUS)
+        bytes += FRAME_ENCODED_MAX(status_t_size);
+    if (sub.streams & PUSH_CUTS)
+        bytes += FRAME_ENCODED_MAX(cut_t_size);
+
+    min = (bytes * 2 * 10000 + baud - 1) / baud;
+    sub.period = qBound<quint32>(qMax<quint32>(min, TCSEMU_PUSH_PERIOD_MIN), sub.period, TCSEMU_PUSH_PERIOD_MAX);
+    if (sub.streams == 0)
+        sub.period = 0;
+
+    this->send(seq, CMD_SUBSCRIBE, subscribe_t_fields, &sub, reply);
+
+    push_cuts = cut.count;
+    push_period = sub.period * 1000ULL;
+    push_last = now;
+    push_streams = sub.streams;
+}
+
+/* Returns the us the device works on the request */
+quint32 tcsemu::process(quint8 seq, quint8 cmd, const quint8* payload, quint16 len,
+                        quint64 now, QByteArray* reply)
+{
+    pb_istream_t stream = pb_istream_from_buffer((quint8*)payload, len);
+    record_t record;
+    link_t link;
+
+    handled++;
+
+    if (stage)
+        return this->update(seq, cmd, payload, len, reply);
+
+    switch (cmd)
+    {
+        case CMD_SEND_DIAG:
+            this->send(seq, cmd, sensors_t_fields, &sensors, reply);
+            break;
+        case CMD_SEND_INFO:
+            this->send(seq, cmd, status_t_fields, &status, reply);
+            break;
+        case CMD_SEND_SETTINGS:
+            this->send(seq, cmd, settings_t_fields, &settings, reply);
+            break;
+        case CMD_SAVE_SETTINGS:
+            pb_decode(&stream, settings_t_fields, &settings);
+            if (settings_page != NULL)
+                memcpy(settings_page, &settings, sizeof(settings));
+            return TCSEMU_SAVE_US;
+        case CMD_SEND_GEARS:
+            this->send(seq, cmd, gears_t_fields, &gears, reply);
+            break;
+        case CMD_SEND_RECORD:
+            /* No window frozen */
+            memset(&record, 0, sizeof(record));
+            record.block = len ? payload[0] : 0;
+            this->send(seq, cmd, record_t_fields, &record, reply);
+            break;
+        case CMD_CLEAR_RECORD:
+            break;
+        case CMD_SET_BAUD:
+            if (link_fallback || !pb_decode(&stream, link_t_fields, &link) || link.baud == baud)
+                link.baud = 0;
+            this->send(seq, cmd, link_t_fields, &link, reply);
+
+            /* Answered at the old rate, like usartSetBaudS() the switch may still fail */
+            if (link.baud && link.baud <= TCSEMU_BAUD_MAX)
+            {
+                link_fallback = baud;
+                link_start = now;
+                baud = link.baud;
+            }
+            break;
+        case CMD_LINK_CHECK:
+            link.baud = baud;
+            link_fallback = 0;
+            this->send(seq, cmd, link_t_fields, &link, reply);
+            break;
+        case CMD_LINK_TEST:
+            /* Echoed as it came, up to the largest message, the rate stays unconfirmed */
+            if (len <= TCSEMU_PAYLOAD_MAX)
+            {
+                quint8 out[FRAME_ENCODED_MAX(TCSEMU_PAYLOAD_MAX)];
+
+                reply->append((const char*)out, frameEncode(out, seq, cmd, payload, len));
+            }
+            break;
+        case CMD_SUBSCRIBE:
+            this->subscribe(seq, payload, len, now, reply);
+            break;
+        case CMD_UPDATE:
+            /* The stage takes over at the same rate, nothing pushed */
+            if (flash == NULL)
+                return 0;
+            link.baud = baud;
+            this->send(seq, cmd, link_t_fields, &link, reply);
+            stage = true;
+            update_size = 0;
+            link_fallback = 0;
+            push_streams = 0;
+            break;
+        default:
+            return 0;
+    }
+
+    return TCSEMU_REQUEST_US;
+}
+
+/*
+ * The stage, as updaterProcess() answers: the record goes first, the
+ * first page is kept until the CRC of the whole image checked, then
+ * the record is completed and the firmware restarts.
+ */
+quint32 tcsemu::update(quint8 seq, quint8 cmd, const quint8* payload, quint16 len, QByteArray* reply)
+{
+    quint8 out[FRAME_ENCODED_MAX(link_t_size)];
+    quint32 us = TCSEMU_REQUEST_US;
+    quint8 status;
+    link_t link;
+
+    switch (cmd)
+    {
+        case CMD_UPDATE:
+            link.baud = baud;
+            this->send(seq, cmd, link_t_fields, &link, reply);
+            return us;
+        case CMD_UPDATE_BEGIN:
+            update_size = len == UPDATE_BEGIN_LEN ? updateGet32(payload) : 0;
+            if (update_size == 0 || update_size > UPDATE_APP_SIZE || (update_size & 3))
+            {
+                update_size = 0;
+                status = UPDATE_ERROR_SIZE;
+                break;
+            }
+            memset(at(UPDATE_RECORD_ADDR), 0xFF, UPDATE_PAGE_SIZE);
+            memset(at(UPDATE_RECORD_ADDR), 0, 4);
+            memset(at(UPDATE_APP_ADDR), 0xFF, UPDATE_PAGE_SIZE);
+            memset(update_first, 0xFF, sizeof(update_first));
+            update_crc = updateGet32(payload + 4);
+            update_next = 0;
+            update_erased = 1;
+            us += 2 * STM32EMU_ERASE_US + 2 * STM32EMU_PROGRAM_US;
+            status = UPDATE_OK;
+            break;
+        case CMD_UPDATE_BLOCK:
+            status = this->updateBlock(payload, len, &us);
+            break;
+        case CMD_UPDATE_END:
+            status = this->updateEnd(&us);
+            break;
+        default:
+            return 0;
+    }
+
+    len = frameEncode(out, seq, cmd, &status, 1);
+    reply->append((const char*)out, len);
+
+    /* Committed, the reply goes out and the new firmware starts */
+    if (cmd == CMD_UPDATE_END && status == UPDATE_OK)
+        this->reset();
+
+    return us;
+}
+
+/* In order, the last block again is only compared */
+quint8 tcsemu::updateBlock(const quint8* payload, quint16 len, quint32* us)
+{
+    quint32 offset, page, i;
+    const quint8* data;
+
+    if (update_size == 0)
+        return UPDATE_ERROR_STATE;
+    if (len <= UPDATE_BLOCK_HEADER || len > UPDATE_PAYLOAD_MAX || (len & 3))
+        return UPDATE_ERROR_SIZE;
+
+    offset = updateGet32(payload);
+    data = payload + UPDATE_BLOCK_HEADER;
+    len -= UPDATE_BLOCK_HEADER;
+
+    if (offset < update_next && offset + len == update_next)
+    {
+        for (i = 0; i < len; i++)
+        {
+            const quint32 at_offset = offset + i;
+            const quint8 held = at_offset < UPDATE_PAGE_SIZE ? update_first[at_offset] : *at(UPDATE_APP_ADDR + at_offset);
+
+            if (held != data[i])
+                return UPDATE_ERROR_OFFSET;
+        }
+        return UPDATE_OK;
+    }
+    if (offset != update_next)
+        return UPDATE_ERROR_OFFSET;
+    if (offset + len > update_size)
+        return UPDATE_ERROR_SIZE;
+
+    for (i = 0; i < len; i++)
+    {
+        page = (offset + i) / UPDATE_PAGE_SIZE;
+        if (page == 0)
+        {
+            update_first[offset + i] = data[i];
+            continue;
+        }
+
+        if (update_erased <= page)
+        {
+            memset(at(UPDATE_APP_ADDR + update_erased * UPDATE_PAGE_SIZE), 0xFF, UPDATE_PAGE_SIZE);
+            update_erased++;
+            *us += STM32EMU_ERASE_US;
+        }
+        *at(UPDATE_APP_ADDR + offset + i) = data[i];
+    }
+    *us += len / 2 * STM32EMU_PROGRAM_US;
+    update_next += len;
+
+    return UPDATE_OK;
+}
+
+quint8 tcsemu::updateEnd(quint32* us)
+{
+    const quint32 first = qMin<quint32>(update_size, UPDATE_PAGE_SIZE);
+    quint32 crc;
+
+    if (update_size == 0 || update_next != update_size)
+        return UPDATE_ERROR_STATE;
+
+    crc = updateCrc(UPDATE_CRC_INIT, update_first, first);
+    crc = updateCrc(crc, at(UPDATE_APP_ADDR + first), update_size - first);
+    if (crc != update_crc)
+    {
+        update_size = 0;
+        return UPDATE_ERROR_CRC;
+    }
+
+    memcpy(at(UPDATE_APP_ADDR), update_first, first);
+    updatePut32(at(UPDATE_RECORD_ADDR + UPDATE_RECORD_SIZE * 4), update_size);
+    updatePut32(at(UPDATE_RECORD_ADDR + UPDATE_RECORD_CRC * 4), crc);
+    *us += (first + 8) / 2 * STM32EMU_PROGRAM_US;
+    update_size = 0;
+
+    return UPDATE_OK;
+}
+
+/* updaterAppValid() without the vectors, the emulator does not run the image */
+bool tcsemu::updateValid(void)
+{
+    const quint32 state = updateGet32(at(UPDATE_RECORD_ADDR + UPDATE_RECORD_STATE * 4));
+    const quint32 size = updateGet32(at(UPDATE_RECORD_ADDR + UPDATE_RECORD_SIZE * 4));
+
+    if (state == UPDATE_RECORD_ERASED)
+        return true;
+    if (state != UPDATE_RECORD_STARTED || size == 0 || size > UPDATE_APP_SIZE || (size & 3))
+        return false;
+
+    return updateCrc(UPDATE_CRC_INIT, at(UPDATE_APP_ADDR), size)
+            == updateGet32(at(UPDATE_RECORD_ADDR + UPDATE_RECORD_CRC * 4));
+}
@@ -0,0 +1,117 @@
+#include <string.h>
+#include "tcsunit.h"
+
+tcsunit::tcsunit(const QString& name, transport* device, const QString& image, bool delta,
+                 const settings_t* settings, QObject *parent) :
+    QThread(parent),
+    name(name),
+    device(device),
+    image(image),
+    delta(delta)
+{
+    memset(&this->settings, 0, sizeof(this->settings));
+    this->configure = settings != NULL;
+    if (this->configure)
+        this->settings = *settings;
+
+    memset(done, 0, sizeof(done));
+    memset(ms, 0, sizeof(ms));
+    this->failed = -1;
+}
+
+tcsunit::~tcsunit()
+{
+    wait();
+    delete device;
+}
+
+quint32 tcsunit::totalTime(void)
+{
+    quint32 total = 0;
+    int i;
+
+    for (i = 0; i < TCSUNIT_STEPS; i++)
+        total += ms[i];
+
+    return total;
+}
+
+/* Field by field, the decoded structs carry padding and unused bytes */
+bool tcsunit::sameSettings(const settings_t* a, const settings_t* b)
+{
+    const Settings_data* x = &a->data;
+    const Settings_data* y = &b->data;
+
+    return x->functions == y->functions
+        && x->cut_type == y->cut_type
+        && x->sensor_threshold == y->sensor_threshold
+        && x->slip_threshold == y->slip_threshold
+        && x->sensor_gain == y->sensor_gain
+        && x->sensor_direction == y->sensor_direction
+        && x->min_speed == y->min_speed
+        && x->min_rpm == y->min_rpm
+        && x->gears_ratio.size == y->gears_ratio.size
+        && memcmp(x->gears_ratio.bytes, y->gears_ratio.bytes, x->gears_ratio.size) == 0
+        && x->gears_cut_time.size == y->gears_cut_time.size
+        && memcmp(x->gears_cut_time.bytes, y->gears_cut_time.bytes, x->gears_cut_time.size) == 0
+        && x->tc_gear_trim.size == y->tc_gear_trim.size
+        && memcmp(x->tc_gear_trim.bytes, y->tc_gear_trim.bytes, x->tc_gear_trim.size) == 0;
+}
+
+void tcsunit::run()
+{
+    QElapsedTimer timer;
+    int step;
+
+    for (step = 0; step < TCSUNIT_STEPS; step++)
+    {
+        if (step == TCSUNIT_FLASH && image.isEmpty())
+            continue;
+        if (step == TCSUNIT_CONFIGURE && !configure)
+            continue;
+
+        timer.start();
+        done[step] = true;
+        if (this->execute(step))
+            failed = step;
+        ms[step] = timer.elapsed();
+
+        if (failed >= 0)
+            break;
+    }
+
+    if (device->isConnected())
+        device->disconnect();
+}
+
+/* The protocol objects live in this thread, the device only goes through them */
+bool tcsunit::execute(int step)
+{
+    tcscom tcs(device);
+    bootloader bl(device);
+    tcsupdate up(device);
+    settings_t saved;
+    QFile file;
+
+    switch (step)
+    {
+        case TCSUNIT_CONNECT:
+            return device->connect();
+
+        case TCSUNIT_FLASH:
+            file.setFileName(image);
+            /* In full, the stage is rewritten too */
+            return (!delta || up.writeFile(&file)) && bl.writeFile(&file, delta);
+
+        case TCSUNIT_CONFIGURE:
+            return tcs.setSettings(&settings);
+
+        case TCSUNIT_VERIFY:
+            memset(&saved, 0, sizeof(saved));
+            if (tcs.getSettings(&saved))
+                return true;
+            return configure && !sameSettings(&settings, &saved);
+    }
+
+    return true;
+}
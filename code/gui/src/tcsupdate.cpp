@@ -0,0 +1,155 @@
+#include <string.h> // memcpy
+#include <QSettings>
+#include "tcsupdate.h"
+#include "tcscom.h"
+
+tcsupdate::tcsupdate(transport *device, QObject *parent) :
+    QObject(parent)
+{
+    this->device = device;
+    this->seq = 0;
+}
+
+tcsupdate::~tcsupdate()
+{
+
+}
+
+/*
+ * Flashes the application of a full image, the stage pages of the image
+ * are left out. The stage keeps the first page until the CRC of the
+ * whole image checked, an update cut halfway leaves the device in the
+ * stage, to be updated again by either path. The page hashes of the
+ * bootloader go stale, they are dropped before the first block.
+ */
+bool tcsupdate::writeFile(QFile *file)
+{
+    QElapsedTimer timer;
+    QByteArray data;
+    QSettings manifest("OpenTCS", "OpenTCS");
+    tcscom tcs(this->device);
+    quint8 payload[UPDATE_PAYLOAD_MAX];
+    quint32 baud, reset, offset, len, total;
+    quint8 status;
+
+    if (!file->open(QIODevice::ReadOnly))
+    {
+        qWarning("tcsupdate::writeFile Cannot open the image");
+        return true;
+    }
+    data = file->readAll();
+    file->close();
+
+    /* Images without a stage in front are built for the ROM bootloader only */
+    if (data.length() <= UPDATE_STAGE_SIZE || data.length() > UPDATE_STAGE_SIZE + UPDATE_APP_SIZE)
+        return true;
+    data = data.mid(UPDATE_STAGE_SIZE);
+    while (data.length() % 4)
+        data.append((char)0xFF);
+
+    reset = updateGet32((const quint8*)data.constData() + 4);
+    if (reset < UPDATE_APP_ADDR || reset >= UPDATE_APP_ADDR + UPDATE_APP_SIZE)
+    {
+        qWarning("tcsupdate::writeFile No update stage in the image");
+        return true;
+    }
+
+    timer.start();
+    baud = tcs.enterUpdate();
+    if (baud == 0)
+    {
+        qWarning("tcsupdate::writeFile No update stage on the device");
+        return true;
+    }
+    if (baud != this->device->baudRate() && this->device->setBaudRate(baud))
+        return true;
+    msleep(TCSUPDATE_RESTART_DELAY);
+
+    /* Hashes are per device ID, which only the ROM bootloader reads */
+    manifest.remove(BOOTLOADER_MANIFEST);
+    manifest.sync();
+
+    len = data.length();
+    total = (len + UPDATE_BLOCK_SIZE - 1) / UPDATE_BLOCK_SIZE;
+    frameDecoderInit(&decoder, rx_buff, sizeof(rx_buff));
+
+    updatePut32(payload, len);
+    updatePut32(payload + 4, updateCrc(UPDATE_CRC_INIT, (const quint8*)data.constData(), len));
+    status = this->request(CMD_UPDATE_BEGIN, payload, UPDATE_BEGIN_LEN);
+
+    for (offset = 0; status == UPDATE_OK && offset < len; offset += UPDATE_BLOCK_SIZE)
+    {
+        const quint32 n = qMin<quint32>(UPDATE_BLOCK_SIZE, len - offset);
+
+        updatePut32(payload, offset);
+        memcpy(payload + UPDATE_BLOCK_HEADER, data.constData() + offset, n);
+        status = this->request(CMD_UPDATE_BLOCK, payload, UPDATE_BLOCK_HEADER + n);
+        emit progress(BOOTLOADER_WRITE, offset / UPDATE_BLOCK_SIZE + 1, total);
+    }
+
+    if (status == UPDATE_OK)
+        status = this->request(CMD_UPDATE_END, NULL, 0);
+
+    if (status != UPDATE_OK)
+    {
+        qWarning("tcsupdate::writeFile Failed with status %d at 0x%08x", status,
+                 UPDATE_APP_ADDR + qMin(offset, len));
+        return true;
+    }
+
+    /* The new firmware starts at the default rate */
+    this->device->setBaudRate(TRANSPORT_BAUD);
+
+    qDebug("tcsupdate::writeFile %d bytes at %d baud, %d ms", (int)len, (int)baud, (int)timer.elapsed());
+    emit flashed(len, 0, timer.elapsed());
+
+    return false;
+}
+
+/*
+ * Sends a request until it is answered, a block sent again is only
+ * compared by the stage. Returns its status, TCSUPDATE_NO_REPLY when
+ * the stage stays quiet.
+ */
+quint8 tcsupdate::request(quint8 cmd, const quint8 *payload, quint16 len)
+{
+    quint8 status = TCSUPDATE_NO_REPLY;
+    quint8 retry;
+
+    for (retry = 0; status == TCSUPDATE_NO_REPLY && retry < TCSUPDATE_RETRIES; retry++)
+    {
+        const quint8 seq = this->seq++;
+        const quint16 n = frameEncode(tx_buff, seq, cmd, payload, len);
+
+        if (device->write(tx_buff, n))
+            return TCSUPDATE_NO_REPLY;
+        status = this->readStatus(seq, cmd);
+    }
+
+    return status;
+}
+
+/* Replies to earlier attempts are skipped, they have an older seq */
+quint8 tcsupdate::readStatus(quint8 seq, quint8 cmd)
+{
+    QElapsedTimer timer;
+    quint8 byte;
+
+    timer.start();
+    while (timer.elapsed() < TCSUPDATE_TIMEOUT)
+    {
+        if (device->queued() == 0)
+        {
+            device->waitEvent(qMax<qint64>(TCSUPDATE_TIMEOUT - timer.elapsed(), 0));
+            continue;
+        }
+        if (device->read(&byte))
+            break;
+
+        if (frameDecode(&decoder, byte) == FRAME_OK && frameSeq(&decoder) == seq
+                && frameCmd(&decoder) == cmd && framePayloadLen(&decoder) == 1)
+            return framePayload(&decoder)[0];
+    }
+
+    return TCSUPDATE_NO_REPLY;
+}
@@ -0,0 +1,276 @@
+#include "tcsworker.h"
+
+tcsworker::tcsworker(transport *device, QObject *parent) :
+    QThread(parent),
+    device(device ? device : new ftdi),
+    tcs(this->device),
+    bl(this->device),
+    up(this->device)
+{
+    this->subscribed = false;
+    this->stopping = false;
+
+    qRegisterMetaType<settings_t>("settings_t");
+    qRegisterMetaType<sensors_t>("sensors_t");
+    qRegisterMetaType<status_t>("status_t");
+
+    /* Emitted by tcs in this thread, the slots run there too */
+    QObject::connect(&tcs, SIGNAL(sensorsReceived(sensors_t)), this, SLOT(queueSensors(sensors_t)), Qt::DirectConnection);
+    QObject::connect(&tcs, SIGNAL(statusReceived(status_t)), this, SLOT(queueStatus(status_t)), Qt::DirectConnection);
+    QObject::connect(&tcs, SIGNAL(cutReceived(cut_t)), this, SLOT(queueCut(cut_t)), Qt::DirectConnection);
+    QObject::connect(&bl, SIGNAL(progress(int,quint32,quint32)), this, SIGNAL(flashProgress(int,quint32,quint32)), Qt::DirectConnection);
+    QObject::connect(&bl, SIGNAL(flashed(quint32,quint32,quint32)), this, SIGNAL(flashed(quint32,quint32,quint32)), Qt::DirectConnection);
+    QObject::connect(&up, SIGNAL(progress(int,quint32,quint32)), this, SIGNAL(flashProgress(int,quint32,quint32)), Qt::DirectConnection);
+    QObject::connect(&up, SIGNAL(flashed(quint32,quint32,quint32)), this, SIGNAL(flashed(quint32,quint32,quint32)), Qt::DirectConnection);
+
+    start();
+}
+
+/* Lets the running request finish, the ones behind it are canceled */
+tcsworker::~tcsworker()
+{
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+    device->wake();
+    wait();
+
+    while (!requests.isEmpty())
+    {
+        tcsrequest* request = requests.dequeue();
+
+        request->result.reportCanceled();
+        request->result.reportFinished();
+        delete request;
+    }
+
+    delete device;
+}
+
+QFuture<bool> tcsworker::post(tcsrequest* request)
+{
+    QFuture<bool> future = request->result.future();
+
+    request->result.reportStarted();
+
+    mutex.lock();
+    requests.enqueue(request);
+    mutex.unlock();
+    device->wake();
+
+    return future;
+}
+
+QFuture<bool> tcsworker::connectDevice()
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_CONNECT;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::disconnectDevice()
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_DISCONNECT;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::negotiateBaudRate()
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_NEGOTIATE;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::getSettings()
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_GET_SETTINGS;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::setSettings(const settings_t& settings)
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_SET_SETTINGS;
+    request->settings = settings;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::getState()
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_GET_STATE;
+    return post(request);
+}
+
+/* No streams stops the pushes */
+QFuture<bool> tcsworker::subscribe(quint8 streams, quint32 period)
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_SUBSCRIBE;
+    request->streams = streams;
+    request->period = period;
+    return post(request);
+}
+
+QFuture<bool> tcsworker::flash(const QString& filename)
+{
+    tcsrequest* request = new tcsrequest;
+
+    request->type = TCSWORKER_FLASH;
+    request->filename = filename;
+    return post(request);
+}
+
+/*
+ * Runs the requests, and decodes pushes while there are none. Bytes
+ * that came in just before the wait are picked up TCSWORKER_IDLE later
+ * at worst, see transport::waitEvent().
+ */
+void tcsworker::run()
+{
+    tcsrequest* request;
+    bool error;
+
+    while (true)
+    {
+        mutex.lock();
+        if (stopping)
+        {
+            mutex.unlock();
+            break;
+        }
+        request = requests.isEmpty() ? NULL : requests.dequeue();
+        mutex.unlock();
+
+        if (request != NULL)
+        {
+            error = execute(request);
+
+            request->result.reportResult(error);
+            request->result.reportFinished();
+            emit requestFinished(request->type, error);
+            delete request;
+            continue;
+        }
+
+        if (subscribed)
+            tcs.readPush();
+        if (device->queued() == 0)
+            device->waitEvent(TCSWORKER_IDLE);
+    }
+
+    if (device->isConnected())
+        device->disconnect();
+}
+
+bool tcsworker::execute(tcsrequest* request)
+{
+    sensors_t sensors;
+    status_t status;
+    QFile file;
+
+    switch (request->type)
+    {
+        case TCSWORKER_CONNECT:
+            subscribed = false;
+            return device->connect();
+
+        case TCSWORKER_DISCONNECT:
+            subscribed = false;
+            return !device->disconnect();
+
+        case TCSWORKER_NEGOTIATE:
+            if (device->baudRate() != TRANSPORT_BAUD)
+                return false;
+            return tcs.negotiateBaudRate();
+
+        case TCSWORKER_GET_SETTINGS:
+            if (tcs.getSettings(&request->settings))
+                return true;
+            emit settingsReceived(request->settings);
+            return false;
+
+        case TCSWORKER_SET_SETTINGS:
+            return tcs.setSettings(&request->settings);
+
+        case TCSWORKER_GET_STATE:
+            if (tcs.getState(&sensors, &status, NULL))
+                return true;
+            emit stateReceived(sensors, status);
+            return false;
+
+        case TCSWORKER_SUBSCRIBE:
+            subscribed = tcs.subscribe(request->streams, request->period) != 0;
+            return request->streams && !subscribed;
+
+        case TCSWORKER_FLASH:
+            subscribed = false;
+            file.setFileName(request->filename);
+            /* Through the update stage on the link, the ROM bootloader when it cannot */
+            return up.writeFile(&file) && bl.writeFile(&file);
+    }
+
+    return true;
+}
+
+/*
+ * Consumer side of the telemetry ring, call it until it returns false
+ * on telemetryReady(). The flag is cleared before the last look, so a
+ * push that lands after it is announced again.
+ */
+bool tcsworker::takeTelemetry(telemetry_t* t)
+{
+    if (telemetry.pop(t))
+        return true;
+
+    notified.storeRelease(0);
+    return telemetry.pop(t);
+}
+
+void tcsworker::queueTelemetry(const telemetry_t& t)
+{
+    if (!telemetry.push(t))
+    {
+        dropped.fetchAndAddRelaxed(1);
+        return;
+    }
+
+    if (notified.testAndSetOrdered(0, 1))
+        emit telemetryReady();
+}
+
+void tcsworker::queueSensors(const sensors_t& sensors)
+{
+    telemetry_t t;
+
+    t.type = PUSH_SENSORS;
+    t.sensors = sensors;
+    queueTelemetry(t);
+}
+
+void tcsworker::queueStatus(const status_t& status)
+{
+    telemetry_t t;
+
+    t.type = PUSH_STATUS;
+    t.status = status;
+    queueTelemetry(t);
+}
+
+void tcsworker::queueCut(const cut_t& cut)
+{
+    telemetry_t t;
+
+    t.type = PUSH_CUTS;
+    t.cut = cut;
+    queueTelemetry(t);
+}
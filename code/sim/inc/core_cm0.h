@@ -0,0 +1,114 @@
+#ifndef _SIM_CORE_CM0_H_
+#define _SIM_CORE_CM0_H_
+
+/*
+ * Host replacement for the CMSIS Cortex-M0 core header.
+ *
+ * The core peripherals (NVIC, SCB, SysTick) live in RAM instead of
+ * the System Control Space so that the StdPeriph drivers and the
+ * firmware can be compiled and run on a Linux host.
+ */
+
+#include <stdint.h>
+
+#define __CORE_CM0_H_GENERIC
+#define __CORE_CM0_H_DEPENDANT
+
+#define __CORTEX_M                (0x00)
+
+#define __ASM                     __asm
+#define __INLINE                  inline
+#define __STATIC_INLINE           static inline
+
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+
+typedef struct
+{
+  __IO uint32_t ISER[1];
+  __IO uint32_t ICER[1];
+  __IO uint32_t ISPR[1];
+  __IO uint32_t ICPR[1];
+  __IO uint32_t IP[8];
+} NVIC_Type;
+
+typedef struct
+{
+  __I  uint32_t CPUID;
+  __IO uint32_t ICSR;
+  __IO uint32_t AIRCR;
+  __IO uint32_t SCR;
+  __IO uint32_t CCR;
+  __IO uint32_t SHP[2];
+  __IO uint32_t SHCSR;
+} SCB_Type;
+
+typedef struct
+{
+  __IO uint32_t CTRL;
+  __IO uint32_t LOAD;
+  __IO uint32_t VAL;
+  __I  uint32_t CALIB;
+} SysTick_Type;
+
+#define SysTick_CTRL_CLKSOURCE_Msk         (1UL << 2)
+#define SysTick_CTRL_TICKINT_Msk           (1UL << 1)
+#define SysTick_CTRL_ENABLE_Msk            (1UL << 0)
+
+extern NVIC_Type sim_NVIC;
+extern SCB_Type sim_SCB;
+extern SysTick_Type sim_SysTick;
+
+#define NVIC                ((NVIC_Type *) &sim_NVIC)
+#define SCB                 ((SCB_Type *) &sim_SCB)
+#define SysTick             ((SysTick_Type *) &sim_SysTick)
+
+static inline void __enable_irq(void) {}
+static inline void __disable_irq(void) {}
+static inline void __NOP(void) {}
+static inline void __WFI(void) {}
+static inline void __WFE(void) {}
+static inline void __SEV(void) {}
+static inline void __ISB(void) {}
+static inline void __DSB(void) {}
+static inline void __DMB(void) {}
+
+static inline void NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  NVIC->ISER[0] |= (1 << ((uint32_t)(IRQn) & 0x1F));
+}
+
+static inline void NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  NVIC->ISER[0] &= ~(1 << ((uint32_t)(IRQn) & 0x1F));
+}
+
+static inline void NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+  NVIC->ISPR[0] |= (1 << ((uint32_t)(IRQn) & 0x1F));
+}
+
+static inline void NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+  NVIC->ISPR[0] &= ~(1 << ((uint32_t)(IRQn) & 0x1F));
+}
+
+/* Two priority bits, kept in the top of each IP byte as on the core */
+static inline void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority)
+{
+  const uint32_t shift = ((uint32_t)IRQn & 3) * 8;
+
+  NVIC->IP[(uint32_t)IRQn >> 2] = (NVIC->IP[(uint32_t)IRQn >> 2] & ~(0xFFUL << shift))
+                                  | (((priority << 6) & 0xFF) << shift);
+}
+
+static inline uint32_t NVIC_GetPriority(IRQn_Type IRQn)
+{
+  return ((NVIC->IP[(uint32_t)IRQn >> 2] >> (((uint32_t)IRQn & 3) * 8)) & 0xFF) >> 6;
+}
+
+/* Stops the simulation, the firmware is not restarted in place */
+void NVIC_SystemReset(void) __attribute__ ((noreturn));
+
+#endif /* _SIM_CORE_CM0_H_ */
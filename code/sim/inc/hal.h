@@ -0,0 +1,25 @@
+#ifndef _HAL_H_
+#define _HAL_H_
+
+/*
+ * Host replacement for the ChibiOS HAL.
+ *
+ * Only the clock tree constants and the PAL pad macros used by the
+ * firmware are provided, the peripherals themselves are the RAM
+ * backed instances from stm32f0xx_sim.h.
+ */
+
+#include "board.h"
+#include "stm32f0xx_sim.h"
+
+#define STM32_HCLK      48000000
+#define STM32_PCLK      (STM32_HCLK / 1)
+
+#define palSetPad(port, pad) ((port)->ODR |= (1 << (pad)))
+#define palClearPad(port, pad) ((port)->ODR &= ~(1 << (pad)))
+#define palTogglePad(port, pad) ((port)->ODR ^= (1 << (pad)))
+#define palReadPad(port, pad) (((port)->IDR >> (pad)) & 1)
+
+void halInit(void);
+
+#endif /* _HAL_H_ */
@@ -0,0 +1,71 @@
+#ifndef _NIL_H_
+#define _NIL_H_
+
+/*
+ * Host replacement for ChibiOS/Nil.
+ *
+ * Threads are cooperative coroutines scheduled on a virtual clock,
+ * a sleeping or waiting thread hands control back to the simulator
+ * which then advances time to the next peripheral or thread event.
+ * Only the subset of the Nil API used by the firmware is provided.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "nilconf.h"
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef int32_t cnt_t;
+
+#define MSG_OK                  0
+#define MSG_TIMEOUT             -1
+#define MSG_RESET               -2
+
+#define TIME_IMMEDIATE          ((systime_t)-1)
+#define TIME_INFINITE           ((systime_t)0)
+
+#define S2ST(sec)                                                           \
+  ((systime_t)((sec) * NIL_CFG_ST_FREQUENCY))
+
+#define MS2ST(msec)                                                         \
+  ((systime_t)(((((uint32_t)(msec)) *                                       \
+                 ((uint32_t)NIL_CFG_ST_FREQUENCY) - 1UL) / 1000UL) + 1UL))
+
+#define US2ST(usec)                                                         \
+  ((systime_t)(((((uint32_t)(usec)) *                                       \
+                 ((uint32_t)NIL_CFG_ST_FREQUENCY) - 1UL) / 1000000UL) + 1UL))
+
+typedef struct {
+    volatile cnt_t cnt;
+} semaphore_t;
+
+#define THD_WORKING_AREA(s, n) uint8_t s[n]
+#define THD_FUNCTION(tname, arg) void tname(void *arg)
+
+void chSysInit(void);
+#define chSysLock()
+#define chSysUnlock()
+#define chSysLockFromISR()
+#define chSysUnlockFromISR()
+#define chSchRescheduleS()
+
+/* Threads woken by an interrupt run once it returns, see simThreadsRun() */
+#define CH_IRQ_PROLOGUE()
+#define CH_IRQ_EPILOGUE()
+#define CH_IRQ_HANDLER(id) void id(void)
+
+void chThdSleep(systime_t time);
+#define chThdSleepSeconds(sec) chThdSleep(S2ST(sec))
+#define chThdSleepMilliseconds(msec) chThdSleep(MS2ST(msec))
+#define chThdSleepMicroseconds(usec) chThdSleep(US2ST(usec))
+
+systime_t chVTGetSystemTimeX(void);
+
+#define chSemObjectInit(sp, n) ((sp)->cnt = (n))
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time);
+#define chSemWait(sp) chSemWaitTimeout(sp, TIME_INFINITE)
+void chSemSignal(semaphore_t *sp);
+#define chSemSignalI(sp) chSemSignal(sp)
+
+#endif /* _NIL_H_ */
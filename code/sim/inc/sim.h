@@ -0,0 +1,121 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include "stm32f0xx_sim.h"
+
+/*
+ * Host simulator of the OpenTCS control loop.
+ *
+ * The firmware sources run unmodified against RAM backed peripheral
+ * registers (stm32f0xx_sim.h) and a cooperative Nil kernel (nil.h).
+ * Time is virtual and only advances between events, so a recorded or
+ * generated trace replays as fast as the host can process it.
+ */
+
+/* Virtual time in nanoseconds */
+typedef uint64_t simtime_t;
+
+#define SIM_US(x) ((simtime_t)(x)*1000ULL)
+#define SIM_MS(x) ((simtime_t)(x)*1000000ULL)
+#define SIM_S(x)  ((simtime_t)(x)*1000000000ULL)
+#define SIM_NEVER UINT64_MAX
+
+extern simtime_t sim_now;
+
+/* Kernel (sim_nil.c) */
+void simThreadCreate(const char *name, void (*func)(void *), void *arg);
+simtime_t simThreadsNextWake(void);
+void simThreadsRun(void);
+
+/* Peripherals (sim_periph.c) */
+void simPeriphSync(void);
+simtime_t simPeriphNextEvent(void);
+void simPeriphProcess(void);
+void simPeriphIrq(void);
+void simCaptureEdge(TIM_TypeDef *tim, uint8_t channel);
+
+/* Called by the ADC model for each conversion, channel is 0..18 */
+uint16_t simAnalogInput(uint8_t channel, simtime_t t);
+
+/* Ignition outputs driven active by TIM3 right now, bit i for channel i+1 */
+uint8_t simIgnitionOutputs(void);
+
+/* Called when an ignition cut pulse on TIM3 ends, channels is a bit mask */
+extern void (*simOnCut)(simtime_t start, simtime_t end, uint8_t channels);
+
+/* Called on each ignition edge, cut is the outputs active at that time */
+extern void (*simOnSpark)(simtime_t t, uint8_t cut);
+
+/* Called for each byte sent on USART1 */
+extern void (*simOnUsartTx)(uint8_t byte);
+
+/* Queues bytes on the USART1 receive line, they arrive back to back */
+void simUsartRx(const uint8_t *data, uint32_t len);
+/* Rate of the host end of USART1, 0 to follow the device */
+void simUsartHostBaud(uint32_t baud);
+
+/* Flash and CRC unit (sim_flash.c), opentcs-update links them instead of the drivers */
+extern simtime_t sim_flash_busy;    /* Time the flash stalled the CPU */
+extern uint32_t sim_flash_erases;
+extern uint32_t sim_flash_programs; /* Half words */
+bool simFlashInit(void);
+void simFlashPowerUp(uint32_t seed);
+/* Cuts the power in the middle of the ops-th erase or program from now */
+void simFlashCut(uint32_t ops, jmp_buf *jump);
+
+/* Main loop (sim.c) */
+void simRun(simtime_t until);
+void simFatal(const char *fmt, ...) __attribute__ ((noreturn));
+
+/* Trace replay (replay.c) */
+struct __trace_sample {
+    simtime_t t;
+    float rpm;
+    float front_hz;     /* TIM2 CC3 */
+    float rear_hz;      /* TIM2 CC4 */
+    float strain;       /* ADC counts */
+    float tc_switch;    /* ADC counts */
+    float vbat;         /* ADC counts */
+    uint8_t gear;       /* Engaged gear from 1, 0 when unknown or shifting */
+};
+typedef struct __trace_sample trace_sample_t;
+
+typedef bool (*trace_source_t)(trace_sample_t *s, void *ctx);
+
+void replayInit(trace_source_t source, void *ctx, uint32_t seed);
+bool replayDone(void);
+simtime_t replayNextEvent(void);
+void replayProcess(void);
+const trace_sample_t *replayCurrent(void);
+
+/* Synthetic laps and trace files (trace.c) */
+typedef struct {
+    uint32_t seed;
+    uint32_t laps;
+    uint32_t lap;
+    uint32_t corner;
+    simtime_t t;
+    /* engine state */
+    float rpm;
+    uint8_t gear;
+    uint8_t target_gear;
+    uint8_t phase;
+    simtime_t phase_start;
+    simtime_t phase_len;
+    float slip_peak;
+    float shift_rpm;
+    float rpm_from;
+    float rpm_to;
+} lapgen_t;
+
+void lapgenInit(lapgen_t *g, uint32_t laps, uint32_t seed);
+bool lapgenNext(trace_sample_t *s, void *ctx);
+uint8_t lapgenGearsRatio(uint8_t *ratio, uint32_t scale);
+bool traceFileNext(trace_sample_t *s, void *ctx);
+void traceFileWrite(FILE *f, const trace_sample_t *s);
+
+#endif /* _SIM_H_ */
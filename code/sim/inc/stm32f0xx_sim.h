@@ -0,0 +1,124 @@
+#ifndef _STM32F0XX_SIM_H_
+#define _STM32F0XX_SIM_H_
+
+/*
+ * Peripheral register blocks for the host build.
+ *
+ * This header is force-included in every translation unit, it pulls
+ * the real device header and then points every peripheral macro at a
+ * RAM instance owned by the simulator. The StdPeriph drivers and the
+ * firmware sources then run unmodified against those instances.
+ */
+
+#include "stm32f0xx.h"
+
+extern TIM_TypeDef sim_TIM1, sim_TIM2, sim_TIM3, sim_TIM6, sim_TIM14;
+extern TIM_TypeDef sim_TIM15, sim_TIM16, sim_TIM17;
+extern RTC_TypeDef sim_RTC;
+extern WWDG_TypeDef sim_WWDG;
+extern IWDG_TypeDef sim_IWDG;
+extern SPI_TypeDef sim_SPI1, sim_SPI2;
+extern USART_TypeDef sim_USART1, sim_USART2;
+extern I2C_TypeDef sim_I2C1, sim_I2C2;
+extern PWR_TypeDef sim_PWR;
+extern DAC_TypeDef sim_DAC;
+extern CEC_TypeDef sim_CEC;
+extern SYSCFG_TypeDef sim_SYSCFG;
+extern COMP_TypeDef sim_COMP;
+extern EXTI_TypeDef sim_EXTI;
+extern ADC_TypeDef sim_ADC1;
+extern ADC_Common_TypeDef sim_ADC;
+extern DBGMCU_TypeDef sim_DBGMCU;
+extern DMA_TypeDef sim_DMA1;
+extern DMA_Channel_TypeDef sim_DMA1_Channel[5];
+extern FLASH_TypeDef sim_FLASH;
+extern OB_TypeDef sim_OB;
+extern RCC_TypeDef sim_RCC;
+extern CRC_TypeDef sim_CRC;
+extern GPIO_TypeDef sim_GPIOA, sim_GPIOB, sim_GPIOC, sim_GPIOD, sim_GPIOF;
+
+#undef TIM1
+#undef TIM2
+#undef TIM3
+#undef TIM6
+#undef TIM14
+#undef TIM15
+#undef TIM16
+#undef TIM17
+#undef RTC
+#undef WWDG
+#undef IWDG
+#undef SPI1
+#undef SPI2
+#undef USART1
+#undef USART2
+#undef I2C1
+#undef I2C2
+#undef PWR
+#undef DAC
+#undef CEC
+#undef SYSCFG
+#undef COMP
+#undef EXTI
+#undef ADC1
+#undef ADC
+#undef DBGMCU
+#undef DMA1
+#undef DMA1_Channel1
+#undef DMA1_Channel2
+#undef DMA1_Channel3
+#undef DMA1_Channel4
+#undef DMA1_Channel5
+#undef FLASH
+#undef OB
+#undef RCC
+#undef CRC
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef GPIOF
+
+#define TIM1                (&sim_TIM1)
+#define TIM2                (&sim_TIM2)
+#define TIM3                (&sim_TIM3)
+#define TIM6                (&sim_TIM6)
+#define TIM14               (&sim_TIM14)
+#define TIM15               (&sim_TIM15)
+#define TIM16               (&sim_TIM16)
+#define TIM17               (&sim_TIM17)
+#define RTC                 (&sim_RTC)
+#define WWDG                (&sim_WWDG)
+#define IWDG                (&sim_IWDG)
+#define SPI1                (&sim_SPI1)
+#define SPI2                (&sim_SPI2)
+#define USART1              (&sim_USART1)
+#define USART2              (&sim_USART2)
+#define I2C1                (&sim_I2C1)
+#define I2C2                (&sim_I2C2)
+#define PWR                 (&sim_PWR)
+#define DAC                 (&sim_DAC)
+#define CEC                 (&sim_CEC)
+#define SYSCFG              (&sim_SYSCFG)
+#define COMP                (&sim_COMP)
+#define EXTI                (&sim_EXTI)
+#define ADC1                (&sim_ADC1)
+#define ADC                 (&sim_ADC)
+#define DBGMCU              (&sim_DBGMCU)
+#define DMA1                (&sim_DMA1)
+#define DMA1_Channel1       (&sim_DMA1_Channel[0])
+#define DMA1_Channel2       (&sim_DMA1_Channel[1])
+#define DMA1_Channel3       (&sim_DMA1_Channel[2])
+#define DMA1_Channel4       (&sim_DMA1_Channel[3])
+#define DMA1_Channel5       (&sim_DMA1_Channel[4])
+#define FLASH               (&sim_FLASH)
+#define OB                  (&sim_OB)
+#define RCC                 (&sim_RCC)
+#define CRC                 (&sim_CRC)
+#define GPIOA               (&sim_GPIOA)
+#define GPIOB               (&sim_GPIOB)
+#define GPIOC               (&sim_GPIOC)
+#define GPIOD               (&sim_GPIOD)
+#define GPIOF               (&sim_GPIOF)
+
+#endif /* _STM32F0XX_SIM_H_ */
@@ -0,0 +1,630 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "filter.h"
+#include "capture.h"
+#include "slip.h"
+#include "tc.h"
+#include "gear.h"
+#include "recorder.h"
+#include "frame.h"
+
+/*
+ * opentcs-bench, host timings of the firmware signal processing kernels
+ * and of the serial link framing shared with the GUI.
+ *
+ * Numbers are for the host CPU, they compare implementations with each
+ * other and do not predict Cortex-M0 cycle counts. The tables the
+ * kernels use are checked against values worked out by hand, the exit
+ * status is 1 when any check fails.
+ */
+
+#define BENCH_CHANNELS 4
+#define BENCH_SAMPLES 32
+#define BENCH_HALVES 20000000
+#define BENCH_TEETH 50000000
+#define BENCH_TOOTH_TICKS 156   /* 640 Hz teeth on the 100 kHz timer */
+#define BENCH_SLIP_UPDATES 50000000
+#define BENCH_TC_LOOKUPS 200000000
+#define BENCH_GEAR_UPDATES 100000000
+#define BENCH_GEAR_SAMPLES 20000   /* Per gear, with ratio noise */
+#define BENCH_RECORD_SAMPLES 65536 /* Power of two, 75s of recording */
+#define BENCH_RECORD_PASSES 200
+#define BENCH_FRAME_BYTES 100000000 /* Payload framed per size */
+#define BENCH_FRAME_MAX 1024
+
+static volatile uint32_t sink;
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    checks++;
+    if (ok)
+        return;
+    failures++;
+    printf("FAIL %s\n", what);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(uint16_t *buf, uint32_t n, uint32_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        buf[i] = seed >> 20;
+    }
+}
+
+/* Previous getAnalogSensors(), average of the whole buffer per channel */
+static void benchAverage(const uint16_t *buf)
+{
+    const double t0 = now();
+    double t;
+    uint32_t n, ch, i;
+
+    for (n = 0; n < BENCH_HALVES / 2; n++)
+    {
+        for (ch = 0; ch < BENCH_CHANNELS; ch++)
+        {
+            uint32_t sum = 0;
+
+            for (i = ch; i < BENCH_SAMPLES; i += BENCH_CHANNELS)
+                sum += buf[i];
+            sink = sum / (BENCH_SAMPLES / BENCH_CHANNELS);
+        }
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per buffer, %5.2f ns per sample\n", "average (32 samples)",
+           t * 1e9 / (BENCH_HALVES / 2), t * 1e9 / (BENCH_HALVES / 2) / BENCH_SAMPLES);
+}
+
+static void benchDecimate(const uint16_t *buf)
+{
+    filter_t f[BENCH_CHANNELS];
+    const double t0 = now();
+    double t;
+    uint32_t n, ch;
+
+    for (ch = 0; ch < BENCH_CHANNELS; ch++)
+        filterInit(&f[ch]);
+
+    for (n = 0; n < BENCH_HALVES; n++)
+    {
+        const uint16_t *half = &buf[(n & 1) * (BENCH_SAMPLES / 2)];
+
+        for (ch = 0; ch < BENCH_CHANNELS; ch++)
+            sink = filterDecimate(&f[ch], &half[ch], BENCH_CHANNELS);
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per half,   %5.2f ns per sample\n", "filterDecimate (CIC+MA)",
+           t * 1e9 / BENCH_HALVES, t * 1e9 / BENCH_HALVES / (BENCH_SAMPLES / 2));
+}
+
+/* Wheel speed capture body, timestamp, period ring and frequency, run for every tooth */
+static void benchCapture(void)
+{
+    capture_t c;
+    const double t0 = now();
+    double t;
+    uint32_t n, ticks = 0;
+    uint16_t overflows = 0;
+
+    captureInit(&c);
+
+    for (n = 0; n < BENCH_TEETH; n++)
+    {
+        const uint32_t next = ticks + BENCH_TOOTH_TICKS + (n & 0x7);
+
+        if ((next >> 16) != (ticks >> 16))
+            overflows++;
+        ticks = next;
+
+        captureEdge(&c, captureTimestamp(overflows, ticks & 0xFFFF, 0));
+        sink = captureFrequency(&c, 100000, 1);
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per edge\n", "capture", t * 1e9 / BENCH_TEETH);
+}
+
+/* Both wheel filters and the ratio, as run for every wheel capture */
+static void benchSlip(void)
+{
+    wheel_filter_t front, rear;
+    const double t0 = now();
+    double t;
+    uint32_t n;
+
+    wheelFilterInit(&front);
+    wheelFilterInit(&rear);
+
+    for (n = 0; n < BENCH_SLIP_UPDATES; n++)
+    {
+        const uint32_t period = BENCH_TOOTH_TICKS + (n & 0xF);
+
+        if (n & 1)
+            wheelFilterUpdate(&rear, period - 5, 100000, 1);
+        else
+            wheelFilterUpdate(&front, period, 100000, 1);
+        sink = slipRatio(&front, &rear);
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per update\n", "wheelFilterUpdate+slipRatio", t * 1e9 / BENCH_SLIP_UPDATES);
+}
+
+/*
+ * Expected tcLookup() entries for the settings of benchTc(), cut time
+ * = 100 ms * trim * RPM share, the share 50% up to min_rpm and 100%
+ * from TC_RPM_FULL. 8704 RPM sits halfway between the points at 8192
+ * (share 76%) and 9216 (82%).
+ */
+static const struct {
+    uint8_t gear;
+    uint32_t rpm;
+    uint8_t threshold;
+    uint8_t cut_time;
+} bench_tc_expected[] = {
+    {0, 0, 8, 60},              /* 10% / 120% trim, clamped low */
+    {0, 8704, 8, 94},           /* 91 to 98 */
+    {0, 16384, 8, 120},         /* Last point */
+    {0, 60000, 8, 120},         /* Above the table */
+    {1, 3000, 10, 50},          /* Between two points below min_rpm */
+    {1, 8704, 10, 79},          /* 76 to 82 */
+    {1, 9216, 10, 82},          /* On a point */
+    {2, 0, 11, 42},             /* 85% trim */
+    {3, 20000, 14, 70},         /* 70% trim, above the table */
+    {5, 5000, 10, 56},          /* No trim set, 100%: 50 to 57 */
+    {9, 0, 10, 50},             /* Past the last gear, the last one */
+};
+
+/* Per gear entries at a few RPM, then the cost of one lookup */
+static void benchTc(void)
+{
+    static const uint32_t rpms[] = {3000, 6000, 9000, 12000, 15000};
+    Settings_data data = {0};
+    tc_table_t table;
+    tc_row_t row;
+    double t0, t;
+    uint32_t n;
+    uint8_t gear, i;
+    char what[64];
+
+    data.slip_threshold = 10;
+    data.min_rpm = 4000;
+    data.tc_gear_trim.size = 6;
+    data.tc_gear_trim.bytes[0] = 120;
+    data.tc_gear_trim.bytes[1] = 100;
+    data.tc_gear_trim.bytes[2] = 85;
+    data.tc_gear_trim.bytes[3] = 70;
+    data.tc_gear_trim.bytes[4] = 70;
+    tcBuildTable(&table, &data, 100);
+
+    printf("tc threshold %%/cut ms   rpm");
+    for (i = 0; i < sizeof(rpms)/sizeof(rpms[0]); i++)
+        printf(" %7u", rpms[i]);
+    printf("\n");
+    for (gear = 0; gear < TC_GEARS; gear++)
+    {
+        printf("  gear %u trim %3u%%         ", gear + 1, data.tc_gear_trim.bytes[gear]);
+        for (i = 0; i < sizeof(rpms)/sizeof(rpms[0]); i++)
+        {
+            const tc_entry_t e = tcLookup(&table, gear, rpms[i]);
+            printf(" %3u/%3u", e.threshold, e.cut_time);
+        }
+        printf("\n");
+    }
+
+    for (i = 0; i < sizeof(bench_tc_expected)/sizeof(bench_tc_expected[0]); i++)
+    {
+        const tc_entry_t e = tcLookup(&table, bench_tc_expected[i].gear, bench_tc_expected[i].rpm);
+
+        snprintf(what, sizeof(what), "tcLookup gear %u at %u rpm: %u/%u",
+                 bench_tc_expected[i].gear + 1, bench_tc_expected[i].rpm, e.threshold, e.cut_time);
+        check(e.threshold == bench_tc_expected[i].threshold
+              && e.cut_time == bench_tc_expected[i].cut_time, what);
+    }
+
+    /* 200 ms at 120% is past what IGN_TIMER holds */
+    tcBuildRow(&row, &data, 200, 0);
+    check(row.cut_time[0] == 120 && row.cut_time[TC_RPM_POINTS - 1] == TC_CUT_MAX, "tcBuildRow clamps to TC_CUT_MAX");
+
+    t0 = now();
+    for (n = 0; n < BENCH_TC_LOOKUPS; n++)
+        sink = tcLookup(&table, n % TC_GEARS, n & 0x3FFF).cut_time;
+    t = now() - t0;
+    printf("%-28s %6.2f ns per lookup\n", "tcLookup", t * 1e9 / BENCH_TC_LOOKUPS);
+}
+
+/* Overall gear ratios, wheel sensor teeth and what the table should hold */
+struct __bench_bike {
+    const char *name;
+    uint8_t teeth;
+    uint8_t gears;
+    float ratio[GEAR_MAX];
+};
+
+static const struct __bench_bike bench_bikes[] = {
+    {"sim lapgen, 16 teeth", 16, 6, {11.0f, 8.2f, 6.7f, 5.8f, 5.2f, 4.8f}},
+    {"600 sport, 24 teeth", 24, 6, {14.3f, 10.5f, 8.8f, 7.7f, 6.9f, 6.3f}},
+    {"450 mx 5 speed, 30 teeth", 30, 5, {19.5f, 15.1f, 12.3f, 10.4f, 8.9f}},
+};
+
+static uint32_t benchRand(uint32_t *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+/* Speed for a gear and RPM with up to noise percent of error */
+static uint32_t benchGearSpeed(const struct __bench_bike *b, uint8_t gear, uint32_t rpm,
+                               float noise, uint32_t *seed)
+{
+    const float e = noise * ((float)(benchRand(seed) & 0xFFFF) / 32768.0f - 1.0f) / 100.0f;
+
+    return (uint32_t)(rpm * b->teeth / (60.0f * b->ratio[gear]) * (1.0f + e) + 0.5f);
+}
+
+/*
+ * Share of samples put in the right gear with the ratio off by up to
+ * noise percent, for each learned table. One sample per classification,
+ * no hysteresis, so this is the raw windows. Each table must hold every
+ * gear in windows that do not overlap, and classify at least the share
+ * in min_correct.
+ */
+static void benchGearTables(void)
+{
+    static const float noises[] = {1.0f, 2.0f, 3.0f};
+    static const float min_correct[] = {99.5f, 99.5f, 97.0f};
+    uint32_t seed = 1;
+    uint8_t b, i, gear;
+    char what[80];
+
+    printf("gear windows, correct %% at noise");
+    for (i = 0; i < sizeof(noises)/sizeof(noises[0]); i++)
+        printf(" %4.0f%%", noises[i]);
+    printf("\n");
+
+    for (b = 0; b < sizeof(bench_bikes)/sizeof(bench_bikes[0]); b++)
+    {
+        const struct __bench_bike *bike = &bench_bikes[b];
+        Settings_data data = {0};
+        gear_table_t table;
+
+        data.gears_ratio.size = bike->gears;
+        for (gear = 0; gear < bike->gears; gear++)
+            data.gears_ratio.bytes[gear] = (uint8_t)(bike->teeth * GEAR_RATIO_SCALE / (60.0f * bike->ratio[gear]) + 0.5f);
+        gearBuildTable(&table, &data);
+
+        snprintf(what, sizeof(what), "%s: %u windows", bike->name, table.count);
+        check(table.count == bike->gears, what);
+        for (gear = 0; gear + 1 < table.count; gear++)
+        {
+            snprintf(what, sizeof(what), "%s: windows %u and %u overlap", bike->name, gear + 1, gear + 2);
+            check(table.hi[gear] <= table.lo[gear + 1], what);
+        }
+
+        printf("  %-31s", bike->name);
+        for (i = 0; i < sizeof(noises)/sizeof(noises[0]); i++)
+        {
+            uint32_t correct = 0, total = 0, n;
+
+            for (gear = 0; gear < bike->gears; gear++)
+            {
+                for (n = 0; n < BENCH_GEAR_SAMPLES; n++)
+                {
+                    const uint32_t rpm = 3000 + benchRand(&seed) % 11000;
+                    const uint32_t speed = benchGearSpeed(bike, gear, rpm, noises[i], &seed);
+
+                    correct += gearClassify(&table, speed * gearRpmRecip(rpm)) == gear;
+                    total++;
+                }
+            }
+            printf(" %5.1f", 100.0 * correct / total);
+            snprintf(what, sizeof(what), "%s: %.1f%% correct at %.0f%% noise",
+                     bike->name, 100.0 * correct / total, noises[i]);
+            check(100.0 * correct / total >= min_correct[i], what);
+        }
+        printf("  ratios");
+        for (gear = 0; gear < bike->gears; gear++)
+            printf(" %u", data.gears_ratio.bytes[gear]);
+        printf("\n");
+    }
+}
+
+/* A table stops at a zero, a ratio not above the previous one, or one past the learner */
+static void benchGearBounds(void)
+{
+    static const uint8_t tables[][GEAR_MAX] = {
+        {30, 40, 50, 60, 127, 0},
+        {30, 40, 50, 60, 128, 140},
+        {30, 40, 40, 60, 70, 80},
+        {30, 40, 0, 60, 70, 80},
+    };
+    static const uint8_t counts[] = {5, 4, 2, 2};
+    Settings_data data = {0};
+    gear_table_t table;
+    uint8_t t;
+    char what[48];
+
+    for (t = 0; t < sizeof(counts); t++)
+    {
+        data.gears_ratio.size = GEAR_MAX;
+        memcpy(data.gears_ratio.bytes, tables[t], GEAR_MAX);
+        gearBuildTable(&table, &data);
+        snprintf(what, sizeof(what), "gearBuildTable stops at gear %u", counts[t] + 1);
+        check(table.count == counts[t], what);
+    }
+}
+
+/* Previous getCurGearIdx(), a division and up to 5 compares */
+static uint8_t benchGearLoop(const Settings_data *data, uint32_t speed, uint32_t rpm)
+{
+    uint32_t ratio;
+    uint8_t i;
+
+    if (rpm == 0)
+        return 0;
+    ratio = (speed * 100) / rpm;
+    for (i = 0; i < 5; i++)
+    {
+        if (ratio >= data->gears_ratio.bytes[i])
+            return i;
+    }
+    return 0;
+}
+
+static void benchGear(void)
+{
+    const struct __bench_bike *bike = &bench_bikes[1];
+    Settings_data data = {0};
+    gear_table_t table;
+    gear_est_t est;
+    uint32_t speeds[256], rpms[256], recips[256];
+    uint32_t seed = 1, n;
+    double t0, t;
+    uint8_t gear;
+
+    benchGearTables();
+    benchGearBounds();
+
+    data.gears_ratio.size = bike->gears;
+    for (gear = 0; gear < bike->gears; gear++)
+        data.gears_ratio.bytes[gear] = (uint8_t)(bike->teeth * GEAR_RATIO_SCALE / (60.0f * bike->ratio[gear]) + 0.5f);
+    gearBuildTable(&table, &data);
+    gearInit(&est);
+
+    for (n = 0; n < 256; n++)
+    {
+        rpms[n] = 3000 + benchRand(&seed) % 11000;
+        speeds[n] = benchGearSpeed(bike, (n / 32) % bike->gears, rpms[n], 2.0f, &seed);
+        recips[n] = gearRpmRecip(rpms[n]);
+    }
+
+    t0 = now();
+    for (n = 0; n < BENCH_GEAR_UPDATES; n++)
+        sink = benchGearLoop(&data, speeds[n & 0xFF], rpms[n & 0xFF]);
+    t = now() - t0;
+    printf("%-28s %6.2f ns per sample\n", "gear divide loop (old)", t * 1e9 / BENCH_GEAR_UPDATES);
+
+    t0 = now();
+    for (n = 0; n < BENCH_GEAR_UPDATES; n++)
+    {
+        gearUpdate(&est, &table, speeds[n & 0xFF], recips[n & 0xFF]);
+        sink = est.gear;
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per sample\n", "gearUpdate", t * 1e9 / BENCH_GEAR_UPDATES);
+}
+
+/* Learner fed with steady stretches of each gear, then the cluster search */
+static void benchGearLearn(void)
+{
+    const struct __bench_bike *bike = &bench_bikes[1];
+    gear_learn_t learn;
+    uint8_t ratio[GEAR_MAX], confidence[GEAR_MAX], n, gear;
+    uint32_t seed = 1, i;
+    double t0, t;
+
+    gearLearnInit(&learn);
+    t0 = now();
+    for (i = 0; i < BENCH_GEAR_UPDATES; i++)
+    {
+        /* 4000 samples per gear, the RPM sweeps slowly within a stretch */
+        const uint32_t rpm = 4000 + (i % 4000) * 2;
+
+        gear = (i / 4000) % bike->gears;
+        gearLearnSample(&learn, benchGearSpeed(bike, gear, rpm, 0.5f, &seed), rpm, gearRpmRecip(rpm));
+
+        /* The sensors thread, every 100ms */
+        if (learn.saturated)
+            gearLearnHalve(&learn, 0, GEAR_LEARN_BINS);
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per sample\n", "gearLearnSample", t * 1e9 / BENCH_GEAR_UPDATES);
+
+    t0 = now();
+    for (i = 0; i < 10000; i++)
+        n = gearLearnFind(&learn, ratio, confidence);
+    t = now() - t0;
+    printf("%-28s %6.2f us per search, found", "gearLearnFind", t * 1e6 / 10000);
+    for (gear = 0; gear < n; gear++)
+        printf(" %u/%u%%", ratio[gear], confidence[gear]);
+    printf("\n");
+
+    check(n == bike->gears, "gearLearnFind finds every gear");
+    for (gear = 0; gear < n && gear < bike->gears; gear++)
+    {
+        const float expected = bike->teeth * GEAR_RATIO_SCALE / (60.0f * bike->ratio[gear]);
+
+        check(fabsf(ratio[gear] - expected) <= 1.0f && confidence[gear] >= 90,
+              "gearLearnFind ratio within one unit, 90% confident");
+    }
+}
+
+/*
+ * Recorder samples of a 600 sport pulling through the gears: inputs are
+ * held between their captures as in sensors.c, the strain gauge has a
+ * few counts of noise and a shift every 4 seconds.
+ */
+static void benchRecordFill(uint32_t (*samples)[RECORDER_FIELDS])
+{
+    const struct __bench_bike *bike = &bench_bikes[1];
+    const float dt = 288e-6f * RECORDER_DECIMATION;
+    float rpm_phase = 0, wheel_phase = 0;
+    uint32_t seed = 1, rpm_ticks = 0, wheel_ticks = 0, i;
+
+    for (i = 0; i < BENCH_RECORD_SAMPLES; i++)
+    {
+        const float t = i * dt;
+        const uint8_t gear = (uint8_t)(t / 4.0f) % bike->gears;
+        const float rpm = 7000.0f + 5000.0f * (t / 4.0f - (uint32_t)(t / 4.0f));
+        const float wheel_hz = rpm * bike->teeth / (60.0f * bike->ratio[gear]) / 4;
+        const uint8_t shifting = (t / 4.0f - (uint32_t)(t / 4.0f)) > 0.99f;
+
+        /* A capture updates the period once per revolution or 4 teeth */
+        rpm_phase += dt * rpm / 60.0f;
+        if (rpm_phase >= 1.0f)
+        {
+            rpm_phase -= (uint32_t)rpm_phase;
+            rpm_ticks = (uint32_t)(100000.0f * 60.0f / rpm) + (benchRand(&seed) & 3);
+        }
+        wheel_phase += dt * wheel_hz;
+        if (wheel_phase >= 1.0f)
+        {
+            wheel_phase -= (uint32_t)wheel_phase;
+            wheel_ticks = (uint32_t)(100000.0f / wheel_hz) + (benchRand(&seed) & 1);
+        }
+
+        samples[i][RECORDER_RPM] = rpm_ticks;
+        samples[i][RECORDER_FRONT] = wheel_ticks;
+        samples[i][RECORDER_REAR] = wheel_ticks;
+        samples[i][RECORDER_STRAIN] = (shifting ? 2600 : 1500) + (benchRand(&seed) & 7);
+        samples[i][RECORDER_SLIP] = 0;
+        samples[i][RECORDER_FLAGS] = (gear << RECORDER_FLAG_GEAR_SHIFT)
+                | (shifting ? RECORDER_FLAG_SHIFTING | RECORDER_FLAG_CUT : 0);
+    }
+}
+
+static void benchRecorder(void)
+{
+    static uint32_t samples[BENCH_RECORD_SAMPLES][RECORDER_FIELDS];
+    static recorder_t r;
+    recorder_reader_t rd;
+    const uint8_t* data;
+    uint32_t i, n = 0, bytes = 0, errors = 0;
+    uint8_t b, len;
+    double t0, t;
+
+    benchRecordFill(samples);
+    recorderInit(&r);
+
+    t0 = now();
+    for (i = 0; i < BENCH_RECORD_SAMPLES * BENCH_RECORD_PASSES; i++)
+        recorderSample(&r, i * RECORDER_DECIMATION, samples[i & (BENCH_RECORD_SAMPLES - 1)]);
+    t = now() - t0;
+    printf("%-28s %6.2f ns per sample\n", "recorderSample", t * 1e9 / i);
+
+    /* Decode the ring again and again, checking it the first time */
+    t0 = now();
+    for (i = 0; i < BENCH_RECORD_PASSES * 100; i++)
+    {
+        for (b = 0; (data = recorderBlock(&r, b, &len)) != NULL; b++)
+        {
+            recorderReadInit(&rd, data, len);
+            while (recorderRead(&rd))
+            {
+                if (i == 0)
+                {
+                    const uint32_t *s = samples[(rd.time / RECORDER_DECIMATION) & (BENCH_RECORD_SAMPLES - 1)];
+
+                    errors += (memcmp(rd.value, s, sizeof(rd.value)) != 0);
+                    n++;
+                }
+            }
+            if (i == 0)
+                bytes += len;
+        }
+    }
+    t = now() - t0;
+    printf("%-28s %6.2f ns per sample, %.2f bytes per sample, %.0f ms in %u bytes, %u errors\n",
+           "recorderRead", t * 1e9 / (n * (double)i), (double)bytes / n,
+           n * 288e-3 * RECORDER_DECIMATION, RECORDER_BLOCKS * RECORDER_BLOCK_SIZE, errors);
+}
+
+/* COBS and CRC-16 throughput, protobuf payloads hold a few zeros */
+static void benchFrame(uint16_t len)
+{
+    static uint8_t payload[BENCH_FRAME_MAX];
+    static uint8_t enc[FRAME_ENCODED_MAX(BENCH_FRAME_MAX)];
+    static uint8_t dec[FRAME_PACKET(BENCH_FRAME_MAX)];
+    const uint32_t frames = BENCH_FRAME_BYTES / len;
+    frame_decoder_t d;
+    uint32_t i, ok = 0, seed = 1;
+    uint16_t j, size = 0;
+    double t0, te, td;
+    char name[32];
+
+    for (j = 0; j < len; j++)
+    {
+        seed = seed * 1103515245 + 12345;
+        payload[j] = (seed >> 16) % 8 ? seed >> 24 : 0;
+    }
+
+    t0 = now();
+    for (i = 0; i < frames; i++)
+    {
+        size = frameEncode(enc, i, 1, payload, len);
+        sink += enc[size / 2];
+    }
+    te = now() - t0;
+
+    frameDecoderInit(&d, dec, sizeof(dec));
+    t0 = now();
+    for (i = 0; i < frames; i++)
+    {
+        for (j = 0; j < size; j++)
+            ok += (frameDecode(&d, enc[j]) == FRAME_OK);
+    }
+    td = now() - t0;
+
+    if (framePayloadLen(&d) != len || memcmp(framePayload(&d), payload, len) != 0)
+        ok = 0;
+
+    snprintf(name, sizeof(name), "frame %u bytes", len);
+    printf("%-28s %6.1f MB/s encode, %6.1f MB/s decode, %u bytes on the line, %u errors\n",
+           name, frames * (double)len / te / 1e6, frames * (double)len / td / 1e6, size, frames - ok);
+}
+
+int main(void)
+{
+    uint16_t buf[BENCH_SAMPLES];
+
+    fill(buf, BENCH_SAMPLES, 1);
+    benchAverage(buf);
+    benchDecimate(buf);
+    benchCapture();
+    benchSlip();
+    benchTc();
+    benchGear();
+    benchGearLearn();
+    benchRecorder();
+    benchFrame(16);
+    benchFrame(settings_t_size);
+    benchFrame(BENCH_FRAME_MAX);
+
+    printf("\n%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
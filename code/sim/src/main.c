@@ -0,0 +1,964 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "threads.h"
+#include "sim.h"
+#include "frame.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+
+/*
+ * opentcs-sim, runs the ignition and sensors threads against a trace.
+ *
+ * Ground truth comes from the trace itself: a shift starts when the
+ * strain gauge crosses the threshold in the configured direction, a
+ * slip starts when the rear wheel turns 10% faster than the front one.
+ * Every ignition cut is matched against the open truth events to
+ * measure the detection latency, events without a cut are missed and
+ * cuts without an event are spurious.
+ *
+ * Each ignition edge is a spark on every output, the ones active on
+ * TIM3 at that time are removed. A cut reports how many sparks it
+ * removed and its tail, the time from the last removed spark to the
+ * end of the cut that takes power away without removing anything.
+ *
+ * The slip the sensors thread computes is checked against the trace on
+ * every sample: it must lie within what the slip was over the last
+ * SLIP_LAG_SAMPLES, give or take SLIP_ERR_MAX.
+ *
+ * Synthetic laps know the engaged gear, the gear estimator is checked
+ * against it on every sample outside of shifts. The gears learned in the
+ * background are printed at the end, for a recorded trace this is the
+ * offline learner.
+ *
+ * Each window frozen by the flight recorder is read back as the GUI
+ * would, decoded and cleared. Its samples must follow each other without
+ * a gap and surround the trigger.
+ *
+ * With -g the GUI polls the serial thread over the USART1 receive line:
+ * bursts of one to three pipelined requests cut in random pieces, so
+ * frames cross the end of the DMA ring and arrive split by idle lines.
+ * Every request must be answered, in order, within 100ms. The round
+ * trip from a burst to the end of its last reply is reported.
+ *
+ * With -b the GUI first negotiates the link rate, as a loopback test of
+ * the handshake: once with a host that fails to follow, the device must
+ * go back to 115200 on its own, then for real before polling.
+ *
+ * With -p the GUI then subscribes to the sensors, status and cuts and
+ * keeps polling: pushes and replies share the link. Pushes must come
+ * without a gap in their sequence numbers and the cut count pushed last
+ * must match the cuts seen on the outputs.
+ */
+
+#define EVT_SHIFT 0
+#define EVT_SLIP 1
+#define EVT_TYPES 2
+
+#define EVT_MAX_OPEN 64
+#define EVT_WINDOW SIM_MS(250)  /* Max delay between an event and its cut */
+#define EVT_EARLY SIM_MS(1)     /* Noise can trip a single conversion early */
+#define EVT_EXPIRE SIM_MS(400)  /* Cuts are reported when the pulse ends */
+#define RECORDER_SAMPLE_US (288.0 * RECORDER_DECIMATION)
+#define GUI_BURST_MAX 3     /* Requests sent back to back */
+#define GUI_PIECE_GAP_US 500 /* Longest pause inside a burst */
+#define GUI_REPLY_TIMEOUT SIM_MS(100)
+#define GUI_LINK_TIMEOUT 250        /* ms, the device gives up on a new rate after 200 */
+#define GUI_SWITCH_DELAY 5          /* ms for the device to drain its reply and switch */
+#define GUI_BAUD 115200
+#define GUI_CMD_SET_BAUD 0x08
+#define GUI_CMD_LINK_CHECK 0x09
+#define GUI_CMD_SUBSCRIBE 0x0A
+#define GUI_CMD_CUT_EVENT 0x0B
+#define GUI_CMD_LINK_TEST 0x0D
+#define GUI_CMD_PUSH 0x80
+#define GUI_PUSH_ALL 0x07    /* Sensors, status and cuts */
+#define SLIP_RATIO 1.10f
+#define SLIP_MIN_HZ 10.0f
+#define SLIP_LAG_SAMPLES 80     /* Trace samples the slip output may lag */
+#define SLIP_ERR_MAX 1.5f       /* Percent points */
+
+extern const settings_t default_settings;
+
+struct __truth_event {
+    uint8_t type;
+    simtime_t start;
+    bool detected;
+    float peak;         /* Highest slip ratio while open */
+};
+typedef struct __truth_event truth_event_t;
+
+static struct {
+    trace_source_t source;
+    void *ctx;
+    FILE *out;
+    FILE *serial;           /* USART1 output */
+    uint32_t serial_bytes;
+    uint32_t gui_period;    /* ms between request bursts, 0 without GUI */
+    simtime_t gui_sent;     /* Time of the burst in flight */
+    uint8_t gui_cmd[GUI_BURST_MAX]; /* Replies expected, in order */
+    uint8_t gui_pending;
+    uint8_t gui_next;       /* Index in gui_cmd of the next reply */
+    uint8_t gui_seq;        /* Sequence number of the next request */
+    frame_decoder_t gui_decoder;
+    uint8_t gui_frame[FRAME_PACKET(256)]; /* Reply being received */
+    uint8_t gui_reply[256]; /* Payload of the last reply */
+    uint16_t gui_reply_len;
+    uint32_t gui_baud;      /* Negotiated with -b, 0 to stay at GUI_BAUD */
+    bool gui_fallback;      /* The device went back after a failed switch */
+    simtime_t gui_switch;   /* Negotiation time */
+    uint32_t gui_bursts;
+    uint32_t gui_trips;     /* Bursts answered in full */
+    uint32_t gui_requests;
+    uint32_t gui_replies;
+    uint32_t gui_missed;
+    uint32_t gui_errors;    /* Bad CRC, unexpected command or sequence number */
+    uint64_t gui_latency_ns;
+    simtime_t gui_latency_max;
+    uint32_t push_period;   /* ms asked with -p, 0 without pushes */
+    uint32_t push_applied;  /* ms the device applied */
+    simtime_t push_start;
+    uint8_t push_seq;       /* Sequence number of the next push */
+    uint32_t push_sensors;
+    uint32_t push_status;
+    uint32_t push_cuts;
+    uint32_t push_gaps;     /* Pushes lost */
+    uint32_t push_errors;   /* Unknown command or bad message */
+    cut_t push_cut;         /* Last cut pushed */
+    bool verbose;
+    float level[EVT_TYPES];
+    simtime_t t;            /* Time of the last observed sample */
+    truth_event_t open[EVT_MAX_OPEN];
+    uint8_t nb_open;
+    uint32_t events[EVT_TYPES];
+    uint32_t missed[EVT_TYPES];
+    uint32_t *latency[EVT_TYPES];  /* us */
+    uint32_t nb_latency[EVT_TYPES];
+    uint32_t cuts;
+    uint32_t repeats;
+    uint32_t spurious;
+    uint32_t sparks;        /* Removed by the running cuts */
+    simtime_t last_spark;   /* Last spark removed */
+    uint64_t cut_sparks;
+    uint64_t cut_ns;
+    uint64_t tail_ns;
+    uint32_t empty;         /* Cuts that removed no spark */
+    uint32_t gear_samples;
+    uint32_t gear_correct;
+    uint32_t gear_neutral;  /* Estimator in neutral while a gear is engaged */
+    uint32_t windows;       /* Flight recorder windows read back */
+    uint32_t window_pre;    /* Samples up to the trigger */
+    uint32_t window_post;
+    uint32_t window_bytes;
+    uint32_t window_errors;
+    float slip_peak_sum;
+    float slip_peak_max;
+    float slip_hist[SLIP_LAG_SAMPLES]; /* Percent, last samples */
+    uint32_t slip_run;      /* Samples since the front wheel got going */
+    uint32_t slip_samples;  /* Samples checked */
+    uint32_t slip_slipping; /* Of those, with slip above SLIP_ERR_MAX */
+    uint32_t slip_wrong;    /* Off by more than SLIP_ERR_MAX */
+    float slip_err_max;
+    uint32_t max_latency;   /* us, 0 disables the check */
+    bool failed;
+} metrics;
+
+static const char *const evt_names[EVT_TYPES] = {"shift", "slip"};
+
+static void eventClose(uint8_t i)
+{
+    truth_event_t *ev = &metrics.open[i];
+
+    if (ev->type == EVT_SLIP)
+    {
+        metrics.slip_peak_sum += ev->peak;
+        if (ev->peak > metrics.slip_peak_max)
+            metrics.slip_peak_max = ev->peak;
+    }
+
+    if (!ev->detected)
+    {
+        metrics.missed[ev->type]++;
+        if (metrics.verbose)
+            printf("%10.3f ms  %s missed\n", ev->start / 1e6, evt_names[ev->type]);
+    }
+    metrics.open[i] = metrics.open[--metrics.nb_open];
+}
+
+static void eventOpen(uint8_t type, simtime_t t)
+{
+    if (metrics.nb_open >= EVT_MAX_OPEN)
+        simFatal("too many open events\n");
+
+    metrics.open[metrics.nb_open++] = (truth_event_t){type, t, false, 0};
+    metrics.events[type]++;
+}
+
+/* Signed distance to each event condition, an event is active above 0 */
+static void eventLevels(const trace_sample_t *s, float level[EVT_TYPES])
+{
+    if (settings.data.sensor_direction == SETTINGS_SENSOR_NORMAL)
+        level[EVT_SHIFT] = s->strain - (float)settings.data.sensor_threshold;
+    else
+        level[EVT_SHIFT] = (float)settings.data.sensor_threshold - s->strain;
+
+    if (s->front_hz >= SLIP_MIN_HZ)
+        level[EVT_SLIP] = s->rear_hz - s->front_hz * SLIP_RATIO;
+    else
+        level[EVT_SLIP] = -1.0f;
+}
+
+/*
+ * The slip the firmware works with against the trace, at the time the
+ * replay has reached. The wheel filters lag a change of speed by a few
+ * teeth, so the output only has to lie within what the slip was over
+ * the last SLIP_LAG_SAMPLES, once the front wheel has been turning for
+ * that long.
+ */
+static void slipObserve(void)
+{
+    const trace_sample_t *c = replayCurrent();
+    float truth, lo, hi, err = 0;
+    uint32_t i;
+
+    if (c->front_hz < SLIP_MIN_HZ)
+    {
+        metrics.slip_run = 0;
+        return;
+    }
+
+    truth = 100.0f * (c->rear_hz / c->front_hz - 1.0f);
+    if (truth < 0)
+        truth = 0;
+    metrics.slip_hist[metrics.slip_run++ % SLIP_LAG_SAMPLES] = truth;
+    if (metrics.slip_run < 2 * SLIP_LAG_SAMPLES)
+        return;
+
+    lo = hi = truth;
+    for (i = 0; i < SLIP_LAG_SAMPLES; i++)
+    {
+        if (metrics.slip_hist[i] < lo)
+            lo = metrics.slip_hist[i];
+        if (metrics.slip_hist[i] > hi)
+            hi = metrics.slip_hist[i];
+    }
+
+    if (status.slipping_pct < lo)
+        err = lo - status.slipping_pct;
+    else if (status.slipping_pct > hi)
+        err = status.slipping_pct - hi;
+
+    metrics.slip_samples++;
+    if (truth >= SLIP_ERR_MAX)
+        metrics.slip_slipping++;
+    if (err > metrics.slip_err_max)
+        metrics.slip_err_max = err;
+    if (err > SLIP_ERR_MAX)
+        metrics.slip_wrong++;
+}
+
+static void metricsObserve(const trace_sample_t *s)
+{
+    float level[EVT_TYPES];
+    uint8_t i;
+
+    eventLevels(s, level);
+
+    for (i = 0; i < EVT_TYPES; i++)
+    {
+        if (level[i] >= 0 && metrics.level[i] < 0)
+        {
+            /* The replay interpolates, so does the crossing time */
+            const float f = metrics.level[i] / (metrics.level[i] - level[i]);
+
+            eventOpen(i, metrics.t + (simtime_t)(f * (s->t - metrics.t)));
+        }
+        metrics.level[i] = level[i];
+    }
+    metrics.t = s->t;
+
+    if (s->gear)
+    {
+        metrics.gear_samples++;
+        if (getCurGearNeutral())
+            metrics.gear_neutral++;
+        else if (getCurGearIdx() + 1 == s->gear)
+            metrics.gear_correct++;
+    }
+
+    slipObserve();
+
+    for (i = 0; i < metrics.nb_open; i++)
+    {
+        truth_event_t *ev = &metrics.open[i];
+
+        if (ev->type == EVT_SLIP && s->front_hz >= SLIP_MIN_HZ && s->rear_hz / s->front_hz - 1.0f > ev->peak)
+            ev->peak = s->rear_hz / s->front_hz - 1.0f;
+    }
+
+    i = 0;
+    while (i < metrics.nb_open)
+    {
+        if (metrics.open[i].start + EVT_EXPIRE < s->t)
+            eventClose(i);
+        else
+            i++;
+    }
+}
+
+/* Reads back a frozen flight recorder window and clears it */
+static void recordCheck(void)
+{
+    record_t record;
+    recorder_reader_t rd;
+    uint32_t next = 0, pre = 0, post = 0;
+    uint8_t i = 0;
+    bool error = false;
+
+    if (!getRecordBlock(0, &record))
+        return;
+
+    do
+    {
+        recorderReadInit(&rd, record.data.bytes, record.data.size);
+        while (recorderRead(&rd))
+        {
+            if ((pre || post) && rd.time != next)
+                error = true;
+            next = rd.time + RECORDER_DECIMATION;
+            if (rd.time <= record.trigger)
+                pre++;
+            else
+                post++;
+        }
+        if (rd.pos != rd.len)
+            error = true;
+        metrics.window_bytes += record.data.size;
+    }
+    while (getRecordBlock(++i, &record));
+
+    if (pre == 0 || post == 0)
+        error = true;
+    if (metrics.verbose)
+        printf("%10.3f ms  record window %u blocks, %u samples before the %s trigger, %u after%s\n",
+               sim_now / 1e6, i, pre, record.reason == RECORDER_TRIGGER_SHIFT ? "shift" : "tc", post,
+               error ? ", decode error" : "");
+
+    metrics.windows++;
+    metrics.window_pre += pre;
+    metrics.window_post += post;
+    metrics.window_errors += error;
+    clearRecord();
+}
+
+/* Feeds the replay and records the ground truth on the way */
+static bool observedNext(trace_sample_t *s, void *ctx)
+{
+    (void)ctx;
+
+    if (!metrics.source(s, metrics.ctx))
+        return false;
+
+    metricsObserve(s);
+    recordCheck();
+    if (metrics.out != NULL)
+        traceFileWrite(metrics.out, s);
+    return true;
+}
+
+static void onSpark(simtime_t t, uint8_t cut)
+{
+    if (cut)
+    {
+        metrics.sparks += __builtin_popcount(cut);
+        metrics.last_spark = t;
+    }
+}
+
+/* Checks a frame the device sent on its own */
+static void guiPush(const frame_decoder_t *d)
+{
+    pb_istream_t is = pb_istream_from_buffer((uint8_t *)framePayload(d), framePayloadLen(d));
+    sensors_t sensors;
+    status_t status;
+    bool ok = false;
+
+    if (metrics.push_sensors + metrics.push_status + metrics.push_cuts)
+        metrics.push_gaps += (uint8_t)(frameSeq(d) - metrics.push_seq);
+    metrics.push_seq = frameSeq(d) + 1;
+
+    switch (frameCmd(d) & ~GUI_CMD_PUSH)
+    {
+        case 0x01:
+            ok = pb_decode(&is, sensors_t_fields, &sensors);
+            metrics.push_sensors++;
+            break;
+        case 0x02:
+            ok = pb_decode(&is, status_t_fields, &status);
+            metrics.push_status++;
+            break;
+        case GUI_CMD_CUT_EVENT:
+            ok = pb_decode(&is, cut_t_fields, &metrics.push_cut)
+                    && metrics.push_cut.reason != RECORDER_TRIGGER_NONE && metrics.push_cut.duration > 0;
+            metrics.push_cuts++;
+            if (metrics.verbose)
+                printf("%10.3f ms  push cut %u at %u ms, reason %u, %u us\n", sim_now / 1e6,
+                       metrics.push_cut.count, metrics.push_cut.time,
+                       metrics.push_cut.reason, metrics.push_cut.duration);
+            break;
+    }
+    if (!ok)
+        metrics.push_errors++;
+}
+
+/* Decodes the replies to the GUI requests, debug output in between fails its CRC */
+static void guiReplyByte(uint8_t byte)
+{
+    frame_decoder_t *d = &metrics.gui_decoder;
+    const uint8_t res = frameDecode(d, byte);
+
+    if (res == FRAME_PENDING || (res == FRAME_ERROR && metrics.serial != NULL))
+        return;
+    if (res == FRAME_OK && (frameCmd(d) & GUI_CMD_PUSH))
+    {
+        guiPush(d);
+        return;
+    }
+    if (res == FRAME_ERROR || metrics.gui_pending == 0
+            || frameCmd(d) != metrics.gui_cmd[metrics.gui_next]
+            || frameSeq(d) != (uint8_t)(metrics.gui_seq - metrics.gui_pending))
+    {
+        metrics.gui_errors++;
+        return;
+    }
+
+    memcpy(metrics.gui_reply, framePayload(d), framePayloadLen(d));
+    metrics.gui_reply_len = framePayloadLen(d);
+    metrics.gui_replies++;
+    metrics.gui_next++;
+    if (--metrics.gui_pending == 0)
+    {
+        const simtime_t latency = sim_now - metrics.gui_sent;
+
+        metrics.gui_trips++;
+        metrics.gui_latency_ns += latency;
+        if (latency > metrics.gui_latency_max)
+            metrics.gui_latency_max = latency;
+    }
+}
+
+static void onUsartTx(uint8_t byte)
+{
+    if (metrics.gui_period)
+        guiReplyByte(byte);
+
+    metrics.serial_bytes++;
+    if (metrics.serial != NULL)
+        fputc(byte, metrics.serial);
+}
+
+static void onCut(simtime_t start, simtime_t end, uint8_t channels)
+{
+    truth_event_t *match = NULL;
+    const uint32_t sparks = (metrics.last_spark >= start) ? metrics.sparks : 0;
+    bool repeat = false;
+    uint8_t i;
+
+    metrics.cuts++;
+    metrics.cut_ns += end - start;
+    metrics.cut_sparks += sparks;
+    if (sparks)
+        metrics.tail_ns += end - metrics.last_spark;
+    else
+        metrics.empty++;
+    metrics.sparks = 0;
+
+    slipObserve();
+
+    for (i = 0; i < metrics.nb_open; i++)
+    {
+        truth_event_t *ev = &metrics.open[i];
+
+        if (ev->start > start + EVT_EARLY || start > ev->start + EVT_WINDOW)
+            continue;
+        if (ev->detected)
+            repeat = true;
+        else if (match == NULL || ev->start < match->start)
+            match = ev;
+    }
+
+    if (metrics.verbose)
+    {
+        printf("%10.3f ms  cut %.1f ms channels 0x%X sparks %u%s\n", start / 1e6,
+               (end - start) / 1e6, channels, sparks,
+               match ? "" : (repeat ? " (repeat)" : " (spurious)"));
+    }
+
+    if (match != NULL)
+    {
+        const uint8_t type = match->type;
+
+        match->detected = true;
+        metrics.latency[type] = realloc(metrics.latency[type],
+                                        (metrics.nb_latency[type] + 1) * sizeof(uint32_t));
+        metrics.latency[type][metrics.nb_latency[type]++] =
+            (start > match->start) ? (start - match->start) / 1000 : 0;
+    }
+    else if (repeat)
+        metrics.repeats++;
+    else
+        metrics.spurious++;
+}
+
+static int cmpU32(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void metricsReport(double wall)
+{
+    gears_t gears;
+    uint8_t i;
+
+    while (metrics.nb_open)
+        eventClose(0);
+
+    printf("simulated %.3f s in %.3f s (x%.0f)\n", sim_now / 1e9, wall,
+           wall > 0 ? sim_now / 1e9 / wall : 0);
+
+    for (i = 0; i < EVT_TYPES; i++)
+    {
+        uint32_t *l = metrics.latency[i];
+        const uint32_t n = metrics.nb_latency[i];
+        uint64_t sum = 0;
+        uint32_t j;
+
+        printf("%-6s events %5u  detected %5u  missed %5u", evt_names[i],
+               metrics.events[i], n, metrics.missed[i]);
+        if (i == EVT_SLIP && metrics.events[i])
+            printf("  peak %% avg %.1f max %.1f", 100 * metrics.slip_peak_sum / metrics.events[i],
+                   100 * metrics.slip_peak_max);
+
+        if (n == 0)
+        {
+            printf("\n");
+            continue;
+        }
+
+        qsort(l, n, sizeof(uint32_t), cmpU32);
+        for (j = 0; j < n; j++)
+            sum += l[j];
+
+        printf("  latency us min %u avg %u p50 %u p99 %u max %u\n", l[0],
+               (uint32_t)(sum / n), l[n / 2], l[(n * 99) / 100], l[n - 1]);
+
+        if (metrics.max_latency && l[n - 1] > metrics.max_latency)
+        {
+            printf("%s latency above %u us\n", evt_names[i], metrics.max_latency);
+            metrics.failed = true;
+        }
+    }
+
+    if (metrics.slip_samples)
+    {
+        printf("slip   samples %u  slipping %u  error %% max %.2f  off by more than %.1f %u\n",
+               metrics.slip_samples, metrics.slip_slipping, metrics.slip_err_max, SLIP_ERR_MAX, metrics.slip_wrong);
+        if (metrics.slip_wrong)
+            metrics.failed = true;
+    }
+
+    if (metrics.gear_samples)
+        printf("gear   samples %u  correct %.2f%%  neutral %.2f%%\n", metrics.gear_samples,
+               100.0 * metrics.gear_correct / metrics.gear_samples,
+               100.0 * metrics.gear_neutral / metrics.gear_samples);
+
+    getGearsLearned(&gears);
+    printf("gears  learned from %u samples, ratio/confidence %%:", gears.samples);
+    for (i = 0; i < gears.ratio.size; i++)
+        printf(" %u/%u", gears.ratio.bytes[i], gears.confidence.bytes[i]);
+    if (settings.data.gears_ratio.size && settings.data.gears_ratio.bytes[0])
+    {
+        printf("  expected:");
+        for (i = 0; i < settings.data.gears_ratio.size; i++)
+            printf(" %u", settings.data.gears_ratio.bytes[i]);
+    }
+    printf("\n");
+
+    if (metrics.windows)
+    {
+        printf("record windows %u  ms before %.1f after %.1f  bytes per sample %.2f  errors %u\n",
+               metrics.windows, RECORDER_SAMPLE_US * metrics.window_pre / 1e3 / metrics.windows,
+               RECORDER_SAMPLE_US * metrics.window_post / 1e3 / metrics.windows,
+               (double)metrics.window_bytes / (metrics.window_pre + metrics.window_post),
+               metrics.window_errors);
+        if (metrics.window_errors)
+            metrics.failed = true;
+    }
+
+    if (metrics.serial != NULL)
+        printf("usart1 sent %u bytes, %u messages dropped\n", metrics.serial_bytes, usart_tx_dropped);
+
+    if (metrics.gui_bursts)
+    {
+        printf("gui    requests %u  answered %u  missed %u  errors %u", metrics.gui_requests,
+               metrics.gui_replies, metrics.gui_missed, metrics.gui_errors);
+        if (metrics.gui_trips)
+            printf("  round trip ms avg %.2f max %.2f", metrics.gui_latency_ns / 1e6 / metrics.gui_trips,
+                   metrics.gui_latency_max / 1e6);
+        printf("\n");
+        if (metrics.gui_missed || metrics.gui_errors)
+            metrics.failed = true;
+    }
+
+    if (metrics.gui_period && metrics.gui_baud)
+    {
+        if (metrics.gui_switch)
+            printf("link   %u baud in %.2f ms", metrics.gui_baud, metrics.gui_switch / 1e6);
+        else
+            printf("link   %u baud refused", metrics.gui_baud);
+        printf(", fallback %s\n", metrics.gui_fallback ? "ok" : "failed");
+        if (!metrics.gui_fallback || !metrics.gui_switch)
+            metrics.failed = true;
+    }
+
+    if (metrics.push_period)
+    {
+        const double s = (sim_now - metrics.push_start) / 1e9;
+
+        if (metrics.push_applied)
+            printf("push   every %u ms  sensors %u (%.1f/s)  status %u (%.1f/s)  cuts %u, count %u of %u"
+                   "  gaps %u  errors %u\n", metrics.push_applied,
+                   metrics.push_sensors, metrics.push_sensors / s, metrics.push_status, metrics.push_status / s,
+                   metrics.push_cuts, metrics.push_cut.count, metrics.cuts, metrics.push_gaps, metrics.push_errors);
+        else
+            printf("push   subscription refused\n");
+        if (!metrics.push_applied || metrics.push_gaps || metrics.push_errors || metrics.push_sensors == 0
+                || metrics.push_cut.count != metrics.cuts)
+            metrics.failed = true;
+    }
+
+    printf("cuts   %5u  repeat %5u  spurious %5u", metrics.cuts,
+           metrics.repeats, metrics.spurious);
+    if (metrics.cuts)
+        printf("  ms avg %.2f  sparks avg %.2f  tail ms avg %.2f  empty %u",
+               metrics.cut_ns / 1e6 / metrics.cuts,
+               (double)metrics.cut_sparks / metrics.cuts,
+               metrics.cuts > metrics.empty ? metrics.tail_ns / 1e6 / (metrics.cuts - metrics.empty) : 0.0,
+               metrics.empty);
+    printf("\n");
+}
+
+static void sensorsThread(void *arg)
+{
+    (void)arg;
+    initIgnition();
+    startAdc();
+    startSensors();
+}
+
+static void serialThread(void *arg)
+{
+    (void)arg;
+    startSerialCom();
+}
+
+/* Sends msg as one request and decodes the reply in it, false without one */
+static bool guiRequest(uint8_t cmd, const pb_field_t fields[], void *msg)
+{
+    uint8_t payload[64], buf[FRAME_ENCODED_MAX(sizeof(payload))];
+    pb_ostream_t os = pb_ostream_from_buffer(payload, sizeof(payload));
+    pb_istream_t is;
+
+    pb_encode(&os, fields, msg);
+    metrics.gui_cmd[0] = cmd;
+    metrics.gui_next = 0;
+    metrics.gui_pending = 1;
+    metrics.gui_requests++;
+    simUsartRx(buf, frameEncode(buf, metrics.gui_seq++, cmd, payload, os.bytes_written));
+    metrics.gui_sent = sim_now;
+
+    while (metrics.gui_pending && sim_now - metrics.gui_sent < GUI_REPLY_TIMEOUT)
+        chThdSleepMilliseconds(1);
+    if (metrics.gui_pending)
+    {
+        metrics.gui_pending = 0;
+        return false;
+    }
+
+    is = pb_istream_from_buffer(metrics.gui_reply, metrics.gui_reply_len);
+    return pb_decode(&is, fields, msg);
+}
+
+/* Sends one request, returns the link rate in the reply or 0 without one */
+static uint32_t guiLink(uint8_t cmd, uint32_t baud)
+{
+    link_t link = {baud};
+
+    return guiRequest(cmd, link_t_fields, &link) ? link.baud : 0;
+}
+
+/* A payload as long as the largest message, without zeros, must come back as sent */
+static bool guiLinkTest(void)
+{
+    uint8_t pattern[settings_t_size], buf[FRAME_ENCODED_MAX(sizeof(pattern))];
+    uint8_t i;
+
+    for (i = 0; i < sizeof(pattern); i++)
+        pattern[i] = 0x80 | i;
+
+    metrics.gui_cmd[0] = GUI_CMD_LINK_TEST;
+    metrics.gui_next = 0;
+    metrics.gui_pending = 1;
+    metrics.gui_requests++;
+    simUsartRx(buf, frameEncode(buf, metrics.gui_seq++, GUI_CMD_LINK_TEST, pattern, sizeof(pattern)));
+    metrics.gui_sent = sim_now;
+
+    while (metrics.gui_pending && sim_now - metrics.gui_sent < GUI_REPLY_TIMEOUT)
+        chThdSleepMilliseconds(1);
+    if (metrics.gui_pending)
+    {
+        metrics.gui_pending = 0;
+        return false;
+    }
+
+    return metrics.gui_reply_len == sizeof(pattern)
+            && memcmp(metrics.gui_reply, pattern, sizeof(pattern)) == 0;
+}
+
+/*
+ * The GUI side of the rate handshake: the device answers at the old
+ * rate and switches, the host follows, echoes a full size frame and
+ * confirms at the new rate. On any failure the host goes back and the
+ * device does after a timeout.
+ */
+static bool guiSetBaud(uint32_t baud, bool follow)
+{
+    if (guiLink(GUI_CMD_SET_BAUD, baud) != baud)
+        return false;
+    if (follow)
+        simUsartHostBaud(baud);
+    chThdSleepMilliseconds(GUI_SWITCH_DELAY);
+    if (guiLinkTest() && guiLink(GUI_CMD_LINK_CHECK, 0) == baud)
+        return true;
+
+    simUsartHostBaud(GUI_BAUD);
+    chThdSleepMilliseconds(GUI_LINK_TIMEOUT);
+    return false;
+}
+
+static void guiThread(void *arg)
+{
+    static const uint8_t cmds[] = {0x01, 0x02, 0x06}; /* Diag, info and a record block */
+    uint8_t burst[GUI_BURST_MAX * FRAME_ENCODED_MAX(1)];
+    (void)arg;
+
+    if (metrics.gui_baud)
+    {
+        simtime_t start;
+
+        chThdSleepMilliseconds(metrics.gui_period);
+        metrics.gui_fallback = !guiSetBaud(metrics.gui_baud, false)
+                && guiLink(GUI_CMD_LINK_CHECK, 0) == GUI_BAUD;
+
+        start = sim_now;
+        if (guiSetBaud(metrics.gui_baud, true))
+            metrics.gui_switch = sim_now - start;
+    }
+
+    if (metrics.push_period)
+    {
+        subscribe_t sub = {GUI_PUSH_ALL, metrics.push_period};
+
+        if (guiRequest(GUI_CMD_SUBSCRIBE, subscribe_t_fields, &sub) && sub.streams == GUI_PUSH_ALL)
+            metrics.push_applied = sub.period;
+        metrics.push_start = sim_now;
+    }
+
+    while (true)
+    {
+        uint32_t len = 0, sent = 0;
+        uint8_t i;
+
+        chThdSleepMilliseconds(metrics.gui_period);
+        while (metrics.gui_pending && sim_now - metrics.gui_sent < GUI_REPLY_TIMEOUT)
+            chThdSleepMilliseconds(1);
+
+        if (metrics.gui_pending)
+        {
+            metrics.gui_missed += metrics.gui_pending;
+            if (metrics.verbose)
+                printf("%10.3f ms  gui %u requests not answered\n", sim_now / 1e6, metrics.gui_pending);
+        }
+
+        metrics.gui_pending = 1 + rand() % GUI_BURST_MAX;
+        metrics.gui_next = 0;
+        for (i = 0; i < metrics.gui_pending; i++)
+        {
+            const uint8_t cmd = cmds[rand() % sizeof(cmds)];
+            const uint8_t block = rand() % RECORDER_BLOCKS;
+
+            metrics.gui_cmd[i] = cmd;
+            len += frameEncode(&burst[len], metrics.gui_seq++, cmd, &block, cmd == 0x06);
+        }
+        metrics.gui_requests += metrics.gui_pending;
+
+        while (sent < len)
+        {
+            const uint32_t n = 1 + rand() % (len - sent);
+
+            simUsartRx(&burst[sent], n);
+            sent += n;
+            if (sent < len)
+                chThdSleepMicroseconds(1 + rand() % GUI_PIECE_GAP_US);
+        }
+        metrics.gui_sent = sim_now;
+        metrics.gui_bursts++;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] [trace]\n"
+            "  -l laps       synthetic laps when no trace is given (10)\n"
+            "  -s seed       generator and noise seed (1)\n"
+            "  -t threshold  shifter sensor threshold in ADC counts (2000)\n"
+            "  -c type       cut type: normal, sync, progressive or disabled (normal)\n"
+            "  -f functions  comma separated: shifter, tc, awd (shifter,tc)\n"
+            "  -m us         exit with an error if a detection latency exceeds us\n"
+            "  -w file       write the replayed trace to file\n"
+            "  -u file       enable debug output, write what USART1 sends to file\n"
+            "  -g ms         send GUI requests every ms and check the replies\n"
+            "  -b baud       with -g, negotiate the link rate first\n"
+            "  -p ms         with -g, subscribe to pushes every ms\n"
+            "  -v            print every event and cut\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    lapgen_t gen;
+    FILE *in = NULL;
+    uint32_t laps = 10, seed = 1, threshold = 2000;
+    uint8_t cut_type = SETTINGS_CUT_NORMAL;
+    uint32_t functions = SETTINGS_FUNCTION_SHIFTER | SETTINGS_FUNCTION_TC;
+    struct timespec t0, t1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:s:t:c:f:m:w:u:g:b:p:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': laps = strtoul(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 't': threshold = strtoul(optarg, NULL, 0); break;
+            case 'c':
+                if (strcmp(optarg, "normal") == 0)
+                    cut_type = SETTINGS_CUT_NORMAL;
+                else if (strcmp(optarg, "sync") == 0)
+                    cut_type = SETTINGS_CUT_SYNC;
+                else if (strcmp(optarg, "progressive") == 0)
+                    cut_type = SETTINGS_CUT_PROGRESSIVE;
+                else if (strcmp(optarg, "disabled") == 0)
+                    cut_type = SETTINGS_CUT_DISABLED;
+                else
+                    usage(argv[0]);
+                break;
+            case 'f':
+                functions = 0;
+                if (strstr(optarg, "shifter") != NULL)
+                    functions |= SETTINGS_FUNCTION_SHIFTER;
+                if (strstr(optarg, "tc") != NULL)
+                    functions |= SETTINGS_FUNCTION_TC;
+                if (strstr(optarg, "awd") != NULL)
+                    functions |= SETTINGS_FUNCTION_SHIFTER_AWD;
+                break;
+            case 'm': metrics.max_latency = strtoul(optarg, NULL, 0); break;
+            case 'w':
+                metrics.out = fopen(optarg, "w");
+                if (metrics.out == NULL)
+                {
+                    perror(optarg);
+                    return 1;
+                }
+                fprintf(metrics.out, "# time_ms rpm front_hz rear_hz strain tc_sw vbat\n");
+                break;
+            case 'u':
+                metrics.serial = fopen(optarg, "wb");
+                if (metrics.serial == NULL)
+                {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'g': metrics.gui_period = strtoul(optarg, NULL, 0); break;
+            case 'b': metrics.gui_baud = strtoul(optarg, NULL, 0); break;
+            case 'p': metrics.push_period = strtoul(optarg, NULL, 0); break;
+            case 'v': metrics.verbose = true; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+    {
+        in = fopen(argv[optind], "r");
+        if (in == NULL)
+        {
+            perror(argv[optind]);
+            return 1;
+        }
+        metrics.source = traceFileNext;
+        metrics.ctx = in;
+    }
+    else
+    {
+        lapgenInit(&gen, laps, seed);
+        metrics.source = lapgenNext;
+        metrics.ctx = &gen;
+    }
+
+    settings = default_settings;
+    settings.data.functions = functions;
+    settings.data.cut_type = cut_type;
+    settings.data.sensor_threshold = threshold;
+    if (in == NULL)
+        settings.data.gears_ratio.size = lapgenGearsRatio(settings.data.gears_ratio.bytes, GEAR_RATIO_SCALE);
+    serial_dbg = (metrics.serial != NULL);
+    simOnUsartTx = onUsartTx;
+    simOnCut = onCut;
+    simOnSpark = onSpark;
+
+    halInit();
+    usartInit(DBG_USART);
+    chSysInit();
+    simThreadCreate("Sensors", sensorsThread, NULL);
+    simThreadCreate("Serial", serialThread, NULL);
+    if (metrics.gui_period)
+    {
+        srand(seed);
+        frameDecoderInit(&metrics.gui_decoder, metrics.gui_frame, sizeof(metrics.gui_frame));
+        simUsartHostBaud(GUI_BAUD);
+        simThreadCreate("GUI", guiThread, NULL);
+    }
+
+    metrics.level[EVT_SHIFT] = metrics.level[EVT_SLIP] = -1.0f;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    replayInit(observedNext, NULL, seed);
+    simRun(SIM_NEVER);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    metricsReport((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    if (in != NULL)
+        fclose(in);
+    if (metrics.out != NULL)
+        fclose(metrics.out);
+    if (metrics.serial != NULL)
+        fclose(metrics.serial);
+    return metrics.failed ? 3 : 0;
+}
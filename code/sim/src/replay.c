@@ -0,0 +1,196 @@
+#include <math.h>
+#include "sim.h"
+
+/*
+ * Replays a trace into the peripheral models.
+ *
+ * Samples are linearly interpolated, engine and wheel frequencies are
+ * integrated into capture edges on TIM1 CC4 (ignition), TIM2 CC3
+ * (front wheel) and TIM2 CC4 (rear wheel). Analog inputs get a small
+ * amount of deterministic noise, like a real strain gauge amplifier.
+ */
+
+#define REPLAY_MIN_HZ 1.0f  /* Below this an input is considered stopped */
+#define REPLAY_IDLE_NS SIM_MS(10)
+#define REPLAY_NOISE 6      /* ADC counts, peak */
+#define REPLAY_TEMP 1750    /* Internal temperature sensor, ADC counts */
+
+struct __edge_input {
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    simtime_t next;
+};
+typedef struct __edge_input edge_input_t;
+
+static struct {
+    trace_source_t source;
+    void *ctx;
+    trace_sample_t prev;
+    trace_sample_t next;
+    trace_sample_t cur;
+    bool done;
+    uint32_t noise;
+    edge_input_t inputs[3];
+} replay;
+
+void (*simOnSpark)(simtime_t t, uint8_t cut) = NULL;
+
+static float lerp(float a, float b, float f)
+{
+    return a + (b - a) * f;
+}
+
+/* Moves the interpolation window so that prev.t <= t < next.t */
+static void replaySeek(simtime_t t)
+{
+    float f;
+
+    while (!replay.done && replay.next.t <= t)
+    {
+        replay.prev = replay.next;
+        if (!replay.source(&replay.next, replay.ctx))
+        {
+            replay.done = true;
+            replay.next = replay.prev;
+        }
+    }
+
+    if (replay.done || replay.next.t == replay.prev.t)
+    {
+        replay.cur = replay.prev;
+        replay.cur.t = t;
+        return;
+    }
+
+    f = (float)(t - replay.prev.t) / (float)(replay.next.t - replay.prev.t);
+    replay.cur.t = t;
+    replay.cur.rpm = lerp(replay.prev.rpm, replay.next.rpm, f);
+    replay.cur.front_hz = lerp(replay.prev.front_hz, replay.next.front_hz, f);
+    replay.cur.rear_hz = lerp(replay.prev.rear_hz, replay.next.rear_hz, f);
+    replay.cur.strain = lerp(replay.prev.strain, replay.next.strain, f);
+    replay.cur.tc_switch = lerp(replay.prev.tc_switch, replay.next.tc_switch, f);
+    replay.cur.vbat = lerp(replay.prev.vbat, replay.next.vbat, f);
+}
+
+static float inputHz(const edge_input_t *in)
+{
+    if (in == &replay.inputs[0])
+        return replay.cur.rpm / 60.0f;
+    if (in == &replay.inputs[1])
+        return replay.cur.front_hz;
+    return replay.cur.rear_hz;
+}
+
+static void scheduleEdge(edge_input_t *in)
+{
+    const float hz = inputHz(in);
+
+    if (hz < REPLAY_MIN_HZ)
+        in->next = sim_now + REPLAY_IDLE_NS;
+    else
+        in->next = sim_now + (simtime_t)(1e9f / hz);
+}
+
+void replayInit(trace_source_t source, void *ctx, uint32_t seed)
+{
+    uint8_t i;
+
+    replay.source = source;
+    replay.ctx = ctx;
+    replay.done = false;
+    replay.noise = seed ? seed : 1;
+
+    if (!source(&replay.prev, ctx))
+        simFatal("empty trace\n");
+    if (!source(&replay.next, ctx))
+        replay.next = replay.prev;
+
+    replay.inputs[0] = (edge_input_t){TIM1, 4, 0};
+    replay.inputs[1] = (edge_input_t){TIM2, 3, 0};
+    replay.inputs[2] = (edge_input_t){TIM2, 4, 0};
+
+    sim_now = replay.prev.t;
+    replaySeek(sim_now);
+    for (i = 0; i < 3; i++)
+        scheduleEdge(&replay.inputs[i]);
+}
+
+bool replayDone(void)
+{
+    return replay.done;
+}
+
+const trace_sample_t *replayCurrent(void)
+{
+    return &replay.cur;
+}
+
+simtime_t replayNextEvent(void)
+{
+    simtime_t next = SIM_NEVER;
+    uint8_t i;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (replay.inputs[i].next < next)
+            next = replay.inputs[i].next;
+    }
+    return next;
+}
+
+void replayProcess(void)
+{
+    uint8_t i;
+
+    replaySeek(sim_now);
+
+    for (i = 0; i < 3; i++)
+    {
+        edge_input_t *in = &replay.inputs[i];
+
+        if (in->next > sim_now)
+            continue;
+
+        if (inputHz(in) >= REPLAY_MIN_HZ)
+        {
+            if (in == &replay.inputs[0] && simOnSpark)
+                simOnSpark(sim_now, simIgnitionOutputs());
+            simCaptureEdge(in->tim, in->channel);
+        }
+        scheduleEdge(in);
+    }
+}
+
+static int32_t noise(void)
+{
+    /* xorshift32 */
+    replay.noise ^= replay.noise << 13;
+    replay.noise ^= replay.noise >> 17;
+    replay.noise ^= replay.noise << 5;
+    return (int32_t)(replay.noise % (2*REPLAY_NOISE + 1)) - REPLAY_NOISE;
+}
+
+static uint16_t adcClamp(float v)
+{
+    const int32_t i = (int32_t)lrintf(v) + noise();
+
+    if (i < 0) return 0;
+    if (i > 4095) return 4095;
+    return i;
+}
+
+uint16_t simAnalogInput(uint8_t channel, simtime_t t)
+{
+    /* Conversions are always in the past of sim_now, interpolate from the window */
+    if (t > replay.cur.t)
+        replaySeek(t);
+
+    switch (channel)
+    {
+        case 0: return adcClamp(replay.cur.strain);
+        case 1: return adcClamp(replay.cur.tc_switch);
+        case 2: return adcClamp(replay.cur.vbat);
+        case 16: return adcClamp(REPLAY_TEMP);
+        default: return 0;
+    }
+}
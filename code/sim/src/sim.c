@@ -0,0 +1,49 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include "sim.h"
+
+/*
+ * Event loop.
+ *
+ * The virtual clock jumps to the earliest of the next input edge, the
+ * next peripheral event and the next thread wake up. Peripherals are
+ * brought up to date, pending interrupts are served, then every thread
+ * that can run does so until it blocks again.
+ */
+
+simtime_t sim_now = 0;
+
+void simRun(simtime_t until)
+{
+    while (sim_now < until && !replayDone())
+    {
+        simtime_t next = replayNextEvent();
+        simtime_t t;
+
+        t = simPeriphNextEvent();
+        if (t < next) next = t;
+        t = simThreadsNextWake();
+        if (t < next) next = t;
+        if (until < next) next = until;
+
+        if (next > sim_now)
+            sim_now = next;
+
+        simPeriphSync();
+        simPeriphProcess();
+        replayProcess();
+        simPeriphIrq();
+        simThreadsRun();
+    }
+}
+
+void simFatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "sim: %.6f s: ", sim_now / 1e9);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(2);
+}
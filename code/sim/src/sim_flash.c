@@ -0,0 +1,189 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "sim.h"
+
+/*
+ * Flash and CRC unit of the STM32F050K6, in place of their StdPeriph
+ * drivers in opentcs-update. The flash and the start of SRAM are mapped
+ * at their own addresses, so code that reads them through pointers runs
+ * unmodified.
+ *
+ * Programming follows the hardware: a half word only goes to an erased
+ * location, unless it is 0, and only clears bits. Every erase and
+ * program adds its time to sim_flash_busy. A power cut armed with
+ * simFlashCut() hits in the middle of an operation, leaves what it was
+ * writing half done and longjmp()s out.
+ */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SIM_FLASH_BASE 0x08000000
+#define SIM_FLASH_SIZE 0x8000
+#define SIM_FLASH_PAGE 1024
+#define SIM_SRAM_BASE 0x20000000
+#define SIM_SRAM_SIZE 0x1000
+#define SIM_FLASH_ERASE_NS SIM_US(30000)    /* Page, as the GUI emulator */
+#define SIM_FLASH_PROGRAM_NS SIM_US(53)     /* Half word */
+#define SIM_CRC_POLY 0x04C11DB7
+
+simtime_t sim_flash_busy = 0;
+uint32_t sim_flash_erases = 0;
+uint32_t sim_flash_programs = 0;
+
+static bool locked = true;
+static uint32_t crc_dr = 0xFFFFFFFF;
+static uint32_t cut_ops = 0;    /* Operations before the cut, 0 when none is armed */
+static jmp_buf *cut_jump;
+static uint32_t noise = 1;
+
+static uint32_t simNoise(void)
+{
+    noise = noise * 1664525 + 1013904223;
+    return noise >> 8;
+}
+
+bool simFlashInit(void)
+{
+    void *flash = mmap((void *)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    void *sram = mmap((void *)SIM_SRAM_BASE, SIM_SRAM_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (flash != (void *)SIM_FLASH_BASE || sram != (void *)SIM_SRAM_BASE)
+        return false;
+
+    memset(flash, 0xFF, SIM_FLASH_SIZE);
+    simFlashPowerUp(1);
+    return true;
+}
+
+/* SRAM comes up with noise, the flash controller locked */
+void simFlashPowerUp(uint32_t seed)
+{
+    uint32_t *sram = (uint32_t *)SIM_SRAM_BASE;
+    uint32_t i;
+
+    noise = seed;
+    for (i = 0; i < SIM_SRAM_SIZE / 4; i++)
+        sram[i] = simNoise() ^ (simNoise() << 24);
+    locked = true;
+    crc_dr = 0xFFFFFFFF;
+    cut_ops = 0;
+}
+
+void simFlashCut(uint32_t ops, jmp_buf *jump)
+{
+    cut_ops = ops;
+    cut_jump = jump;
+}
+
+/* Counts one operation, true when the power goes in the middle of it */
+static bool simFlashCutNow(void)
+{
+    return cut_ops && --cut_ops == 0;
+}
+
+void FLASH_Unlock(void)
+{
+    locked = false;
+}
+
+void FLASH_Lock(void)
+{
+    locked = true;
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG)
+{
+    (void)FLASH_FLAG;
+}
+
+FLASH_Status FLASH_ErasePage(uint32_t Page_Address)
+{
+    uint8_t *page = (uint8_t *)(Page_Address & ~(SIM_FLASH_PAGE - 1));
+    uint32_t i;
+
+    if (locked || Page_Address < SIM_FLASH_BASE || Page_Address >= SIM_FLASH_BASE + SIM_FLASH_SIZE)
+        return FLASH_ERROR_PROGRAM;
+
+    if (simFlashCutNow())
+    {
+        for (i = 0; i < SIM_FLASH_PAGE; i++)
+            if (simNoise() & 1)
+                page[i] = 0xFF;
+        longjmp(*cut_jump, 1);
+    }
+
+    memset(page, 0xFF, SIM_FLASH_PAGE);
+    sim_flash_busy += SIM_FLASH_ERASE_NS;
+    sim_flash_erases++;
+    return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data)
+{
+    uint16_t *hw = (uint16_t *)Address;
+
+    if (locked || (Address & 1) || Address < SIM_FLASH_BASE
+            || Address >= SIM_FLASH_BASE + SIM_FLASH_SIZE)
+        return FLASH_ERROR_PROGRAM;
+
+    /* PGERR, nothing is written */
+    if (*hw != 0xFFFF && Data != 0)
+        return FLASH_ERROR_PROGRAM;
+
+    if (simFlashCutNow())
+    {
+        *hw &= Data | simNoise();
+        longjmp(*cut_jump, 1);
+    }
+
+    *hw &= Data;
+    sim_flash_busy += SIM_FLASH_PROGRAM_NS;
+    sim_flash_programs++;
+    return FLASH_COMPLETE;
+}
+
+/* Two half words, the low one first, as the driver does */
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data)
+{
+    FLASH_Status status = FLASH_ProgramHalfWord(Address, Data);
+
+    if (status != FLASH_COMPLETE)
+        return status;
+    return FLASH_ProgramHalfWord(Address + 2, Data >> 16);
+}
+
+void CRC_ResetDR(void)
+{
+    crc_dr = 0xFFFFFFFF;
+}
+
+/* Most significant bit first, no reversal, the reset configuration */
+uint32_t CRC_CalcCRC(uint32_t CRC_Data)
+{
+    uint8_t bit;
+
+    crc_dr ^= CRC_Data;
+    for (bit = 0; bit < 32; bit++)
+        crc_dr = (crc_dr & 0x80000000) ? (crc_dr << 1) ^ SIM_CRC_POLY : crc_dr << 1;
+
+    return crc_dr;
+}
+
+uint32_t CRC_CalcBlockCRC(uint32_t pBuffer[], uint32_t BufferLength)
+{
+    uint32_t i;
+
+    for (i = 0; i < BufferLength; i++)
+        CRC_CalcCRC(pBuffer[i]);
+
+    return crc_dr;
+}
+
+uint32_t CRC_GetCRC(void)
+{
+    return crc_dr;
+}
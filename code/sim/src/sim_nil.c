@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <ucontext.h>
+#include "nil.h"
+#include "sim.h"
+
+/*
+ * Cooperative stand-in for the Nil scheduler.
+ *
+ * Threads keep the priority order in which they are created, like the
+ * Nil thread table. A thread runs until it sleeps or waits on a
+ * semaphore, then control returns to simRun() which advances the
+ * virtual clock.
+ */
+
+#define SIM_MAX_THREADS 8
+#define SIM_STACK_SIZE (64*1024)
+#define SIM_TICK_NS (1000000000ULL/NIL_CFG_ST_FREQUENCY)
+
+#define SIM_THD_READY 0
+#define SIM_THD_SLEEPING 1
+#define SIM_THD_WTSEM 2
+
+struct __simthread {
+    const char *name;
+    void (*func)(void *);
+    void *arg;
+    ucontext_t ctx;
+    uint8_t state;
+    simtime_t wake;
+    semaphore_t *sem;
+    msg_t msg;
+};
+typedef struct __simthread simthread_t;
+
+static simthread_t threads[SIM_MAX_THREADS];
+static uint8_t nb_threads = 0;
+static simthread_t *current = NULL;
+static ucontext_t sched_ctx;
+
+static void threadEntry(void)
+{
+    current->func(current->arg);
+    simFatal("thread %s returned\n", current->name);
+}
+
+void simThreadCreate(const char *name, void (*func)(void *), void *arg)
+{
+    simthread_t *tp;
+
+    if (nb_threads >= SIM_MAX_THREADS)
+        simFatal("too many threads\n");
+
+    tp = &threads[nb_threads++];
+    tp->name = name;
+    tp->func = func;
+    tp->arg = arg;
+    tp->state = SIM_THD_READY;
+    tp->wake = 0;
+    tp->sem = NULL;
+
+    getcontext(&tp->ctx);
+    tp->ctx.uc_stack.ss_sp = malloc(SIM_STACK_SIZE);
+    tp->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+    tp->ctx.uc_link = NULL;
+    makecontext(&tp->ctx, threadEntry, 0);
+}
+
+simtime_t simThreadsNextWake(void)
+{
+    simtime_t next = SIM_NEVER;
+    uint8_t i;
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        if (threads[i].state == SIM_THD_READY)
+            return sim_now;
+        if (threads[i].wake < next)
+            next = threads[i].wake;
+    }
+    return next;
+}
+
+/* Returns the highest priority thread that can run at sim_now */
+static simthread_t *nextReady(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        simthread_t *tp = &threads[i];
+
+        if (tp->state != SIM_THD_READY && tp->wake <= sim_now)
+        {
+            if (tp->state == SIM_THD_WTSEM)
+            {
+                tp->sem = NULL;
+                tp->msg = MSG_TIMEOUT;
+            }
+            tp->state = SIM_THD_READY;
+        }
+        if (tp->state == SIM_THD_READY)
+            return tp;
+    }
+    return NULL;
+}
+
+void simThreadsRun(void)
+{
+    simthread_t *tp;
+
+    while ((tp = nextReady()) != NULL)
+    {
+        current = tp;
+        swapcontext(&sched_ctx, &tp->ctx);
+        current = NULL;
+
+        /* Registers may have been written, let the peripherals react */
+        simPeriphIrq();
+    }
+}
+
+static void threadSuspend(void)
+{
+    swapcontext(&current->ctx, &sched_ctx);
+}
+
+void chSysInit(void)
+{
+}
+
+void chThdSleep(systime_t time)
+{
+    if (current == NULL)
+        simFatal("chThdSleep() outside of a thread\n");
+
+    current->state = SIM_THD_SLEEPING;
+    current->wake = sim_now + (simtime_t)time * SIM_TICK_NS;
+    threadSuspend();
+}
+
+systime_t chVTGetSystemTimeX(void)
+{
+    return (systime_t)(sim_now / SIM_TICK_NS);
+}
+
+msg_t chSemWaitTimeout(semaphore_t *sp, systime_t time)
+{
+    if (sp->cnt > 0)
+    {
+        sp->cnt--;
+        return MSG_OK;
+    }
+    if (time == TIME_IMMEDIATE || current == NULL)
+        return MSG_TIMEOUT;
+
+    current->state = SIM_THD_WTSEM;
+    current->sem = sp;
+    current->msg = MSG_OK;
+    if (time == TIME_INFINITE)
+        current->wake = SIM_NEVER;
+    else
+        current->wake = sim_now + (simtime_t)time * SIM_TICK_NS;
+    threadSuspend();
+
+    return current->msg;
+}
+
+void chSemSignal(semaphore_t *sp)
+{
+    uint8_t i;
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        if (threads[i].state == SIM_THD_WTSEM && threads[i].sem == sp)
+        {
+            threads[i].state = SIM_THD_READY;
+            threads[i].sem = NULL;
+            threads[i].msg = MSG_OK;
+            return;
+        }
+    }
+    sp->cnt++;
+}
@@ -0,0 +1,886 @@
+#include <string.h>
+#include "threads.h"
+#include "sim.h"
+
+/*
+ * Behavioural models of the peripherals used by the control loop.
+ *
+ * Register blocks are plain RAM, so the models re-read them after
+ * every slice of firmware code (simPeriphIrq) to pick up enables,
+ * counter restarts and flag clears, and publish their own state back
+ * before firmware code runs again (simPeriphSync).
+ */
+
+#define SIM_IRQ_STORM 10000
+#define SIM_ADC_CLK 14000000ULL
+#define SIM_ADC_ISR_MARK 0x80000000 /* Reserved bit, detects w1c writes */
+
+NVIC_Type sim_NVIC;
+SCB_Type sim_SCB;
+SysTick_Type sim_SysTick;
+
+TIM_TypeDef sim_TIM1, sim_TIM2, sim_TIM3, sim_TIM6, sim_TIM14;
+TIM_TypeDef sim_TIM15, sim_TIM16, sim_TIM17;
+RTC_TypeDef sim_RTC;
+WWDG_TypeDef sim_WWDG;
+IWDG_TypeDef sim_IWDG;
+SPI_TypeDef sim_SPI1, sim_SPI2;
+USART_TypeDef sim_USART1, sim_USART2;
+I2C_TypeDef sim_I2C1, sim_I2C2;
+PWR_TypeDef sim_PWR;
+DAC_TypeDef sim_DAC;
+CEC_TypeDef sim_CEC;
+SYSCFG_TypeDef sim_SYSCFG;
+COMP_TypeDef sim_COMP;
+EXTI_TypeDef sim_EXTI;
+ADC_TypeDef sim_ADC1;
+ADC_Common_TypeDef sim_ADC;
+DBGMCU_TypeDef sim_DBGMCU;
+DMA_TypeDef sim_DMA1;
+DMA_Channel_TypeDef sim_DMA1_Channel[5];
+FLASH_TypeDef sim_FLASH;
+OB_TypeDef sim_OB;
+RCC_TypeDef sim_RCC;
+CRC_TypeDef sim_CRC;
+GPIO_TypeDef sim_GPIOA, sim_GPIOB, sim_GPIOC, sim_GPIOD, sim_GPIOF;
+
+void (*simOnCut)(simtime_t start, simtime_t end, uint8_t channels) = NULL;
+void (*simOnUsartTx)(uint8_t byte) = NULL;
+
+/*
+ * Timers
+ */
+
+struct __simtim {
+    TIM_TypeDef *regs;
+    bool running;
+    simtime_t start;    /* Time at which the counter was cnt0 */
+    uint32_t cnt0;
+    uint32_t cnt;       /* Last value published to CNT */
+    uint16_t sr;        /* Flags, SR bits are rc_w0 */
+    uint8_t edges[4];   /* Input capture prescaler counters */
+};
+typedef struct __simtim simtim_t;
+
+static simtim_t timers[] = {
+    {&sim_TIM1, false, 0, 0, 0, 0, {0}},
+    {&sim_TIM2, false, 0, 0, 0, 0, {0}},
+    {&sim_TIM3, false, 0, 0, 0, 0, {0}},
+};
+#define SIM_NB_TIMERS (sizeof(timers)/sizeof(timers[0]))
+#define SIM_IGN_TIMER (&timers[2])
+
+static simtim_t *timFind(TIM_TypeDef *regs)
+{
+    uint8_t i;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+    {
+        if (timers[i].regs == regs)
+            return &timers[i];
+    }
+    return NULL;
+}
+
+/* Counter ticks elapsed in dt nanoseconds */
+static uint64_t timTicks(simtim_t *t, simtime_t dt)
+{
+    const unsigned __int128 div = (unsigned __int128)(t->regs->PSC + 1) * 1000000000ULL;
+
+    return (uint64_t)(((unsigned __int128)dt * STM32_PCLK) / div);
+}
+
+/* Nanoseconds needed for n counter ticks, rounded up */
+static simtime_t timNs(simtim_t *t, uint64_t n)
+{
+    const unsigned __int128 num = (unsigned __int128)n * (t->regs->PSC + 1) * 1000000000ULL;
+
+    return (simtime_t)((num + STM32_PCLK - 1) / STM32_PCLK);
+}
+
+static uint64_t timCount(simtim_t *t)
+{
+    return t->cnt0 + timTicks(t, sim_now - t->start);
+}
+
+static void timPublish(simtim_t *t)
+{
+    t->regs->SR = t->sr;
+    t->regs->CNT = t->cnt;
+}
+
+static void timSync(simtim_t *t)
+{
+    if (t->running)
+    {
+        t->cnt = timCount(t) % ((uint64_t)t->regs->ARR + 1);
+        t->regs->CNT = t->cnt;
+    }
+}
+
+static void timRebase(simtim_t *t, uint32_t cnt)
+{
+    t->start = sim_now;
+    t->cnt0 = cnt;
+    t->cnt = cnt;
+}
+
+/* Reports the output compare pulse of the ignition timer */
+static void timIgnitionPulse(simtim_t *t, uint64_t end_count)
+{
+    const uint16_t ccer = t->regs->CCER;
+    /* TIM3 is a 16 bit timer, upper bits of CCRx are not implemented */
+    const uint32_t ccr[4] = {t->regs->CCR1 & 0xFFFF, t->regs->CCR2 & 0xFFFF,
+                             t->regs->CCR3 & 0xFFFF, t->regs->CCR4 & 0xFFFF};
+    const uint16_t ccmr[4] = {t->regs->CCMR1, t->regs->CCMR1 >> 8, t->regs->CCMR2, t->regs->CCMR2 >> 8};
+    uint64_t first = UINT64_MAX, last = 0;
+    uint8_t i, channels = 0;
+
+    for (i = 0; i < 4; i++)
+    {
+        uint64_t a, b;
+        const uint8_t mode = (ccmr[i] & TIM_CCMR1_OC1M) >> 4;
+
+        if (!(ccer & (TIM_CCER_CC1E << (i*4))))
+            continue;
+
+        if (mode == 7) /* PWM2, active from CCR */
+        {
+            a = ccr[i];
+            b = end_count;
+        }
+        else if (mode == 6) /* PWM1, active until CCR */
+        {
+            a = t->cnt0;
+            b = ccr[i];
+        }
+        else
+            continue;
+
+        if (a < t->cnt0) a = t->cnt0;
+        if (b > end_count) b = end_count;
+        if (a >= b)
+            continue;
+
+        channels |= 1 << i;
+        if (a < first) first = a;
+        if (b > last) last = b;
+    }
+
+    if (channels && simOnCut)
+    {
+        simOnCut(t->start + timNs(t, first - t->cnt0),
+                 t->start + timNs(t, last - t->cnt0), channels);
+    }
+}
+
+static void timObserve(simtim_t *t)
+{
+    TIM_TypeDef *regs = t->regs;
+
+    /* UG sets UIF at once on hardware, so a clear that follows it wins */
+    if (regs->EGR & TIM_EGR_UG)
+    {
+        regs->EGR = 0;
+        t->sr |= TIM_SR_UIF;
+        timRebase(t, 0);
+    }
+    else if (regs->CNT != t->cnt)
+    {
+        timRebase(t, regs->CNT);
+    }
+
+    /* Flags can only be cleared by software */
+    t->sr &= regs->SR;
+
+    if ((regs->CR1 & TIM_CR1_CEN) && !t->running)
+    {
+        t->running = true;
+        timRebase(t, regs->CNT);
+    }
+    else if (!(regs->CR1 & TIM_CR1_CEN) && t->running)
+    {
+        t->running = false;
+        if (t == SIM_IGN_TIMER)
+            timIgnitionPulse(t, timCount(t));
+        timRebase(t, regs->CNT);
+    }
+
+    timPublish(t);
+}
+
+static simtime_t timNextEvent(simtim_t *t)
+{
+    uint64_t count, period;
+
+    if (!t->running)
+        return SIM_NEVER;
+
+    period = (uint64_t)t->regs->ARR + 1;
+    count = timCount(t);
+    return t->start + timNs(t, ((count / period) + 1) * period - t->cnt0);
+}
+
+static void timProcess(simtim_t *t)
+{
+    const uint64_t period = (uint64_t)t->regs->ARR + 1;
+    uint64_t count;
+
+    if (!t->running)
+        return;
+
+    /* The counter is rebased at every update, so reaching period is the event */
+    count = timCount(t);
+    if (count < period)
+        return;
+
+    t->sr |= TIM_SR_UIF;
+
+    if (t->regs->CR1 & TIM_CR1_OPM)
+    {
+        if (t == SIM_IGN_TIMER)
+            timIgnitionPulse(t, period);
+        t->regs->CR1 &= ~TIM_CR1_CEN;
+        t->running = false;
+        timRebase(t, 0);
+    }
+    else
+    {
+        timRebase(t, count % period);
+    }
+    timPublish(t);
+}
+
+uint8_t simIgnitionOutputs(void)
+{
+    simtim_t *t = SIM_IGN_TIMER;
+    const uint16_t ccer = t->regs->CCER;
+    const uint32_t ccr[4] = {t->regs->CCR1 & 0xFFFF, t->regs->CCR2 & 0xFFFF,
+                             t->regs->CCR3 & 0xFFFF, t->regs->CCR4 & 0xFFFF};
+    const uint16_t ccmr[4] = {t->regs->CCMR1, t->regs->CCMR1 >> 8, t->regs->CCMR2, t->regs->CCMR2 >> 8};
+    uint64_t count;
+    uint8_t i, channels = 0;
+
+    if (!t->running)
+        return 0;
+
+    count = timCount(t);
+    for (i = 0; i < 4; i++)
+    {
+        const uint8_t mode = (ccmr[i] & TIM_CCMR1_OC1M) >> 4;
+
+        if (!(ccer & (TIM_CCER_CC1E << (i*4))))
+            continue;
+        if ((mode == 7 && count >= ccr[i]) || (mode == 6 && count < ccr[i]))
+            channels |= 1 << i;
+    }
+    return channels;
+}
+
+void simCaptureEdge(TIM_TypeDef *regs, uint8_t channel)
+{
+    simtim_t *t = timFind(regs);
+    const uint16_t ccif = TIM_SR_CC1IF << (channel - 1);
+    const uint16_t ccof = TIM_SR_CC1OF << (channel - 1);
+    uint16_t ccmr;
+    uint8_t psc;
+
+    if (t == NULL || !t->running)
+        return;
+
+    if (!(regs->CCER & (TIM_CCER_CC1E << ((channel - 1) * 4))))
+        return;
+
+    /* ICxPSC, capture once every 1, 2, 4 or 8 edges */
+    ccmr = (channel <= 2) ? regs->CCMR1 : regs->CCMR2;
+    psc = (ccmr >> (((channel - 1) & 1) * 8 + 2)) & 0x3;
+    if (++t->edges[channel - 1] < (1 << psc))
+        return;
+    t->edges[channel - 1] = 0;
+
+    timSync(t);
+
+    switch (channel)
+    {
+        case 1: regs->CCR1 = t->cnt; break;
+        case 2: regs->CCR2 = t->cnt; break;
+        case 3: regs->CCR3 = t->cnt; break;
+        case 4: regs->CCR4 = t->cnt; break;
+        default: return;
+    }
+
+    if (t->sr & ccif)
+        t->sr |= ccof;
+    t->sr |= ccif;
+    timPublish(t);
+}
+
+/*
+ * DMA
+ */
+
+struct __simdma {
+    bool enabled;
+    uint32_t cndtr;     /* Reload value */
+    uint32_t cmar;
+};
+typedef struct __simdma simdma_t;
+
+static simdma_t dma[5];
+
+static void dmaObserve(void)
+{
+    uint8_t i;
+
+    if (DMA1->IFCR)
+    {
+        uint32_t clear = DMA1->IFCR;
+
+        /* Clearing GIFx clears all flags of channel x */
+        for (i = 0; i < 5; i++)
+        {
+            if (clear & (DMA_IFCR_CGIF1 << (i*4)))
+                clear |= 0xF << (i*4);
+        }
+        DMA1->ISR &= ~clear;
+        DMA1->IFCR = 0;
+    }
+
+    for (i = 0; i < 5; i++)
+    {
+        const bool en = sim_DMA1_Channel[i].CCR & DMA_CCR_EN;
+
+        if (en && !dma[i].enabled)
+        {
+            dma[i].cndtr = sim_DMA1_Channel[i].CNDTR;
+            dma[i].cmar = sim_DMA1_Channel[i].CMAR;
+        }
+        dma[i].enabled = en;
+    }
+}
+
+/* One peripheral request on channel ch (0..4), returns false if nothing was moved */
+static bool dmaTransfer(uint8_t ch, uint32_t value)
+{
+    DMA_Channel_TypeDef *c = &sim_DMA1_Channel[ch];
+    const uint32_t msize = (c->CCR & DMA_CCR_MSIZE) >> 10;
+    uint32_t idx;
+
+    if (!dma[ch].enabled || c->CNDTR == 0 || (c->CCR & DMA_CCR_DIR))
+        return false;
+
+    idx = (c->CCR & DMA_CCR_MINC) ? dma[ch].cndtr - c->CNDTR : 0;
+    switch (msize)
+    {
+        case 0: ((uint8_t *)(uintptr_t)dma[ch].cmar)[idx] = value; break;
+        case 1: ((uint16_t *)(uintptr_t)dma[ch].cmar)[idx] = value; break;
+        default: ((uint32_t *)(uintptr_t)dma[ch].cmar)[idx] = value; break;
+    }
+
+    c->CNDTR--;
+    if (c->CNDTR == dma[ch].cndtr / 2)
+        DMA1->ISR |= (DMA_ISR_HTIF1 | DMA_ISR_GIF1) << (ch*4);
+    if (c->CNDTR == 0)
+    {
+        DMA1->ISR |= (DMA_ISR_TCIF1 | DMA_ISR_GIF1) << (ch*4);
+        if (c->CCR & DMA_CCR_CIRC)
+            c->CNDTR = dma[ch].cndtr;
+    }
+    return true;
+}
+
+/* Number of requests until the next half or full transfer flag */
+static uint32_t dmaToNextFlag(uint8_t ch)
+{
+    const DMA_Channel_TypeDef *c = &sim_DMA1_Channel[ch];
+
+    if (!dma[ch].enabled || c->CNDTR == 0)
+        return 0;
+    if (c->CNDTR > dma[ch].cndtr / 2)
+        return c->CNDTR - dma[ch].cndtr / 2;
+    return c->CNDTR;
+}
+
+static bool dmaIrqWanted(uint8_t ch)
+{
+    return dma[ch].enabled && (sim_DMA1_Channel[ch].CCR & (DMA_CCR_TCIE | DMA_CCR_HTIE));
+}
+
+/*
+ * ADC, continuous conversion of the CHSELR sequence
+ */
+
+struct __simadc {
+    bool running;
+    simtime_t start;
+    uint64_t done;      /* Conversions completed since start */
+    uint32_t isr;
+    uint8_t seq[19];
+    uint8_t nb_seq;
+};
+typedef struct __simadc simadc_t;
+
+static simadc_t adc;
+
+/* Sampling time + 12.5 cycles, in half ADC cycles */
+static const uint16_t adc_half_cycles[8] = {28, 40, 52, 82, 108, 136, 168, 504};
+
+static simtime_t adcConvNs(void)
+{
+    return (adc_half_cycles[ADC1->SMPR & ADC_SMPR1_SMPR] * 1000000000ULL) / (2*SIM_ADC_CLK);
+}
+
+static void adcPublish(void)
+{
+    ADC1->ISR = adc.isr | SIM_ADC_ISR_MARK;
+}
+
+static void adcSequence(void)
+{
+    uint8_t i;
+
+    adc.nb_seq = 0;
+    for (i = 0; i < 19; i++)
+    {
+        const uint8_t ch = (ADC1->CFGR1 & ADC_CFGR1_SCANDIR) ? 18 - i : i;
+
+        if (ADC1->CHSELR & (1 << ch))
+            adc.seq[adc.nb_seq++] = ch;
+    }
+}
+
+/* True if the analog watchdog looks at conversions of channel ch */
+static bool adcWatched(uint8_t ch)
+{
+    const uint32_t cfgr1 = ADC1->CFGR1;
+
+    if (!(cfgr1 & ADC_CFGR1_AWDEN))
+        return false;
+    return !(cfgr1 & ADC_CFGR1_AWDSGL) || ch == ((cfgr1 & ADC_CFGR1_AWDCH) >> 26);
+}
+
+static void adcConvert(uint64_t k)
+{
+    const uint8_t ch = adc.seq[k % adc.nb_seq];
+    const uint16_t value = simAnalogInput(ch, adc.start + (k + 1) * adcConvNs());
+
+    if (adcWatched(ch))
+    {
+        const uint16_t high = (ADC1->TR >> 16) & ADC_HTR_HT;
+        const uint16_t low = ADC1->TR & ADC_LTR_LT;
+
+        if (value > high || value < low)
+            adc.isr |= ADC_ISR_AWD;
+    }
+
+    ADC1->DR = value;
+    adc.isr |= ADC_ISR_EOC;
+    if ((k % adc.nb_seq) == (uint64_t)adc.nb_seq - 1)
+        adc.isr |= ADC_ISR_EOSEQ;
+
+    if (ADC1->CFGR1 & ADC_CFGR1_DMAEN)
+        dmaTransfer(0, value);
+}
+
+static void adcSync(void)
+{
+    uint64_t target, skip;
+    const uint32_t len = dma[0].cndtr;
+
+    if (!adc.running || adc.nb_seq == 0)
+        return;
+
+    target = (sim_now - adc.start) / adcConvNs();
+
+    /* Only the last buffer worth of samples can still be observed */
+    if (len && target - adc.done > 2 * (uint64_t)len)
+    {
+        skip = ((target - adc.done - len) / len) * len;
+        adc.done += skip;
+        DMA1->ISR |= DMA_ISR_HTIF1 | DMA_ISR_TCIF1 | DMA_ISR_GIF1;
+    }
+
+    while (adc.done < target)
+        adcConvert(adc.done++);
+
+    adcPublish();
+}
+
+static void adcObserve(void)
+{
+    /* ISR is rc_w1, a write drops the reserved marker bit */
+    if (!(ADC1->ISR & SIM_ADC_ISR_MARK))
+        adc.isr &= ~ADC1->ISR;
+
+    if ((ADC1->CR & ADC_CR_ADEN) && (ADC1->CR & ADC_CR_ADSTART) && !adc.running)
+    {
+        adc.running = true;
+        adc.start = sim_now;
+        adc.done = 0;
+        adcSequence();
+    }
+    else if (!(ADC1->CR & ADC_CR_ADSTART) && adc.running)
+    {
+        adc.running = false;
+    }
+
+    adcPublish();
+}
+
+static simtime_t adcNextEvent(void)
+{
+    uint64_t n = UINT64_MAX;
+    uint8_t i;
+
+    if (!adc.running || adc.nb_seq == 0)
+        return SIM_NEVER;
+
+    if ((ADC1->CFGR1 & ADC_CFGR1_DMAEN) && dmaIrqWanted(0) && dmaToNextFlag(0))
+        n = dmaToNextFlag(0);
+
+    /* The watchdog can fire on every watched conversion */
+    if ((ADC1->IER & ADC_IER_AWDIE) && (NVIC->ISER[0] & (1 << ADC1_COMP_IRQn)))
+    {
+        for (i = 1; i <= adc.nb_seq && i < n; i++)
+        {
+            if (adcWatched(adc.seq[(adc.done + i - 1) % adc.nb_seq]))
+            {
+                n = i;
+                break;
+            }
+        }
+    }
+
+    if (n == UINT64_MAX)
+        return SIM_NEVER;
+
+    return adc.start + (adc.done + n) * adcConvNs();
+}
+
+/*
+ * USART1 transmitter, fed by DMA channel 4 one character time apart.
+ * Bytes leave at the end of their character, stop bit included. The
+ * receiver takes the bytes given to simUsartRx() back to back, into RDR
+ * or DMA channel 5, and flags IDLE one character after the last one.
+ * The host end of the line runs at simUsartHostBaud(), when the two
+ * rates are more than 3% apart every byte is garbled both ways.
+ */
+
+#define SIM_USART_CLK 48000000ULL   /* PCLK, halInit() sets RCC as mcuconf.h does */
+#define SIM_USART_RX_SIZE 4096      /* Power of two */
+
+struct __simusart {
+    simtime_t next;     /* End of the character on the line, SIM_NEVER when idle */
+    uint32_t cmar;      /* Transfer being sent */
+    uint32_t cndtr;
+    uint8_t rx[SIM_USART_RX_SIZE];
+    uint32_t rx_head;   /* Free running */
+    uint32_t rx_tail;
+    simtime_t rx_next;  /* End of the character being received */
+    simtime_t rx_idle;  /* When IDLE sets */
+    uint32_t host_baud; /* 0 follows the USART */
+};
+typedef struct __simusart simusart_t;
+
+static simusart_t usart = {.next = SIM_NEVER, .rx_next = SIM_NEVER, .rx_idle = SIM_NEVER};
+
+static bool usartTxRequest(void)
+{
+    const DMA_Channel_TypeDef *c = &sim_DMA1_Channel[3];
+
+    return (USART1->CR1 & USART_CR1_UE) && (USART1->CR1 & USART_CR1_TE)
+        && (USART1->CR3 & USART_CR3_DMAT) && (c->CCR & DMA_CCR_EN)
+        && (c->CCR & DMA_CCR_DIR) && c->CNDTR;
+}
+
+static simtime_t usartCharNs(void)
+{
+    return (10 * USART1->BRR * 1000000000ULL) / SIM_USART_CLK;
+}
+
+static simtime_t usartHostCharNs(void)
+{
+    if (usart.host_baud == 0)
+        return usartCharNs();
+    return 10 * 1000000000ULL / usart.host_baud;
+}
+
+/* What a receiver at the wrong rate makes of a byte */
+static uint8_t usartLine(uint8_t byte)
+{
+    const uint32_t baud = USART1->BRR ? SIM_USART_CLK / USART1->BRR : 0;
+    const uint32_t diff = (baud > usart.host_baud) ? baud - usart.host_baud : usart.host_baud - baud;
+
+    if (usart.host_baud == 0 || diff * 32 <= usart.host_baud)
+        return byte;
+    return byte ^ 0xA5;
+}
+
+void simUsartHostBaud(uint32_t baud)
+{
+    usart.host_baud = baud;
+}
+
+/* Threads enable DMA after the models looked, a new transfer starts here */
+static simtime_t usartNextEvent(void)
+{
+    simtime_t next = usart.rx_next;
+
+    if (usart.next == SIM_NEVER && usartTxRequest())
+    {
+        usart.cmar = sim_DMA1_Channel[3].CMAR;
+        usart.cndtr = sim_DMA1_Channel[3].CNDTR;
+        usart.next = sim_now + usartCharNs();
+        USART1->ISR &= ~USART_ISR_TC;
+    }
+    if (usart.next < next)
+        next = usart.next;
+    if (usart.rx_idle < next)
+        next = usart.rx_idle;
+    return next;
+}
+
+void simUsartRx(const uint8_t *data, uint32_t len)
+{
+    if (usart.rx_head - usart.rx_tail + len > SIM_USART_RX_SIZE)
+        simFatal("USART1 receive queue full\n");
+
+    while (len--)
+        usart.rx[usart.rx_head++ & (SIM_USART_RX_SIZE - 1)] = *data++;
+
+    if (usart.rx_next == SIM_NEVER)
+        usart.rx_next = sim_now + usartHostCharNs();
+    usart.rx_idle = SIM_NEVER;
+}
+
+static void usartReceive(void)
+{
+    const uint8_t byte = usartLine(usart.rx[usart.rx_tail++ & (SIM_USART_RX_SIZE - 1)]);
+
+    if (usart.rx_tail == usart.rx_head)
+    {
+        usart.rx_idle = usart.rx_next + usartCharNs();
+        usart.rx_next = SIM_NEVER;
+    }
+    else
+        usart.rx_next += usartHostCharNs();
+
+    if (!(USART1->CR1 & USART_CR1_UE) || !(USART1->CR1 & USART_CR1_RE))
+        return;
+
+    if (!(USART1->CR3 & USART_CR3_DMAR) || !dmaTransfer(4, byte))
+    {
+        if (USART1->ISR & USART_ISR_RXNE)
+            USART1->ISR |= USART_ISR_ORE;
+        USART1->RDR = byte;
+        USART1->ISR |= USART_ISR_RXNE;
+    }
+}
+
+static void usartProcess(void)
+{
+    DMA_Channel_TypeDef *c = &sim_DMA1_Channel[3];
+
+    while (sim_now >= usart.rx_next)
+        usartReceive();
+
+    if (sim_now >= usart.rx_idle)
+    {
+        if ((USART1->CR1 & USART_CR1_UE) && (USART1->CR1 & USART_CR1_RE))
+            USART1->ISR |= USART_ISR_IDLE;
+        usart.rx_idle = SIM_NEVER;
+    }
+
+    if (sim_now < usart.next)
+        return;
+
+    /* Disabled or restarted since the character started */
+    if (!usartTxRequest() || c->CMAR != usart.cmar)
+    {
+        usart.next = SIM_NEVER;
+        return;
+    }
+
+    if (simOnUsartTx != NULL)
+        simOnUsartTx(usartLine(((uint8_t *)(uintptr_t)usart.cmar)[usart.cndtr - c->CNDTR]));
+
+    if (--c->CNDTR == 0)
+    {
+        DMA1->ISR |= DMA_ISR_TCIF4 | DMA_ISR_GIF4;
+        USART1->ISR |= USART_ISR_TC;
+        usart.next = SIM_NEVER;
+    }
+    else
+        usart.next += usartCharNs();
+}
+
+/*
+ * Interrupts
+ */
+
+static bool timPending(TIM_TypeDef *regs, uint16_t mask)
+{
+    return regs->SR & regs->DIER & mask;
+}
+
+static bool dmaPending(uint8_t ch)
+{
+    return (DMA1->ISR >> (ch*4)) & sim_DMA1_Channel[ch].CCR & (DMA_CCR_TCIE | DMA_CCR_HTIE | DMA_CCR_TEIE);
+}
+
+static bool pendTIM1CC(void) { return timPending(TIM1, TIM_SR_CC1IF | TIM_SR_CC2IF | TIM_SR_CC3IF | TIM_SR_CC4IF); }
+static bool pendTIM1UP(void) { return timPending(TIM1, TIM_SR_UIF | TIM_SR_COMIF | TIM_SR_TIF | TIM_SR_BIF); }
+static bool pendTIM2(void) { return timPending(TIM2, 0x5F); }
+static bool pendTIM3(void) { return timPending(TIM3, 0x5F); }
+static bool pendDMA1Ch1(void) { return dmaPending(0); }
+static bool pendDMA1Ch4_5(void) { return dmaPending(3) || dmaPending(4); }
+static bool pendADC(void) { return adc.isr & ADC1->IER; }
+static bool pendUSART1(void)
+{
+    const uint32_t cr1 = USART1->CR1;
+    const uint32_t isr = USART1->ISR;
+
+    return ((cr1 & USART_CR1_RXNEIE) && (isr & USART_ISR_RXNE))
+        || ((cr1 & USART_CR1_IDLEIE) && (isr & USART_ISR_IDLE))
+        || ((cr1 & USART_CR1_TCIE) && (isr & USART_ISR_TC))
+        || ((cr1 & USART_CR1_TXEIE) && (isr & USART_ISR_TXE));
+}
+
+void __attribute__((weak)) DMA1_Ch1_IRQHandler(void) {}
+void __attribute__((weak)) DMA1_Ch4_5_IRQHandler(void) {}
+void __attribute__((weak)) ADC1_COMP_IRQHandler(void) {}
+void __attribute__((weak)) TIM1_BRK_UP_TRG_COM_IRQHandler(void) {}
+void __attribute__((weak)) TIM1_CC_IRQHandler(void) {}
+void __attribute__((weak)) TIM2_IRQHandler(void) {}
+void __attribute__((weak)) TIM3_IRQHandler(void) {}
+void __attribute__((weak)) USART1_IRQHandler(void) {}
+
+static const struct {
+    IRQn_Type irq;
+    bool (*pending)(void);
+    void (*handler)(void);
+} irq_table[] = {
+    {DMA1_Channel1_IRQn, pendDMA1Ch1, DMA1_Ch1_IRQHandler},
+    {DMA1_Channel4_5_IRQn, pendDMA1Ch4_5, DMA1_Ch4_5_IRQHandler},
+    {ADC1_COMP_IRQn, pendADC, ADC1_COMP_IRQHandler},
+    {TIM1_BRK_UP_TRG_COM_IRQn, pendTIM1UP, TIM1_BRK_UP_TRG_COM_IRQHandler},
+    {TIM1_CC_IRQn, pendTIM1CC, TIM1_CC_IRQHandler},
+    {TIM2_IRQn, pendTIM2, TIM2_IRQHandler},
+    {TIM3_IRQn, pendTIM3, TIM3_IRQHandler},
+    {USART1_IRQn, pendUSART1, USART1_IRQHandler},
+};
+
+static void simPeriphObserve(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+        timObserve(&timers[i]);
+    dmaObserve();
+    adcObserve();
+
+    USART1->ISR &= ~USART1->ICR;
+    USART1->ICR = 0;
+}
+
+void simPeriphIrq(void)
+{
+    uint32_t storm = 0;
+    uint8_t i;
+    bool served;
+
+    simPeriphObserve();
+
+    do
+    {
+        uint8_t best = 0xFF;
+
+        /* Lowest priority value first, then lowest vector, as the NVIC does */
+        for (i = 0; i < sizeof(irq_table)/sizeof(irq_table[0]); i++)
+        {
+            if ((NVIC->ISER[0] & (1 << irq_table[i].irq)) && irq_table[i].pending()
+                    && (best == 0xFF || NVIC_GetPriority(irq_table[i].irq) < NVIC_GetPriority(irq_table[best].irq)))
+                best = i;
+        }
+
+        served = (best != 0xFF);
+        if (served)
+        {
+            if (++storm > SIM_IRQ_STORM)
+                simFatal("IRQ %d is never acknowledged\n", irq_table[best].irq);
+
+            irq_table[best].handler();
+            simPeriphObserve();
+        }
+    } while (served);
+}
+
+void simPeriphSync(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+        timSync(&timers[i]);
+    adcSync();
+}
+
+simtime_t simPeriphNextEvent(void)
+{
+    simtime_t next = adcNextEvent();
+    uint8_t i;
+
+    const simtime_t t = usartNextEvent();
+
+    if (t < next)
+        next = t;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+    {
+        const simtime_t t = timNextEvent(&timers[i]);
+        if (t < next)
+            next = t;
+    }
+    return next;
+}
+
+void simPeriphProcess(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+        timProcess(&timers[i]);
+    usartProcess();
+}
+
+/*
+ * Reset values and StdPeriph functions that cannot work on RAM registers
+ */
+
+void halInit(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < SIM_NB_TIMERS; i++)
+        timers[i].regs->ARR = 0xFFFF;
+
+    USART1->ISR = USART_ISR_TXE | USART_ISR_TC;
+    /* 48 MHz from the PLL on HSI/2, as mcuconf.h sets it up */
+    RCC->CFGR = RCC_CFGR_SWS_PLL | RCC_CFGR_PLLMULL12;
+    I2C1->ISR = I2C_ISR_TXE | I2C_ISR_TC;
+    GPIOC->IDR = 0xFFFF; /* Buttons released */
+    adcPublish();
+}
+
+void NVIC_SystemReset(void)
+{
+    simFatal("system reset requested at %.3f ms", sim_now / 1e6);
+}
+
+/* ISER is write-1-to-set on the core, the RAM copy holds the enable state */
+void NVIC_Init(NVIC_InitTypeDef* NVIC_InitStruct)
+{
+    if (NVIC_InitStruct->NVIC_IRQChannelCmd != DISABLE)
+        NVIC_EnableIRQ(NVIC_InitStruct->NVIC_IRQChannel);
+    else
+        NVIC_DisableIRQ(NVIC_InitStruct->NVIC_IRQChannel);
+}
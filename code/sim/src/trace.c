@@ -0,0 +1,275 @@
+#include <math.h>
+#include <string.h>
+#include "sim.h"
+
+/*
+ * Trace sources for the replay.
+ *
+ * lapgen produces a deterministic synthetic session: a bike accelerating
+ * through the gears, braking and downshifting into a corner, then
+ * spinning the rear wheel on the exit. The engine model closes the loop:
+ * cylinders cut by the ignition outputs give no torque, and the rear
+ * wheel slip follows the remaining torque. Trace files hold one sample per
+ * line, "time_ms rpm front_hz rear_hz strain tc_sw vbat", '#' starts a
+ * comment.
+ */
+
+#define LAPGEN_STEP SIM_MS(1)
+#define LAPGEN_CORNERS 8
+#define LAPGEN_TEETH 16         /* Pulses per wheel revolution */
+#define LAPGEN_GEARS 6
+
+#define STRAIN_BASE 1000.0f     /* ADC counts */
+#define STRAIN_UP 3200.0f       /* Upshift peak */
+#define STRAIN_DOWN 200.0f      /* Downshift peak */
+#define STRAIN_RAMP SIM_MS(8)
+#define STRAIN_HOLD SIM_MS(60)
+#define SHIFT_ENGAGE SIM_MS(35) /* From strain onset to gear change */
+#define SHIFT_RPM_DROP SIM_MS(15)
+
+#define SLIP_TAU SIM_MS(40)     /* Rear wheel slip response to torque */
+#define CYLINDERS 4
+
+#define TC_SWITCH 2048.0f
+#define VBAT 3100.0f
+
+#define LAPGEN_ACCEL 0
+#define LAPGEN_UPSHIFT 1
+#define LAPGEN_BRAKE 2
+#define LAPGEN_DOWNSHIFT 3
+#define LAPGEN_CORNER 4
+
+/* Primary times secondary times final drive */
+static const float gear_ratio[LAPGEN_GEARS] = {11.0f, 8.2f, 6.7f, 5.8f, 5.2f, 4.8f};
+
+/* Vehicle state that is not part of the public generator struct */
+static struct {
+    float wheel;        /* Front wheel revolutions per second */
+    float slip;
+    simtime_t slip_start;
+    simtime_t slip_len;
+    uint8_t top_gear;
+    uint8_t corner_gear;
+    float corner_rpm;
+} veh;
+
+static uint32_t rnd(lapgen_t *g)
+{
+    /* xorshift32 */
+    g->seed ^= g->seed << 13;
+    g->seed ^= g->seed >> 17;
+    g->seed ^= g->seed << 5;
+    return g->seed;
+}
+
+static float rndf(lapgen_t *g, float lo, float hi)
+{
+    return lo + (hi - lo) * (float)(rnd(g) & 0xFFFFFF) / (float)0x1000000;
+}
+
+static void setPhase(lapgen_t *g, uint8_t phase, simtime_t len)
+{
+    g->phase = phase;
+    g->phase_start = g->t;
+    g->phase_len = len;
+}
+
+static void startStraight(lapgen_t *g)
+{
+    veh.top_gear = 2 + rnd(g) % (LAPGEN_GEARS - 2);
+    g->shift_rpm = rndf(g, 11000.0f, 12500.0f);
+    setPhase(g, LAPGEN_ACCEL, SIM_NEVER);
+}
+
+static void startShift(lapgen_t *g, uint8_t phase, uint8_t gear)
+{
+    g->target_gear = gear;
+    g->rpm_from = g->rpm;
+    g->rpm_to = g->rpm * gear_ratio[gear] / gear_ratio[g->gear];
+    setPhase(g, phase, STRAIN_HOLD + 2*STRAIN_RAMP);
+}
+
+void lapgenInit(lapgen_t *g, uint32_t laps, uint32_t seed)
+{
+    memset(g, 0, sizeof(*g));
+    memset(&veh, 0, sizeof(veh));
+
+    g->seed = seed ? seed : 1;
+    g->laps = laps;
+    g->gear = 0;
+    g->rpm = 4000.0f;
+    veh.wheel = g->rpm / 60.0f / gear_ratio[0];
+    startStraight(g);
+}
+
+static float strainPulse(simtime_t dt, float peak)
+{
+    if (dt < STRAIN_RAMP)
+        return STRAIN_BASE + (peak - STRAIN_BASE) * dt / STRAIN_RAMP;
+    if (dt < STRAIN_RAMP + STRAIN_HOLD)
+        return peak;
+    if (dt < 2*STRAIN_RAMP + STRAIN_HOLD)
+        return peak - (peak - STRAIN_BASE) * (dt - STRAIN_RAMP - STRAIN_HOLD) / STRAIN_RAMP;
+    return STRAIN_BASE;
+}
+
+static void stepShift(lapgen_t *g, float *strain)
+{
+    const simtime_t dt = g->t - g->phase_start;
+    const float peak = (g->phase == LAPGEN_UPSHIFT) ? STRAIN_UP : STRAIN_DOWN;
+
+    *strain = strainPulse(dt, peak);
+
+    /* The engine is cut or blipped, wheel speed carries on */
+    if (dt >= SHIFT_ENGAGE + SHIFT_RPM_DROP)
+    {
+        g->gear = g->target_gear;
+        g->rpm = veh.wheel * 60.0f * gear_ratio[g->gear];
+    }
+    else if (dt >= SHIFT_ENGAGE)
+    {
+        g->gear = g->target_gear;
+        g->rpm = g->rpm_from + (g->rpm_to - g->rpm_from) * (dt - SHIFT_ENGAGE) / SHIFT_RPM_DROP;
+    }
+
+    if (dt < g->phase_len)
+        return;
+
+    if (g->phase == LAPGEN_UPSHIFT)
+        setPhase(g, LAPGEN_ACCEL, SIM_NEVER);
+    else
+        setPhase(g, LAPGEN_BRAKE, SIM_NEVER);
+}
+
+/* gears_ratio as the firmware learns it, speed * scale / rpm per gear */
+uint8_t lapgenGearsRatio(uint8_t *ratio, uint32_t scale)
+{
+    uint8_t i;
+
+    for (i = 0; i < LAPGEN_GEARS; i++)
+        ratio[i] = (uint8_t)lroundf(LAPGEN_TEETH * scale / (60.0f * gear_ratio[i]));
+    return LAPGEN_GEARS;
+}
+
+bool lapgenNext(trace_sample_t *s, void *ctx)
+{
+    lapgen_t *g = ctx;
+    const float dt = 1e-9f * LAPGEN_STEP;
+    float strain = STRAIN_BASE;
+    float demand = 0, power;
+    simtime_t st;
+
+    if (g->lap >= g->laps)
+        return false;
+
+    switch (g->phase)
+    {
+        case LAPGEN_ACCEL:
+            veh.wheel += 4.0f * gear_ratio[g->gear] / gear_ratio[0] * dt;
+            g->rpm = veh.wheel * (1.0f + veh.slip) * 60.0f * gear_ratio[g->gear];
+            if (g->rpm >= g->shift_rpm)
+            {
+                if (g->gear < veh.top_gear)
+                {
+                    startShift(g, LAPGEN_UPSHIFT, g->gear + 1);
+                    g->shift_rpm = rndf(g, 11000.0f, 12500.0f);
+                }
+                else
+                {
+                    veh.corner_gear = rnd(g) % 3;
+                    veh.corner_rpm = rndf(g, 5500.0f, 7000.0f);
+                    setPhase(g, LAPGEN_BRAKE, SIM_NEVER);
+                }
+            }
+            break;
+
+        case LAPGEN_UPSHIFT:
+        case LAPGEN_DOWNSHIFT:
+            stepShift(g, &strain);
+            break;
+
+        case LAPGEN_BRAKE:
+            veh.wheel -= 5.0f * dt;
+            g->rpm = veh.wheel * 60.0f * gear_ratio[g->gear];
+            if (g->rpm > veh.corner_rpm)
+                break;
+            if (g->gear > veh.corner_gear)
+            {
+                startShift(g, LAPGEN_DOWNSHIFT, g->gear - 1);
+            }
+            else
+            {
+                setPhase(g, LAPGEN_CORNER, (simtime_t)rndf(g, 1000.0f, 2500.0f) * LAPGEN_STEP);
+            }
+            break;
+
+        case LAPGEN_CORNER:
+            if (g->t - g->phase_start < g->phase_len)
+                break;
+
+            /* Corner exit, the rear wheel spins up */
+            veh.slip_start = g->t;
+            veh.slip_len = (simtime_t)rndf(g, 150.0f, 400.0f) * LAPGEN_STEP;
+            g->slip_peak = rndf(g, 0.12f, 0.30f);
+            startStraight(g);
+
+            if (++g->corner >= LAPGEN_CORNERS)
+            {
+                g->corner = 0;
+                g->lap++;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    /* Slip the rider's throttle asks for, scaled by the cylinders firing */
+    st = g->t - veh.slip_start;
+    if (veh.slip_len && st < veh.slip_len)
+        demand = g->slip_peak * sinf((float)M_PI * st / veh.slip_len);
+    power = 1.0f - (float)__builtin_popcount(simIgnitionOutputs()) / CYLINDERS;
+    veh.slip += (demand * power - veh.slip) * LAPGEN_STEP / SLIP_TAU;
+
+    s->t = g->t;
+    s->rpm = g->rpm;
+    s->front_hz = veh.wheel * LAPGEN_TEETH;
+    s->rear_hz = veh.wheel * (1.0f + veh.slip) * LAPGEN_TEETH;
+    s->strain = strain;
+    s->tc_switch = TC_SWITCH;
+    s->vbat = VBAT;
+    s->gear = (g->phase == LAPGEN_UPSHIFT || g->phase == LAPGEN_DOWNSHIFT) ? 0 : g->gear + 1;
+
+    g->t += LAPGEN_STEP;
+    return true;
+}
+
+bool traceFileNext(trace_sample_t *s, void *ctx)
+{
+    FILE *f = ctx;
+    char line[256];
+    double t;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *c = strchr(line, '#');
+
+        if (c != NULL)
+            *c = '\0';
+
+        if (sscanf(line, "%lf %f %f %f %f %f %f", &t, &s->rpm, &s->front_hz,
+                   &s->rear_hz, &s->strain, &s->tc_switch, &s->vbat) == 7)
+        {
+            s->t = (simtime_t)(t * 1e6);
+            s->gear = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void traceFileWrite(FILE *f, const trace_sample_t *s)
+{
+    fprintf(f, "%.3f %.1f %.2f %.2f %.0f %.0f %.0f\n", s->t / 1e6, s->rpm,
+            s->front_hz, s->rear_hz, s->strain, s->tc_switch, s->vbat);
+}
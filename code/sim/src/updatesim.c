@@ -0,0 +1,521 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "updater.h"
+#include "threads.h"
+
+/*
+ * opentcs-update, the resident update stage of the firmware (updater.c)
+ * against the model of the flash and of the CRC unit (sim_flash.c), the
+ * GUI side played here. It updates at each link rate, injects faults on
+ * the link, cuts the power all along an update and checks the stage and
+ * the settings page are never touched. Last the application's own
+ * settings.c writes the settings page and reads it back, and reads a page
+ * of the previous layout.
+ *
+ * A request costs the adapter latency each way, its bytes and those of
+ * the reply at the link rate, and the time the flash stalls the stage.
+ * The times are modelled, not measured.
+ */
+
+#define UPD_LATENCY SIM_US(1000)    /* Each way, as the GUI loopback */
+#define UPD_TIMEOUT SIM_MS(100)     /* Wait for a reply */
+#define UPD_RETRIES 3
+#define UPD_IMAGE_SIZE 24576
+#define UPD_SETTINGS_ADDR (UPDATE_FLASH_ADDR + UPDATE_FLASH_SIZE - UPDATE_PAGE_SIZE)
+#define UPD_CUT_STEP 7              /* Flash operations between two power cuts tried */
+#define UPD_CUT_EDGE 16             /* Every one of the first and last operations is tried */
+
+/* Faults injected into one block of update() */
+#define UPD_FAULT_NONE 0
+#define UPD_FAULT_DATA 1            /* A bit flipped before framing, the frame is good */
+#define UPD_FAULT_REQUEST 2         /* The request damaged on the line */
+#define UPD_FAULT_REPLY 3           /* The reply damaged on the line */
+#define UPD_FAULT_SKIP 4            /* The block left out */
+
+typedef struct {
+    uint32_t baud;
+    simtime_t t;                    /* Link, stalls and timeouts */
+    simtime_t flash;                /* Stalls */
+    uint8_t seq;
+    uint8_t fault;
+    uint32_t fault_block;
+    uint32_t requests;
+    uint32_t timeouts;
+} host_t;
+
+static updater_t stage;
+static uint8_t stage_code[UPDATE_STAGE_SIZE - UPDATE_PAGE_SIZE];
+static uint8_t settings_page[UPDATE_PAGE_SIZE];
+static uint8_t image_a[UPD_IMAGE_SIZE], image_b[UPD_IMAGE_SIZE];
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    checks++;
+    if (ok)
+        return;
+    failures++;
+    printf("FAIL %s\n", what);
+}
+
+static simtime_t linkTime(uint32_t bytes, uint32_t baud)
+{
+    return (simtime_t)bytes * 10 * 1000000000ULL / baud;
+}
+
+static void fill(uint8_t *buf, uint32_t len, uint32_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        buf[i] = seed >> 24;
+    }
+}
+
+/* Vectors that pass for an application's, noise behind them */
+static void makeImage(uint8_t *image, uint32_t size, uint32_t seed)
+{
+    fill(image, size, seed);
+    updatePut32(image, UPDATE_RAM_ADDR + UPDATE_RAM_SIZE);
+    updatePut32(image + 4, UPDATE_APP_ADDR + 0x101);
+}
+
+/* What the ROM bootloader leaves: the stage, an erased record and the application */
+static void flashRom(const uint8_t *image, uint32_t size)
+{
+    memset((void *)UPDATE_FLASH_ADDR, 0xFF, UPDATE_FLASH_SIZE - UPDATE_PAGE_SIZE);
+    memcpy((void *)UPDATE_FLASH_ADDR, stage_code, sizeof(stage_code));
+    memcpy((void *)UPDATE_APP_ADDR, image, size);
+}
+
+static bool flashHolds(const uint8_t *image, uint32_t size)
+{
+    return memcmp((const void *)UPDATE_APP_ADDR, image, size) == 0;
+}
+
+static void checkUntouched(const char *what)
+{
+    char msg[96];
+
+    snprintf(msg, sizeof(msg), "%s: stage or settings page changed", what);
+    check(memcmp((const void *)UPDATE_FLASH_ADDR, stage_code, sizeof(stage_code)) == 0
+          && memcmp((const void *)UPD_SETTINGS_ADDR, settings_page, sizeof(settings_page)) == 0, msg);
+}
+
+/* What updaterReset() does, true when the application starts */
+static bool boot(void)
+{
+    volatile uint32_t *const handoff = (uint32_t *)UPDATE_HANDOFF_ADDR;
+    uint32_t baud = UPDATER_BAUD;
+
+    if (handoff[0] != UPDATE_MAGIC && updaterAppValid())
+        return true;
+    if (handoff[0] == UPDATE_MAGIC)
+        baud = handoff[1];
+    handoff[0] = 0;
+
+    updaterInit(&stage, baud);
+    return false;
+}
+
+/*
+ * One request to the stage and its reply, whose payload goes to out.
+ * False when no good reply came back, the host waited UPD_TIMEOUT.
+ */
+static bool request(host_t *h, uint8_t cmd, const uint8_t *payload, uint16_t len,
+                    bool damage_request, bool damage_reply, uint8_t *out, uint16_t *out_len)
+{
+    uint8_t buf[FRAME_ENCODED_MAX(UPDATE_PAYLOAD_MAX)], reply[UPDATER_REPLY_MAX];
+    uint8_t packet[FRAME_PACKET(UPDATER_LINK_SIZE)];
+    const uint16_t n = frameEncode(buf, h->seq, cmd, payload, len);
+    const simtime_t busy = sim_flash_busy;
+    frame_decoder_t d;
+    uint16_t i, r, reply_len = 0;
+    const uint8_t seq = h->seq++;
+
+    h->requests++;
+    if (damage_request)
+        buf[n / 2] ^= 0x10;
+
+    h->t += UPD_LATENCY + linkTime(n, h->baud);
+    for (i = 0; i < n; i++)
+    {
+        if ((r = updaterReceive(&stage, buf[i], reply)) != 0)
+            reply_len = r;
+    }
+    h->flash += sim_flash_busy - busy;
+    h->t += sim_flash_busy - busy;
+
+    if (reply_len && damage_reply)
+        reply[reply_len / 2] ^= 0x10;
+
+    frameDecoderInit(&d, packet, sizeof(packet));
+    for (i = 0; i < reply_len; i++)
+    {
+        if (frameDecode(&d, reply[i]) == FRAME_OK && frameSeq(&d) == seq && frameCmd(&d) == cmd)
+        {
+            h->t += linkTime(reply_len, h->baud) + UPD_LATENCY;
+            memcpy(out, framePayload(&d), framePayloadLen(&d));
+            *out_len = framePayloadLen(&d);
+            return true;
+        }
+    }
+
+    h->t += UPD_TIMEOUT;
+    h->timeouts++;
+    return false;
+}
+
+/* Stage request, sent again when its reply does not come, -1 when it never does */
+static int send(host_t *h, uint8_t cmd, const uint8_t *payload, uint16_t len, bool faulty)
+{
+    uint8_t status[UPDATER_LINK_SIZE];
+    uint16_t status_len;
+    uint8_t i;
+
+    for (i = 0; i < UPD_RETRIES; i++)
+    {
+        const bool damage_request = faulty && i == 0 && h->fault == UPD_FAULT_REQUEST;
+        const bool damage_reply = faulty && i == 0 && h->fault == UPD_FAULT_REPLY;
+
+        if (request(h, cmd, payload, len, damage_request, damage_reply, status, &status_len))
+            return status_len == 1 ? status[0] : -1;
+    }
+
+    return -1;
+}
+
+/* The GUI side of an update, returns the first status that is not UPDATE_OK */
+static int update(host_t *h, const uint8_t *image, uint32_t size)
+{
+    uint8_t payload[UPDATE_PAYLOAD_MAX];
+    uint32_t offset, n, block;
+    int res;
+
+    updatePut32(payload, size);
+    updatePut32(payload + 4, updateCrc(UPDATE_CRC_INIT, image, size));
+    if ((res = send(h, CMD_UPDATE_BEGIN, payload, UPDATE_BEGIN_LEN, false)) != UPDATE_OK)
+        return res;
+
+    for (offset = 0, block = 0; offset < size; offset += n, block++)
+    {
+        const bool faulty = h->fault != UPD_FAULT_NONE && block == h->fault_block;
+
+        n = size - offset < UPDATE_BLOCK_SIZE ? size - offset : UPDATE_BLOCK_SIZE;
+        if (faulty && h->fault == UPD_FAULT_SKIP)
+            continue;
+
+        updatePut32(payload, offset);
+        memcpy(payload + UPDATE_BLOCK_HEADER, image + offset, n);
+        if (faulty && h->fault == UPD_FAULT_DATA)
+            payload[UPDATE_BLOCK_HEADER + n / 2] ^= 0x01;
+
+        if ((res = send(h, CMD_UPDATE_BLOCK, payload, UPDATE_BLOCK_HEADER + n, faulty)) != UPDATE_OK)
+            return res;
+    }
+
+    return send(h, CMD_UPDATE_END, NULL, 0, false);
+}
+
+/*
+ * CMD_UPDATE: the application leaves the rate to the stage and resets,
+ * as enterUpdate() in serial_protocol.c, the stage answers the same
+ * link_t to the GUI.
+ */
+static bool enter(host_t *h)
+{
+    volatile uint32_t *const handoff = (uint32_t *)UPDATE_HANDOFF_ADDR;
+    uint8_t link[UPDATER_LINK_SIZE];
+    uint16_t len;
+
+    handoff[0] = UPDATE_MAGIC;
+    handoff[1] = h->baud;
+    if (boot())
+        return false;
+
+    return request(h, CMD_UPDATE, NULL, 0, false, false, link, &len)
+        && len >= 2 && link[0] == 0x08;
+}
+
+static void hostInit(host_t *h, uint32_t baud)
+{
+    memset(h, 0, sizeof(*h));
+    h->baud = baud;
+}
+
+/* CRC-32/MPEG-2 byte by byte, against its check value and the word order of the CRC unit */
+static void crcCheck(void)
+{
+    static const uint8_t text[] = "123456789";
+    uint8_t words[8];
+    uint32_t crc = 0xFFFFFFFF, bytes = 0xFFFFFFFF, i, bit;
+
+    for (i = 0; i < 9; i++)
+    {
+        crc ^= (uint32_t)text[i] << 24;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        if (i == 7)
+            bytes = crc;
+    }
+    check(crc == 0x0376E6E7, "CRC-32/MPEG-2 check value");
+
+    for (i = 0; i < 8; i++)
+        words[i] = text[(i & ~3) + 3 - (i & 3)];
+    CRC_ResetDR();
+    check(updateCrc(UPDATE_CRC_INIT, words, 8) == bytes
+          && CRC_CalcBlockCRC((uint32_t *)words, 2) == bytes, "updateCrc() against the CRC unit");
+}
+
+static void reportUpdate(const char *name, const host_t *h, int res)
+{
+    printf("%-26s %7.3f s  flash %6.3f s  %4u requests  %u timeouts  status %d\n", name,
+           h->t / 1e9, h->flash / 1e9, h->requests, h->timeouts, res);
+}
+
+/* From an application running, at each rate, the images in turn */
+static void testRates(void)
+{
+    static const uint32_t rates[] = {115200, 460800, 1000000, 2000000, 3000000};
+    char name[64];
+    uint8_t i;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+        const uint8_t *image = i & 1 ? image_a : image_b;
+        host_t h;
+        int res;
+
+        hostInit(&h, rates[i]);
+        simFlashPowerUp(i + 1);
+        check(boot(), "the application starts before the update");
+        check(enter(&h), "the stage answers CMD_UPDATE");
+
+        res = update(&h, image, UPD_IMAGE_SIZE);
+        snprintf(name, sizeof(name), "update at %u", rates[i]);
+        reportUpdate(name, &h, res);
+        check(res == UPDATE_OK && stage.committed, name);
+
+        simFlashPowerUp(i + 100);
+        check(boot() && flashHolds(image, UPD_IMAGE_SIZE), "the new image starts");
+        checkUntouched(name);
+    }
+}
+
+static void testFault(const char *name, uint8_t fault, uint32_t block, int expect)
+{
+    host_t h;
+    int res;
+
+    hostInit(&h, 1000000);
+    h.fault = fault;
+    h.fault_block = block;
+    simFlashPowerUp(fault + 1000);
+    check(boot() && enter(&h), name);
+
+    res = update(&h, image_a, UPD_IMAGE_SIZE);
+    reportUpdate(name, &h, res);
+    check(res == expect, name);
+
+    if (res == UPDATE_OK)
+    {
+        check(flashHolds(image_a, UPD_IMAGE_SIZE), name);
+        checkUntouched(name);
+        return;
+    }
+
+    /* Nothing starts, the stage waits at its own rate after a power cycle */
+    simFlashPowerUp(fault + 2000);
+    check(!boot(), "a failed update does not start");
+    check(stage.baud == UPDATER_BAUD, "the stage answers at its own rate");
+
+    hostInit(&h, UPDATER_BAUD);
+    check(update(&h, image_a, UPD_IMAGE_SIZE) == UPDATE_OK && boot(), "update again after a failed one");
+    checkUntouched(name);
+}
+
+/* Requests in the wrong state or with bad sizes are refused */
+static void testProtocol(void)
+{
+    uint8_t payload[UPDATE_PAYLOAD_MAX];
+    host_t h;
+
+    hostInit(&h, 1000000);
+    simFlashPowerUp(3000);
+    check(boot() && enter(&h), "protocol: enter the stage");
+
+    memset(payload, 0, sizeof(payload));
+    check(send(&h, CMD_UPDATE_BLOCK, payload, UPDATE_BLOCK_HEADER + 4, false) == UPDATE_ERROR_STATE,
+          "protocol: block before begin");
+    check(send(&h, CMD_UPDATE_END, NULL, 0, false) == UPDATE_ERROR_STATE, "protocol: end before begin");
+
+    updatePut32(payload, UPDATE_APP_SIZE + 4);
+    check(send(&h, CMD_UPDATE_BEGIN, payload, UPDATE_BEGIN_LEN, false) == UPDATE_ERROR_SIZE,
+          "protocol: image too large");
+    updatePut32(payload, 6);
+    check(send(&h, CMD_UPDATE_BEGIN, payload, UPDATE_BEGIN_LEN, false) == UPDATE_ERROR_SIZE,
+          "protocol: image not in words");
+    check(flashHolds(image_a, UPD_IMAGE_SIZE) && updaterAppValid(), "protocol: refused begin keeps the image");
+
+    updatePut32(payload, UPD_IMAGE_SIZE);
+    check(send(&h, CMD_UPDATE_BEGIN, payload, UPDATE_BEGIN_LEN, false) == UPDATE_OK
+          && send(&h, CMD_UPDATE_END, NULL, 0, false) == UPDATE_ERROR_STATE, "protocol: end before the blocks");
+    check(!updaterAppValid(), "protocol: begin drops the image");
+
+    check(update(&h, image_b, UPD_IMAGE_SIZE) == UPDATE_OK, "protocol: update after the errors");
+    checkUntouched("protocol");
+    printf("%-26s %u requests refused as expected\n", "protocol", 5);
+}
+
+/*
+ * Power cut in the middle of every UPD_CUT_STEP-th flash operation of an
+ * update, and of each of the first and last ones, from an image the ROM bootloader
+ * flashed and from one the stage committed in turn. After it, either
+ * the old or the new image is whole and starts, or nothing starts and
+ * an update from the stage at its own rate succeeds.
+ */
+static void testPowerCuts(void)
+{
+    static uint8_t before[2][UPDATE_FLASH_SIZE];
+    static jmp_buf jump;
+    volatile uint32_t cuts = 0, kept = 0, started = 0, recovered = 0, trial = 0;
+    uint32_t ops0, ops, k;
+    host_t h;
+
+    hostInit(&h, 3000000);
+    flashRom(image_a, UPD_IMAGE_SIZE);
+    memcpy(before[0], (const void *)UPDATE_FLASH_ADDR, UPDATE_FLASH_SIZE);
+    simFlashPowerUp(4000);
+    check(boot() && enter(&h) && update(&h, image_a, UPD_IMAGE_SIZE) == UPDATE_OK, "power cut: committed image");
+    memcpy(before[1], (const void *)UPDATE_FLASH_ADDR, UPDATE_FLASH_SIZE);
+
+    ops0 = sim_flash_erases + sim_flash_programs;
+    simFlashPowerUp(4001);
+    check(boot() && enter(&h) && update(&h, image_b, UPD_IMAGE_SIZE) == UPDATE_OK, "power cut: reference update");
+    ops = sim_flash_erases + sim_flash_programs - ops0;
+
+    for (k = 1; k <= ops; k += (k < UPD_CUT_EDGE || k + UPD_CUT_EDGE >= ops) ? 1 : UPD_CUT_STEP)
+    {
+        char name[64];
+
+        snprintf(name, sizeof(name), "power cut at operation %u", k);
+        memcpy((void *)UPDATE_FLASH_ADDR, before[trial++ & 1], UPDATE_FLASH_SIZE);
+        simFlashPowerUp(k);
+        hostInit(&h, 3000000);
+        if (!boot() || !enter(&h))
+        {
+            check(false, name);
+            continue;
+        }
+
+        if (setjmp(jump) == 0)
+        {
+            simFlashCut(k, &jump);
+            update(&h, image_b, UPD_IMAGE_SIZE);
+            simFlashCut(0, NULL);
+            check(false, "power cut: the cut did not happen");
+            continue;
+        }
+
+        cuts++;
+        simFlashPowerUp(k + 5000);
+        if (boot())
+        {
+            if (flashHolds(image_a, UPD_IMAGE_SIZE))
+                kept++;
+            else
+                started++;
+            check(flashHolds(image_a, UPD_IMAGE_SIZE) || flashHolds(image_b, UPD_IMAGE_SIZE), name);
+        }
+        else
+        {
+            hostInit(&h, UPDATER_BAUD);
+            check(update(&h, image_b, UPD_IMAGE_SIZE) == UPDATE_OK && boot()
+                  && flashHolds(image_b, UPD_IMAGE_SIZE), name);
+            recovered++;
+        }
+        checkUntouched(name);
+    }
+
+    printf("%-26s %u of %u operations: the old image started %u times, the new one %u,"
+           " the stage recovered %u\n", "power cut", cuts, ops, kept, started, recovered);
+}
+
+/* writeSettings() programs the settings page and nothing else */
+static void testSettings(void)
+{
+    static uint8_t before[UPD_SETTINGS_ADDR - UPDATE_FLASH_ADDR];
+    settings_t st, back;
+    uint32_t i;
+
+    /* Noise in the page, the defaults */
+    memcpy(before, (const void *)UPDATE_FLASH_ADDR, sizeof(before));
+    st = readSettings();
+    st.data.min_rpm = 5500;
+    st.data.gears_ratio.bytes[0] = 38;
+
+    check(writeSettings(&st) == 0, "writeSettings() succeeds");
+    check(memcmp((const void *)UPD_SETTINGS_ADDR, &st, sizeof(st)) == 0,
+          "the settings are at the start of the settings page");
+    check(memcmp((const void *)UPDATE_FLASH_ADDR, before, sizeof(before)) == 0,
+          "writeSettings() leaves the rest of the flash");
+
+    back = readSettings();
+    check(memcmp(&back, &st, sizeof(st)) == 0, "readSettings() returns what was written");
+
+    /* A version 1 page, the CRC of the data alone and gears_ratio * 100 */
+    CRC_ResetDR();
+    st.CRCValue = CRC_CalcBlockCRC((uint32_t *)&st.data, sizeof(st.data) / 4);
+    FLASH_Unlock();
+    FLASH_ErasePage(UPD_SETTINGS_ADDR);
+    for (i = 0; i < sizeof(st) / 4; i++)
+        FLASH_ProgramWord(UPD_SETTINGS_ADDR + 4 * i, ((const uint32_t *)&st)[i]);
+    FLASH_Lock();
+
+    back = readSettings();
+    check(back.data.min_rpm == 5500 && back.data.gears_ratio.bytes[0] == 0,
+          "a version 1 page keeps its settings and clears gears_ratio");
+
+    printf("%-26s %u byte page at 0x%08X\n", "settings", (unsigned)sizeof(st), UPD_SETTINGS_ADDR);
+}
+
+int main(void)
+{
+    if (!simFlashInit())
+    {
+        fprintf(stderr, "Cannot map the flash at 0x%08X and SRAM at 0x%08X\n", UPDATE_FLASH_ADDR, UPDATE_RAM_ADDR);
+        return 1;
+    }
+
+    fill(stage_code, sizeof(stage_code), 0x5354);
+    fill(settings_page, sizeof(settings_page), 0x5345);
+    memcpy((void *)UPD_SETTINGS_ADDR, settings_page, sizeof(settings_page));
+    makeImage(image_a, UPD_IMAGE_SIZE, 1);
+    makeImage(image_b, UPD_IMAGE_SIZE, 2);
+
+    crcCheck();
+
+    /* As the ROM bootloader leaves it, no record, the vectors are enough */
+    flashRom(image_a, UPD_IMAGE_SIZE);
+    simFlashPowerUp(0);
+    check(boot(), "an image from the ROM bootloader starts");
+
+    printf("%u byte image, %u byte blocks\n\n", UPD_IMAGE_SIZE, UPDATE_BLOCK_SIZE);
+    testRates();
+    testFault("bad block", UPD_FAULT_DATA, 7, UPDATE_ERROR_CRC);
+    testFault("block left out", UPD_FAULT_SKIP, 3, UPDATE_ERROR_OFFSET);
+    testFault("request lost", UPD_FAULT_REQUEST, 20, UPDATE_OK);
+    testFault("reply lost", UPD_FAULT_REPLY, 20, UPDATE_OK);
+    testProtocol();
+    testPowerCuts();
+    testSettings();
+
+    printf("\n%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+/*
+ * Continuous input capture.
+ *
+ * 16 bit capture values are extended to 32 bit timestamps with the
+ * overflow count of their timer, every edge to edge period is kept in a
+ * small ring so that consumers can average over a few teeth. Every
+ * consumer takes the last period only, the ring is kept short for RAM.
+ */
+
+#define CAPTURE_RING_SIZE 4 /* Power of two */
+
+struct __capture {
+    uint32_t periods[CAPTURE_RING_SIZE]; /* Timer ticks between edges */
+    uint32_t last;      /* Timestamp of the last edge */
+    uint8_t head;       /* Next slot to write */
+    uint8_t count;      /* Valid periods, up to CAPTURE_RING_SIZE */
+    uint8_t started;    /* last is valid */
+};
+typedef struct __capture capture_t;
+
+void captureInit(capture_t* c);
+uint32_t captureTimestamp(uint16_t overflows, uint16_t ccr, uint8_t overflow_pending);
+void captureEdge(capture_t* c, uint32_t timestamp);
+uint8_t captureTimeout(capture_t* c, uint32_t now, uint32_t timeout);
+uint32_t capturePeriod(const capture_t* c);
+uint32_t captureFrequency(const capture_t* c, uint32_t clk, uint8_t n);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed point decimator for the ADC channels.
+ *
+ * Stage 1 sums FILTER_DECIMATION consecutive samples of a channel (one
+ * stage CIC), stage 2 is a moving average over the last FILTER_TAPS
+ * sums. The output is in ADC counts with FILTER_FRAC_BITS fractional
+ * bits (Q12.4), it needs no division.
+ */
+
+#define FILTER_DECIMATION 4
+#define FILTER_TAPS 8
+#define FILTER_GAIN_BITS 5 /* log2(FILTER_DECIMATION*FILTER_TAPS) */
+#define FILTER_FRAC_BITS 4
+
+struct __filter {
+    uint16_t taps[FILTER_TAPS]; /* Stage 1 sums, 4*4095 fits */
+    uint32_t total;
+    uint16_t last;              /* Latest stage 1 sum, lowest latency */
+    uint8_t pos;
+};
+typedef struct __filter filter_t;
+
+void filterInit(filter_t* f);
+uint16_t filterDecimate(filter_t* f, const uint16_t* samples, uint8_t stride);
+
+#endif
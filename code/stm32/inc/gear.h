@@ -0,0 +1,94 @@
+#ifndef _GEAR_H_
+#define _GEAR_H_
+
+#include <stdint.h>
+#include "messages.pb.h"
+
+/*
+ * Gear estimator.
+ *
+ * gears_ratio holds the wheel to engine ratio of each gear, first gear
+ * first, as speed * GEAR_RATIO_SCALE / rpm. When the settings change the
+ * table is turned into one Q12 window per gear, 3/8 of the gap to each
+ * neighbour wide. The gap left in between is neither gear: clutch in,
+ * neutral or a shift in progress. A sample costs one multiplication and
+ * a binary search over the windows, the reciprocal of the RPM is updated
+ * once per revolution. A new gear, or neutral, must be seen for a few
+ * samples in a row and the engaged gear's window is widened by
+ * hysteresis, so noise at a boundary does not flip the gear.
+ */
+
+#define GEAR_MAX 6
+#define GEAR_RATIO_SCALE 1000   /* gears_ratio = speed * GEAR_RATIO_SCALE / rpm */
+#define GEAR_Q 12               /* Keeps speed * reciprocal in 32 bits */
+#define GEAR_MIN_RPM 500        /* Below this the engine is not turning */
+#define GEAR_CONFIRM 4          /* Samples to change gear */
+#define GEAR_NEUTRAL_CONFIRM 32 /* Samples to declare neutral, outlasts a shift */
+#define GEAR_NEUTRAL 0xFF
+
+struct __gear_table {
+    uint32_t lo[GEAR_MAX];      /* Q12 ratio window of each gear */
+    uint32_t hi[GEAR_MAX];
+    uint32_t hyst[GEAR_MAX];    /* Q12, added around the engaged gear */
+    uint8_t count;              /* Gears learned, 0 when the table is empty */
+};
+typedef struct __gear_table gear_table_t;
+
+struct __gear_est {
+    uint8_t gear;               /* Last engaged gear, 0 based */
+    uint8_t neutral;            /* No gear is engaged */
+    uint8_t candidate;          /* Gear or GEAR_NEUTRAL seen lately */
+    uint8_t count;              /* Samples in a row of candidate */
+};
+typedef struct __gear_est gear_est_t;
+
+/*
+ * Gear ratio learner.
+ *
+ * Every steady ratio sample goes into a histogram with one bin per
+ * gears_ratio unit, up to 127: road gearing sits between 20 and 70, and
+ * gearBuildTable() takes nothing above. A window is 3/8 of a gap of 5 to
+ * 10 units, so coarser bins would blur neighbouring gears. The counts
+ * are 16 bits: at a few hundred teeth per second a bin saturates after
+ * minutes in one gear, where 8 bits would halve the others every second
+ * or two and lose a gear not ridden for a minute. That is 256 B, the
+ * largest buffer after the display. A sample is steady when the engine pulls above
+ * GEAR_LEARN_MIN_RPM and the ratio moved less than 1/64 since the
+ * previous one, a slipping clutch or a shift sweeps the ratio and is
+ * left out. When a bin saturates the sensors thread halves them all, so
+ * the oldest samples fade over hours of riding. Gears are the
+ * highest peaks of the smoothed histogram, first gear lowest, each with
+ * its centroid and a confidence: the share of its samples that sit on
+ * the peak, scaled down until the cluster holds GEAR_LEARN_FULL_MASS
+ * samples.
+ */
+
+#define GEAR_LEARN_BINS 128
+#define GEAR_LEARN_MIN_RPM 2500
+#define GEAR_LEARN_STEADY_SHIFT 6   /* Max ratio change between samples, 1/64 */
+#define GEAR_LEARN_MIN_PEAK 16      /* Smoothed counts, 4 samples on a bin */
+#define GEAR_LEARN_MIN_SHARE 64     /* Smallest peak, 1/64 of the highest */
+#define GEAR_LEARN_MIN_GAP 3        /* Bins between two gears */
+#define GEAR_LEARN_SPAN 2           /* Bins each side of a peak in its cluster */
+#define GEAR_LEARN_FULL_MASS 64
+#define GEAR_LEARN_HALVE_BINS 16    /* Bins halved per lock */
+
+struct __gear_learn {
+    uint16_t hist[GEAR_LEARN_BINS];
+    uint32_t prev;              /* Q12 ratio of the previous sample */
+    uint32_t samples;           /* Steady samples so far */
+    uint8_t saturated;          /* A bin is full, samples wait for gearLearnHalve() */
+};
+typedef struct __gear_learn gear_learn_t;
+
+void gearBuildTable(gear_table_t* table, const Settings_data* data);
+uint32_t gearRpmRecip(uint32_t rpm);
+uint8_t gearClassify(const gear_table_t* table, uint32_t ratio);
+void gearInit(gear_est_t* g);
+void gearUpdate(gear_est_t* g, const gear_table_t* table, uint32_t speed, uint32_t rpm_recip);
+void gearLearnInit(gear_learn_t* l);
+void gearLearnSample(gear_learn_t* l, uint32_t speed, uint32_t rpm, uint32_t rpm_recip);
+void gearLearnHalve(gear_learn_t* l, uint16_t first, uint16_t count);
+uint8_t gearLearnFind(const gear_learn_t* l, uint8_t ratio[GEAR_MAX], uint8_t confidence[GEAR_MAX]);
+
+#endif
@@ -40,7 +40,7 @@
  * @note    This number is not inclusive of the idle thread which is
  *          Implicitly handled.
  */
-#define NIL_CFG_NUM_THREADS                 6
+#define NIL_CFG_NUM_THREADS                 4
 
 /** @} */
 
@@ -0,0 +1,89 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdint.h>
+
+/*
+ * Flight recorder.
+ *
+ * The inputs and the cut state are sampled every RECORDER_DECIMATION
+ * halves of adc_samples and packed into a ring of fixed size blocks. A
+ * block starts with a key sample: its time, in halves of adc_samples,
+ * then every field as a varint. Each following sample is one byte with a
+ * bit per field that changed, then the zigzag varint of each change, so
+ * a steady sample costs one byte. Blocks decode on their own and the
+ * oldest one is dropped whole when the ring is full.
+ *
+ * A trigger keeps recording for RECORDER_POST samples, or until only
+ * RECORDER_PRE_BLOCKS blocks before the trigger are left, then freezes
+ * the ring. The window stays until it is cleared, triggers in between
+ * are ignored.
+ *
+ * At about 4 bytes per sample a block holds 27ms: the laps of the
+ * simulator leave 68ms before the trigger and 38ms after it, the blocks
+ * run out before RECORDER_POST.
+ */
+
+#define RECORDER_BLOCK_SIZE 48      /* One serial message per block */
+#define RECORDER_BLOCKS 4           /* 192 B, recorder_t is 236 B */
+#define RECORDER_PRE_BLOCKS 2       /* Kept before the trigger */
+#define RECORDER_DECIMATION 8       /* Power of two, 2.3ms between samples */
+#define RECORDER_POST 43            /* Samples after the trigger, 100ms at most */
+
+/* Sample fields */
+#define RECORDER_RPM 0              /* RPM timer ticks per revolution */
+#define RECORDER_FRONT 1            /* Speed timer ticks per capture */
+#define RECORDER_REAR 2
+#define RECORDER_STRAIN 3           /* ADC counts, as seen by the shifter */
+#define RECORDER_SLIP 4             /* status.slipping_pct */
+#define RECORDER_FLAGS 5
+#define RECORDER_FIELDS 6
+
+/* RECORDER_FLAGS bits */
+#define RECORDER_FLAG_SHIFTING 0x01
+#define RECORDER_FLAG_SLIPPING 0x02
+#define RECORDER_FLAG_CUT 0x04
+#define RECORDER_FLAG_CUT_TC 0x08  /* The cut is a progressive TC pulse */
+#define RECORDER_FLAG_NEUTRAL 0x10
+#define RECORDER_FLAG_GEAR_SHIFT 5 /* Engaged gear above, 0 based */
+
+#define RECORDER_TRIGGER_NONE 0
+#define RECORDER_TRIGGER_SHIFT 1
+#define RECORDER_TRIGGER_TC 2
+
+#define RECORDER_RUNNING 0
+#define RECORDER_POST_TRIGGER 1
+#define RECORDER_FROZEN 2
+
+struct __recorder {
+    uint8_t data[RECORDER_BLOCKS][RECORDER_BLOCK_SIZE];
+    uint8_t used[RECORDER_BLOCKS];  /* Bytes written in each block */
+    uint32_t prev[RECORDER_FIELDS]; /* Last sample written */
+    uint32_t time;                  /* Time of the last sample */
+    uint32_t trigger;               /* Time of the last sample before the trigger */
+    uint16_t post;                  /* Samples left after the trigger */
+    uint8_t head;                   /* Block being written */
+    uint8_t count;                  /* Blocks holding data */
+    uint8_t post_blocks;            /* Blocks started after the trigger */
+    uint8_t reason;                 /* RECORDER_TRIGGER_x */
+    uint8_t state;
+};
+typedef struct __recorder recorder_t;
+
+struct __recorder_reader {
+    const uint8_t* data;
+    uint8_t len;
+    uint8_t pos;
+    uint32_t time;                  /* Last sample read */
+    uint32_t value[RECORDER_FIELDS];
+};
+typedef struct __recorder_reader recorder_reader_t;
+
+void recorderInit(recorder_t* r);
+void recorderSample(recorder_t* r, uint32_t time, const uint32_t value[RECORDER_FIELDS]);
+void recorderTrigger(recorder_t* r, uint8_t reason);
+const uint8_t* recorderBlock(const recorder_t* r, uint8_t i, uint8_t* len);
+void recorderReadInit(recorder_reader_t* rd, const uint8_t* data, uint8_t len);
+uint8_t recorderRead(recorder_reader_t* rd);
+
+#endif
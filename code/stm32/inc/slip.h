@@ -0,0 +1,36 @@
+#ifndef _SLIP_H_
+#define _SLIP_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed point wheel slip estimator.
+ *
+ * Each wheel has an alpha-beta filter that tracks its tooth frequency
+ * and acceleration from the capture periods, both in Q16. Slip is the
+ * filtered rear speed relative to the filtered front one, Q16 as well.
+ * Updates are straight line code, a few multiplications and 32 bit
+ * divisions, so they can run from the capture interrupt.
+ */
+
+#define SLIP_Q 16
+#define SLIP_ONE ((int32_t)1 << SLIP_Q)
+
+#define WHEEL_ALPHA_SHIFT 1     /* alpha = 1/2 */
+#define WHEEL_BETA_SHIFT 3      /* beta = 1/8 */
+#define WHEEL_ACCEL_MAX (30000 * SLIP_ONE) /* Hz/s, keeps the Q16 state in range */
+#define WHEEL_PERIOD_MAX 0xFFFF /* Ticks, longer periods are clamped */
+#define SLIP_MIN_SPEED SLIP_ONE /* Hz, front wheel speed to compute a ratio */
+
+struct __wheel_filter {
+    int32_t speed;      /* Q16 teeth per second */
+    int32_t accel;      /* Q16 teeth per second per second */
+    uint8_t started;
+};
+typedef struct __wheel_filter wheel_filter_t;
+
+void wheelFilterInit(wheel_filter_t* w);
+void wheelFilterUpdate(wheel_filter_t* w, uint32_t period, uint32_t clk, uint8_t edges);
+int32_t slipRatio(const wheel_filter_t* front, const wheel_filter_t* rear);
+
+#endif
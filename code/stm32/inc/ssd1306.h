@@ -42,9 +42,6 @@
 #include "threads.h"
 
 #define SSD1306_SPI SPI1
-#define SSD1306_TIMER TIM17 /* Timer used for auto refresh interrupt */
-#define SSD1306_TIMER_IRQn TIM17_IRQn
-#define SSD1306_TIMER_IRQHandler TIM17_IRQHandler
 
 // Pin Definitions
 #define SSD1306_DC_PORT                    GPIOB     // Data/Command
@@ -61,6 +58,10 @@
 #define SSD1306_LCDWIDTH                  128
 #define SSD1306_LCDHEIGHT                 64
 
+// Text screen, 5x8 characters and a blank column
+#define SSD1306_COLS                      21
+#define SSD1306_ROWS                      8
+
 // Commands
 #define SSD1306_SETCONTRAST               0x81
 #define SSD1306_DISPLAYALLON_RESUME       0xA4
@@ -78,6 +79,7 @@
 #define SSD1306_SETLOWCOLUMN              0x00
 #define SSD1306_SETHIGHCOLUMN             0x10
 #define SSD1306_SETSTARTLINE              0x40
+#define SSD1306_SETPAGESTART              0xB0
 #define SSD1306_MEMORYMODE                0x20
 #define SSD1306_COMSCANINC                0xC0
 #define SSD1306_COMSCANDEC                0xC8
@@ -90,16 +92,8 @@
 void    ssd1306Init ( uint8_t vccstate );
 void    ssd1306TurnOn(void);
 void    ssd1306TurnOff(void);
-void    ssd1306DrawPixel ( uint8_t x, uint8_t y );
-void    ssd1306ClearPixel ( uint8_t x, uint8_t y );
-uint8_t ssd1306GetPixel ( uint8_t x, uint8_t y );
 void    ssd1306ClearScreen ( void );
-void    ssd1306Refresh ( void );
-void    ssd1306DrawChar(uint8_t x, uint8_t y, uint8_t c, struct FONT_DEF font);
-void    ssd1306DrawString( uint8_t x, uint8_t y, const char* text, struct FONT_DEF font );
-void    ssd1306ShiftFrameBuffer( uint8_t height );
-void    ssd1306DrawLine(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1);
-void    ssd1306DrawCircle(uint8_t x, uint8_t y, uint8_t radius);
-void    ssd1306FillArea(uint8_t x, uint8_t y, uint8_t cx, uint8_t cy);
+void    ssd1306DrawChar(uint8_t col, uint8_t row, char c);
+void    ssd1306DrawString(uint8_t col, uint8_t row, const char* text);
 
 #endif
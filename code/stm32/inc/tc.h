@@ -0,0 +1,78 @@
+#ifndef _TC_H_
+#define _TC_H_
+
+#include <stdint.h>
+#include "messages.pb.h"
+
+/*
+ * Traction control table.
+ *
+ * One row per gear with the slip threshold and the cut time to apply
+ * at points TC_RPM_SHIFT apart. tc_gear_trim is the TC strength of
+ * each gear in percent: above 100 the threshold drops and the cut gets
+ * longer. Over RPM the cut grows linearly from TC_CUT_LOW_PCT at
+ * min_rpm to the full time at TC_RPM_FULL. The table is built from the
+ * settings outside of interrupts, a lookup interpolates between the
+ * two points around the RPM with one multiply.
+ */
+
+#define TC_GEARS 6
+#define TC_RPM_SHIFT 10         /* 1024 RPM between points */
+#define TC_RPM_POINTS 17        /* 0 to 16384 RPM, the last one holds above */
+#define TC_RPM_FULL 12000
+#define TC_CUT_LOW_PCT 50
+#define TC_CUT_MAX 130          /* ms, IGN_TIMER wraps at 131ms */
+
+struct __tc_entry {
+    uint8_t threshold;          /* Slip in percent */
+    uint8_t cut_time;           /* ms */
+};
+typedef struct __tc_entry tc_entry_t;
+
+struct __tc_row {
+    uint8_t threshold;          /* Slip in percent, the same at any RPM */
+    uint8_t cut_time[TC_RPM_POINTS]; /* ms */
+};
+typedef struct __tc_row tc_row_t;
+
+struct __tc_table {
+    tc_row_t gear[TC_GEARS];
+};
+typedef struct __tc_table tc_table_t;
+
+/*
+ * Progressive cut.
+ *
+ * A PI controller turns the slip error into a cut depth, the share of
+ * sparks to drop out of TC_DEPTH_FULL. The pattern spreads that depth
+ * over the cylinders one engine revolution at a time: each cylinder
+ * accumulates the depth and is cut when it overflows, with staggered
+ * starting points so that 1 in 4 rotates over the four cylinders.
+ */
+
+#define TC_CYLINDERS 4
+#define TC_DEPTH_FULL 256
+#define TC_PI_KP 32             /* Depth per percent of slip error */
+#define TC_PI_KI 256            /* Depth per percent per second */
+#define TC_PI_DT_MAX 65535      /* us, longer steps are clamped */
+#define TC_PI_ERROR_MAX 100     /* Percent */
+
+struct __tc_pi {
+    int32_t integral;           /* Depth, Q8 */
+};
+typedef struct __tc_pi tc_pi_t;
+
+struct __tc_pattern {
+    uint16_t acc[TC_CYLINDERS];
+};
+typedef struct __tc_pattern tc_pattern_t;
+
+void tcBuildRow(tc_row_t* row, const Settings_data* data, uint8_t cut_time, uint8_t gear);
+void tcBuildTable(tc_table_t* table, const Settings_data* data, uint8_t cut_time);
+tc_entry_t tcLookup(const tc_table_t* table, uint8_t gear, uint32_t rpm);
+void tcPiInit(tc_pi_t* pi);
+uint16_t tcPiUpdate(tc_pi_t* pi, int32_t error, uint32_t dt);
+void tcPatternInit(tc_pattern_t* p);
+uint8_t tcPatternNext(tc_pattern_t* p, uint16_t depth);
+
+#endif
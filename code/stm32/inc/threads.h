@@ -5,6 +5,12 @@
 #include "nil.h"
 #include "stm32f0xx.h"
 #include "messages.pb.h"
+#include "filter.h"
+#include "capture.h"
+#include "slip.h"
+#include "tc.h"
+#include "gear.h"
+#include "recorder.h"
 
 #define DBG_USART USART1
 
@@ -63,15 +69,15 @@ extern char serial_dbg;
 
 /* Communications */
 
-#define USART_TXBUF_SIZE 64
-#define USART_RXBUF_SIZE 64
+#define USART_TXBUF_SIZE 64 /* Power of two */
+#define USART_RXBUF_SIZE 192 /* Two of the largest frames, any size */
 
 extern char usart_txbuf[USART_TXBUF_SIZE];
 extern char usart_rxbuf[USART_RXBUF_SIZE];
+extern uint32_t usart_tx_dropped;
+extern uint32_t usart_baud;
 
 void spiInit(SPI_TypeDef* SPIx);
-uint8_t spiSendS(SPI_TypeDef* SPIx, uint8_t* buffer, uint16_t len);
-uint8_t spiSendI(SPI_TypeDef* SPIx, uint8_t* buffer, uint16_t len);
 
 void i2cInit(I2C_TypeDef* I2Cx);
 uint8_t i2cSendS(I2C_TypeDef* I2Cx, const uint8_t addr, uint8_t* buffer, uint8_t len);
@@ -79,9 +85,13 @@ uint8_t i2cReceiveS(I2C_TypeDef* I2Cx, const uint8_t addr, uint8_t* buffer, uint
 
 void usartInit(USART_TypeDef* USARTx);
 uint8_t usartSendI(USART_TypeDef* USARTx, const char *buffer, uint16_t len);
+uint8_t usartSend(USART_TypeDef* USARTx, const char *buffer, uint16_t len);
 uint8_t usartSendS(USART_TypeDef* USARTx, const char *buffer, uint16_t len);
-inline void usartPrintString(USART_TypeDef* USARTx, const char *str);
-inline void serDbg(const char *str);
+uint16_t usartReceiveS(systime_t timeout);
+uint8_t usartSetBaudS(USART_TypeDef* USARTx, uint32_t baud);
+uint8_t usartFlushS(USART_TypeDef* USARTx);
+void usartPrintString(USART_TypeDef* USARTx, const char *str);
+void serDbg(const char *str);
 
 /* End of Communications */
 
@@ -89,14 +99,20 @@ inline void serDbg(const char *str);
 #define SETTINGS_FUNCTION_TC 0x1
 #define SETTINGS_FUNCTION_SHIFTER 0x2
 #define SETTINGS_FUNCTION_LED 0x4
+#define SETTINGS_FUNCTION_SHIFTER_AWD 0x8 /* Shift onset from the ADC analog watchdog */
 
 #define SETTINGS_CUT_DISABLED 0x0
 #define SETTINGS_CUT_NORMAL 0x1
 #define SETTINGS_CUT_PROGRESSIVE 0x2
+#define SETTINGS_CUT_SYNC 0x3 /* Normal cuts aligned to the ignition events */
 
 #define SETTINGS_SENSOR_NORMAL 0
 #define SETTINGS_SENSOR_REVERSE 1
 
+/* Layout of the settings page, in its CRC. 1 had no version in the CRC
+   and gears_ratio as speed * 100 / rpm */
+#define SETTINGS_VERSION 2
+
 extern settings_t settings;
 
 void settingsInit(void);
@@ -119,8 +135,11 @@ void startControl(void) __attribute__ ((noreturn));
 #define LIGHT_STATE_BLINK 2
 #define LIGHT_STATE_PULSE 3
 
+#define LIGHT_PERIOD 75 /* ms */
+
 extern light_settings_t light_settings;
-void startLight(void) __attribute__ ((noreturn));
+void initLight(void);
+void updateLightTick(void);
 
 /* End of Light */
 
@@ -130,16 +149,37 @@ void startLight(void) __attribute__ ((noreturn));
 #define ADC_STARTED 1
 
 #define ADC_CHANNELS 4
+#define ADC_SAMPLES 32 /* 8 sequences of ADC_CHANNELS */
+
+/* Position in a sequence, channels are scanned upward */
+#define ADC_CHN_STRAIN 0
+#define ADC_CHN_TC_SW 1
+#define ADC_CHN_VBAT 2
+#define ADC_CHN_TEMP 3
+
+struct __adc_filtered {
+    uint16_t value[ADC_CHANNELS]; /* Q12.4, indexed by ADC_CHN_x */
+    uint32_t count; /* Updates so far, one per half of adc_samples */
+};
+typedef struct __adc_filtered adc_filtered_t;
 
-extern uint16_t adc_samples[32];
+extern uint16_t adc_samples[ADC_SAMPLES];
 
 void startAdc(void);
+void adcGetFiltered(adc_filtered_t* filtered);
+void adcApplySettings(void);
 
 /* End of ADC */
 
 
 /* Ignition */
-void startIgnition(void) __attribute__ ((noreturn));
+void initIgnition(void);
+void updateTcTable(void);
+void ignitionTriggerI(void);
+void ignitionRevolutionI(uint32_t period);
+tc_entry_t getTcEntryI(void);
+uint8_t getCutStateI(void);
+void getCutEvent(cut_t* cut);
 
 /* End of Ignition */
 
@@ -166,6 +206,17 @@ extern sensors_t sensors;
 
 void startSensors(void) __attribute__ ((noreturn));
 uint8_t getCurCutTime(void);
+uint8_t getCurGearIdx(void);
+uint8_t getCurGearNeutral(void);
+void getGearsLearned(gears_t* gears);
+void checkStrainGaugeI(uint32_t strain_gauge);
+uint8_t getEnginePhaseI(uint32_t* since, uint32_t* period);
+void getStrainWatchdogWindow(uint8_t shifting, uint16_t* low, uint16_t* high);
+void strainWatchdogI(void);
+void recordSensorsI(uint32_t strain_gauge, uint32_t time);
+void recordTriggerI(uint8_t reason);
+uint8_t getRecordBlock(uint8_t i, record_t* record);
+void clearRecord(void);
 
 /* End of Sensors */
 
@@ -0,0 +1,41 @@
+#ifndef _UPDATER_H_
+#define _UPDATER_H_
+
+#include <stdint.h>
+#include "frame.h"
+#include "update.h"
+
+/*
+ * Resident update stage, the layout and the requests are in update.h.
+ *
+ * updaterReceive() takes the link one byte at a time and returns the
+ * reply to send once a request is complete, the stage main loop only
+ * moves bytes between it and the USART. Flash and CRC go through the
+ * StdPeriph drivers, so the same code runs in the host simulator
+ * against its model of the flash.
+ */
+
+#define UPDATER_BAUD 115200         /* Without a rate from the application */
+#define UPDATER_LINK_SIZE 6         /* link_t_size, the stage has no nanopb */
+#define UPDATER_REPLY_MAX FRAME_ENCODED_MAX(UPDATER_LINK_SIZE)
+#define UPDATER_NONE 0xFF           /* updaterProcess(), not a request for the stage */
+
+struct __updater {
+    frame_decoder_t decoder;
+    uint8_t packet[FRAME_PACKET(UPDATE_PAYLOAD_MAX)];
+    uint32_t baud;                  /* Answered to CMD_UPDATE */
+    uint32_t size;                  /* Of the image, 0 before CMD_UPDATE_BEGIN */
+    uint32_t crc;
+    uint32_t next;                  /* Offset of the next block */
+    uint16_t erased;                /* Pages of the application erased */
+    uint8_t committed;              /* Restart into the new image */
+    uint32_t first[UPDATE_PAGE_SIZE / 4]; /* First page, programmed last */
+};
+typedef struct __updater updater_t;
+
+void updaterInit(updater_t* u, uint32_t baud);
+uint16_t updaterReceive(updater_t* u, uint8_t byte, uint8_t* reply);
+uint8_t updaterProcess(updater_t* u, uint8_t cmd, const uint8_t* payload, uint16_t len);
+uint8_t updaterAppValid(void);
+
+#endif
@@ -1,16 +1,40 @@
 #include "nil.h"
 #include "threads.h"
 
-uint16_t adc_samples[32];
+#if FILTER_DECIMATION != (ADC_SAMPLES/2)/ADC_CHANNELS
+#error "FILTER_DECIMATION must match the sequences in half of adc_samples"
+#endif
+
+uint16_t adc_samples[ADC_SAMPLES];
+static filter_t adc_filters[ADC_CHANNELS];
+static adc_filtered_t adc_filtered;
+static uint8_t adc_awd; /* Analog watchdog set up by startAdc() */
+
+/*
+ * Function prototypes.
+ */
+
+static void filterHalfI(const uint16_t* half);
+
+/*
+ * Actual functions.
+ */
 
 void startAdc(void)
 {
     ADC_InitTypeDef ADC_InitStructure;
     DMA_InitTypeDef DMA_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    uint8_t i;
 
     RCC_ADCCLKConfig(RCC_ADCCLK_HSI14); /* Enable ADC1 clock (14MHz HSI) so that we can talk to it */
     RCC_HSI14Cmd(ENABLE);
 
+    for (i = 0; i < ADC_CHANNELS; i++)
+    {
+        filterInit(&adc_filters[i]);
+    }
+
     DMA_DeInit(DMA1_Channel1);
     DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&ADC1->DR;
     DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)adc_samples;
@@ -25,6 +49,14 @@ void startAdc(void)
     DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
     DMA_Init(DMA1_Channel1, &DMA_InitStructure);
 
+    /* Each half of adc_samples is checked as soon as it is filled */
+    DMA_ITConfig(DMA1_Channel1, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
     DMA_Cmd(DMA1_Channel1, ENABLE);
 //    ADC_ITConfig(ADC1, ADC_IT_EOC, ENABLE); // Enable ADC1 EOC interrupt
     /* ADC DMA request in circular mode */
@@ -41,7 +73,7 @@ void startAdc(void)
     ADC_InitStructure.ADC_ContinuousConvMode = ENABLE;
     ADC_InitStructure.ADC_ExternalTrigConvEdge = ADC_ExternalTrigConvEdge_None;
     ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
-    ADC_InitStructure.ADC_ScanDirection = ADC_ScanDirection_Backward;
+    ADC_InitStructure.ADC_ScanDirection = ADC_ScanDirection_Upward;
     ADC_Init(ADC1, &ADC_InitStructure);
 
     /* Convert the ADC1 temperature sensor  with 239.5 Cycles as sampling time */
@@ -52,6 +84,25 @@ void startAdc(void)
 
     ADC_TempSensorCmd(ENABLE);
 
+    if (settings.data.functions & SETTINGS_FUNCTION_SHIFTER_AWD)
+    {
+        uint16_t low, high;
+
+        /* Analog watchdog on the strain gauge only */
+        getStrainWatchdogWindow(status.shifting, &low, &high);
+        ADC_AnalogWatchdogThresholdsConfig(ADC1, high, low);
+        ADC_AnalogWatchdogSingleChannelConfig(ADC1, ADC_AnalogWatchdog_Channel_0);
+        ADC_AnalogWatchdogSingleChannelCmd(ADC1, ENABLE);
+        ADC_AnalogWatchdogCmd(ADC1, ENABLE);
+        ADC_ITConfig(ADC1, ADC_IT_AWD, ENABLE);
+        adc_awd = 1;
+
+        NVIC_InitStructure.NVIC_IRQChannel = ADC1_COMP_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&NVIC_InitStructure);
+    }
+
     /* ADC Calibration */
     ADC_GetCalibrationFactor(ADC1);
 
@@ -67,11 +118,78 @@ void startAdc(void)
     serDbg("startAdc Complete\r\n");
 }
 
+/*
+ * Moves the analog watchdog window to the strain gauge settings, the
+ * thresholds are written between conversions as strainWatchdogI()
+ * does. Turning the watchdog mode on takes a restart, turning it off
+ * opens the window so it never fires again.
+ */
+void adcApplySettings(void)
+{
+    uint16_t low = 0, high = 0xFFF;
+
+    if (!adc_awd)
+    {
+        return;
+    }
+
+    chSysLock();
+    if (settings.data.functions & SETTINGS_FUNCTION_SHIFTER_AWD)
+    {
+        getStrainWatchdogWindow(status.shifting, &low, &high);
+    }
+    ADC_AnalogWatchdogThresholdsConfig(ADC1, high, low);
+    chSysUnlock();
+}
+
+/* Copies the filtered values, never a mix of two updates */
+void adcGetFiltered(adc_filtered_t* filtered)
+{
+    chSysLock();
+    *filtered = adc_filtered;
+    chSysUnlock();
+}
+
+/* Runs the decimators on a half of adc_samples that DMA is not writing */
+static void filterHalfI(const uint16_t* half)
+{
+    uint8_t i;
+
+    for (i = 0; i < ADC_CHANNELS; i++)
+    {
+        adc_filtered.value[i] = filterDecimate(&adc_filters[i], &half[i], ADC_CHANNELS);
+    }
+    adc_filtered.count++;
+
+    /* Shift detection uses stage 1 only, the moving average would add 1ms */
+    checkStrainGaugeI(adc_filters[ADC_CHN_STRAIN].last / FILTER_DECIMATION);
+
+    recordSensorsI(adc_filters[ADC_CHN_STRAIN].last / FILTER_DECIMATION, adc_filtered.count);
+}
+
 void DMA1_Ch1_IRQHandler(void)
 {
-  /* Test on DMA1 Channel1 Transfer Complete interrupt */
+  /* Test on DMA1 Channel1 Half Transfer interrupt, first half is stable */
+  if(DMA_GetITStatus(DMA1_IT_HT1))
+  {
+    DMA_ClearITPendingBit(DMA1_IT_HT1);
+    filterHalfI(&adc_samples[0]);
+  }
+
+  /* Test on DMA1 Channel1 Transfer Complete interrupt, second half is stable */
   if(DMA_GetITStatus(DMA1_IT_TC1))
   {
-    DMA_ClearITPendingBit(DMA1_IT_GL1);
+    DMA_ClearITPendingBit(DMA1_IT_TC1);
+    filterHalfI(&adc_samples[ADC_SAMPLES/2]);
+  }
+}
+
+void ADC1_COMP_IRQHandler(void)
+{
+  /* Strain gauge crossed the threshold, see strainWatchdogI() */
+  if(ADC_GetITStatus(ADC1, ADC_IT_AWD))
+  {
+    ADC_ClearITPendingBit(ADC1, ADC_IT_AWD);
+    strainWatchdogI();
   }
 }
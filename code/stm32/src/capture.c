@@ -0,0 +1,105 @@
+#include "capture.h"
+
+void captureInit(capture_t* c)
+{
+    uint8_t i;
+
+    for (i = 0; i < CAPTURE_RING_SIZE; i++)
+    {
+        c->periods[i] = 0;
+    }
+    c->last = 0;
+    c->head = 0;
+    c->count = 0;
+    c->started = 0;
+}
+
+/*
+ * Builds a 32 bit timestamp from a capture value. CCRx must be read
+ * before the UIF flag: if an update is pending and the capture is in
+ * the lower half of the counter, the edge came after the wrap that has
+ * not been counted yet.
+ */
+uint32_t captureTimestamp(uint16_t overflows, uint16_t ccr, uint8_t overflow_pending)
+{
+    uint32_t high = overflows;
+
+    if (overflow_pending && ccr < 0x8000)
+    {
+        high++;
+    }
+    return (high << 16) | ccr;
+}
+
+void captureEdge(capture_t* c, uint32_t timestamp)
+{
+    if (c->started)
+    {
+        /* Unsigned difference is right across the 32 bit wrap */
+        c->periods[c->head] = timestamp - c->last;
+        c->head = (c->head + 1) & (CAPTURE_RING_SIZE - 1);
+        if (c->count < CAPTURE_RING_SIZE)
+        {
+            c->count++;
+        }
+    }
+    c->last = timestamp;
+    c->started = 1;
+}
+
+/*
+ * Forgets the history of a channel that had no edge for more than
+ * timeout ticks. Returns 1 when it just stopped.
+ */
+uint8_t captureTimeout(capture_t* c, uint32_t now, uint32_t timeout)
+{
+    if (!c->started || (now - c->last) <= timeout)
+    {
+        return 0;
+    }
+    captureInit(c);
+    return 1;
+}
+
+/* Latest period in ticks, 0 when there is none yet */
+uint32_t capturePeriod(const capture_t* c)
+{
+    if (c->count == 0)
+    {
+        return 0;
+    }
+    return c->periods[(c->head - 1) & (CAPTURE_RING_SIZE - 1)];
+}
+
+/*
+ * Edge frequency over the last n periods. Pass the timer clock as clk
+ * for Hz, 60 times the timer clock for per minute. clk * n must fit in
+ * 32 bits. Returns 0 when there is no period yet.
+ */
+uint32_t captureFrequency(const capture_t* c, uint32_t clk, uint8_t n)
+{
+    uint32_t sum = 0;
+    uint8_t i, pos = c->head;
+
+    if (n > c->count)
+    {
+        n = c->count;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        pos = (pos - 1) & (CAPTURE_RING_SIZE - 1);
+        sum += c->periods[pos];
+    }
+
+    /* Two edges within the same tick */
+    if (sum == 0)
+    {
+        return 0;
+    }
+    return (clk * n) / sum;
+}
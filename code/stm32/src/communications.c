@@ -3,8 +3,11 @@
 #include <string.h> // memcpy
 
 #define I2C_TIMEOUT 100 /* ms */
-#define SPI_TIMEOUT 100 /* ms */
 #define USART_TIMEOUT 100 /* ms */
+#define USART_IRQ_PRIORITY 3 /* Lowest */
+#define USART_BAUD 115200 /* At reset, the GUI may negotiate a faster rate */
+#define USART_BRR_MIN 16 /* Oversampling by 16 */
+#define USART_CLK STM32_PCLK /* STM32_USART1SW in mcuconf.h */
 
 #define DMA_REMAP_USART TRUE
 #define DMA_CHANNEL_USART1_TX DMA1_Channel4
@@ -15,21 +18,43 @@
 #define DMA_CTCIF_USART1_RX DMA_IFCR_CTCIF5
 #define DMA_TCIF_USART1_RX DMA_ISR_TCIF5
 
-#define DMA_CHANNEL_SPI1_TX DMA1_Channel3
-#define DMA_CTCIF_SPI1_TX DMA_IFCR_CTCIF3
-#define DMA_TCIF_SPI1_TX DMA_ISR_TCIF3
-
-#define DMA_CHANNEL_SPI1_RX DMA1_Channel2
-#define DMA_CTCIF_SPI1_RX DMA_IFCR_CTCIF2
-#define DMA_TCIF_SPI1_RX DMA_ISR_TCIF2
-
-semaphore_t usart1_semI, usart1_semS;
-semaphore_t spi1_semI, spi1_semS;
+semaphore_t usart1_semS;
+semaphore_t usart1_rx_sem; /* Signalled when bytes were received */
+semaphore_t usart1_tx_sem; /* Signalled at the end of a transfer a writer waits for */
 semaphore_t i2c1_semI, i2c1_semS;
 
 char usart_txbuf[USART_TXBUF_SIZE];
 char usart_rxbuf[USART_RXBUF_SIZE];
 
+/*
+ * usart_txbuf is a ring shared by every writer. Indexes run free and
+ * wrap at 16 bits, end - tail is the number of bytes taken. DMA sends
+ * from tail up to head or to the end of the buffer, the transfer
+ * complete interrupt moves tail on and starts the next part.
+ * usartSendS() takes room up to end under the lock and copies into it
+ * with interrupts on, head only moves to end once it has. I-class
+ * writers copy under the lock, behind what it took.
+ */
+static volatile uint16_t usart_tx_head = 0; /* Next byte not ready to send */
+static volatile uint16_t usart_tx_end = 0;  /* Next byte to queue */
+static volatile uint16_t usart_tx_tail = 0; /* Next byte to send */
+static volatile uint16_t usart_tx_dma = 0;  /* Bytes in the running transfer, 0 when idle */
+static uint8_t usart_tx_copying = 0;        /* usartSendS() is filling the room it took */
+static uint8_t usart_tx_waiting = 0;        /* A writer waits on usart1_tx_sem */
+uint32_t usart_tx_dropped = 0;              /* Messages refused by usartSendI() */
+
+/*
+ * usart_rxbuf is written in circles by DMA. The half, full and USART
+ * idle line interrupts add what arrived since the previous one to head,
+ * free running like the transmit indexes. They come at least every half
+ * buffer, so head never misses a lap. The size is not a power of two,
+ * positions in the buffer wrap explicitly.
+ */
+static volatile uint16_t usart_rx_head = 0; /* Bytes received so far */
+static uint16_t usart_rx_pos = 0;           /* DMA write index at the last interrupt */
+
+uint32_t usart_baud = USART_BAUD;
+
 char serial_dbg = 1;
 
 void i2cInit(I2C_TypeDef* I2Cx)
@@ -108,6 +133,23 @@ uint8_t i2cReceiveS(I2C_TypeDef* I2Cx, const uint8_t addr, uint8_t *buffer, uint
     return 0;
 }
 
+/*
+ * 8N1 without flow control at baud, with the USART disabled. What
+ * USART_Init() does, by register and from the clock mcuconf.h sets:
+ * USART_Init() and RCC_GetClocksFreq() took 120 bytes of the stack of
+ * main() and of the serial thread.
+ */
+static void usartConfig(USART_TypeDef* USARTx, uint32_t baud)
+{
+    USARTx->CR2 &= ~USART_CR2_STOP;
+    USARTx->CR1 = (USARTx->CR1 & ~(USART_CR1_M | USART_CR1_PCE | USART_CR1_PS))
+                  | USART_CR1_TE | USART_CR1_RE;
+    USARTx->CR3 &= ~(USART_CR3_RTSE | USART_CR3_CTSE);
+
+    /* Oversampling by 16, rounded to the nearest */
+    USARTx->BRR = (USART_CLK + baud / 2) / baud;
+}
+
 void usartInit(USART_TypeDef* USARTx)
 {
 #if defined(DMA_REMAP_USART) && DMA_REMAP_USART
@@ -115,58 +157,52 @@ void usartInit(USART_TypeDef* USARTx)
     SYSCFG_DMAChannelRemapConfig(SYSCFG_DMARemap_USART1Rx, ENABLE);
 #endif
 
-    chSemObjectInit(&usart1_semI, 1);
     chSemObjectInit(&usart1_semS, 1);
+    chSemObjectInit(&usart1_rx_sem, 0);
+    chSemObjectInit(&usart1_tx_sem, 0);
+    usart_tx_head = usart_tx_end = usart_tx_tail = usart_tx_dma = 0;
+    usart_tx_copying = usart_tx_waiting = 0;
+    usart_rx_head = usart_rx_pos = 0;
 
     memset(usart_txbuf, 0, sizeof(usart_txbuf));
     memset(usart_rxbuf, 0, sizeof(usart_rxbuf));
 
-    USART_InitTypeDef USART_InitStructure;
-    DMA_InitTypeDef DMA_InitStructure;
-    USART_InitStructure.USART_BaudRate = 115200;
-    USART_InitStructure.USART_WordLength = USART_WordLength_8b;
-    USART_InitStructure.USART_StopBits = USART_StopBits_1;
-    USART_InitStructure.USART_Parity = USART_Parity_No;
-    USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
-    USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
-    USART_Init(USARTx, &USART_InitStructure);
-
-    /* DMA channel Tx of USART Configuration */
+    usart_baud = USART_BAUD;
+    usartConfig(USARTx, usart_baud);
+
+    /*
+     * DMA channels by register like usartTxStartI(), byte to byte at
+     * medium priority, without a DMA_InitTypeDef on the stack of main().
+     */
     DMA_DeInit(DMA_CHANNEL_USART1_TX);
-    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USARTx->TDR;
-    DMA_InitStructure.DMA_BufferSize = 0;
-    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)usart_txbuf;
-    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
-    DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
-    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
-    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
-    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
-    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
-    DMA_Init(DMA_CHANNEL_USART1_TX, &DMA_InitStructure);
-
-    /* Enable the USART Tx DMA request */
+    DMA_CHANNEL_USART1_TX->CPAR = (uint32_t)&USARTx->TDR;
+    DMA_CHANNEL_USART1_TX->CMAR = (uint32_t)usart_txbuf;
+    DMA_CHANNEL_USART1_TX->CNDTR = 0;
+    DMA_CHANNEL_USART1_TX->CCR = DMA_CCR_DIR | DMA_CCR_MINC | DMA_Priority_Medium;
+
+    /* Enable the USART Tx DMA request, the end of each transfer starts the next */
     USART_DMACmd(USARTx, USART_DMAReq_Tx, ENABLE);
+    DMA_ITConfig(DMA_CHANNEL_USART1_TX, DMA_IT_TC, ENABLE);
 
-    /* DMA channel Rx of USART Configuration */
+    /* Rx in circles over usart_rxbuf */
     DMA_DeInit(DMA_CHANNEL_USART1_RX);
-    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USARTx->RDR;
-    DMA_InitStructure.DMA_BufferSize = (uint16_t)sizeof(usart_rxbuf);
-    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)usart_rxbuf;
-    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
-    DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
-    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
-    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
-    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
-    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
-    DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
-    DMA_Init(DMA_CHANNEL_USART1_RX, &DMA_InitStructure);
+    DMA_CHANNEL_USART1_RX->CPAR = (uint32_t)&USARTx->RDR;
+    DMA_CHANNEL_USART1_RX->CMAR = (uint32_t)usart_rxbuf;
+    DMA_CHANNEL_USART1_RX->CNDTR = sizeof(usart_rxbuf);
+    DMA_CHANNEL_USART1_RX->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_Priority_Medium;
 
     /* Enable the USART Rx DMA request */
     USART_DMACmd(USARTx, USART_DMAReq_Rx, ENABLE);
-    DMA_ITConfig(DMA_CHANNEL_USART1_RX, DMA_IT_TC, ENABLE);
+    DMA_ITConfig(DMA_CHANNEL_USART1_RX, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    /* The end of a burst is seen when the line stays idle for a character */
+    USART_ITConfig(USARTx, USART_IT_IDLE, ENABLE);
+
+    /* Below the capture and cut interrupts, they must not wait for the link */
+    NVIC_SetPriority(DMA1_Channel4_5_IRQn, USART_IRQ_PRIORITY);
+    NVIC_SetPriority(USART1_IRQn, USART_IRQ_PRIORITY);
     NVIC_EnableIRQ(DMA1_Channel4_5_IRQn);
+    NVIC_EnableIRQ(USART1_IRQn);
 
     /* Enable the DMA channel */
     DMA_Cmd(DMA_CHANNEL_USART1_RX, ENABLE);
@@ -174,72 +210,342 @@ void usartInit(USART_TypeDef* USARTx)
     USART_Cmd(USARTx, ENABLE);
 }
 
+/* Bytes taken in the ring, called with the system locked */
+static uint16_t usartTxUsedI(void)
+{
+    return (uint16_t)(usart_tx_end - usart_tx_tail);
+}
+
+/* Starts sending the queued bytes up to the end of usart_txbuf, unless DMA is busy */
+static void usartTxStartI(void)
+{
+    const uint16_t tail = usart_tx_tail & (USART_TXBUF_SIZE - 1);
+    uint16_t len = (uint16_t)(usart_tx_head - usart_tx_tail);
+
+    if (usart_tx_dma != 0 || len == 0)
+    {
+        return;
+    }
+    if (len > USART_TXBUF_SIZE - tail)
+    {
+        len = USART_TXBUF_SIZE - tail;
+    }
+    usart_tx_dma = len;
+
+    DMA_CHANNEL_USART1_TX->CCR &= ~DMA_CCR_EN; /* CMAR and CNDTR are read only while enabled */
+    DMA_CHANNEL_USART1_TX->CMAR = (uint32_t)&usart_txbuf[tail];
+    DMA_CHANNEL_USART1_TX->CNDTR = len;
+    DMA_CHANNEL_USART1_TX->CCR |= DMA_CCR_EN;
+}
+
+/* Copies len bytes to the ring from index at, round the end */
+static void usartTxCopy(uint16_t at, const char* buffer, uint16_t len)
+{
+    uint16_t first = USART_TXBUF_SIZE - (at & (USART_TXBUF_SIZE - 1));
+
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(&usart_txbuf[at & (USART_TXBUF_SIZE - 1)], buffer, first);
+    memcpy(usart_txbuf, buffer + first, len - first);
+}
+
+/* Copies len bytes after end, the caller has checked that they fit */
+static void usartTxQueueI(const char* buffer, uint16_t len)
+{
+    usartTxCopy(usart_tx_end, buffer, len);
+    usart_tx_end += len;
+
+    /* Behind the room usartSendS() fills, sent once that is done */
+    if (!usart_tx_copying)
+    {
+        usart_tx_head = usart_tx_end;
+        usartTxStartI();
+    }
+}
+
+/* Called from DMA1_Ch4_5_IRQHandler at the end of a transfer */
+static void usartTxCompleteI(void)
+{
+    DMA1->IFCR |= DMA_CTCIF_USART1_TX; /* Clear transfer complete flag */
+
+    usart_tx_tail += usart_tx_dma;
+    usart_tx_dma = 0;
+    usartTxStartI();
+
+    if (usart_tx_waiting)
+    {
+        usart_tx_waiting = 0;
+        chSemSignalI(&usart1_tx_sem);
+    }
+}
+
+/*
+ * Sleeps until the next transfer completes, the caller set
+ * usart_tx_waiting under the lock after finding the ring busy. Returns
+ * 1 when none did for USART_TIMEOUT.
+ */
+static uint8_t usartTxWaitS(void)
+{
+    return chSemWaitTimeout(&usart1_tx_sem, MS2ST(USART_TIMEOUT)) != MSG_OK;
+}
+
+/* Moves the receive head to the DMA write index and wakes the reader */
+static void usartRxUpdateI(void)
+{
+    uint16_t pos = USART_RXBUF_SIZE - DMA_CHANNEL_USART1_RX->CNDTR;
+    uint16_t n;
+
+    if (pos == USART_RXBUF_SIZE) /* Read as the channel reloads */
+    {
+        pos = 0;
+    }
+    n = (pos >= usart_rx_pos) ? pos - usart_rx_pos : pos + USART_RXBUF_SIZE - usart_rx_pos;
+
+    if (n == 0)
+    {
+        return;
+    }
+    usart_rx_pos = pos;
+    usart_rx_head += n;
+    chSemSignalI(&usart1_rx_sem);
+}
+
+/*
+ * Waits up to timeout for bytes to arrive and returns the receive head.
+ * The byte after the one at usart_rxbuf[i] is at i + 1, or at 0 past the
+ * end, until the head has moved USART_RXBUF_SIZE past it.
+ */
+uint16_t usartReceiveS(systime_t timeout)
+{
+    chSemWaitTimeout(&usart1_rx_sem, timeout);
+
+    return usart_rx_head;
+}
+
+void DMA1_Ch4_5_IRQHandler(void)
+{
+    CH_IRQ_PROLOGUE();
+
+    if (DMA1->ISR & DMA_TCIF_USART1_TX)
+    {
+        /* The ring is shared with the senders, under the lock like theirs */
+        chSysLockFromISR();
+        usartTxCompleteI();
+        chSysUnlockFromISR();
+    }
+
+    if (DMA1->ISR & (DMA_ISR_HTIF5 | DMA_TCIF_USART1_RX))
+    {
+        DMA1->IFCR |= DMA_IFCR_CHTIF5 | DMA_CTCIF_USART1_RX;
+
+        chSysLockFromISR();
+        usartRxUpdateI();
+        chSysUnlockFromISR();
+    }
+
+    CH_IRQ_EPILOGUE();
+}
+
+void USART1_IRQHandler(void)
+{
+    CH_IRQ_PROLOGUE();
+
+    if (USART1->ISR & USART_ISR_IDLE)
+    {
+        USART1->ICR = USART_ICR_IDLECF;
+
+        chSysLockFromISR();
+        usartRxUpdateI();
+        chSysUnlockFromISR();
+    }
+
+    CH_IRQ_EPILOGUE();
+}
+
+/*
+ * Queues the whole message or nothing and never waits. I-class, the
+ * caller holds the system lock, from an interrupt with
+ * chSysLockFromISR(). Returns 1 when the ring has no room for it.
+ */
 uint8_t usartSendI(USART_TypeDef* USARTx, const char* buffer, uint16_t len)
 {
     uint8_t ret = 1;
     if (USARTx == USART1)
     {
-        if (chSemWaitTimeout(&usart1_semI, TIME_IMMEDIATE) != MSG_OK)
+        if (len <= USART_TXBUF_SIZE - usartTxUsedI())
         {
-            return 1;
+            usartTxQueueI(buffer, len);
+            ret = 0;
         }
-        if (len > USART_TXBUF_SIZE)
+        else
         {
-            len = USART_TXBUF_SIZE;
+            usart_tx_dropped++;
         }
+    }
+    return ret;
+}
 
-        /* Copy data to usart tx buffer */
-        memcpy(usart_txbuf, buffer, len);
-
-        /* Stop and re-initialise DMA1
-         * We don't care if it was running,
-         * we'll restart from the beginning of the buffer
-         */
-        DMA_CHANNEL_USART1_TX->CCR &= ~DMA_CCR_EN; /* Stop DMA1_Channel */
-        DMA1->IFCR |= DMA_CTCIF_USART1_TX; /* Clear transfer complete flag */
-        DMA_CHANNEL_USART1_TX->CMAR = (uint32_t)usart_txbuf;
-        DMA_CHANNEL_USART1_TX->CNDTR = len;
+/* usartSendI() from a thread, never waits either */
+uint8_t usartSend(USART_TypeDef* USARTx, const char* buffer, uint16_t len)
+{
+    uint8_t ret;
 
-        /* Start DMA1_Channel4 */
-        DMA_CHANNEL_USART1_TX->CCR |= DMA_CCR_EN;
+    chSysLock();
+    ret = usartSendI(USARTx, buffer, len);
+    chSysUnlock();
 
-        chSemSignal(&usart1_semI);
-    }
     return ret;
 }
 
+/*
+ * Queues the message, sleeping while the ring is too full to take it
+ * whole, until a transfer completes. Messages longer than the ring go
+ * out in pieces as it drains. The room is taken under the lock, the
+ * copy is done outside of it. Returns 1 if no transfer completed for
+ * USART_TIMEOUT, the rest of the message is not sent.
+ */
 uint8_t usartSendS(USART_TypeDef* USARTx, const char* buffer, uint16_t len)
 {
     uint8_t ret = 1;
     if (USARTx == USART1)
     {
+        const uint8_t split = (len > USART_TXBUF_SIZE);
+        uint16_t at = 0, n;
+
+        /* One thread at a time, messages of two threads do not interleave */
         if (chSemWaitTimeout(&usart1_semS, MS2ST(USART_TIMEOUT)) != MSG_OK)
         {
             return 1;
         }
 
-/* DMA */
-//        if((DMA1->ISR & DMA_TCIF_USART1_TX) == RESET)
-//        {
-//            DMA1->IFCR |= DMA_CTCIF_USART1_TX; /* Clear transfer complete flag */
-//        }
+        while (len > 0)
+        {
+            chSysLock();
+            n = USART_TXBUF_SIZE - usartTxUsedI();
+            if (n >= len || (split && n > 0))
+            {
+                n = (n > len) ? len : n;
+                at = usart_tx_end;
+                usart_tx_end += n;
+                usart_tx_copying = 1;
+            }
+            else
+            {
+                n = 0;
+                usart_tx_waiting = 1;
+            }
+            chSysUnlock();
 
-//        ret = usartSendI(USARTx, buffer, len);
+            if (n == 0)
+            {
+                if (usartTxWaitS())
+                {
+                    break;
+                }
+                continue;
+            }
 
-//        /* Wait for transfer to finish  */
-//        while((DMA1->ISR & DMA_TCIF_USART1_TX) == RESET) {};
-//        DMA1->IFCR |= DMA_CTCIF_USART1_TX; /* Clear transfer complete flag */
+            /* Nobody else writes the room taken */
+            usartTxCopy(at, buffer, n);
 
-/* Manual */
-        while (len--) {
-            USARTx->TDR = (*buffer++ & (uint16_t)0x01FF);
-            while ((USARTx->ISR & USART_ISR_TXE) == RESET);
+            chSysLock();
+            usart_tx_copying = 0;
+            usart_tx_head = usart_tx_end;
+            usartTxStartI();
+            chSysUnlock();
+
+            buffer += n;
+            len -= n;
         }
+        ret = (len > 0);
         chSemSignal(&usart1_semS);
     }
     return ret;
 }
 
+/* Waits for everything queued to be on the line, 1 when it did not drain in time */
+static uint8_t usartDrainS(USART_TypeDef* USARTx)
+{
+    uint16_t waited = 0;
+
+    chSysLock();
+    while (usart_tx_head != usart_tx_tail)
+    {
+        usart_tx_waiting = 1;
+        chSysUnlock();
+        if (usartTxWaitS())
+        {
+            return 1;
+        }
+        chSysLock();
+    }
+    chSysUnlock();
+
+    /* The last byte or two are still shifting out */
+    while (!(USARTx->ISR & USART_ISR_TC))
+    {
+        if (waited++ >= USART_TIMEOUT)
+        {
+            return 1;
+        }
+        chThdSleepMilliseconds(1);
+    }
+
+    return 0;
+}
+
+/* Returns once what was sent so far is on the line, 1 when it did not drain */
+uint8_t usartFlushS(USART_TypeDef* USARTx)
+{
+    uint8_t ret;
+
+    if (chSemWaitTimeout(&usart1_semS, MS2ST(USART_TIMEOUT)) != MSG_OK)
+    {
+        return 1;
+    }
+    ret = usartDrainS(USARTx);
+    chSemSignal(&usart1_semS);
+
+    return ret;
+}
+
+/*
+ * Switches to another baud rate once everything queued is on the line,
+ * bytes received meanwhile are lost. Returns 1 when the USART clock
+ * cannot make that rate or the link did not drain, the rate is kept.
+ */
+uint8_t usartSetBaudS(USART_TypeDef* USARTx, uint32_t baud)
+{
+    if (USARTx != USART1 || baud == 0 || USART_CLK / baud < USART_BRR_MIN)
+    {
+        return 1;
+    }
+
+    /* Nobody queues while the rate changes */
+    if (chSemWaitTimeout(&usart1_semS, MS2ST(USART_TIMEOUT)) != MSG_OK)
+    {
+        return 1;
+    }
+
+    if (usartDrainS(USARTx))
+    {
+        chSemSignal(&usart1_semS);
+        return 1;
+    }
+
+    /* BRR is only written with the USART disabled */
+    USART_Cmd(USARTx, DISABLE);
+    usartConfig(USARTx, baud);
+    USART_Cmd(USARTx, ENABLE);
+    usart_baud = baud;
+
+    chSemSignal(&usart1_semS);
+
+    return 0;
+}
+
 void usartPrintString(USART_TypeDef* USARTx, const char* str)
 {
     usartSendS(USARTx, str, strlen(str));
@@ -251,19 +557,12 @@ void serDbg(const char* str)
         usartPrintString(DBG_USART, str);
 }
 
+/* Polled by the display, the only device on SPI1 */
 void spiInit(SPI_TypeDef* SPIx)
 {
     SPI_InitTypeDef SPI_InitStructure;
-    DMA_InitTypeDef  DMA_InitStructure;
-    DMA_Channel_TypeDef* DMA_Ch;
 
-    if (SPIx == SPI1)
-    {
-        chSemObjectInit(&spi1_semI, 1);
-        chSemObjectInit(&spi1_semS, 1);
-        DMA_Ch = DMA_CHANNEL_SPI1_TX;
-    }
-    else
+    if (SPIx != SPI1)
     {
         return;
     }
@@ -282,78 +581,6 @@ void spiInit(SPI_TypeDef* SPIx)
     SPI_InitStructure.SPI_CRCPolynomial = 7;
     SPI_Init(SPIx, &SPI_InitStructure);
     SPI_Cmd(SPIx, ENABLE);
-
-    /* Setup DMA */
-    DMA_StructInit(&DMA_InitStructure);
-    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
-    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
-    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
-    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
-    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
-    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&SPIx->DR;
-    DMA_InitStructure.DMA_MemoryBaseAddr = 0;
-    DMA_InitStructure.DMA_BufferSize = 0;
-    /* write */
-    DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
-    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
-    DMA_Init(DMA_Ch, &DMA_InitStructure);
-
-    /* Enable the SPI Tx DMA request */
-    SPI_I2S_DMACmd(SPIx, SPI_I2S_DMAReq_Tx, ENABLE);
-}
-
-uint8_t spiSendI(SPI_TypeDef* SPIx, uint8_t* buffer, uint16_t len)
-{
-    if (SPIx == SPI1)
-    {
-        if (chSemWaitTimeout(&spi1_semI, TIME_IMMEDIATE) != MSG_OK)
-        {
-            return 1;
-        }
-        /* Stop and re-initialise DMA1
-         * We don't care if it was running,
-         * we'll restart from the beginning of the buffer
-         */
-        DMA_CHANNEL_SPI1_TX->CCR &= ~DMA_CCR_EN; /* Stop DMA1_Channel3 */
-        DMA1->IFCR |= DMA_CTCIF_SPI1_TX; /* Clear transfer complete flag */
-        DMA_CHANNEL_SPI1_TX->CMAR = (uint32_t)buffer;
-        DMA_CHANNEL_SPI1_TX->CNDTR = len;
-
-        /* Start DMA1_Channel3 */
-        DMA_CHANNEL_SPI1_TX->CCR |= DMA_CCR_EN;
-        chSemSignal(&spi1_semI);
-
-        return 0;
-    }
-    else
-    {
-        return 1;
-    }
-}
-
-uint8_t spiSendS(SPI_TypeDef* SPIx, uint8_t* buffer, uint16_t len)
-{
-    uint8_t ret = 1;
-    if (SPIx == SPI1)
-    {
-        if (chSemWaitTimeout(&spi1_semS, MS2ST(SPI_TIMEOUT)) != MSG_OK)
-        {
-            return 1;
-        }
-
-        if((DMA1->ISR & DMA_TCIF_SPI1_TX) == RESET)
-        {
-            DMA1->IFCR |= DMA_CTCIF_SPI1_TX; /* Clear transfer complete flag */
-        }
-        ret = spiSendI(SPIx, buffer, len);
-
-        /* Wait for transfer to finish  */
-        while((DMA1->ISR & DMA_TCIF_SPI1_TX) == RESET) chThdSleepMilliseconds(10);
-        DMA1->IFCR |= DMA_CTCIF_SPI1_TX; /* Clear transfer complete flag */
-        chSemSignal(&spi1_semS);
-    }
-    return ret;
 }
 
 void reverse(char s[])
@@ -3,6 +3,9 @@
 #include "menu.h"
 #include "string.h"
 
+#define GEARS_MIN_LEARNED 2 /* Gears to find before storing them */
+#define GEARS_MIN_CONFIDENCE 50 /* Percent, for every gear found */
+
 display_t display = {DISPLAY_OFF};
 const char version[] = VERSION;
 const char enabled[] = "Enabled";
@@ -51,7 +54,7 @@ void startDisplay(void) {
     display.state = DISPLAY_ON;
     palSetPad(GPIOC, GPIOC_LED4);
 
-    ssd1306DrawString(40, 20, "OpenTCS", Font_System7x8);
+    ssd1306DrawString(7, 3, "OpenTCS");
     chThdSleepMilliseconds(100); // Fails
     palClearPad(GPIOC, GPIOC_LED4);
 
@@ -78,37 +81,37 @@ void startDisplay(void) {
 
 void drawTitle(char * str)
 {
-    const uint8_t len = Font_System7x8.u8Width*strlen(str);
-    ssd1306DrawString(64-(len/2), 0, str, Font_System7x8);
+    const uint8_t len = strlen(str);
+    ssd1306DrawString(len < SSD1306_COLS ? (SSD1306_COLS-len)/2 : 0, 0, str);
 }
 
-void showDiag(void)
+/* A value right of its label, over what the last one left */
+void drawValue(uint8_t row, int value)
 {
-    char str[10] = "";
-
-    while (!BUTTON_SEL) {
-
-        drawTitle("Diagnostics");
+    char str[12] = "";
 
-        ssd1306DrawString(0, 10, "RPM:", Font_System5x8);
-        itoa(sensors.rpm, str);
-        ssd1306DrawString(25, 10, str, Font_System5x8);
-
-        ssd1306DrawString(0, 20, "Speed:", Font_System5x8);
-        itoa(sensors.speed, str);
-        ssd1306DrawString(35, 20, str, Font_System5x8);
+    itoa(value, str);
+    ssd1306DrawString(11, row, "      ");
+    ssd1306DrawString(11, row, str);
+}
 
-        ssd1306DrawString(0, 30, "Shifter:", Font_System5x8);
-        itoa(sensors.strain_gauge, str);
-        ssd1306DrawString(45, 30, str, Font_System5x8);
+void showDiag(void)
+{
+    ssd1306ClearScreen();
+    drawTitle("Diagnostics");
+    ssd1306DrawString(0, 2, "RPM:");
+    ssd1306DrawString(0, 3, "Speed:");
+    ssd1306DrawString(0, 4, "Shifter:");
+    ssd1306DrawString(0, 5, "TC Switch:");
+    ssd1306DrawString(0, 6, "VBAT:");
 
-        ssd1306DrawString(0, 40, "TC Switch:", Font_System5x8);
-        itoa(sensors.tc_switch, str);
-        ssd1306DrawString(55, 40, str, Font_System5x8);
+    while (!BUTTON_SEL) {
 
-        ssd1306DrawString(0, 50, "VBAT:", Font_System5x8);
-        itoa(sensors.tc_switch, str);
-        ssd1306DrawString(30, 50, str, Font_System5x8);
+        drawValue(2, sensors.rpm);
+        drawValue(3, sensors.speed);
+        drawValue(4, sensors.strain_gauge);
+        drawValue(5, sensors.tc_switch);
+        drawValue(6, sensors.tc_switch);
 
         chThdSleepMilliseconds(100);
     }
@@ -116,51 +119,52 @@ void showDiag(void)
 
 void showInfo(void)
 {
+    ssd1306ClearScreen();
     drawTitle("Version");
-    ssd1306DrawString(0, 10, version, Font_System5x8);
+    ssd1306DrawString(0, 1, version);
 
-    ssd1306DrawString(0, 20, "Cut mode:", Font_System5x8);
+    ssd1306DrawString(0, 2, "Cut mode:");
     if (settings.data.functions == SETTINGS_CUT_PROGRESSIVE)
     {
-        ssd1306DrawString(25, 20, "Progressive", Font_System5x8);
+        ssd1306DrawString(10, 2, "Progressive");
     }
     else if (settings.data.functions == SETTINGS_CUT_NORMAL)
     {
-        ssd1306DrawString(25, 20, "Normal", Font_System5x8);
+        ssd1306DrawString(10, 2, "Normal");
     }
     else
     {
-        ssd1306DrawString(25, 20, disabled, Font_System5x8);
+        ssd1306DrawString(10, 2, disabled);
     }
 
-    ssd1306DrawString(0, 30, "Shifter:", Font_System5x8);
+    ssd1306DrawString(0, 3, "Shifter:");
     if (settings.data.functions & SETTINGS_FUNCTION_SHIFTER)
     {
-        ssd1306DrawString(35, 30, disabled, Font_System5x8);
+        ssd1306DrawString(10, 3, disabled);
     }
     else
     {
-        ssd1306DrawString(35, 30, enabled, Font_System5x8);
+        ssd1306DrawString(10, 3, enabled);
     }
 
-    ssd1306DrawString(0, 40, "TC:", Font_System5x8);
+    ssd1306DrawString(0, 4, "TC:");
     if (settings.data.functions & SETTINGS_FUNCTION_TC)
     {
-        ssd1306DrawString(20, 40, disabled, Font_System5x8);
+        ssd1306DrawString(10, 4, disabled);
     }
     else
     {
-        ssd1306DrawString(20, 40, enabled, Font_System5x8);
+        ssd1306DrawString(10, 4, enabled);
     }
 
-    ssd1306DrawString(0, 50, "Shift Light:", Font_System5x8);
+    ssd1306DrawString(0, 5, "Shift Light:");
     if (settings.data.functions & SETTINGS_FUNCTION_LED)
     {
-        ssd1306DrawString(50, 50, disabled, Font_System5x8);
+        ssd1306DrawString(13, 5, disabled);
     }
     else
     {
-        ssd1306DrawString(50, 50, enabled, Font_System5x8);
+        ssd1306DrawString(13, 5, enabled);
     }
 
     while (!BUTTON_SEL) chThdSleepMilliseconds(100);
@@ -168,17 +172,17 @@ void showInfo(void)
 
 void setCutMode(void)
 {
+    ssd1306ClearScreen();
     drawTitle("Cut Mode");
 
-    ssd1306DrawString(10, 0, "Shift Light", Font_System5x8);
     if (settings.data.functions == SETTINGS_CUT_NORMAL)
     {
-        ssd1306DrawString(25, 0, "Progressive", Font_System5x8);
+        ssd1306DrawString(0, 2, "Progressive");
         settings.data.functions = SETTINGS_CUT_PROGRESSIVE;
     }
     else
     {
-        ssd1306DrawString(25, 0, "Normal", Font_System5x8);
+        ssd1306DrawString(0, 2, "Normal");
         settings.data.functions = SETTINGS_CUT_NORMAL;
     }
     writeSettings(&settings);
@@ -187,13 +191,14 @@ void setCutMode(void)
 
 void setShifter(void)
 {
+    ssd1306ClearScreen();
     drawTitle("Shifter Sensor Setup");
 
     uint8_t i;
     uint16_t peak;
 
-    ssd1306DrawString(0, 25, "Shift a gear", Font_System5x8);
-    ssd1306DrawString(10, 10, "to detect direction", Font_System5x8);
+    ssd1306DrawString(0, 2, "Shift a gear");
+    ssd1306DrawString(0, 3, "to detect direction");
 
     chThdSleepMilliseconds(2000);
 
@@ -211,16 +216,17 @@ void setShifter(void)
     /* Peak >= 1.65v */
     if (peak >= 0x8000)
     {
-        ssd1306DrawString(0, 10, "Normal direction", Font_System5x8);
+        ssd1306DrawString(0, 2, "Normal direction");
         settings.data.sensor_direction = SETTINGS_SENSOR_NORMAL;
     }
     else
     {
-        ssd1306DrawString(0, 5, "Reverse direction", Font_System5x8);
+        ssd1306DrawString(0, 2, "Reverse direction");
         settings.data.sensor_direction = SETTINGS_SENSOR_REVERSE;
     }
 
     settings.data.sensor_threshold = peak;
+    adcApplySettings();
     writeSettings(&settings);
 
     chThdSleepMilliseconds(2000);
@@ -228,54 +234,65 @@ void setShifter(void)
     while (!BUTTON_SEL) chThdSleepMilliseconds(100);
 }
 
+/*
+ * Gears are learned in the background while riding, see gearLearnFind().
+ * Shows what was found and stores it once every gear is confident.
+ */
 void setGears(void)
 {
-    uint8_t i, j;
-    uint16_t last_ratio, cur_ratio, speed;
-    char str[2];
-
-    cur_ratio = 0, last_ratio = 0;
-
-    for (i=0; i<6; i++)
-    {
-        ssd1306ClearScreen();
-        drawTitle("Gears Learning");
-        itoa(i, str);
-        ssd1306DrawString(15, 50, "Gear", Font_System7x8);
-        ssd1306DrawString(25, 60, str, Font_System7x8);
+    gears_t gears;
+    uint8_t i, confident;
+    char str[4];
 
-        for (j=0; j<40; j++)
-        {
-            speed = sensors.speed*100;
-            cur_ratio = speed / sensors.rpm;
+    ssd1306ClearScreen();
+    drawTitle("Gears Learning");
 
-            /* Wait until we shift up */
-            while (last_ratio >= cur_ratio+(cur_ratio/100))
-            {
-                chThdSleepMilliseconds(50);
-            }
+    getGearsLearned(&gears);
+    confident = (gears.ratio.size >= GEARS_MIN_LEARNED);
 
-            chThdSleepMilliseconds(100);
-        }
+    /* Gear, ratio and confidence, one line each */
+    for (i = 0; i < gears.ratio.size; i++)
+    {
+        itoa(i+1, str);
+        ssd1306DrawString(0, i+1, str);
+        itoa(gears.ratio.bytes[i], str);
+        ssd1306DrawString(3, i+1, str);
+        itoa(gears.confidence.bytes[i], str);
+        ssd1306DrawString(7, i+1, str);
+        ssd1306DrawString(10, i+1, "%");
+
+        if (gears.confidence.bytes[i] < GEARS_MIN_CONFIDENCE)
+            confident = false;
+    }
 
-        settings.data.gears_ratio.bytes[i] = cur_ratio-(cur_ratio/100);
-        last_ratio = cur_ratio;
+    if (confident)
+    {
+        settings.data.gears_ratio.size = gears.ratio.size;
+        memcpy(settings.data.gears_ratio.bytes, gears.ratio.bytes, gears.ratio.size);
+        writeSettings(&settings);
+        ssd1306DrawString(14, 1, "Saved");
+    }
+    else
+    {
+        ssd1306DrawString(14, 1, "Ride on");
     }
 
-    writeSettings(&settings);
-}
+    chThdSleepMilliseconds(2000);
 
+    while (!BUTTON_SEL) chThdSleepMilliseconds(100);
+}
 
 void toggleLED(void)
 {
-    ssd1306DrawString(10, 0, "Shift Light", Font_System5x8);
+    ssd1306ClearScreen();
+    drawTitle("Shift Light");
     if (settings.data.functions & SETTINGS_FUNCTION_LED)
     {
-        ssd1306DrawString(25, 0, disabled, Font_System5x8);
+        ssd1306DrawString(0, 2, disabled);
     }
     else
     {
-        ssd1306DrawString(25, 0, enabled, Font_System5x8);
+        ssd1306DrawString(0, 2, enabled);
     }
     settings.data.functions ^= SETTINGS_FUNCTION_LED;
     writeSettings(&settings);
@@ -284,14 +301,15 @@ void toggleLED(void)
 
 void toggleShifter(void)
 {
-    ssd1306DrawString(10, 0, "Shifter", Font_System5x8);
+    ssd1306ClearScreen();
+    drawTitle("Shifter");
     if (settings.data.functions & SETTINGS_FUNCTION_SHIFTER)
     {
-        ssd1306DrawString(25, 0, disabled, Font_System5x8);
+        ssd1306DrawString(0, 2, disabled);
     }
     else
     {
-        ssd1306DrawString(25, 0, enabled, Font_System5x8);
+        ssd1306DrawString(0, 2, enabled);
     }
     settings.data.functions ^= SETTINGS_FUNCTION_SHIFTER;
     writeSettings(&settings);
@@ -300,14 +318,15 @@ void toggleShifter(void)
 
 void toggleTC(void)
 {
-    ssd1306DrawString(10, 0, "Traction control", Font_System5x8);
+    ssd1306ClearScreen();
+    drawTitle("Traction control");
     if (settings.data.functions & SETTINGS_FUNCTION_TC)
     {
-        ssd1306DrawString(25, 0, disabled, Font_System5x8);
+        ssd1306DrawString(0, 2, disabled);
     }
     else
     {
-        ssd1306DrawString(25, 0, enabled, Font_System5x8);
+        ssd1306DrawString(0, 2, enabled);
     }
     settings.data.functions ^= SETTINGS_FUNCTION_TC;
     writeSettings(&settings);
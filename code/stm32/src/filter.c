@@ -0,0 +1,40 @@
+#include "filter.h"
+
+void filterInit(filter_t* f)
+{
+    uint8_t i;
+
+    for (i = 0; i < FILTER_TAPS; i++)
+    {
+        f->taps[i] = 0;
+    }
+    f->total = 0;
+    f->last = 0;
+    f->pos = 0;
+}
+
+/*
+ * Consumes FILTER_DECIMATION samples, stride apart, and returns the
+ * new filtered value in Q12.4.
+ */
+uint16_t filterDecimate(filter_t* f, const uint16_t* samples, uint8_t stride)
+{
+    uint16_t sum = 0;
+    uint8_t i;
+
+    /* Stage 1, integrate and dump */
+    for (i = 0; i < FILTER_DECIMATION; i++)
+    {
+        sum += *samples;
+        samples += stride;
+    }
+
+    /* Stage 2, running total of the last FILTER_TAPS sums */
+    f->total += sum;
+    f->total -= f->taps[f->pos];
+    f->taps[f->pos] = sum;
+    f->pos = (f->pos + 1) % FILTER_TAPS;
+    f->last = sum;
+
+    return f->total >> (FILTER_GAIN_BITS - FILTER_FRAC_BITS);
+}
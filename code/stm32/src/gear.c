@@ -0,0 +1,319 @@
+#include "gear.h"
+
+/*
+ * Windows from gears_ratio, the table stops at the first zero, at a
+ * ratio that is not above the previous one or at one the learner has no
+ * bin for, so a table can always be learned again.
+ */
+void gearBuildTable(gear_table_t* table, const Settings_data* data)
+{
+    uint32_t ratio[GEAR_MAX];
+    uint8_t i, n = 0;
+
+    for (i = 0; i < data->gears_ratio.size && i < GEAR_MAX; i++)
+    {
+        const uint32_t r = (uint32_t)data->gears_ratio.bytes[i] << GEAR_Q;
+
+        if (r == 0 || r >= ((uint32_t)GEAR_LEARN_BINS << GEAR_Q) || (n > 0 && r <= ratio[n - 1]))
+        {
+            break;
+        }
+        ratio[n++] = r;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        /* Outer gears mirror their only neighbour, a single gear gets 1/8 */
+        uint32_t below = (i > 0) ? ratio[i] - ratio[i - 1] : 0;
+        uint32_t above = (i + 1 < n) ? ratio[i + 1] - ratio[i] : 0;
+
+        if (below == 0)
+        {
+            below = (above != 0) ? above : ratio[i] / 8;
+        }
+        if (above == 0)
+        {
+            above = below;
+        }
+
+        table->lo[i] = (below * 3 / 8 < ratio[i]) ? ratio[i] - below * 3 / 8 : 0;
+        table->hi[i] = ratio[i] + above * 3 / 8;
+        table->hyst[i] = ((below < above) ? below : above) / 8;
+    }
+    table->count = n;
+}
+
+/* Multiplying a speed by this gives its Q12 ratio, 0 if the engine is stopped */
+uint32_t gearRpmRecip(uint32_t rpm)
+{
+    if (rpm < GEAR_MIN_RPM)
+    {
+        return 0;
+    }
+    return ((uint32_t)GEAR_RATIO_SCALE << GEAR_Q) / rpm;
+}
+
+/* Gear whose window holds ratio, or GEAR_NEUTRAL */
+uint8_t gearClassify(const gear_table_t* table, uint32_t ratio)
+{
+    uint8_t lo = 0, hi = table->count;
+
+    /* Last window that starts at or below ratio */
+    while (lo < hi)
+    {
+        const uint8_t mid = (lo + hi) / 2;
+
+        if (table->lo[mid] <= ratio)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0 || ratio > table->hi[lo - 1])
+    {
+        return GEAR_NEUTRAL;
+    }
+    return lo - 1;
+}
+
+void gearInit(gear_est_t* g)
+{
+    g->gear = 0;
+    g->neutral = 1;
+    g->candidate = GEAR_NEUTRAL;
+    g->count = 0;
+}
+
+/*
+ * One sample, speed in Hz and rpm_recip from gearRpmRecip(). Without a
+ * learned table every sample is the first gear.
+ */
+void gearUpdate(gear_est_t* g, const gear_table_t* table, uint32_t speed, uint32_t rpm_recip)
+{
+    const uint8_t current = g->neutral ? GEAR_NEUTRAL : g->gear;
+    uint8_t sample;
+
+    if (table->count == 0)
+    {
+        g->gear = 0;
+        g->neutral = 0;
+        return;
+    }
+
+    if (rpm_recip == 0)
+    {
+        sample = GEAR_NEUTRAL;
+    }
+    else
+    {
+        const uint32_t ratio = ((speed > 0xFFFF) ? 0xFFFF : speed) * rpm_recip;
+
+        /* The engaged gear holds on until the ratio leaves its widened window */
+        if (current != GEAR_NEUTRAL && current < table->count
+                && ratio + table->hyst[current] >= table->lo[current]
+                && ratio <= table->hi[current] + table->hyst[current])
+        {
+            sample = current;
+        }
+        else
+        {
+            sample = gearClassify(table, ratio);
+        }
+    }
+
+    if (sample == current)
+    {
+        g->candidate = sample;
+        g->count = 0;
+        return;
+    }
+
+    if (sample == g->candidate)
+    {
+        g->count++;
+    }
+    else
+    {
+        g->candidate = sample;
+        g->count = 1;
+    }
+
+    if (g->count >= ((sample == GEAR_NEUTRAL) ? GEAR_NEUTRAL_CONFIRM : GEAR_CONFIRM))
+    {
+        if (sample == GEAR_NEUTRAL)
+        {
+            g->neutral = 1;
+        }
+        else
+        {
+            g->gear = sample;
+            g->neutral = 0;
+        }
+        g->count = 0;
+    }
+}
+
+void gearLearnInit(gear_learn_t* l)
+{
+    uint16_t i;
+
+    for (i = 0; i < GEAR_LEARN_BINS; i++)
+    {
+        l->hist[i] = 0;
+    }
+    l->prev = 0;
+    l->samples = 0;
+    l->saturated = 0;
+}
+
+/*
+ * One sample from the capture interrupt, a handful of instructions.
+ * Samples of a saturated bin are dropped until a thread has halved the
+ * histogram with gearLearnHalve(), once in 65535 samples of a gear.
+ */
+void gearLearnSample(gear_learn_t* l, uint32_t speed, uint32_t rpm, uint32_t rpm_recip)
+{
+    const uint32_t ratio = ((speed > 0xFFFF) ? 0xFFFF : speed) * rpm_recip;
+    const uint32_t prev = l->prev;
+    const uint32_t diff = (ratio > prev) ? ratio - prev : prev - ratio;
+    const uint32_t bin = (ratio + (1 << (GEAR_Q - 1))) >> GEAR_Q;
+
+    l->prev = ratio;
+
+    if (rpm < GEAR_LEARN_MIN_RPM || rpm_recip == 0
+            || diff > (prev >> GEAR_LEARN_STEADY_SHIFT)
+            || bin == 0 || bin >= GEAR_LEARN_BINS)
+    {
+        return;
+    }
+
+    if (l->hist[bin] == 0xFFFF)
+    {
+        l->saturated = 1;
+        return;
+    }
+    l->hist[bin]++;
+    l->samples++;
+}
+
+/*
+ * Halves count bins from the first one, the caller keeps the capture
+ * interrupt out. The last bin clears saturated.
+ */
+void gearLearnHalve(gear_learn_t* l, uint16_t first, uint16_t count)
+{
+    uint16_t i;
+
+    for (i = first; i < first + count && i < GEAR_LEARN_BINS; i++)
+    {
+        l->hist[i] >>= 1;
+    }
+    if (i == GEAR_LEARN_BINS)
+    {
+        l->saturated = 0;
+    }
+}
+
+static uint32_t smoothed(const gear_learn_t* l, uint16_t i)
+{
+    const uint32_t below = (i > 0) ? l->hist[i - 1] : 0;
+    const uint32_t above = (i + 1 < GEAR_LEARN_BINS) ? l->hist[i + 1] : 0;
+
+    return below + 2 * l->hist[i] + above;
+}
+
+/*
+ * Gear ratios and confidences in percent, first gear first. Returns the
+ * number of gears found. Runs in a thread, it scans the histogram twice.
+ */
+uint8_t gearLearnFind(const gear_learn_t* l, uint8_t ratio[GEAR_MAX], uint8_t confidence[GEAR_MAX])
+{
+    uint32_t height[GEAR_MAX], top = 0;
+    uint16_t peak[GEAR_MAX], i;
+    uint8_t n = 0, g;
+
+    for (i = 1; i < GEAR_LEARN_BINS - 1; i++)
+    {
+        const uint32_t s = smoothed(l, i);
+
+        if (s > top)
+        {
+            top = s;
+        }
+    }
+
+    /* Local maxima, the GEAR_MAX highest ones if there are more */
+    for (i = 1; i < GEAR_LEARN_BINS - 1; i++)
+    {
+        const uint32_t s = smoothed(l, i);
+        uint8_t low = 0;
+
+        if (s < GEAR_LEARN_MIN_PEAK || s < top / GEAR_LEARN_MIN_SHARE
+                || s <= smoothed(l, i - 1) || s < smoothed(l, i + 1))
+        {
+            continue;
+        }
+
+        /* Too close to the previous peak, keep the higher one */
+        if (n > 0 && i - peak[n - 1] < GEAR_LEARN_MIN_GAP)
+        {
+            if (s > height[n - 1])
+            {
+                peak[n - 1] = i;
+                height[n - 1] = s;
+            }
+            continue;
+        }
+
+        if (n < GEAR_MAX)
+        {
+            peak[n] = i;
+            height[n++] = s;
+            continue;
+        }
+
+        for (g = 1; g < n; g++)
+        {
+            if (height[g] < height[low])
+            {
+                low = g;
+            }
+        }
+        if (s > height[low])
+        {
+            for (g = low; g + 1 < n; g++)
+            {
+                peak[g] = peak[g + 1];
+                height[g] = height[g + 1];
+            }
+            peak[n - 1] = i;
+            height[n - 1] = s;
+        }
+    }
+
+    for (g = 0; g < n; g++)
+    {
+        const uint16_t from = (peak[g] > GEAR_LEARN_SPAN) ? peak[g] - GEAR_LEARN_SPAN : 1;
+        const uint16_t to = (peak[g] + GEAR_LEARN_SPAN < GEAR_LEARN_BINS) ? peak[g] + GEAR_LEARN_SPAN : GEAR_LEARN_BINS - 1;
+        uint32_t mass = 0, moment = 0, core;
+
+        for (i = from; i <= to; i++)
+        {
+            mass += l->hist[i];
+            moment += i * l->hist[i];
+        }
+        core = l->hist[peak[g] - 1] + l->hist[peak[g]] + l->hist[peak[g] + 1];
+
+        ratio[g] = (moment + mass / 2) / mass;
+        confidence[g] = (core * 100) / mass;
+        if (mass < GEAR_LEARN_FULL_MASS)
+        {
+            confidence[g] = (confidence[g] * mass) / GEAR_LEARN_FULL_MASS;
+        }
+    }
+    return n;
+}
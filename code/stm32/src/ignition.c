@@ -1,27 +1,55 @@
+#include <string.h> // memcmp
 #include "threads.h"
 
 #define IGN_TIMER TIM3
 #define IGN_TIMER_IRQn TIM3_IRQn
 #define IGN_TIMER_IRQHandler TIM3_IRQHandler
-#define IGN_TIMER_PSC 48 /* 500KHz (24Mhz/48), max time 131ms */
+#define IGN_TIMER_CLK 500000 /* 500KHz, max time 131ms */
+#define IGN_TIMER_PSC (STM32_PCLK/IGN_TIMER_CLK)
 #define IGN_TIMER_ARR 0xFFFF
-/* Convert x from ms to us, divide by timer clock period in us */
-#define IGN_TIMER_CONV(x) (IGN_TIMER_ARR-(((uint32_t)x*1000)/(1000000/(STM32_PCLK/IGN_TIMER_PSC))))
+/* Convert x from ms to timer ticks */
+#define IGN_TIMER_TICKS(x) (((uint32_t)x*IGN_TIMER_CLK)/1000)
+/* Convert x from us to timer ticks */
+#define IGN_TIMER_TICKS_US(x) (((uint32_t)(x))/(1000000/IGN_TIMER_CLK))
+#define IGN_TIMER_ALL_CC (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E)
 
-#define SLIP_CUT_TIME 100 /* Max: 131ms */
+#define SLIP_CUT_TIME 100 /* At 100% trim and full RPM, max: 131ms */
+#define SYNC_CUT_MAX_US (TC_CUT_MAX * 1000)
 
 uint8_t cutting = false;
-uint8_t cutting_count = 0;
+static uint8_t cutting_tc = false; /* The running cut is a progressive TC pulse */
+static uint32_t sync_end = 0; /* IGN_TIMER count where the plain cut would end, 0 when not synchronised */
+static uint8_t shift_armed = true; /* One cut per shift, until the strain gauge is released */
+static cut_t cut_event = {0, 0, 0, 0}; /* Last cut, pushed to the GUI */
+
+/* Built by the thread, read by the interrupts */
+static tc_table_t tc_table;
+static uint8_t tc_built = false;
+static tc_pi_t tc_pi;
+static tc_pattern_t tc_pattern;
+static struct {
+    uint32_t slip_threshold;
+    uint32_t min_rpm;
+    Settings_data_tc_gear_trim_t tc_gear_trim;
+} tc_source;
+
+/*
+ * Function prototypes.
+ */
+
+static void armCut(const uint32_t ticks[4], uint16_t channels);
+static uint32_t cutTicks(uint8_t cut_time);
+static void cutEventI(uint8_t reason, const uint32_t ticks[4]);
 
 /*
  * Actual functions.
  */
 
-void startIgnition(void) {
+/* The TC table is kept up to date by updateTcTable(), from the sensors thread */
+void initIgnition(void) {
 
     TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
     TIM_OCInitTypeDef TIM_OCInitStructure;
-    uint8_t pulses[4] = {0,0,0,0};
 
     /* Time base configuration */
     TIM_TimeBaseStructure.TIM_Prescaler = IGN_TIMER_PSC - 1;
@@ -41,95 +69,327 @@ void startIgnition(void) {
     TIM_OC3Init(IGN_TIMER, &TIM_OCInitStructure);
     TIM_OC4Init(IGN_TIMER, &TIM_OCInitStructure);
 
+    tcPiInit(&tc_pi);
+    tcPatternInit(&tc_pattern);
+
+    /* Outputs are enabled per cut in armCut() */
+    IGN_TIMER->CCER &= ~IGN_TIMER_ALL_CC;
+
     /* One Pulse Mode selection */
     TIM_SelectOnePulseMode(IGN_TIMER, TIM_OPMode_Single);
 
     IGN_TIMER->DIER |= TIM_DIER_UIE; // Enable update interrupt (timer level)
     NVIC_EnableIRQ(IGN_TIMER_IRQn); // Enable interrupt from IGN_TIMER (NVIC level)
 
-    serDbg("startIgnition Complete\r\n");
+    updateTcTable();
+
+    /*
+     * Cuts are armed from the sensor interrupts, see ignitionTriggerI().
+     */
+    serDbg("initIgnition Complete\r\n");
+}
+
+/*
+ * Rebuilds the TC table when its settings changed, a gear at a time:
+ * each row is computed on the stack and copied in under the lock, so
+ * the interrupts never see a row half written.
+ */
+void updateTcTable(void)
+{
+    tc_row_t row;
+    uint8_t gear;
+
+    if (tc_built
+            && tc_source.slip_threshold == settings.data.slip_threshold
+            && tc_source.min_rpm == settings.data.min_rpm
+            && memcmp(&tc_source.tc_gear_trim, &settings.data.tc_gear_trim, sizeof(tc_source.tc_gear_trim)) == 0)
+    {
+        return;
+    }
+
+    tc_source.slip_threshold = settings.data.slip_threshold;
+    tc_source.min_rpm = settings.data.min_rpm;
+    tc_source.tc_gear_trim = settings.data.tc_gear_trim;
+
+    for (gear = 0; gear < TC_GEARS; gear++)
+    {
+        tcBuildRow(&row, &settings.data, SLIP_CUT_TIME, gear);
+        chSysLock();
+        tc_table.gear[gear] = row;
+        chSysUnlock();
+    }
+    tc_built = true;
+}
+
+/* Entry for the current gear and RPM, constant time */
+tc_entry_t getTcEntryI(void)
+{
+    return tcLookup(&tc_table, getCurGearIdx(), sensors.rpm);
+}
+
+/*
+ * Decides whether to cut and arms IGN_TIMER.
+ *
+ * Called from DMA1_Ch1 (strain gauge), TIM2 (wheel speed) and TIM3 (end
+ * of cut) interrupts. They all run at NVIC priority 0 so they cannot
+ * preempt each other. Latency budget from a strain gauge crossing to the
+ * cut output: one half of adc_samples (4 sequences of 4 conversions of
+ * 18us, 288us), the DMA interrupt, then one IGN_TIMER tick (2us).
+ */
+void ignitionTriggerI(void)
+{
+    uint32_t ticks[4];
+    uint8_t shift, i;
+
+    if (!status.shifting)
+    {
+        shift_armed = true;
+    }
 
-    while (true) {
+    /* With the clutch in or in neutral there is no drive to take off */
+    shift = status.shifting && shift_armed && !getCurGearNeutral()
+            && (settings.data.functions & SETTINGS_FUNCTION_SHIFTER);
+
+    /* Are we already cutting the ignition? Is it enabled? A shift overrides a progressive TC pulse */
+    if ((cutting == true && !(cutting_tc && shift)) || settings.data.cut_type == SETTINGS_CUT_DISABLED)
+    {
+        return;
+    }
+
+    /* Are we shifting a gear? */
+    if (shift)
+    {
+        /* Get cut time based on current gear */
+        const uint32_t cut = cutTicks(getCurCutTime());
 
-        chThdSleepMilliseconds(20);
+        shift_armed = false;
 
-        /* Are we already cutting the ignition? Is it enabled? */
-        if (cutting == true || settings.data.cut_type == SETTINGS_CUT_DISABLED)
+        for (i = 0; i < 4; i++)
         {
-            continue;
+            ticks[i] = cut;
         }
+    }
+
+    /* Are we slipping? Progressive cuts are scheduled per revolution */
+    else if (status.slipping && (settings.data.functions & SETTINGS_FUNCTION_TC)
+            && settings.data.cut_type != SETTINGS_CUT_PROGRESSIVE)
+    {
+        /* Cut time for this gear and RPM */
+        const uint32_t cut = cutTicks(getTcEntryI().cut_time);
 
-        /* Are we shifting a gear? */
-        if (status.shifting && (settings.data.functions & SETTINGS_FUNCTION_SHIFTER))
+        for (i = 0; i < 4; i++)
         {
-            /* Get cut time based on current gear */
-            const uint8_t cut_time = getCurCutTime();
+            ticks[i] = cut;
+        }
+    }
+
+    else
+    {
+        return;
+    }
+
+    cutEventI(shift ? RECORDER_TRIGGER_SHIFT : RECORDER_TRIGGER_TC, ticks);
+    armCut(ticks, IGN_TIMER_ALL_CC);
+    cutting_tc = false;
+}
+
+/*
+ * Length of a cut of cut_time ms in IGN_TIMER ticks.
+ *
+ * With SETTINGS_CUT_SYNC the next sparks are predicted from the last
+ * ignition edge and the engine period. The cut removes the sparks that
+ * fall within cut_time, at least one, and ends 1/8 of a revolution after
+ * the last of them instead of somewhere in the following cycle. The end
+ * is moved again at every ignition edge, see ignitionRevolutionI().
+ */
+static uint32_t cutTicks(uint8_t cut_time)
+{
+    uint32_t since, period, sparks;
 
-            pulses[0] = cut_time;
-            pulses[1] = cut_time;
-            pulses[2] = cut_time;
-            pulses[3] = cut_time;
+    sync_end = 0;
+    if (settings.data.cut_type != SETTINGS_CUT_SYNC || !getEnginePhaseI(&since, &period))
+    {
+        return IGN_TIMER_TICKS(cut_time);
+    }
+
+    /* Sparks at period - since, 2 * period - since... */
+    sparks = (since + (uint32_t)cut_time * 1000) / period;
+    if (sparks == 0)
+    {
+        sparks = 1;
+    }
+    while (sparks > 1 && sparks * period - since + period > SYNC_CUT_MAX_US)
+    {
+        sparks--;
+    }
 
-            IGN_TIMER->CCER |= (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
+    /* A whole period of margin, the spark edges trim it */
+    sync_end = IGN_TIMER_TICKS_US(sparks * period - since);
+    if (sync_end < IGN_TIMER_TICKS(cut_time))
+    {
+        sync_end = IGN_TIMER_TICKS(cut_time);
+    }
+    return IGN_TIMER_TICKS_US(sparks * period - since + period);
+}
+
+/*
+ * Progressive TC, called from the RPM capture interrupt once per engine
+ * revolution with its period in us. The PI controller sets the share of
+ * sparks to drop and the pattern picks the cylinders whose spark at the
+ * next edge is cut. Outputs are assumed to spark once per revolution
+ * (wasted spark) on the measured edge, cylinder i on IGN_TIMER channel i+1.
+ */
+void ignitionRevolutionI(uint32_t period)
+{
+    uint32_t ticks[4];
+    uint16_t depth, channels = 0;
+    uint8_t cylinders, i;
+
+    /*
+     * A synchronised cut is re-timed from each spark it removes, the
+     * engine slows down by a lot in one revolution when the gear engages.
+     * If the next spark is due before the end of the plain cut it waits
+     * for it with a whole period of margin, else it ends now.
+     */
+    if (cutting == true && sync_end != 0)
+    {
+        const uint32_t cnt = IGN_TIMER->CNT;
+        uint32_t end = cnt + IGN_TIMER_TICKS_US(period / 8);
+
+        if (cnt + IGN_TIMER_TICKS_US(period) <= sync_end)
+        {
+            end = cnt + IGN_TIMER_TICKS_US(2 * period);
         }
+        if (end < IGN_TIMER_ARR)
+        {
+            IGN_TIMER->ARR = end;
+        }
+    }
+
+    if (settings.data.cut_type != SETTINGS_CUT_PROGRESSIVE
+            || !(settings.data.functions & SETTINGS_FUNCTION_TC)
+            || sensors.speed <= settings.data.min_speed
+            || sensors.rpm <= settings.data.min_rpm)
+    {
+        tcPiInit(&tc_pi);
+        return;
+    }
 
-        /* Are we slipping? */
-        else if ((status.slipping_pct > settings.data.slip_threshold) && (settings.data.functions & SETTINGS_FUNCTION_TC))
+    depth = tcPiUpdate(&tc_pi, (int32_t)status.slipping_pct - getTcEntryI().threshold, period);
+    cylinders = tcPatternNext(&tc_pattern, depth);
+
+    /* Nothing to cut, or a gear shift cut is running */
+    if (cylinders == 0 || (cutting == true && !cutting_tc))
+    {
+        return;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        /* Over the spark at the next edge, it ends 1/8 of a revolution after it */
+        ticks[i] = (cylinders & (1 << i)) ? IGN_TIMER_TICKS_US(period + period / 8) : 0;
+        if (cylinders & (1 << i))
         {
-            pulses[0] = SLIP_CUT_TIME;
-            pulses[1] = SLIP_CUT_TIME;
-            pulses[2] = SLIP_CUT_TIME;
-            pulses[3] = SLIP_CUT_TIME;
-
-            IGN_TIMER->CCER |= (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
-
-            /* This mode cuts cylinders one by one up to 4 */
-            if (settings.data.cut_type == SETTINGS_CUT_PROGRESSIVE && cutting_count < 4)
-            {
-                cutting_count++;
-
-                /* Disable all OC outputs */
-                IGN_TIMER->CCER &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
-
-                /* Enable OC outputs based on cylinder cut count */
-                switch(cutting_count)
-                {
-                    case 1:
-                        IGN_TIMER->CCER |= TIM_CCER_CC1E;
-                        break;
-                    case 2:
-                        IGN_TIMER->CCER |= (TIM_CCER_CC1E | TIM_CCER_CC2E);
-                        break;
-                    case 3:
-                        IGN_TIMER->CCER |= (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E);
-                        break;
-                    case 4:
-                        IGN_TIMER->CCER |= (TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
-                        break;
-                    default:
-                        break;
-                }
-            }
+            channels |= TIM_CCER_CC1E << (i * 4);
         }
+    }
+
+    cutEventI(RECORDER_TRIGGER_TC, ticks);
+    armCut(ticks, channels);
+    cutting_tc = true;
+    sync_end = 0;
+}
+
+/*
+ * Starts the one pulse on the given channels, ticks are IGN_TIMER ticks.
+ *
+ * PWM2 keeps the outputs inactive while the counter sits at 0, so every
+ * pulse starts one tick after CEN and ends together on the update event:
+ * ARR is the longest pulse and CCRx = ARR - pulse. A running pulse is
+ * replaced.
+ */
+static void armCut(const uint32_t ticks[4], uint16_t channels)
+{
+    volatile uint32_t* const ccr[4] = {&IGN_TIMER->CCR1, &IGN_TIMER->CCR2, &IGN_TIMER->CCR3, &IGN_TIMER->CCR4};
+    uint32_t pulse[4];
+    uint32_t arr = 0;
+    uint8_t i;
 
-        else
+    for (i = 0; i < 4; i++)
+    {
+        pulse[i] = ticks[i];
+        if (pulse[i] >= IGN_TIMER_ARR)
+        {
+            pulse[i] = IGN_TIMER_ARR - 1;
+        }
+        if (pulse[i] > arr)
         {
-            cutting_count = 0;
-            continue;
+            arr = pulse[i];
         }
+    }
+    arr++;
 
-        cutting = true;
-        palSetPad(GPIOB, GPIOB_PIN9);
+    cutting = true;
+    palSetPad(GPIOB, GPIOB_PIN9);
 
-        /* Convert cut time to CCR value and assign to register */
-        IGN_TIMER->CCR1 = IGN_TIMER_CONV(pulses[0]);
-        IGN_TIMER->CCR2 = IGN_TIMER_CONV(pulses[1]);
-        IGN_TIMER->CCR3 = IGN_TIMER_CONV(pulses[2]);
-        IGN_TIMER->CCR4 = IGN_TIMER_CONV(pulses[3]);
+    /* Stop a running pulse, its end of cut must not fire */
+    IGN_TIMER->CR1 &= ~TIM_CR1_CEN;
+    IGN_TIMER->CNT = 0;
+    IGN_TIMER->SR &= ~TIM_SR_UIF;
+    IGN_TIMER->CCER &= ~IGN_TIMER_ALL_CC;
 
-        /* IGN_TIMER enable counter */
-        IGN_TIMER->CR1 |= TIM_CR1_CEN;
+    IGN_TIMER->ARR = arr;
+    for (i = 0; i < 4; i++)
+    {
+        *ccr[i] = arr - pulse[i];
     }
+    IGN_TIMER->CCER |= channels;
+
+    /* IGN_TIMER enable counter */
+    IGN_TIMER->CR1 |= TIM_CR1_CEN;
+}
+
+/*
+ * Called before a cut is armed, triggers the flight recorder. A pulse
+ * that replaces the running one of the same reason extends that cut,
+ * the outputs do not go back in between.
+ */
+static void cutEventI(uint8_t reason, const uint32_t ticks[4])
+{
+    uint32_t longest = 0;
+    uint8_t i;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (ticks[i] > longest)
+        {
+            longest = ticks[i];
+        }
+    }
+
+    if (!cutting || reason != cut_event.reason)
+    {
+        cut_event.count++;
+    }
+    cut_event.time = chVTGetSystemTimeX() / (NIL_CFG_ST_FREQUENCY / 1000);
+    cut_event.reason = reason;
+    cut_event.duration = longest * (1000000 / IGN_TIMER_CLK);
+
+    recordTriggerI(reason);
+}
+
+/* Last cut, count is 0 before the first one */
+void getCutEvent(cut_t* cut)
+{
+    chSysLock();
+    *cut = cut_event;
+    chSysUnlock();
+}
+
+/* Cut state for the flight recorder */
+uint8_t getCutStateI(void)
+{
+    return (cutting ? RECORDER_FLAG_CUT : 0) | (cutting_tc ? RECORDER_FLAG_CUT_TC : 0);
 }
 
 void doCut(uint16_t cut_time)
@@ -148,7 +408,12 @@ void IGN_TIMER_IRQHandler(void)
         IGN_TIMER->CCER &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC3E | TIM_CCER_CC4E);
 
         cutting = false;
+        cutting_tc = false;
+        sync_end = 0;
 
         palClearPad(GPIOB, GPIOB_PIN9);
+
+        /* Still slipping or a shift came in during the cut */
+        ignitionTriggerI();
     }
 }
@@ -8,18 +8,18 @@
  */
 
 light_settings_t light_settings = {LIGHT_STATE_OFF, 250};
+static light_settings_t previous_settings;
 void updateLight(light_settings_t* s);
 
-TIM_OCInitTypeDef  TIM_OCInitStructure;
-
 /*
  * Actual functions.
  */
 
-void startLight(void)
+void initLight(void)
 {
+    TIM_OCInitTypeDef  TIM_OCInitStructure;
 
-    light_settings_t previous_settings = light_settings;
+    previous_settings = light_settings;
 
     LED_TIMER->CR1 = 0;
     LED_TIMER->CR2 = 0;
@@ -33,36 +33,35 @@ void startLight(void)
     TIM_OCInitStructure.TIM_Pulse = light_settings.duration; // period in ms
     TIM_OC1Init(LED_TIMER, &TIM_OCInitStructure);
 
-    serDbg("startLight Complete\r\n");
+    serDbg("initLight Complete\r\n");
+}
 
-    while (true)
+/* Called every LIGHT_PERIOD ms by the watchdog thread */
+void updateLightTick(void)
+{
+    if (settings.data.functions & SETTINGS_FUNCTION_LED)
     {
-        chThdSleepMilliseconds(75);
+        /* Skip if updating is not needed */
+        if (light_settings.state == previous_settings.state &&
+                light_settings.duration == previous_settings.duration)
+            return;
 
-        if (settings.data.functions & SETTINGS_FUNCTION_LED)
+        previous_settings = light_settings;
+
+        if (status.slipping)
         {
-            /* Skip if updating is not needed */
-            if (light_settings.state == previous_settings.state &&
-                    light_settings.duration == previous_settings.duration)
-                continue;
-
-            previous_settings = light_settings;
-
-            if (status.slipping_pct >= settings.data.slip_threshold)
-            {
-                light_settings.state = LIGHT_STATE_STILL;
-            }
-            else if (status.shifting)
-            {
-                light_settings.state = LIGHT_STATE_PULSE;
-            }
-            else
-            {
-                light_settings.state = LIGHT_STATE_OFF;
-            }
-
-            updateLight(&light_settings);
+            light_settings.state = LIGHT_STATE_STILL;
         }
+        else if (status.shifting)
+        {
+            light_settings.state = LIGHT_STATE_PULSE;
+        }
+        else
+        {
+            light_settings.state = LIGHT_STATE_OFF;
+        }
+
+        updateLight(&light_settings);
     }
 }
 
@@ -1,18 +1,32 @@
+#include <string.h>
 #include "hal.h"
 #include "nil.h"
 #include "threads.h"
+#include "update.h"
 
 /*
  * All clocks are enabled in hwInit();
  * All Pin Mux are set in board.h
  */
 
+#define WATCHDOG_PERIOD 25 /* ms, within the 43.7ms of the WWDG */
+
+/*
+ * Each working area holds the deepest call chain of its thread, from the
+ * -fstack-usage frames and the call graph of the image, nanopb with one
+ * nested message. THD_WORKING_AREA() adds the switch context and an
+ * interrupt frame on top.
+ */
+
 /*
- * Thread 0.
+ * Thread 0, the watchdog. The highest priority, so it also runs the
+ * shift light every LIGHT_PERIOD instead of a thread of its own.
  */
-THD_WORKING_AREA(waThread0, 64);
+THD_WORKING_AREA(waThread0, 144); /* 140, initLight() */
 THD_FUNCTION(Thread0, arg)
 {
+    uint8_t ticks = 0;
+
     (void)arg;
     if (RCC->CSR & RCC_CSR_WWDGRSTF)
     {
@@ -23,6 +37,8 @@ THD_FUNCTION(Thread0, arg)
         RCC->CSR |= RCC_CSR_RMVF;
     }
 
+    initLight();
+
     /* WWDG clock counter = (PCLK1 (48MHz)/4096)/8 = 1464Hz (~683 us)  */
     WWDG_SetPrescaler(WWDG_Prescaler_8);
 
@@ -40,58 +56,45 @@ THD_FUNCTION(Thread0, arg)
     serDbg("WWDG Started\r\n");
     while (true)
     {
-        chThdSleepMilliseconds(25);
+        chThdSleepMilliseconds(WATCHDOG_PERIOD);
         palTogglePad(GPIOC, GPIOC_LED3); /* Watchdog heartbeat */
         WWDG_SetCounter(127);
+
+        if (++ticks == LIGHT_PERIOD / WATCHDOG_PERIOD)
+        {
+            ticks = 0;
+            updateLightTick();
+        }
     }
 }
 
 /*
  * Thread 1.
  */
-THD_WORKING_AREA(waThread1, 128);
+THD_WORKING_AREA(waThread1, 168); /* 168, setGears() */
 THD_FUNCTION(Thread1, arg)
-{
-    (void)arg;
-    startLight();
-}
-
-/*
- * Thread 2.
- */
-THD_WORKING_AREA(waThread2, 256);
-THD_FUNCTION(Thread2, arg)
 {
     (void)arg;
     startDisplay();
 }
 
 /*
- * Thread 3.
- */
-THD_WORKING_AREA(waThread3, 128);
-THD_FUNCTION(Thread3, arg)
-{
-    (void)arg;
-     startIgnition();
-}
-
-/*
- * Thread 4.
+ * Thread 2, also keeps the TC table of the ignition up to date.
  */
-THD_WORKING_AREA(waThread4, 128);
-THD_FUNCTION(Thread4, arg)
+THD_WORKING_AREA(waThread2, 256); /* 256, gearLearnFind() */
+THD_FUNCTION(Thread2, arg)
 {
     (void)arg;
+    initIgnition();
     startAdc(); /* ADC runs in continuous mode with DMA */
     startSensors();
 }
 
 /*
- * Thread 5.
+ * Thread 3.
  */
-THD_WORKING_AREA(waThread5, 128);
-THD_FUNCTION(Thread5, arg)
+THD_WORKING_AREA(waThread3, 664); /* 664, decoding settings_t */
+THD_FUNCTION(Thread3, arg)
 {
     (void)arg;
     startSerialCom();
@@ -103,11 +106,9 @@ THD_FUNCTION(Thread5, arg)
  */
 THD_TABLE_BEGIN
     THD_TABLE_ENTRY(waThread0, "Watchdog", Thread0, NULL)
-    THD_TABLE_ENTRY(waThread1, "Light", Thread1, NULL)
-    THD_TABLE_ENTRY(waThread2, "Display", Thread2, NULL)
-    THD_TABLE_ENTRY(waThread3, "Ignition", Thread3, NULL)
-    THD_TABLE_ENTRY(waThread4, "Sensors", Thread4, NULL)
-    THD_TABLE_ENTRY(waThread5, "Serial Com", Thread5, NULL)
+    THD_TABLE_ENTRY(waThread1, "Display", Thread1, NULL)
+    THD_TABLE_ENTRY(waThread2, "Sensors", Thread2, NULL)
+    THD_TABLE_ENTRY(waThread3, "Serial Com", Thread3, NULL)
 THD_TABLE_END
 
 /*
@@ -121,6 +122,15 @@ int main(void)
     * - Nil RTOS initialization.
     */
     halInit();
+
+    /*
+     * The update stage holds the start of the flash and the Cortex-M0
+     * has no vector table offset: the vectors run from SRAM, mapped at 0.
+     * halInit() resets SYSCFG, so only now.
+     */
+    memcpy((void*)UPDATE_RAM_ADDR, (const void*)UPDATE_APP_ADDR, UPDATE_VECTORS_SIZE);
+    SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE;
+
     settingsInit();
     usartInit(DBG_USART);
     chSysInit();
@@ -19,7 +19,7 @@ menuStruct mainMenu = {"Main Menu", 10, mainMenuItemList};
 void item2Handle(void)
 {
   ssd1306ClearScreen();
-  ssd1306DrawString(0, 0, "item2Handle", Font_System5x8);
+  ssd1306DrawString(0, 0, "item2Handle");
 
   while(BUTTON_SEL) {};
 
@@ -32,37 +32,37 @@ void drawMenu(menuStruct_t *menuToShow, short selectedIndex)
  uint8_t i, y;
 
  ssd1306ClearScreen();
- ssd1306DrawString(0, 0, menuToShow->menuName, Font_System5x8);
+ ssd1306DrawString(0, 0, menuToShow->menuName);
 
  for(i=0;i < ((menuToShow->numberItems+1) > 6 ? 6 : (menuToShow->numberItems+1)) ;i++)
  {
-  y = (i*7)+1;
+  y = i+1;
   if (i > 5 + (selectedIndex > 5 ? selectedIndex - 5 : 0))
   {
    break;
   }
   else if (selectedIndex < 6)
   {
-      if (selectedIndex == i) ssd1306DrawChar(0, y, '>', Font_System5x8);
+      if (selectedIndex == i) ssd1306DrawChar(0, y, '>');
       if (selectedIndex > menuToShow->numberItems)
       {
-          ssd1306DrawString(7, y, "Go Back", Font_System5x8);
+          ssd1306DrawString(1, y, "Go Back");
       }
       else
       {
-          ssd1306DrawString(7, y, menuToShow->items[i].itemName, Font_System5x8);
+          ssd1306DrawString(1, y, menuToShow->items[i].itemName);
       }
   }
   else
   {
-      if (selectedIndex == i+(selectedIndex-5)) ssd1306DrawChar(0, y, '>', Font_System5x8);
+      if (selectedIndex == i+(selectedIndex-5)) ssd1306DrawChar(0, y, '>');
       if (selectedIndex > menuToShow->numberItems)
       {
-          ssd1306DrawString(7, y, "Go Back", Font_System5x8);
+          ssd1306DrawString(1, y, "Go Back");
       }
       else
       {
-          ssd1306DrawString(7, y, menuToShow->items[i+(selectedIndex-5)].itemName, Font_System5x8);
+          ssd1306DrawString(1, y, menuToShow->items[i+(selectedIndex-5)].itemName);
       }
   }
  }
@@ -0,0 +1,245 @@
+#include <string.h> // memcpy, memset
+#include "recorder.h"
+
+#define RECORDER_VARINT_MAX 5
+#define RECORDER_KEY_MAX (RECORDER_VARINT_MAX * (RECORDER_FIELDS + 1)) /* Largest sample */
+
+#if RECORDER_KEY_MAX > RECORDER_BLOCK_SIZE
+#error "A key sample must fit in an empty block"
+#endif
+
+static uint8_t putVarint(uint8_t* p, uint32_t v)
+{
+    uint8_t n = 0;
+
+    while (v >= 0x80)
+    {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+
+    return n;
+}
+
+static uint8_t varintSize(uint32_t v)
+{
+    uint8_t n = 1;
+
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+/* Zigzag, small changes either way take one byte */
+static uint32_t zigzag(uint32_t value, uint32_t prev)
+{
+    const int32_t d = (int32_t)(value - prev);
+
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+/* Returns 0 when the varint runs past the end of the block */
+static uint8_t getVarint(recorder_reader_t* rd, uint32_t* v)
+{
+    uint8_t shift = 0;
+
+    *v = 0;
+    while (rd->pos < rd->len && shift < 7 * RECORDER_VARINT_MAX)
+    {
+        const uint8_t b = rd->data[rd->pos++];
+
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            return 1;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+void recorderInit(recorder_t* r)
+{
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Moves to the next block, dropping the oldest one when the ring is
+ * full. Returns 0 when that would drop the blocks kept before a trigger.
+ */
+static uint8_t recorderNextBlock(recorder_t* r)
+{
+    if (r->state == RECORDER_POST_TRIGGER)
+    {
+        if (r->post_blocks >= RECORDER_BLOCKS - 1 - RECORDER_PRE_BLOCKS)
+        {
+            return 0;
+        }
+        r->post_blocks++;
+    }
+
+    if (r->count > 0)
+    {
+        r->head = (r->head + 1) % RECORDER_BLOCKS;
+    }
+    if (r->count < RECORDER_BLOCKS)
+    {
+        r->count++;
+    }
+    r->used[r->head] = 0;
+
+    return 1;
+}
+
+/* time must be RECORDER_DECIMATION after the previous sample */
+/*
+ * The sample is sized first and written straight into its block, a
+ * buffer for it took 36 bytes of the ADC interrupt stack.
+ */
+void recorderSample(recorder_t* r, uint32_t time, const uint32_t value[RECORDER_FIELDS])
+{
+    uint8_t* p;
+    uint8_t i, changed = 0, n = 1;
+
+    if (r->state == RECORDER_FROZEN)
+    {
+        return;
+    }
+
+    for (i = 0; i < RECORDER_FIELDS; i++)
+    {
+        if (value[i] != r->prev[i])
+        {
+            changed |= 1 << i;
+            n += varintSize(zigzag(value[i], r->prev[i]));
+        }
+    }
+
+    if (r->count == 0 || r->used[r->head] + n > RECORDER_BLOCK_SIZE)
+    {
+        if (!recorderNextBlock(r))
+        {
+            r->state = RECORDER_FROZEN;
+            return;
+        }
+
+        p = r->data[r->head];
+        p += putVarint(p, time);
+        for (i = 0; i < RECORDER_FIELDS; i++)
+        {
+            p += putVarint(p, value[i]);
+        }
+    }
+    else
+    {
+        p = &r->data[r->head][r->used[r->head]];
+        *p++ = changed;
+        for (i = 0; i < RECORDER_FIELDS; i++)
+        {
+            if (changed & (1 << i))
+            {
+                p += putVarint(p, zigzag(value[i], r->prev[i]));
+            }
+        }
+    }
+
+    r->used[r->head] = p - r->data[r->head];
+    memcpy(r->prev, value, sizeof(r->prev));
+    r->time = time;
+
+    if (r->state == RECORDER_POST_TRIGGER && --r->post == 0)
+    {
+        r->state = RECORDER_FROZEN;
+    }
+}
+
+/* Starts the post trigger part of the window, unless one is running or frozen */
+void recorderTrigger(recorder_t* r, uint8_t reason)
+{
+    if (r->state != RECORDER_RUNNING || r->count == 0)
+    {
+        return;
+    }
+
+    r->state = RECORDER_POST_TRIGGER;
+    r->trigger = r->time;
+    r->reason = reason;
+    r->post = RECORDER_POST;
+    r->post_blocks = 0;
+}
+
+/* Block i of the ring, oldest first, NULL past the last one */
+const uint8_t* recorderBlock(const recorder_t* r, uint8_t i, uint8_t* len)
+{
+    uint8_t b;
+
+    if (i >= r->count)
+    {
+        return NULL;
+    }
+
+    b = (r->head + RECORDER_BLOCKS + 1 - r->count + i) % RECORDER_BLOCKS;
+    *len = r->used[b];
+
+    return r->data[b];
+}
+
+void recorderReadInit(recorder_reader_t* rd, const uint8_t* data, uint8_t len)
+{
+    memset(rd, 0, sizeof(*rd));
+    rd->data = data;
+    rd->len = len;
+}
+
+/*
+ * Decodes the next sample of a block into rd->time and rd->value.
+ * Returns 0 at the end of the block or on a truncated sample.
+ */
+uint8_t recorderRead(recorder_reader_t* rd)
+{
+    uint32_t v;
+    uint8_t i, mask;
+
+    if (rd->pos >= rd->len)
+    {
+        return 0;
+    }
+
+    if (rd->pos == 0)
+    {
+        if (!getVarint(rd, &rd->time))
+        {
+            return 0;
+        }
+        for (i = 0; i < RECORDER_FIELDS; i++)
+        {
+            if (!getVarint(rd, &rd->value[i]))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    mask = rd->data[rd->pos++];
+    for (i = 0; i < RECORDER_FIELDS; i++)
+    {
+        if (mask & (1 << i))
+        {
+            if (!getVarint(rd, &v))
+            {
+                return 0;
+            }
+            rd->value[i] += (v >> 1) ^ (0 - (v & 1));
+        }
+    }
+    rd->time += RECORDER_DECIMATION;
+
+    return 1;
+}
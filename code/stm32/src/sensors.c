@@ -1,3 +1,4 @@
+#include <string.h> // memcmp, memcpy
 #include "threads.h"
 
 #define SPEED_TIMER TIM2
@@ -9,9 +10,19 @@
 #define RPM_TIMER TIM1
 #define RPM_TIMER_IRQn TIM1_CC_IRQn
 #define RPM_TIMER_IRQHandler TIM1_CC_IRQHandler
+#define RPM_TIMER_UP_IRQn TIM1_BRK_UP_TRG_COM_IRQn
+#define RPM_TIMER_UP_IRQHandler TIM1_BRK_UP_TRG_COM_IRQHandler
 #define RPM_TIMER_CLK 100000 // 100KHz clock, takes 0.65s to wrap
 #define RPM_TIMER_PSC (STM32_PCLK/RPM_TIMER_CLK)
 
+/*
+ * Rear wheel spin up rate that is wheel spin whatever the front does,
+ * twice what the pick up after a cut shows tooth by tooth
+ */
+#define SLIP_REAR_ACCEL_LIMIT 800 /* Teeth per second per second */
+
+#define CAPTURE_TIMEOUT_TICKS 100000 /* 1s without an edge, input is stopped */
+
 #define POT_I2C I2C1
 #define POT_I2C_ADDR 0x2E /* MCP45X1 ‘0101 11’b + A0 */
 #define POT_CMD_SET_WIPER 0x40
@@ -71,19 +82,30 @@
 #define LR_INT2_THS 0x36
 #define LR_INT2_DURATION 0x37
 
-#define ADC_CHN_STRAIN 0
-#define ADC_CHN_TC_SW 1
-#define ADC_CHN_VBAT 2
+#define ADC_MAX 0xFFF
+
+#define STRAIN_AWD_HYSTERESIS 16 /* ADC counts, single conversions are not averaged */
 
 
 sensors_t sensors = {0, 0, 0, 0, 0};
-static uint8_t TIM1CC4CaptureNumber, TIM2CC3CaptureNumber, TIM2CC4CaptureNumber;
-static uint16_t TIM1CC4ReadValue1, TIM1CC4ReadValue2;
-static uint16_t TIM2CC3ReadValue1, TIM2CC3ReadValue2;
-static uint16_t TIM2CC4ReadValue1, TIM2CC4ReadValue2;
-static int16_t accel1 = 0, accel2 = 0;
-static int32_t spd1arr[2] = {0,0}, spd2arr[2] = {0,0};
-static int8_t spd1arr_pos = 0, spd2arr_pos = 0;
+static capture_t capture_rpm, capture_front, capture_rear;
+static uint16_t rpm_timer_overflows = 0, speed_timer_overflows = 0;
+static wheel_filter_t wheel_front, wheel_rear;
+static uint32_t rpm_recip = 0; /* See gearRpmRecip() */
+
+/* Built by the thread, the interrupts read the active one */
+static gear_table_t gear_table;
+static Settings_data_gears_ratio_t gear_source;
+static uint8_t gear_built = false;
+static gear_est_t gear_est;
+static gear_learn_t gear_learn;
+static struct {
+    uint8_t ratio[GEAR_MAX];
+    uint8_t confidence[GEAR_MAX];
+    uint8_t count;
+} gears_found;
+static recorder_t recorder;
+
 static struct {
     int16_t x;
     int16_t y;
@@ -94,12 +116,13 @@ static struct {
  * Function prototypes.
  */
 
-void getCapture(void);
+void updateSlip(void);
+void updateGearTable(void);
+void updateGearsFound(void);
 void getAnalogSensors(void);
 uint8_t setPotGain(uint8_t gain);
 uint8_t setupLIS331(void);
 uint8_t getLISValues(void);
-uint8_t getCurGearIdx(void);
 
 /*
  * Actual functions.
@@ -128,6 +151,18 @@ void startSensors(void)
     TIM_ICInitStructure.TIM_Channel = TIM_Channel_4;
     TIM_ICInit(SPEED_TIMER, &TIM_ICInitStructure);
 
+    /* Capture continuously, count overflows to extend the 16 bit counter */
+    captureInit(&capture_front);
+    captureInit(&capture_rear);
+    wheelFilterInit(&wheel_front);
+    wheelFilterInit(&wheel_rear);
+    gearInit(&gear_est);
+    gearLearnInit(&gear_learn);
+    recorderInit(&recorder);
+    updateGearTable();
+    TIM_ClearITPendingBit(SPEED_TIMER, TIM_IT_Update);
+    TIM_ITConfig(SPEED_TIMER, TIM_IT_CC3 | TIM_IT_CC4 | TIM_IT_Update, ENABLE);
+
     /* Enable the TIM2 global Interrupt */
     NVIC_InitStructure.NVIC_IRQChannel = SPEED_TIMER_IRQn;
     NVIC_InitStructure.NVIC_IRQChannelPriority = 0;
@@ -151,12 +186,19 @@ void startSensors(void)
     TIM_ICInitStructure.TIM_ICFilter = 0x10;
     TIM_ICInit(RPM_TIMER, &TIM_ICInitStructure);
 
-    /* Enable the TIM1 global Interrupt */
+    captureInit(&capture_rpm);
+    TIM_ClearITPendingBit(RPM_TIMER, TIM_IT_Update);
+    TIM_ITConfig(RPM_TIMER, TIM_IT_CC4 | TIM_IT_Update, ENABLE);
+
+    /* Enable the TIM1 capture and update Interrupts */
     NVIC_InitStructure.NVIC_IRQChannel = RPM_TIMER_IRQn;
     NVIC_InitStructure.NVIC_IRQChannelPriority = 0;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init(&NVIC_InitStructure);
 
+    NVIC_InitStructure.NVIC_IRQChannel = RPM_TIMER_UP_IRQn;
+    NVIC_Init(&NVIC_InitStructure);
+
     /* TIM enable counter */
     TIM_Cmd(RPM_TIMER, ENABLE);
 
@@ -172,14 +214,16 @@ void startSensors(void)
          * Almost everything happens within IRQ Handlers.
          */
         getAnalogSensors();
-        getCapture();
         chThdSleepMilliseconds(100);
+        updateGearTable();
+        updateTcTable();
+        updateGearsFound();
 
-//        serDbg("Accel 1/2: ");
-//        itoa(accel1, tmpstr);
+//        serDbg("Accel front/rear: ");
+//        itoa(wheel_front.accel >> SLIP_Q, tmpstr);
 //        serDbg(tmpstr);
 //        serDbg("/");
-//        itoa(accel2, tmpstr);
+//        itoa(wheel_rear.accel >> SLIP_Q, tmpstr);
 //        serDbg(tmpstr);
 //        serDbg("\r\n");
 
@@ -200,40 +244,165 @@ void startSensors(void)
     }
 }
 
-void getCapture(void)
+/*
+ * Rebuilds the gear table when gears_ratio changed. It is built in place
+ * under the lock, a few dozen instructions, the capture interrupt reads
+ * it.
+ */
+void updateGearTable(void)
 {
-    /* Enable the CC4 Interrupt Request */
-    RPM_TIMER->DIER |= TIM_DIER_CC4IE;
+    if (gear_built && memcmp(&gear_source, &settings.data.gears_ratio, sizeof(gear_source)) == 0)
+    {
+        return;
+    }
 
-    /* Enable the CC3-4 Interrupt Request */
-    SPEED_TIMER->DIER |= TIM_DIER_CC3IE;
-    SPEED_TIMER->DIER |= TIM_DIER_CC4IE;
+    gear_source = settings.data.gears_ratio;
+
+    chSysLock();
+    gearBuildTable(&gear_table, &settings.data);
+    chSysUnlock();
+    gear_built = true;
 }
 
+/* Last engaged gear, it holds through neutral and shifts */
 uint8_t getCurGearIdx(void)
 {
-    uint8_t i;
-    uint16_t ratio;
-    uint32_t speed;
+    return gear_est.gear;
+}
 
-    for(i=0; i<5; i++)
-    {
-        speed = sensors.speed*100;
-        ratio = speed / sensors.rpm;
+uint8_t getCurGearNeutral(void)
+{
+    return gear_est.neutral;
+}
 
-        /* Ration increases with upper gears */
-        if (ratio >= settings.data.gears_ratio.bytes[i])
+/*
+ * Halves the learner's histogram once a bin saturated, a few bins per
+ * lock, then searches it for the gears. Only this thread halves or
+ * reads the histogram, the capture interrupt only adds to it.
+ */
+void updateGearsFound(void)
+{
+    uint8_t ratio[GEAR_MAX], confidence[GEAR_MAX], count;
+    uint16_t i;
+
+    if (gear_learn.saturated)
+    {
+        for (i = 0; i < GEAR_LEARN_BINS; i += GEAR_LEARN_HALVE_BINS)
         {
-            return i;
+            chSysLock();
+            gearLearnHalve(&gear_learn, i, GEAR_LEARN_HALVE_BINS);
+            chSysUnlock();
         }
     }
-    return 0;
+
+    count = gearLearnFind(&gear_learn, ratio, confidence);
+
+    chSysLock();
+    memcpy(gears_found.ratio, ratio, sizeof(ratio));
+    memcpy(gears_found.confidence, confidence, sizeof(confidence));
+    gears_found.count = count;
+    chSysUnlock();
+}
+
+/* Gears learned in the background so far, first gear first */
+void getGearsLearned(gears_t* gears)
+{
+    chSysLock();
+    gears->ratio.size = gears_found.count;
+    memcpy(gears->ratio.bytes, gears_found.ratio, sizeof(gears_found.ratio));
+    memcpy(gears->confidence.bytes, gears_found.confidence, sizeof(gears_found.confidence));
+    chSysUnlock();
+    gears->confidence.size = gears->ratio.size;
+    gears->samples = gear_learn.samples;
+}
+
+/*
+ * Called from DMA1_Ch1_IRQHandler with the strain gauge value seen by
+ * checkStrainGaugeI() and the number of halves of adc_samples so far,
+ * one flight recorder sample every RECORDER_DECIMATION halves.
+ */
+void recordSensorsI(uint32_t strain_gauge, uint32_t time)
+{
+    uint32_t value[RECORDER_FIELDS];
+
+    if (time & (RECORDER_DECIMATION - 1))
+    {
+        return;
+    }
+
+    value[RECORDER_RPM] = capturePeriod(&capture_rpm);
+    value[RECORDER_FRONT] = capturePeriod(&capture_front);
+    value[RECORDER_REAR] = capturePeriod(&capture_rear);
+    value[RECORDER_STRAIN] = strain_gauge;
+    value[RECORDER_SLIP] = status.slipping_pct;
+    value[RECORDER_FLAGS] = getCutStateI()
+            | (status.shifting ? RECORDER_FLAG_SHIFTING : 0)
+            | (status.slipping ? RECORDER_FLAG_SLIPPING : 0)
+            | (gear_est.neutral ? RECORDER_FLAG_NEUTRAL : 0)
+            | (gear_est.gear << RECORDER_FLAG_GEAR_SHIFT);
+
+    recorderSample(&recorder, time, value);
+}
+
+/* Called by the ignition when it starts a cut */
+void recordTriggerI(uint8_t reason)
+{
+    recorderTrigger(&recorder, reason);
+}
+
+/*
+ * Block i of the frozen window, oldest first. Returns 0 past the last
+ * block or while no window is frozen, record->blocks is 0 then.
+ */
+uint8_t getRecordBlock(uint8_t i, record_t* record)
+{
+    const uint8_t* data = NULL;
+    uint8_t len = 0;
+
+    chSysLock();
+    if (recorder.state == RECORDER_FROZEN)
+    {
+        data = recorderBlock(&recorder, i, &len);
+        record->blocks = recorder.count;
+    }
+    else
+    {
+        record->blocks = 0;
+    }
+    record->block = i;
+    record->trigger = recorder.trigger;
+    record->reason = recorder.reason;
+    record->data.size = (data != NULL) ? len : 0;
+    if (data != NULL)
+    {
+        memcpy(record->data.bytes, data, len);
+    }
+    chSysUnlock();
+
+    return (data != NULL);
+}
+
+/* Drops the frozen window and starts recording again */
+void clearRecord(void)
+{
+    chSysLock();
+    recorderInit(&recorder);
+    chSysUnlock();
 }
 
 uint8_t getCurCutTime(void)
 {
-    const uint8_t gear = getCurGearIdx();
+    uint8_t gear = getCurGearIdx();
 
+    /* gears_cut_time may be shorter than the gear table */
+    if (settings.data.gears_cut_time.size == 0)
+    {
+        return 0;
+    }
+    if (gear >= settings.data.gears_cut_time.size)
+    {
+        gear = settings.data.gears_cut_time.size - 1;
+    }
     return settings.data.gears_cut_time.bytes[gear];
 }
 
@@ -263,40 +432,108 @@ uint8_t setPotGain(uint8_t gain)
 
 void getAnalogSensors(void)
 {
-    uint32_t strain_gauge = 0;
-    uint32_t tc_switch = 0;
-    uint32_t vbat = 0;
-    uint8_t i;
+    adc_filtered_t filtered;
 
-    const uint8_t nb_samples = sizeof(adc_samples)/ADC_CHANNELS; /* 8 */
-    i = 0;
+    /* Coherent snapshot of the decimated channels */
+    adcGetFiltered(&filtered);
 
-    while (i <= (sizeof(adc_samples)-ADC_CHANNELS))
-    {
-        strain_gauge += adc_samples[ADC_CHN_STRAIN+i];
-        tc_switch    += adc_samples[ADC_CHN_TC_SW+i];
-        vbat         += adc_samples[ADC_CHN_VBAT+i];
-        i            += ADC_CHANNELS; /* +4 */
-    }
+    /* Diagnostic values only, status.shifting is set by checkStrainGaugeI() */
+    sensors.strain_gauge = filtered.value[ADC_CHN_STRAIN] >> FILTER_FRAC_BITS;
+    sensors.tc_switch    = filtered.value[ADC_CHN_TC_SW] >> FILTER_FRAC_BITS;
+    sensors.vbat         = filtered.value[ADC_CHN_VBAT] >> FILTER_FRAC_BITS;
+}
 
-    strain_gauge /= nb_samples;
-    tc_switch    /= nb_samples;
-    vbat         /= nb_samples;
+/*
+ * Called from DMA1_Ch1_IRQHandler with the mean of the strain gauge
+ * samples in the half of adc_samples that has just been filled.
+ */
+void checkStrainGaugeI(uint32_t strain_gauge)
+{
+    uint8_t shifting;
 
-    sensors.strain_gauge = strain_gauge;
-    sensors.tc_switch    = tc_switch;
-    sensors.vbat         = vbat;
+    /* The analog watchdog owns status.shifting in that mode */
+    if (settings.data.functions & SETTINGS_FUNCTION_SHIFTER_AWD)
+    {
+        return;
+    }
 
     if (settings.data.sensor_direction == SETTINGS_SENSOR_NORMAL)
     {
         /* Sets true if strain gauge value exceeds threshold. */
-        status.shifting = (strain_gauge >= settings.data.sensor_threshold);
+        shifting = (strain_gauge >= settings.data.sensor_threshold);
     }
     else /* SETTINGS_SENSOR_REVERSE */
     {
         /* Sets true if strain gauge value does not exceeds threshold. */
-        status.shifting = (strain_gauge <= settings.data.sensor_threshold);
+        shifting = (strain_gauge <= settings.data.sensor_threshold);
+    }
+
+    if (shifting != status.shifting)
+    {
+        status.shifting = shifting;
+        ignitionTriggerI();
+    }
+}
+
+/*
+ * Analog watchdog window on ADC_CHN_STRAIN for the current state.
+ * The watchdog fires when a conversion falls outside [low, high], so
+ * the window covers the current state and leaving it is the event.
+ * Release needs STRAIN_AWD_HYSTERESIS counts past the threshold.
+ */
+void getStrainWatchdogWindow(uint8_t shifting, uint16_t* low, uint16_t* high)
+{
+    uint32_t threshold = settings.data.sensor_threshold;
+
+    if (threshold > ADC_MAX)
+    {
+        threshold = ADC_MAX;
+    }
+
+    if (settings.data.sensor_direction == SETTINGS_SENSOR_NORMAL)
+    {
+        if (!shifting)
+        {
+            /* Shifting when strain_gauge >= threshold */
+            *low = 0;
+            *high = threshold ? threshold - 1 : 0;
+        }
+        else
+        {
+            *low = (threshold > STRAIN_AWD_HYSTERESIS) ? threshold - STRAIN_AWD_HYSTERESIS : 0;
+            *high = ADC_MAX;
+        }
     }
+    else /* SETTINGS_SENSOR_REVERSE */
+    {
+        if (!shifting)
+        {
+            /* Shifting when strain_gauge <= threshold */
+            *low = (threshold < ADC_MAX) ? threshold + 1 : ADC_MAX;
+            *high = ADC_MAX;
+        }
+        else
+        {
+            *low = 0;
+            *high = (threshold + STRAIN_AWD_HYSTERESIS < ADC_MAX) ? threshold + STRAIN_AWD_HYSTERESIS : ADC_MAX;
+        }
+    }
+}
+
+/*
+ * Called from ADC1_COMP_IRQHandler, a conversion of ADC_CHN_STRAIN
+ * left the window: flip the state and watch for the way back.
+ */
+void strainWatchdogI(void)
+{
+    uint16_t low, high;
+
+    status.shifting = !status.shifting;
+
+    getStrainWatchdogWindow(status.shifting, &low, &high);
+    ADC_AnalogWatchdogThresholdsConfig(ADC1, high, low);
+
+    ignitionTriggerI();
 }
 
 uint8_t setupLIS331(void)
@@ -343,180 +580,158 @@ uint8_t getLISValues(void)
     return 0;
 }
 
-void RPM_TIMER_IRQHandler(void)
+/*
+ * Time since the last ignition edge and the engine period, both in us.
+ * Returns false while the engine is not turning.
+ */
+uint8_t getEnginePhaseI(uint32_t* since, uint32_t* period)
 {
-    uint32_t Capture;
-
-    if (RPM_TIMER->SR & TIM_IT_CC4)
-    {  /* capture timer */
+    /* CNT first, then the pending overflow, as for a capture */
+    const uint16_t cnt = RPM_TIMER->CNT;
+    const uint8_t overflow = (RPM_TIMER->SR & TIM_SR_UIF) != 0;
+    const uint32_t now = captureTimestamp(rpm_timer_overflows, cnt, overflow);
 
-        //clear pending bit
-        RPM_TIMER->SR &= ~TIM_FLAG_CC4;
+    *period = capturePeriod(&capture_rpm) * (1000000 / RPM_TIMER_CLK);
+    *since = (now - capture_rpm.last) * (1000000 / RPM_TIMER_CLK);
 
-        if(TIM1CC4CaptureNumber == 0)
-        {
-            /* Get the Input Capture value */
-            TIM1CC4ReadValue1 = RPM_TIMER->CCR4;
-            TIM1CC4CaptureNumber = 1;
-        }
-        else if(TIM1CC4CaptureNumber == 1)
-        {
-            /* Get the Input Capture value */
-            TIM1CC4ReadValue2 = RPM_TIMER->CCR4;
-
-            /* Capture computation */
-            if (TIM1CC4ReadValue2 > TIM1CC4ReadValue1)
-            {
-                Capture = ((uint32_t)TIM1CC4ReadValue2 - (uint32_t)TIM1CC4ReadValue1);
-            }
-            else
-            {
-                Capture = (((uint32_t)TIM1CC4ReadValue2 + 0x10000) - (uint32_t)TIM1CC4ReadValue1);
-            }
-
-            /* Frequency computation */
-            sensors.rpm = ((STM32_PCLK / RPM_TIMER_PSC) / Capture) * 60;
-
-            TIM1CC4ReadValue1 = TIM1CC4ReadValue2;
-            TIM1CC4CaptureNumber = 0;
-
-            /* Disable CC4 interrupt */
-            RPM_TIMER->DIER &= ~TIM_DIER_CC4IE;
-        }
-    }
+    return (*period != 0 && *since < *period);
 }
 
-void SPEED_TIMER_IRQHandler(void)
+/*
+ * TIM1 capture and update have their own vectors, the update one wins
+ * when both are pending. Both are served here so that a capture is
+ * always timestamped before its overflow is counted.
+ */
+static void rpmTimerI(void)
 {
-    uint32_t Capture = 0;
-
-    if (SPEED_TIMER->SR & TIM_IT_CC3)
-    {  /* capture timer */
+    const uint16_t sr = RPM_TIMER->SR & (TIM_IT_CC4 | TIM_IT_Update);
+    /* CCRx first, then the pending overflow, see captureTimestamp() */
+    const uint16_t ccr = RPM_TIMER->CCR4;
+    const uint8_t overflow = (RPM_TIMER->SR & TIM_SR_UIF) != 0;
 
-        //clear pending bit
-        SPEED_TIMER->SR &= ~TIM_FLAG_CC3;
+    /* Flags are cleared with a single write, only the ones seen */
+    TIM_ClearITPendingBit(RPM_TIMER, sr | (overflow ? TIM_IT_Update : 0));
 
-        if(TIM2CC3CaptureNumber == 0)
-        {
-            /* Get the Input Capture value */
-            TIM2CC3ReadValue1 = SPEED_TIMER->CCR3;
-            TIM2CC3CaptureNumber = 1;
-        }
-        else if(TIM2CC3CaptureNumber == 1)
-        {
-            /* Get the Input Capture value */
-            TIM2CC3ReadValue2 = SPEED_TIMER->CCR3;
-
-            /* Capture computation */
-            if (TIM2CC3ReadValue2 > TIM2CC3ReadValue1)
-            {
-                Capture = ((uint32_t)TIM2CC3ReadValue2 - (uint32_t)TIM2CC3ReadValue1);
-            }
-            else
-            {
-                Capture = (((uint32_t)TIM2CC3ReadValue2 + 0x10000) - (uint32_t)TIM2CC3ReadValue1);
-            }
-
-            /* Frequency computation */
-            spd1arr[spd1arr_pos++] = (STM32_PCLK / SPEED_TIMER_PSC) / Capture;
-
-            if (spd1arr_pos > 1) spd1arr_pos = 0;
+    if (sr & TIM_IT_CC4)
+    {
+        captureEdge(&capture_rpm, captureTimestamp(rpm_timer_overflows, ccr, overflow));
 
-            TIM2CC3ReadValue1 = TIM2CC3ReadValue2;
-            TIM2CC3CaptureNumber = 0;
+        /* One pulse per revolution */
+        sensors.rpm = captureFrequency(&capture_rpm, RPM_TIMER_CLK * 60, 1);
+        rpm_recip = gearRpmRecip(sensors.rpm);
 
-            /* Disable CC3 interrupt */
-            SPEED_TIMER->DIER &= ~TIM_DIER_CC3IE;
+        if (capturePeriod(&capture_rpm) != 0)
+        {
+            ignitionRevolutionI(capturePeriod(&capture_rpm) * (1000000 / RPM_TIMER_CLK));
         }
     }
 
-    else if (SPEED_TIMER->SR & TIM_IT_CC4)
-    {  /* capture timer */
-
-        //clear pending bit
-        SPEED_TIMER->SR &= ~TIM_FLAG_CC4;
+    if (overflow)
+    {
+        rpm_timer_overflows++;
 
-        if(TIM2CC4CaptureNumber == 0)
+        if (captureTimeout(&capture_rpm, (uint32_t)rpm_timer_overflows << 16, CAPTURE_TIMEOUT_TICKS))
         {
-            /* Get the Input Capture value */
-            TIM2CC4ReadValue1 = SPEED_TIMER->CCR4;
-            TIM2CC4CaptureNumber = 1;
+            sensors.rpm = 0;
+            rpm_recip = 0;
         }
-        else if(TIM2CC4CaptureNumber == 1)
-        {
-            /* Get the Input Capture value */
-            TIM2CC4ReadValue2 = SPEED_TIMER->CCR4;
-
-            /* Capture computation */
-            if (TIM2CC4ReadValue2 > TIM2CC4ReadValue1)
-            {
-                Capture = ((uint32_t)TIM2CC4ReadValue2 - (uint32_t)TIM2CC4ReadValue1);
-            }
-            else
-            {
-                Capture = (((uint32_t)TIM2CC4ReadValue2 + 0x10000) - (uint32_t)TIM2CC4ReadValue1);
-            }
+    }
+}
 
-            /* Frequency computation */
-            spd2arr[spd2arr_pos++] = (STM32_PCLK / SPEED_TIMER_PSC) / Capture;
+void RPM_TIMER_IRQHandler(void)
+{
+    rpmTimerI();
+}
 
-            if (spd2arr_pos > 1) spd2arr_pos = 0;
+void RPM_TIMER_UP_IRQHandler(void)
+{
+    rpmTimerI();
+}
 
-            TIM2CC4ReadValue1 = TIM2CC4ReadValue2;
-            TIM2CC4CaptureNumber = 0;
+void SPEED_TIMER_IRQHandler(void)
+{
+    const uint16_t sr = SPEED_TIMER->SR & (TIM_IT_CC3 | TIM_IT_CC4 | TIM_IT_Update);
+    /* CCRx first, then the pending overflow, see captureTimestamp() */
+    const uint16_t ccr3 = SPEED_TIMER->CCR3;
+    const uint16_t ccr4 = SPEED_TIMER->CCR4;
+    const uint8_t overflow = (SPEED_TIMER->SR & TIM_SR_UIF) != 0;
+    uint8_t updated = false;
 
-            /* Disable CC4 interrupt */
-            SPEED_TIMER->DIER &= ~TIM_DIER_CC4IE;
-        }
-    }
+    /* Flags are cleared with a single write, only the ones seen */
+    TIM_ClearITPendingBit(SPEED_TIMER, sr | (overflow ? TIM_IT_Update : 0));
 
-    if (spd1arr_pos == 0)
+    if (sr & TIM_IT_CC3)
     {
-        accel1 = (spd1arr[1] - spd1arr[0]);
-    }
-    else
-    {
-        accel1 = (spd1arr[0] - spd1arr[1]);
+        captureEdge(&capture_front, captureTimestamp(speed_timer_overflows, ccr3, overflow));
+        wheelFilterUpdate(&wheel_front, capturePeriod(&capture_front), SPEED_TIMER_CLK, 1);
+        updated = true;
     }
 
-    if (spd2arr_pos == 0)
-    {
-        accel2 = (spd2arr[1] - spd2arr[0]);
-    }
-    else
+    if (sr & TIM_IT_CC4)
     {
-        accel2 = (spd2arr[0] - spd2arr[1]);
+        captureEdge(&capture_rear, captureTimestamp(speed_timer_overflows, ccr4, overflow));
+        wheelFilterUpdate(&wheel_rear, capturePeriod(&capture_rear), SPEED_TIMER_CLK, 1);
+        /* The rear wheel is geared to the engine, slip or not */
+        gearUpdate(&gear_est, &gear_table, wheel_rear.speed >> SLIP_Q, rpm_recip);
+        gearLearnSample(&gear_learn, wheel_rear.speed >> SLIP_Q, sensors.rpm, rpm_recip);
+        updated = true;
     }
 
-    // Fastest wheel speed in Hertz
-    if (spd1arr[0] >= spd2arr[0])
+    /* Counted after the captures, they need the overflow still pending */
+    if (overflow)
     {
-        sensors.speed = spd1arr[0];
+        const uint32_t now = (uint32_t)++speed_timer_overflows << 16;
+
+        if (captureTimeout(&capture_front, now, CAPTURE_TIMEOUT_TICKS))
+        {
+            wheelFilterInit(&wheel_front);
+            updated = true;
+        }
+        if (captureTimeout(&capture_rear, now, CAPTURE_TIMEOUT_TICKS))
+        {
+            wheelFilterInit(&wheel_rear);
+            updated = true;
+        }
     }
-    else
+
+    if (updated)
     {
-        sensors.speed = spd2arr[0];
+        updateSlip();
     }
+}
+
+void updateSlip(void)
+{
+    const int32_t ratio = slipRatio(&wheel_front, &wheel_rear);
+    const int32_t rear_accel = wheel_rear.accel >> SLIP_Q;
 
-    // Fastest wheel accel
-    if (accel1 >= accel2)
+    /* Fastest wheel speed in Hertz */
+    if (wheel_front.speed >= wheel_rear.speed)
     {
-        status.acceleration = accel1;
+        sensors.speed = wheel_front.speed >> SLIP_Q;
     }
     else
     {
-        status.acceleration = accel2;
+        sensors.speed = wheel_rear.speed >> SLIP_Q;
     }
 
-    status.slipping_pct = ((accel2 - accel1) * 1000) / accel1;
+    status.acceleration = (rear_accel > 0) ? rear_accel : 0;
+
+    /* A rear wheel slower than the front one is braking, not slip */
+    status.slipping_pct = (ratio > 0) ? ((ratio * 100) >> SLIP_Q) : 0;
 
     if (sensors.speed <= settings.data.min_speed
-            || sensors.rpm <= settings.data.min_rpm
-            || status.slipping_pct <= settings.data.slip_threshold)
+            || sensors.rpm <= settings.data.min_rpm)
     {
         status.slipping = 0;
-        return;
+    }
+    else
+    {
+        /* Threshold for the current gear and RPM */
+        status.slipping = (status.slipping_pct > getTcEntryI().threshold)
+                || (rear_accel > SLIP_REAR_ACCEL_LIMIT);
     }
 
-    status.slipping = 1;
+    /* Slip decision is taken as soon as a new speed is known */
+    ignitionTriggerI();
 }
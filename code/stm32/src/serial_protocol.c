@@ -3,143 +3,466 @@
 #include "pb.h"
 #include "pb_encode.h"
 #include "pb_decode.h"
+#include "frame.h"
+#include "update.h"
 
 
 #define GUI_USART USART1
 
-#define SER_MAGIC1 0xAB
-#define SER_MAGIC2 0xCD
-
-#define CMD_OFFSET_CMD 2
-#define CMD_OFFSET_LEN 3
-
 #define CMD_SEND_DIAG 0x01
 #define CMD_SEND_INFO 0x02
 #define CMD_SEND_SETTINGS 0x03
 #define CMD_SAVE_SETTINGS 0x04
-
-uint8_t sendToGUI(const char *data, uint16_t len);
-uint8_t processCmd(uint8_t cmd, uint8_t len);
-int8_t searchBuffer(void);
-uint8_t doChecksum(const char * buf, uint8_t len);
-
-int8_t cmd_pos;
-uint8_t update = 0;
-uint8_t pb_buffer[settings_t_size+4]; /* Set to max structure size */
-
+#define CMD_SEND_GEARS 0x05
+#define CMD_SEND_RECORD 0x06
+#define CMD_CLEAR_RECORD 0x07
+#define CMD_SET_BAUD 0x08
+#define CMD_LINK_CHECK 0x09
+#define CMD_SUBSCRIBE 0x0A
+#define CMD_CUT_EVENT 0x0B
+#define CMD_LINK_TEST 0x0D
+#define CMD_PUSH 0x80 /* Set in the command of frames sent unrequested */
+
+/* subscribe_t.streams bits */
+#define PUSH_SENSORS 0x01
+#define PUSH_STATUS 0x02
+#define PUSH_CUTS 0x04
+#define PUSH_ALL (PUSH_SENSORS | PUSH_STATUS | PUSH_CUTS)
+#define PUSH_PERIOD_MIN 2 /* ms */
+#define PUSH_PERIOD_MAX 60000
+
+#define LINK_CHECK_TIMEOUT 200 /* ms at a new rate without CMD_LINK_CHECK before going back */
+
+#define SERIAL_PAYLOAD_MAX settings_t_size /* Largest message */
+#define PUSH_PAYLOAD_MAX sensors_t_size /* Largest pushed message */
+
+/* A push frame is built in a buffer of a message, behind the message */
+#if FRAME_ENCODED_MAX(PUSH_PAYLOAD_MAX) + PUSH_PAYLOAD_MAX > SERIAL_PAYLOAD_MAX
+#error "A message buffer cannot hold a push frame"
+#endif
+
+/* The next request can arrive whole while the thread replies to one */
+#if USART_RXBUF_SIZE < 2 * FRAME_ENCODED_MAX(SERIAL_PAYLOAD_MAX)
+#error "usart_rxbuf cannot hold two requests"
+#endif
+
+uint8_t sendToGUI(uint8_t seq, uint8_t cmd, const pb_field_t fields[], const void* msg);
+uint8_t pushToGUI(uint8_t cmd, const pb_field_t fields[], const void* msg);
+uint8_t processCmd(uint8_t seq, uint8_t cmd, const uint8_t* payload, uint16_t len);
+systime_t linkTimeLeft(void);
+void linkFallback(void);
+systime_t pushTimeLeft(void);
+void pushTelemetry(void);
+
+/*
+ * Request being decoded, then the reply being encoded: a request is
+ * done with before its reply is built.
+ */
+uint8_t frame[FRAME_ENCODED_MAX(SERIAL_PAYLOAD_MAX)];
+frame_decoder_t frame_decoder;
+uint32_t serial_frame_errors = 0;
+
+/* Rate to go back to unless the new one is confirmed, 0 once it is */
+uint32_t link_fallback = 0;
+systime_t link_start;   /* When the rate changed */
+
+/* Streams the GUI subscribed to, pushed every push_period */
+uint8_t push_streams = 0;
+systime_t push_period;
+systime_t push_last;    /* When the last push was due */
+uint8_t push_seq = 0;   /* Own sequence, a gap is a dropped push */
+uint32_t push_cuts = 0; /* cut_t.count last pushed */
+
+/*
+ * Sleeps until the USART receives something, then decodes every byte
+ * received so far. Frames can span the end of usart_rxbuf and arrive in
+ * as many pieces as the link delivers. Every complete frame is processed
+ * in order, so the GUI can send several requests back to back and read
+ * the replies in one go.
+ */
 void startSerialCom(void)
 {
-    uint8_t cmd, checksum, len;
+    uint16_t head, tail = 0, pos = 0;
+    systime_t timeout, left;
+    uint8_t res;
+
+    frameDecoderInit(&frame_decoder, frame, FRAME_PACKET(SERIAL_PAYLOAD_MAX));
 
     while (true)
     {
-        chThdSleepMilliseconds(50);
+        /* Wakes up in time to go back to the previous rate */
+        timeout = TIME_INFINITE;
+        if (link_fallback && (timeout = linkTimeLeft()) == 0)
+        {
+            linkFallback();
+            timeout = TIME_INFINITE;
+        }
+
+        /* And in time for the next push */
+        if (push_streams)
+        {
+            if ((left = pushTimeLeft()) == 0)
+            {
+                pushTelemetry();
+                left = pushTimeLeft();
+            }
+            if (timeout == TIME_INFINITE || left < timeout)
+            {
+                timeout = left;
+            }
+        }
 
-        if (!update) continue;
+        head = usartReceiveS(timeout);
 
-        if ((cmd_pos = searchBuffer()) >= 0)
+        while (tail != head)
         {
-            cmd = usart_rxbuf[cmd_pos+CMD_OFFSET_CMD]; /* Command to process */
-            len = usart_rxbuf[cmd_pos+CMD_OFFSET_LEN]; /* Total length */
-            checksum  = usart_rxbuf[cmd_pos+len]; /* CS is at the end */
+            /* DMA went round over bytes not read yet, resync on the next delimiter */
+            if ((uint16_t)(head - tail) > USART_RXBUF_SIZE)
+            {
+                pos = (pos + (uint16_t)(head - tail)) % USART_RXBUF_SIZE;
+                tail = head;
+                frameDecoderInit(&frame_decoder, frame, FRAME_PACKET(SERIAL_PAYLOAD_MAX));
+                serial_frame_errors++;
+                break;
+            }
+
+            res = frameDecode(&frame_decoder, usart_rxbuf[pos]);
+            tail++;
+            if (++pos == USART_RXBUF_SIZE)
+            {
+                pos = 0;
+            }
+            if (res == FRAME_OK)
+            {
+                processCmd(frameSeq(&frame_decoder), frameCmd(&frame_decoder),
+                           framePayload(&frame_decoder), framePayloadLen(&frame_decoder));
+
+                /* Replying takes time, more may have come in */
+                head = usartReceiveS(TIME_IMMEDIATE);
+            }
+            else if (res == FRAME_ERROR)
+            {
+                serial_frame_errors++;
+            }
+        }
+    }
+}
+
+/* Time left to confirm the new rate, 0 once it ran out */
+systime_t linkTimeLeft(void)
+{
+    const systime_t elapsed = chVTGetSystemTimeX() - link_start;
+
+    return (elapsed < MS2ST(LINK_CHECK_TIMEOUT)) ? MS2ST(LINK_CHECK_TIMEOUT) - elapsed : 0;
+}
+
+/* The new rate was not confirmed in time */
+void linkFallback(void)
+{
+    usartSetBaudS(GUI_USART, link_fallback);
+    link_fallback = 0;
+    frameDecoderInit(&frame_decoder, frame, FRAME_PACKET(SERIAL_PAYLOAD_MAX));
+}
+
+/* Time left to the next push, 0 when it is due */
+systime_t pushTimeLeft(void)
+{
+    const systime_t elapsed = chVTGetSystemTimeX() - push_last;
 
-            /* Verify checksum and restart loop if fails
-             * maybe some data is still missing? */
-            if (checksum != doChecksum(&usart_rxbuf[cmd_pos], len))
-                continue;
+    return (elapsed < push_period) ? push_period - elapsed : 0;
+}
 
-            /* We got the data and it is valid */
-            update = 0;
+/*
+ * Sends the subscribed streams, a cut only when there was a new one
+ * since the last push. A thread late by a whole period skips the pushes
+ * it missed instead of sending them back to back.
+ */
+void pushTelemetry(void)
+{
+    cut_t cut;
 
-            processCmd(cmd, len);
+    push_last += push_period;
+    if (chVTGetSystemTimeX() - push_last >= push_period)
+    {
+        push_last = chVTGetSystemTimeX();
+    }
 
-            /* Clear buffer */
-            memset(usart_rxbuf, 0, USART_RXBUF_SIZE);
+    if (push_streams & PUSH_SENSORS)
+    {
+        pushToGUI(CMD_SEND_DIAG, sensors_t_fields, &sensors);
+    }
+    if (push_streams & PUSH_STATUS)
+    {
+        pushToGUI(CMD_SEND_INFO, status_t_fields, &status);
+    }
+    if (push_streams & PUSH_CUTS)
+    {
+        getCutEvent(&cut);
+        if (cut.count != push_cuts && pushToGUI(CMD_CUT_EVENT, cut_t_fields, &cut) == 0)
+        {
+            push_cuts = cut.count;
         }
     }
 }
 
-uint8_t doChecksum(const char * buf, uint8_t len)
+/*
+ * Replies with the streams and period applied, then pushes them until
+ * the next CMD_SUBSCRIBE, no streams stops them. The period is at least
+ * twice the time the frames of one push take at the current rate.
+ */
+void subscribe(uint8_t seq, const uint8_t* payload, uint16_t len)
 {
-    uint8_t sum = 0;
+    pb_istream_t stream = pb_istream_from_buffer((uint8_t*)payload, len);
+    uint32_t bytes = 0, min;
+    subscribe_t sub;
+    cut_t cut;
+
+    if (!pb_decode(&stream, subscribe_t_fields, &sub))
+    {
+        sub.streams = 0;
+    }
+    sub.streams &= PUSH_ALL;
+
+    if (sub.streams & PUSH_SENSORS)
+    {
+        bytes += FRAME_ENCODED_MAX(sensors_t_size);
+    }
+    if (sub.streams & PUSH_STATUS)
+    {
+        bytes += FRAME_ENCODED_MAX(status_t_size);
+    }
+    if (sub.streams & PUSH_CUTS)
+    {
+        bytes += FRAME_ENCODED_MAX(cut_t_size);
+    }
+
+    /* 10 bits a byte, half of the link is left to the replies */
+    min = (bytes * 2 * 10000 + usart_baud - 1) / usart_baud;
+    if (min < PUSH_PERIOD_MIN)
+    {
+        min = PUSH_PERIOD_MIN;
+    }
+    if (sub.period < min)
+    {
+        sub.period = min;
+    }
+    if (sub.period > PUSH_PERIOD_MAX)
+    {
+        sub.period = PUSH_PERIOD_MAX;
+    }
+    if (sub.streams == 0)
+    {
+        sub.period = 0;
+    }
 
-    while (len--)
-        sum += *buf++;
+    sendToGUI(seq, CMD_SUBSCRIBE, subscribe_t_fields, &sub);
 
-    return sum;
+    /* Only cuts from now on */
+    getCutEvent(&cut);
+    push_cuts = cut.count;
+    push_period = MS2ST(sub.period);
+    push_last = chVTGetSystemTimeX();
+    push_streams = sub.streams;
 }
 
-int8_t searchBuffer(void)
+/*
+ * Answers at the current rate with the rate it switches to, 0 when it
+ * cannot, then switches. The GUI tries full size frames both ways with
+ * CMD_LINK_TEST, then must confirm with CMD_LINK_CHECK at the new rate
+ * within LINK_CHECK_TIMEOUT, or both go back.
+ */
+void setBaud(uint8_t seq, const uint8_t* payload, uint16_t len)
 {
-    uint8_t i;
-    for (i = 0; i < USART_RXBUF_SIZE-1; i++)
+    pb_istream_t stream = pb_istream_from_buffer((uint8_t*)payload, len);
+    const uint32_t prev = usart_baud;
+    link_t link;
+
+    if (link_fallback || !pb_decode(&stream, link_t_fields, &link) || link.baud == prev)
     {
-        if (usart_rxbuf[i] == SER_MAGIC1
-                && usart_rxbuf[i+1] == SER_MAGIC2)
-            return i;
+        link.baud = 0;
     }
 
-    return -1;
+    sendToGUI(seq, CMD_SET_BAUD, link_t_fields, &link);
+
+    if (link.baud && usartSetBaudS(GUI_USART, link.baud) == 0)
+    {
+        link_fallback = prev;
+        link_start = chVTGetSystemTimeX();
+    }
 }
 
-void sendDiag(void)
+/* Confirms a new rate, or only checks the link */
+void linkCheck(uint8_t seq)
 {
-    pb_ostream_t stream = pb_ostream_from_buffer(pb_buffer, sizeof(pb_buffer));
+    link_t link;
 
-    pb_encode(&stream, sensors_t_fields, &sensors);
+    link.baud = usart_baud;
+    link_fallback = 0;
+    sendToGUI(seq, CMD_LINK_CHECK, link_t_fields, &link);
+}
+
+/*
+ * Echoes the payload, up to the largest message, without confirming
+ * the rate: the GUI checks a frame of the longest kind each way first.
+ */
+void linkTest(uint8_t seq, const uint8_t* payload, uint16_t len)
+{
+    uint8_t pb_buffer[SERIAL_PAYLOAD_MAX];
+    uint16_t size;
 
-    sendToGUI((const char*)&pb_buffer, stream.bytes_written);
+    /* The payload is in frame, where the reply goes */
+    memcpy(pb_buffer, payload, len);
+    size = frameEncode(frame, seq, CMD_LINK_TEST, pb_buffer, len);
+    usartSendS(GUI_USART, (const char*)frame, size);
 }
 
-void sendInfo(void)
+/*
+ * Restarts in the update stage: answers with the rate the stage will
+ * answer at, this one, and resets once the reply is on the line. The
+ * rate goes to the stage in SRAM behind the vectors, a reset keeps it.
+ */
+void enterUpdate(uint8_t seq)
 {
-    pb_ostream_t stream = pb_ostream_from_buffer(pb_buffer, sizeof(pb_buffer));
+    volatile uint32_t* const handoff = (volatile uint32_t*)UPDATE_HANDOFF_ADDR;
+    link_t link;
 
-    pb_encode(&stream, status_t_fields, &status);
+    link.baud = usart_baud;
+    sendToGUI(seq, CMD_UPDATE, link_t_fields, &link);
+    usartFlushS(GUI_USART);
 
-    sendToGUI((const char*)&pb_buffer, stream.bytes_written);
+    handoff[0] = UPDATE_MAGIC;
+    handoff[1] = usart_baud;
+    NVIC_SystemReset();
 }
 
-void sendSettings(void)
+void sendDiag(uint8_t seq)
 {
-    pb_ostream_t stream = pb_ostream_from_buffer(pb_buffer, sizeof(pb_buffer));
+    sendToGUI(seq, CMD_SEND_DIAG, sensors_t_fields, &sensors);
+}
 
-    pb_encode(&stream, settings_t_fields, &settings);
+void sendInfo(uint8_t seq)
+{
+    sendToGUI(seq, CMD_SEND_INFO, status_t_fields, &status);
+}
+
+void sendSettings(uint8_t seq)
+{
+    sendToGUI(seq, CMD_SEND_SETTINGS, settings_t_fields, &settings);
+}
+
+void sendGears(uint8_t seq)
+{
+    gears_t gears;
+
+    getGearsLearned(&gears);
+    sendToGUI(seq, CMD_SEND_GEARS, gears_t_fields, &gears);
+}
 
-    sendToGUI((const char*)&pb_buffer, stream.bytes_written);
+/* One block of the flight recorder window, its index is the payload */
+void sendRecord(uint8_t seq, const uint8_t* payload, uint16_t len)
+{
+    record_t record;
+
+    getRecordBlock(len ? payload[0] : 0, &record);
+    sendToGUI(seq, CMD_SEND_RECORD, record_t_fields, &record);
 }
 
-void saveSettings(uint8_t len)
+void saveSettings(const uint8_t* payload, uint16_t len)
 {
-    pb_istream_t stream = pb_istream_from_buffer((uint8_t*)&usart_rxbuf[cmd_pos+CMD_OFFSET_LEN+1], len-4);
+    pb_istream_t stream = pb_istream_from_buffer((uint8_t*)payload, len);
 
     pb_decode(&stream, settings_t_fields, &settings);
+    adcApplySettings();
 
     writeSettings(&settings);
 }
 
-uint8_t sendToGUI(const char* data, uint16_t len)
+/*
+ * Replies with the command and sequence number it answers, so the GUI
+ * can match replies to pipelined requests.
+ */
+uint8_t sendToGUI(uint8_t seq, uint8_t cmd, const pb_field_t fields[], const void* msg)
 {
-    usartSendI(GUI_USART, data, len);
+    uint8_t pb_buffer[SERIAL_PAYLOAD_MAX]; /* Reply message */
+    pb_ostream_t stream = pb_ostream_from_buffer(pb_buffer, sizeof(pb_buffer));
+    uint16_t len;
+
+    if (!pb_encode(&stream, fields, msg))
+    {
+        return 1;
+    }
+
+    len = frameEncode(frame, seq, cmd, pb_buffer, stream.bytes_written);
+
+    /* Whole frame at once, waits for room behind debug output instead of dropping it */
+    usartSendS(GUI_USART, (const char*)frame, len);
 
     return 0;
 }
 
-uint8_t processCmd(uint8_t cmd, uint8_t len)
+/*
+ * Sends a frame nobody asked for: cmd has CMD_PUSH set and seq is
+ * push_seq. It is built on the stack, frame may hold part of the next
+ * request. Waits for room behind the last reply like it, the wait is
+ * the line time of what is queued. Dropped only when the link does not
+ * drain.
+ */
+uint8_t pushToGUI(uint8_t cmd, const pb_field_t fields[], const void* msg)
+{
+    uint8_t pb_buffer[SERIAL_PAYLOAD_MAX];
+    uint8_t* const buf = &pb_buffer[FRAME_ENCODED_MAX(PUSH_PAYLOAD_MAX)];
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, PUSH_PAYLOAD_MAX);
+    uint16_t len;
+
+    if (!pb_encode(&stream, fields, msg))
+    {
+        return 1;
+    }
+
+    len = frameEncode(pb_buffer, push_seq++, cmd | CMD_PUSH, buf, stream.bytes_written);
+
+    return usartSendS(GUI_USART, (const char*)pb_buffer, len);
+}
+
+uint8_t processCmd(uint8_t seq, uint8_t cmd, const uint8_t* payload, uint16_t len)
 {
     switch (cmd)
     {
         case CMD_SEND_DIAG:
-            sendDiag();
+            sendDiag(seq);
             break;
         case CMD_SEND_INFO:
-            sendInfo();
+            sendInfo(seq);
             break;
         case CMD_SEND_SETTINGS:
-            sendSettings();
+            sendSettings(seq);
             break;
         case CMD_SAVE_SETTINGS:
-            saveSettings(len);
+            saveSettings(payload, len);
+            break;
+        case CMD_SEND_GEARS:
+            sendGears(seq);
+            break;
+        case CMD_SEND_RECORD:
+            sendRecord(seq, payload, len);
+            break;
+        case CMD_CLEAR_RECORD:
+            clearRecord();
+            break;
+        case CMD_SET_BAUD:
+            setBaud(seq, payload, len);
+            break;
+        case CMD_LINK_CHECK:
+            linkCheck(seq);
+            break;
+        case CMD_LINK_TEST:
+            linkTest(seq, payload, len);
+            break;
+        case CMD_SUBSCRIBE:
+            subscribe(seq, payload, len);
+            break;
+        case CMD_UPDATE:
+            enterUpdate(seq);
             break;
         default:
             return 1;
@@ -147,15 +470,3 @@ uint8_t processCmd(uint8_t cmd, uint8_t len)
 
     return 0;
 }
-
-void DMA1_Ch4_5_IRQHandler(void)
-{
-  /* Test on DMA Stream Transfer Complete interrupt */
-  if (DMA1->ISR & DMA_ISR_TCIF5)
-  {
-    /* Clear DMA Stream Transfer Complete interrupt pending bit */
-    DMA1->IFCR |= DMA_IFCR_CTCIF5;
-
-    update = 1;
-  }
-}
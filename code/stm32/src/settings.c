@@ -1,8 +1,9 @@
+#include <string.h> // memset
 #include "threads.h"
 
 #define FLASH_PAGE_SIZE         (0x00000400) /* FLASH Page Size */
 #define SETTINGS_PAGE           (31) /* Page where the settings are located, starting from 0  */
-#define SETTINGS_ADDRESS        (FLASH_BASE+(FLASH_PAGE_SIZE*SETTINGS_PAGE)) /* 0x8003C00 */
+#define SETTINGS_ADDRESS        (FLASH_BASE+(FLASH_PAGE_SIZE*SETTINGS_PAGE)) /* 0x8007C00 */
 #define FLASH_USER_START_ADDR   (SETTINGS_ADDRESS) /* Start @ of user Flash area */
 #define FLASH_USER_END_ADDR     (SETTINGS_ADDRESS+FLASH_PAGE_SIZE) /* End @ of user Flash area */
 
@@ -22,33 +23,55 @@ const settings_t default_settings = {
     },
     0}; /* CRC */
 
+/*
+ * Fills st from the flash page, or with the defaults. In place, so
+ * main() does not hold two copies on its stack.
+ */
+static void loadSettings(settings_t* st)
+{
+    const settings_t* const flash = (settings_t*)SETTINGS_ADDRESS;
+
+    uint32_t CRCValue;
+
+    CRC_ResetDR();
+    CRCValue = CRC_CalcBlockCRC((uint32_t *)&flash->data, sizeof(flash->data)/4);
+
+    if (CRC_CalcCRC(SETTINGS_VERSION) == flash->CRCValue)
+    {
+        *st = *flash; /* Copy struct from flash to ram */
+        return;
+    }
+
+    /* Version 1, the gear ratios are too coarse to convert and are learned again */
+    if (CRCValue == flash->CRCValue)
+    {
+        *st = *flash;
+        memset(st->data.gears_ratio.bytes, 0, sizeof(st->data.gears_ratio.bytes));
+        return;
+    }
+
+    /* If CRC fails to match, assign default settings */
+    *st = default_settings;
+}
+
 void settingsInit()
 {
-    settings = readSettings();
+    loadSettings(&settings);
 }
 
 settings_t readSettings(void)
 {
     settings_t tmp_st;
-    const settings_t* const st = (settings_t*)SETTINGS_ADDRESS;
 
-    const uint32_t CRCValue = CRC_CalcBlockCRC((uint32_t *)&st->data, sizeof(st->data)/4);
+    loadSettings(&tmp_st);
 
-    tmp_st = *st; /* Copy struct from flash to ram */
-
-    /* If CRC fails to match, assign default settings */
-    if (CRCValue != tmp_st.CRCValue)
-    {
-        return default_settings;
-    }
     return tmp_st;
 }
 
 uint8_t writeSettings(settings_t *st)
 {
-    uint32_t Address = 0x00;
-    uint32_t* tmp_data;
-    uint8_t i = 0;
+    uint32_t Address = FLASH_USER_START_ADDR;
+    const uint32_t* tmp_data = (const uint32_t*)st;
 
     /* Unlock the Flash to enable the flash control register access *************/
     FLASH_Unlock();
@@ -65,15 +88,18 @@ uint8_t writeSettings(settings_t *st)
       return 1;
     }
 
-    st->CRCValue = CRC_CalcBlockCRC((uint32_t *)&st->data, sizeof(st->data)/4);
+    CRC_ResetDR();
+    CRC_CalcBlockCRC((uint32_t *)&st->data, sizeof(st->data)/4);
+    st->CRCValue = CRC_CalcCRC(SETTINGS_VERSION);
 
-    while (Address < (FLASH_USER_START_ADDR+sizeof(st)))
+    /* Word by word from the start of the settings page, address 0 is the
+       vector table remapped to SRAM behind the update stage */
+    while (Address < (FLASH_USER_START_ADDR+sizeof(*st)))
     {
-      tmp_data = (uint32_t*)st+i;
       if (FLASH_ProgramWord(Address, *tmp_data) == FLASH_COMPLETE)
       {
         Address = Address + 4;
-        i += 4;
+        tmp_data++;
       }
       else
       {
@@ -0,0 +1,84 @@
+#include "slip.h"
+
+void wheelFilterInit(wheel_filter_t* w)
+{
+    w->speed = 0;
+    w->accel = 0;
+    w->started = 0;
+}
+
+/*
+ * New capture of a wheel, period is in ticks of clk and spans edges
+ * teeth. clk * edges must stay below 2^22.
+ */
+void wheelFilterUpdate(wheel_filter_t* w, uint32_t period, uint32_t clk, uint8_t edges)
+{
+    int32_t measured, predicted, residual;
+    int64_t accel;
+    uint32_t dt, rate;
+
+    if (period == 0)
+    {
+        return;
+    }
+    if (period > WHEEL_PERIOD_MAX)
+    {
+        period = WHEEL_PERIOD_MAX;
+    }
+
+    /* Q10 division keeps 32 bits, then up to Q16 */
+    measured = (int32_t)(((clk * edges) << 10) / period) << (SLIP_Q - 10);
+
+    if (!w->started)
+    {
+        w->speed = measured;
+        w->accel = 0;
+        w->started = 1;
+        return;
+    }
+
+    /* Seconds since the last capture Q16, and its reciprocal Q10 */
+    dt = (period << SLIP_Q) / clk;
+    if (dt == 0)
+    {
+        dt = 1;
+    }
+    rate = (clk << 10) / period;
+
+    predicted = w->speed + (int32_t)(((int64_t)w->accel * dt) >> SLIP_Q);
+    residual = measured - predicted;
+
+    w->speed = predicted + (residual >> WHEEL_ALPHA_SHIFT);
+
+    /* Multiplying by the rate instead of dividing by dt, no 64 bit division in the ISR */
+    accel = w->accel + (((int64_t)(residual >> WHEEL_BETA_SHIFT) * rate) >> 10);
+    if (accel > WHEEL_ACCEL_MAX)
+    {
+        accel = WHEEL_ACCEL_MAX;
+    }
+    else if (accel < -WHEEL_ACCEL_MAX)
+    {
+        accel = -WHEEL_ACCEL_MAX;
+    }
+    w->accel = (int32_t)accel;
+
+    if (w->speed < 0)
+    {
+        w->speed = 0;
+    }
+}
+
+/*
+ * Rear over front speed minus one, Q16. 0 while the front wheel is
+ * too slow for the ratio to mean anything.
+ */
+int32_t slipRatio(const wheel_filter_t* front, const wheel_filter_t* rear)
+{
+    if (front->speed < SLIP_MIN_SPEED)
+    {
+        return 0;
+    }
+
+    /* Q16 difference over Q8 speed gives Q8, front is at least 1 Hz */
+    return ((rear->speed - front->speed) / (front->speed >> 8)) * 256;
+}
@@ -6,6 +6,11 @@
 
     Driver for 128x64 OLED display based on the SSD1306 controller.
 
+    Text only: the screen holds SSD1306_ROWS lines of SSD1306_COLS
+    characters in the 5x8 font, a controller page each. Characters go
+    to the controller as they are drawn, its own memory is the only
+    copy of the screen.
+
     This driver is based on the SSD1306 Library from Limor Fried
     (Adafruit Industries) at: https://github.com/adafruit/SSD1306  
     
@@ -38,7 +43,6 @@
     (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
     SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
-#include <string.h>
 #include "ssd1306.h"
 #include "stm32f0xx.h"
 
@@ -51,8 +55,6 @@ inline void ssd1306SendByte(uint8_t byte);
                            ssd1306SendByte( c ); \
                          } while (0);
 
-static uint8_t buffer[SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8];
-
 /**************************************************************************/
 /* Private Methods                                                        */
 /**************************************************************************/
@@ -71,6 +73,42 @@ inline void ssd1306SendByte(uint8_t byte)
   while (SSD1306_SPI->SR & SPI_SR_BSY) {};
 }
 
+/**************************************************************************/
+/*!
+    @brief Moves the controller to a character cell, later data bytes
+           fill the page from there
+*/
+/**************************************************************************/
+static void ssd1306SetCell(uint8_t col, uint8_t row)
+{
+  const uint8_t x = col * (Font_System5x8.u8Width + 1);
+
+  CMD(SSD1306_SETPAGESTART | row);
+  CMD(SSD1306_SETLOWCOLUMN | (x & 0x0F));
+  CMD(SSD1306_SETHIGHCOLUMN | (x >> 4));
+}
+
+/**************************************************************************/
+/*!
+    @brief Sends a character at the current cell, a column per byte with
+           the top pixel in bit 0, as the font stores them
+*/
+/**************************************************************************/
+static void ssd1306SendChar(char c)
+{
+  const struct FONT_DEF* font = &Font_System5x8;
+  uint8_t col;
+
+  for (col = 0; col < font->u8Width; col++)
+  {
+    if ((c >= font->u8FirstChar) && (c <= font->u8LastChar))
+      { DATA(font->au8FontTable[((c - 32) * font->u8Width) + col]) }
+    else
+      { DATA(0xFF) }    // Not in the font, solid space
+  }
+  DATA(0x00)
+}
+
 /**************************************************************************/
 /* Public Methods                                                         */
 /**************************************************************************/
@@ -119,7 +157,7 @@ void ssd1306Init(uint8_t vccstate)
   CMD(SSD1306_SETVCOMDETECT);                 // 0xDB
   CMD(0x40);                                  // 0x20 is default?
   CMD(SSD1306_MEMORYMODE);                    // 0x20
-  CMD(0x00);                                  // 0x0 act like ks0108
+  CMD(0x02);                                  // page addressing, a row at a time
   CMD(SSD1306_SEGREMAP | 0x1);
   CMD(SSD1306_COMSCANDEC);
   CMD(SSD1306_CHARGEPUMP);                    //0x8D
@@ -128,86 +166,21 @@ void ssd1306Init(uint8_t vccstate)
   else
     { CMD(0x14) }
 
-  // Auto refresh 50ms - 20fps
-  SSD1306_TIMER->CR1 = 0;
-  SSD1306_TIMER->CR2 = 0;
-  SSD1306_TIMER->CNT = 0;
-  SSD1306_TIMER->PSC = 24000 - 1;	// Set prescaler to 24 000 (PSC + 1) (1KHz)
-  SSD1306_TIMER->ARR = 50;	        // Auto reload value
+  ssd1306ClearScreen();
 }
 
 void ssd1306TurnOn(void)
 {
     // Enable the OLED panel
     CMD(SSD1306_DISPLAYON);
-    SSD1306_TIMER->DIER |= TIM_DIER_UIE; // Enable update interrupt (timer level)
-    NVIC_EnableIRQ(SSD1306_TIMER_IRQn); // Enable interrupt from SSD1306_TIMER (NVIC level)
-    SSD1306_TIMER->CR1 |= TIM_CR1_CEN;   // Enable timer
 }
 
 void ssd1306TurnOff(void)
 {
-    SSD1306_TIMER->CR1 &= ~TIM_CR1_CEN;   // Disable timer
-    SSD1306_TIMER->DIER &= ~TIM_DIER_UIE; // Disable update interrupt (timer level)
-    NVIC_DisableIRQ(SSD1306_TIMER_IRQn); // Disable interrupt from SSD1306_TIMER (NVIC level)
     // Disable the OLED panel
     CMD(SSD1306_DISPLAYOFF);
 }
 
-/**************************************************************************/
-/*! 
-    @brief Draws a single pixel in image buffer
-
-    @param[in]  x
-                The x position (0..127)
-    @param[in]  y
-                The y position (0..63)
-*/
-/**************************************************************************/
-void ssd1306DrawPixel(uint8_t x, uint8_t y) 
-{
-  if ((x >= SSD1306_LCDWIDTH) || (y >= SSD1306_LCDHEIGHT))
-    return;
-
-  buffer[x+ (y/8)*SSD1306_LCDWIDTH] |= (1 << y%8);
-}
-
-/**************************************************************************/
-/*! 
-    @brief Clears a single pixel in image buffer
-
-    @param[in]  x
-                The x position (0..127)
-    @param[in]  y
-                The y position (0..63)
-*/
-/**************************************************************************/
-void ssd1306ClearPixel(uint8_t x, uint8_t y) 
-{
-  if ((x >= SSD1306_LCDWIDTH) || (y >= SSD1306_LCDHEIGHT))
-    return;
-
-  buffer[x+ (y/8)*SSD1306_LCDWIDTH] &= ~(1 << y%8); 
-}
-
-/**************************************************************************/
-/*! 
-    @brief Gets the value (1 or 0) of the specified pixel from the buffer
-
-    @param[in]  x
-                The x position (0..127)
-    @param[in]  y
-                The y position (0..63)
-
-    @return     1 if the pixel is enabled, 0 if disabled
-*/
-/**************************************************************************/
-uint8_t ssd1306GetPixel(uint8_t x, uint8_t y)
-{
-  if ((x >= SSD1306_LCDWIDTH) || (y >=SSD1306_LCDHEIGHT)) return 0;
-  return buffer[x+ (y/8)*SSD1306_LCDWIDTH] & (1 << y%8) ? 1 : 0;
-}
-
 /**************************************************************************/
 /*! 
     @brief Clears the screen
@@ -215,300 +188,70 @@ uint8_t ssd1306GetPixel(uint8_t x, uint8_t y)
 /**************************************************************************/
 void ssd1306ClearScreen() 
 {
-  memset(buffer, 0, 1024);
-}
-
-/**************************************************************************/
-/*!
-    @brief Draws a line
-*/
-/**************************************************************************/
-void ssd1306DrawLine(uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1) {
-    uint8_t dy, dx;
-    uint8_t addx, addy;
-    int16_t P, diff, i;
-
-    if (x1 >= x0) {
-        dx = x1 - x0;
-        addx = 1;
-    } else {
-        dx = x0 - x1;
-        addx = -1;
-    }
-    if (y1 >= y0) {
-        dy = y1 - y0;
-        addy = 1;
-    } else {
-        dy = y0 - y1;
-        addy = -1;
-    }
-
-    if (dx >= dy) {
-        dy *= 2;
-        P = dy - dx;
-        diff = P - dx;
-
-        for(i=0; i<=dx; ++i) {
-            buffer[x0+ (y0/8)*SSD1306_LCDWIDTH] |= ~(1 << y0%8);
-            if (P < 0) {
-                P  += dy;
-                x0 += addx;
-            } else {
-                P  += diff;
-                x0 += addx;
-                y0 += addy;
-            }
-        }
-    } else {
-        dx *= 2;
-        P = dx - dy;
-        diff = P - dy;
-
-        for(i=0; i<=dy; ++i) {
-            buffer[x0+ (y0/8)*SSD1306_LCDWIDTH] |= ~(1 << y0%8);
-            if (P < 0) {
-                P  += dx;
-                y0 += addy;
-            } else {
-                P  += diff;
-                x0 += addx;
-                y0 += addy;
-            }
-        }
-    }
-}
+  uint8_t row, x;
 
-/**************************************************************************/
-/*!
-    @brief Draws a circle
-*/
-/**************************************************************************/
-void ssd1306DrawCircle(uint8_t x, uint8_t y, uint8_t radius) {
-    int16_t a, b, P;
-
-    a = 0;
-    b = radius;
-    P = 1 - radius;
-
-    do {
-        buffer[(x+a)+ ((y+b)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y+b)%8);
-        buffer[(x+b)+ ((y+a)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y+a)%8);
-        buffer[(x-a)+ ((y+b)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y+b)%8);
-        buffer[(x-b)+ ((y+a)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y+a)%8);
-        buffer[(x+b)+ ((y-a)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y-a)%8);
-        buffer[(x+a)+ ((y+b)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y+b)%8);
-        buffer[(x-a)+ ((y-b)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y-b)%8);
-        buffer[(x-b)+ ((y-a)/8)*SSD1306_LCDWIDTH] |= ~(1 << (y-a)%8);
-        if (P < 0)
-            P += 3 + 2*a++;
-        else
-            P += 5 + 2*(a++ - b--);
-    } while(a <= b);
+  for (row = 0; row < SSD1306_ROWS; row++)
+  {
+    CMD(SSD1306_SETPAGESTART | row);
+    CMD(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
+    CMD(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
+    for (x = 0; x < SSD1306_LCDWIDTH; x++)
+      { DATA(0x00) }
+  }
 }
 
 /**************************************************************************/
 /*!
-    @brief Draws a filled rectangle
-*/
-/**************************************************************************/
-void ssd1306FillArea(uint8_t x, uint8_t y, uint8_t cx, uint8_t cy) {
-    uint8_t x0, x1, y1;
-
-    x0 = x;
-    x1 = x + cx;
-    y1 = y + cy;
-    for(; y < y1; y++)
-        for(x = x0; x < x1; x++)
-            buffer[x+ (y/8)*SSD1306_LCDWIDTH] |= ~(1 << y%8);
-}
+    @brief  Draws a single character, off screen ones are dropped
 
-/**************************************************************************/
-/*! 
-    @brief Renders the contents of the pixel buffer on the LCD
+    @param[in]  col
+                Column, 0..SSD1306_COLS-1
+    @param[in]  row
+                Row, 0..SSD1306_ROWS-1
 */
 /**************************************************************************/
-void ssd1306Refresh(void) 
+void ssd1306DrawChar(uint8_t col, uint8_t row, char c)
 {
-  CMD(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
-  CMD(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
-  CMD(SSD1306_SETSTARTLINE | 0x0); // line #0
-
-  palSetPad( SSD1306_DC_PORT, SSD1306_DC_PIN);
-
-  spiSendS(SSD1306_SPI, buffer, 1024);
-}
-
-/**************************************************************************/
-/*!
-    @brief  Draws a single graphic character using the supplied font
-*/
-/**************************************************************************/
-void ssd1306DrawChar(uint8_t x, uint8_t y, uint8_t c, struct FONT_DEF font)
-{
-  uint8_t col, column[font.u8Width];
-
-  // Check if the requested character is available
-  if ((c >= font.u8FirstChar) && (c <= font.u8LastChar))
-  {
-    // Retrieve appropriate columns from font data
-    for (col = 0; col < font.u8Width; col++)
-    {
-      column[col] = font.au8FontTable[((c - 32) * font.u8Width) + col];    // Get first column of appropriate character
-    }
-  }
-  else
-  {
-    // Requested character is not available in this font ... send a space instead
-    for (col = 0; col < font.u8Width; col++)
-    {
-      column[col] = 0xFF;    // Send solid space
-    }
-  }
-
-  // Render each column
-  uint16_t xoffset, yoffset;
-  for (xoffset = 0; xoffset < font.u8Width; xoffset++)
+  if ((col < SSD1306_COLS) && (row < SSD1306_ROWS))
   {
-    for (yoffset = 0; yoffset < (font.u8Height + 1); yoffset++)
-    {
-      uint8_t bit = 0x00;
-      bit = (column[xoffset] << (8 - (yoffset + 1)));     // Shift current row bit left
-      bit = (bit >> 7);                     // Shift current row but right (results in 0x01 for black, and 0x00 for white)
-      if (bit)
-      {
-        ssd1306DrawPixel(x + xoffset, y + yoffset);
-      }
-    }
+    ssd1306SetCell(col, row);
+    ssd1306SendChar(c);
   }
 }
 
 /**************************************************************************/
 /*!
-    @brief  Draws a string using the supplied font data.
+    @brief  Draws a string from col, cut at the right edge.
 
-    @param[in]  x
-                Starting x co-ordinate
-    @param[in]  y
-                Starting y co-ordinate
+    @param[in]  col
+                Starting column
+    @param[in]  row
+                Row
     @param[in]  text
                 The string to render
-    @param[in]  font
-                Pointer to the FONT_DEF to use when drawing the string
 
     @section Example
 
     @code 
 
-    #include "drivers/lcd/bitmap/ssd1306/ssd1306.h"
-    #include "drivers/lcd/smallfonts.h"
-    
     // Configure the pins and initialise the LCD screen
-    ssd1306Init();
+    ssd1306Init(SSD1306_SWITCHCAPVCC);
+    ssd1306TurnOn();
 
     // Render some text on the screen
-    ssd1306DrawString(1, 10, "5x8 System", Font_System5x8);
-    ssd1306DrawString(1, 20, "7x8 System", Font_System7x8);
-
-    // Refresh the screen to see the results
-    ssd1306Refresh();
-
-    @endcode
-*/
-/**************************************************************************/
-void ssd1306DrawString(uint8_t x, uint8_t y, const char *text, struct FONT_DEF font)
-{
-  uint8_t l;
-  for (l = 0; l < strlen(text); l++)
-  {
-    ssd1306DrawChar(x + (l * (font.u8Width + 1)), y, text[l], font);
-  }
-}
-
-/**************************************************************************/
-/*!
-    @brief  Shifts the contents of the frame buffer up the specified
-            number of pixels
-
-    @param[in]  height
-                The number of pixels to shift the frame buffer up, leaving
-                a blank space at the bottom of the frame buffer x pixels
-                high
-
-    @section Example
-
-    @code 
-
-    #include "drivers/lcd/bitmap/ssd1306/ssd1306.h"
-    #include "drivers/lcd/smallfonts.h"
-    
-    // Configure the pins and initialise the LCD screen
-    ssd1306Init();
-
-    // Enable the backlight
-    ssd1306BLEnable();
-
-    // Continually write some text, scrolling upward one line each time
-    while (1)
-    {
-      // Shift the buffer up 8 pixels (adjust for font-height)
-      ssd1306ShiftFrameBuffer(8);
-      // Render some text on the screen with different fonts
-      ssd1306DrawString(1, 56, "INSERT TEXT HERE", Font_System5x8);
-      // Refresh the screen to see the results
-      ssd1306Refresh();    
-      // Wait a bit before writing the next line
-      systicknilThdSleepMilliseconds(1000);
-    }
+    ssd1306DrawString(1, 2, "5x8 System");
 
     @endcode
 */
 /**************************************************************************/
-void ssd1306ShiftFrameBuffer( uint8_t height )
+void ssd1306DrawString(uint8_t col, uint8_t row, const char *str)
 {
-  if (height == 0) return;
-  if (height >= SSD1306_LCDHEIGHT)
-  {
-    // Clear the entire frame buffer
-    ssd1306ClearScreen();
+  if ((col >= SSD1306_COLS) || (row >= SSD1306_ROWS))
     return;
-  }
-
-  // This is horribly inefficient, but at least easy to understand
-  // In a production environment, this should be significantly optimised
 
-  uint8_t y, x;
-  for (y = 0; y < SSD1306_LCDHEIGHT; y++)
+  ssd1306SetCell(col, row);
+  for (; (*str != '\0') && (col < SSD1306_COLS); str++, col++)
   {
-    for (x = 0; x < SSD1306_LCDWIDTH; x++)
-    {
-      if ((SSD1306_LCDHEIGHT - 1) - y > height)
-      {
-        // Shift height from further ahead in the buffer
-        ssd1306GetPixel(x, y + height) ? ssd1306DrawPixel(x, y) : ssd1306ClearPixel(x, y);
-      }
-      else
-      {
-        // Clear the entire line
-        ssd1306ClearPixel(x, y);
-      }
-    }
+    ssd1306SendChar(*str);
   }
 }
-
-void SSD1306_TIMER_IRQHandler(void)
-{
-    if(SSD1306_TIMER->SR & TIM_SR_UIF) // if UIF flag is set
-    {
-        SSD1306_TIMER->SR &= ~TIM_SR_UIF; // clear UIF flag
-
-        CMD(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
-        CMD(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
-        CMD(SSD1306_SETSTARTLINE | 0x0); // line #0
-
-        palSetPad(SSD1306_DC_PORT, SSD1306_DC_PIN);
-
-        spiSendI(SSD1306_SPI, buffer, 1024);
-
-        palTogglePad(GPIOC, GPIOC_LED4); /* Display heartbeat */
-    }
-}
@@ -0,0 +1,173 @@
+#include "tc.h"
+
+static uint32_t gearTrim(const Settings_data* data, uint8_t gear)
+{
+    if (gear >= data->tc_gear_trim.size || data->tc_gear_trim.bytes[gear] == 0)
+    {
+        return 100;
+    }
+    return data->tc_gear_trim.bytes[gear];
+}
+
+/* Share of the cut time at an RPM, in percent */
+static uint32_t rpmScale(const Settings_data* data, uint32_t rpm)
+{
+    if (data->min_rpm >= TC_RPM_FULL || rpm >= TC_RPM_FULL)
+    {
+        return 100;
+    }
+    if (rpm <= data->min_rpm)
+    {
+        return TC_CUT_LOW_PCT;
+    }
+    return TC_CUT_LOW_PCT + ((100 - TC_CUT_LOW_PCT) * (rpm - data->min_rpm))
+            / (TC_RPM_FULL - data->min_rpm);
+}
+
+/*
+ * Fills the row of a gear from slip_threshold, min_rpm and
+ * tc_gear_trim, cut_time is the cut in ms at 100% trim and full RPM.
+ */
+void tcBuildRow(tc_row_t* row, const Settings_data* data, uint8_t cut_time, uint8_t gear)
+{
+    const uint32_t trim = gearTrim(data, gear);
+    uint32_t threshold = (data->slip_threshold * 100) / trim;
+    uint8_t point;
+
+    if (threshold > 0xFF)
+    {
+        threshold = 0xFF;
+    }
+    row->threshold = threshold;
+
+    for (point = 0; point < TC_RPM_POINTS; point++)
+    {
+        uint32_t cut = (cut_time * trim * rpmScale(data, (uint32_t)point << TC_RPM_SHIFT)) / 10000;
+
+        if (cut > TC_CUT_MAX)
+        {
+            cut = TC_CUT_MAX;
+        }
+        else if (cut == 0)
+        {
+            cut = 1;
+        }
+        row->cut_time[point] = cut;
+    }
+}
+
+void tcBuildTable(tc_table_t* table, const Settings_data* data, uint8_t cut_time)
+{
+    uint8_t gear;
+
+    for (gear = 0; gear < TC_GEARS; gear++)
+    {
+        tcBuildRow(&table->gear[gear], data, cut_time, gear);
+    }
+}
+
+tc_entry_t tcLookup(const tc_table_t* table, uint8_t gear, uint32_t rpm)
+{
+    const uint32_t point = rpm >> TC_RPM_SHIFT;
+    const tc_row_t* row;
+    tc_entry_t entry;
+    int32_t low, high;
+
+    if (gear >= TC_GEARS)
+    {
+        gear = TC_GEARS - 1;
+    }
+    row = &table->gear[gear];
+    entry.threshold = row->threshold;
+
+    if (point >= TC_RPM_POINTS - 1)
+    {
+        entry.cut_time = row->cut_time[TC_RPM_POINTS - 1];
+        return entry;
+    }
+
+    low = row->cut_time[point];
+    high = row->cut_time[point + 1];
+    entry.cut_time = low + (((high - low) * (int32_t)(rpm & ((1 << TC_RPM_SHIFT) - 1))) >> TC_RPM_SHIFT);
+    return entry;
+}
+
+void tcPiInit(tc_pi_t* pi)
+{
+    pi->integral = 0;
+}
+
+/*
+ * One controller step, error is the slip above the threshold in
+ * percent and dt the time since the previous step in us. Returns the
+ * cut depth, 0 to TC_DEPTH_FULL. The integral only covers what the
+ * proportional term cannot reach, so it does not wind up.
+ */
+uint16_t tcPiUpdate(tc_pi_t* pi, int32_t error, uint32_t dt)
+{
+    int32_t depth;
+
+    if (error > TC_PI_ERROR_MAX)
+    {
+        error = TC_PI_ERROR_MAX;
+    }
+    else if (error < -TC_PI_ERROR_MAX)
+    {
+        error = -TC_PI_ERROR_MAX;
+    }
+    if (dt > TC_PI_DT_MAX)
+    {
+        dt = TC_PI_DT_MAX;
+    }
+
+    /* Q8 depth, 1e6/256 us per Q8 second */
+    pi->integral += (TC_PI_KI * error * (int32_t)dt) / 3906;
+    if (pi->integral < 0)
+    {
+        pi->integral = 0;
+    }
+    else if (pi->integral > (TC_DEPTH_FULL << 8))
+    {
+        pi->integral = TC_DEPTH_FULL << 8;
+    }
+
+    depth = TC_PI_KP * error + (pi->integral >> 8);
+    if (depth < 0)
+    {
+        return 0;
+    }
+    if (depth > TC_DEPTH_FULL)
+    {
+        return TC_DEPTH_FULL;
+    }
+    return depth;
+}
+
+void tcPatternInit(tc_pattern_t* p)
+{
+    uint8_t i;
+
+    for (i = 0; i < TC_CYLINDERS; i++)
+    {
+        p->acc[i] = (i * TC_DEPTH_FULL) / TC_CYLINDERS;
+    }
+}
+
+/*
+ * Cylinders to cut during the next revolution, bit i for cylinder i.
+ */
+uint8_t tcPatternNext(tc_pattern_t* p, uint16_t depth)
+{
+    uint8_t i, cut = 0;
+
+    for (i = 0; i < TC_CYLINDERS; i++)
+    {
+        p->acc[i] += depth;
+        if (p->acc[i] >= TC_DEPTH_FULL)
+        {
+            p->acc[i] -= TC_DEPTH_FULL;
+            cut |= 1 << i;
+        }
+    }
+    return cut;
+}
@@ -0,0 +1,301 @@
+#include <string.h>
+#include "stm32f0xx.h"
+#include "updater.h"
+
+#define UPDATER_FLASH_FLAGS (FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR)
+
+static uint8_t updaterBegin(updater_t* u, const uint8_t* payload, uint16_t len);
+static uint8_t updaterBlock(updater_t* u, const uint8_t* payload, uint16_t len);
+static uint8_t updaterEnd(updater_t* u);
+
+void updaterInit(updater_t* u, uint32_t baud)
+{
+    memset(u, 0, sizeof(*u));
+    frameDecoderInit(&u->decoder, u->packet, sizeof(u->packet));
+    u->baud = baud;
+}
+
+/*
+ * Feeds one byte of the link, returns the length of the reply frame
+ * written to reply once it completes a request, 0 otherwise. reply
+ * holds UPDATER_REPLY_MAX bytes.
+ */
+uint16_t updaterReceive(updater_t* u, uint8_t byte, uint8_t* reply)
+{
+    uint8_t link[UPDATER_LINK_SIZE];
+    uint32_t baud = u->baud;
+    uint8_t status, len = 0;
+
+    if (frameDecode(&u->decoder, byte) != FRAME_OK)
+    {
+        return 0;
+    }
+
+    /* link_t, the rate as field 1 varint, so the GUI finds the stage as it found the application */
+    if (frameCmd(&u->decoder) == CMD_UPDATE)
+    {
+        link[len++] = 0x08;
+        while (baud >= 0x80)
+        {
+            link[len++] = baud | 0x80;
+            baud >>= 7;
+        }
+        link[len++] = baud;
+
+        return frameEncode(reply, frameSeq(&u->decoder), CMD_UPDATE, link, len);
+    }
+
+    status = updaterProcess(u, frameCmd(&u->decoder), framePayload(&u->decoder),
+                            framePayloadLen(&u->decoder));
+    if (status == UPDATER_NONE)
+    {
+        return 0;
+    }
+
+    return frameEncode(reply, frameSeq(&u->decoder), frameCmd(&u->decoder), &status, 1);
+}
+
+uint8_t updaterProcess(updater_t* u, uint8_t cmd, const uint8_t* payload, uint16_t len)
+{
+    switch (cmd)
+    {
+        case CMD_UPDATE_BEGIN:
+            return updaterBegin(u, payload, len);
+        case CMD_UPDATE_BLOCK:
+            return updaterBlock(u, payload, len);
+        case CMD_UPDATE_END:
+            return updaterEnd(u);
+    }
+
+    return UPDATER_NONE;
+}
+
+/*
+ * An image the stage committed is checked against its record, size and
+ * CRC. Without a record, the ROM bootloader flashed it and only its
+ * vectors are checked. The CRC unit clock must be on.
+ */
+uint8_t updaterAppValid(void)
+{
+    const uint32_t* vectors = (const uint32_t*)UPDATE_APP_ADDR;
+    const uint32_t* record = (const uint32_t*)UPDATE_RECORD_ADDR;
+    const uint32_t size = record[UPDATE_RECORD_SIZE];
+
+    if (vectors[0] <= UPDATE_RAM_ADDR || vectors[0] > UPDATE_RAM_ADDR + UPDATE_RAM_SIZE
+            || vectors[1] < UPDATE_APP_ADDR || vectors[1] >= UPDATE_APP_ADDR + UPDATE_APP_SIZE)
+    {
+        return 0;
+    }
+
+    if (record[UPDATE_RECORD_STATE] == UPDATE_RECORD_ERASED)
+    {
+        return 1;
+    }
+    if (record[UPDATE_RECORD_STATE] != UPDATE_RECORD_STARTED
+            || size == 0 || size > UPDATE_APP_SIZE || (size & 3))
+    {
+        return 0;
+    }
+
+    CRC_ResetDR();
+    return CRC_CalcBlockCRC((uint32_t*)UPDATE_APP_ADDR, size / 4) == record[UPDATE_RECORD_CRC];
+}
+
+static uint8_t updaterErase(uint32_t address)
+{
+    FLASH_ClearFlag(UPDATER_FLASH_FLAGS);
+
+    return FLASH_ErasePage(address) != FLASH_COMPLETE;
+}
+
+/* Words, then read back */
+static uint8_t updaterProgram(uint32_t address, const uint8_t* data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i += 4)
+    {
+        FLASH_ClearFlag(UPDATER_FLASH_FLAGS);
+        if (FLASH_ProgramWord(address + i, updateGet32(data + i)) != FLASH_COMPLETE)
+        {
+            return 1;
+        }
+    }
+
+    return memcmp((const void*)address, data, len) != 0;
+}
+
+/*
+ * The record goes first, then the first page: from now on no image
+ * starts until the end of the update, whenever it is cut.
+ */
+static uint8_t updaterBegin(updater_t* u, const uint8_t* payload, uint16_t len)
+{
+    uint8_t started[4];
+    uint32_t size;
+
+    if (len != UPDATE_BEGIN_LEN)
+    {
+        return UPDATE_ERROR_SIZE;
+    }
+
+    size = updateGet32(payload);
+    if (size == 0 || size > UPDATE_APP_SIZE || (size & 3))
+    {
+        return UPDATE_ERROR_SIZE;
+    }
+
+    u->size = 0;
+    updatePut32(started, UPDATE_RECORD_STARTED);
+    FLASH_Unlock();
+    if (updaterErase(UPDATE_RECORD_ADDR)
+            || updaterProgram(UPDATE_RECORD_ADDR + UPDATE_RECORD_STATE * 4, started, sizeof(started))
+            || updaterErase(UPDATE_APP_ADDR))
+    {
+        return UPDATE_ERROR_FLASH;
+    }
+
+    memset(u->first, 0xFF, sizeof(u->first));
+    u->size = size;
+    u->crc = updateGet32(payload + 4);
+    u->next = 0;
+    u->erased = 1;
+
+    return UPDATE_OK;
+}
+
+/*
+ * Copies or compares one block, page by page: the first page goes to
+ * RAM, the others are erased on their first block and programmed.
+ */
+static uint8_t updaterWrite(updater_t* u, uint32_t offset, const uint8_t* data, uint32_t len, uint8_t compare)
+{
+    uint32_t page, n;
+
+    for (; len; offset += n, data += n, len -= n)
+    {
+        page = offset / UPDATE_PAGE_SIZE;
+        n = (page + 1) * UPDATE_PAGE_SIZE - offset;
+        if (n > len)
+        {
+            n = len;
+        }
+
+        if (page == 0)
+        {
+            if (compare && memcmp((uint8_t*)u->first + offset, data, n) != 0)
+            {
+                return 1;
+            }
+            memcpy((uint8_t*)u->first + offset, data, n);
+            continue;
+        }
+
+        if (compare)
+        {
+            if (memcmp((const void*)(UPDATE_APP_ADDR + offset), data, n) != 0)
+            {
+                return 1;
+            }
+            continue;
+        }
+
+        while (u->erased <= page)
+        {
+            if (updaterErase(UPDATE_APP_ADDR + u->erased * UPDATE_PAGE_SIZE))
+            {
+                return 1;
+            }
+            u->erased++;
+        }
+
+        if (updaterProgram(UPDATE_APP_ADDR + offset, data, n))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The last block again is acknowledged again, it is its reply that was lost */
+static uint8_t updaterBlock(updater_t* u, const uint8_t* payload, uint16_t len)
+{
+    uint32_t offset;
+
+    if (u->size == 0)
+    {
+        return UPDATE_ERROR_STATE;
+    }
+    if (len <= UPDATE_BLOCK_HEADER || len > UPDATE_PAYLOAD_MAX || (len & 3))
+    {
+        return UPDATE_ERROR_SIZE;
+    }
+
+    offset = updateGet32(payload);
+    payload += UPDATE_BLOCK_HEADER;
+    len -= UPDATE_BLOCK_HEADER;
+
+    if (offset < u->next && offset + len == u->next)
+    {
+        return updaterWrite(u, offset, payload, len, 1) ? UPDATE_ERROR_OFFSET : UPDATE_OK;
+    }
+    if (offset != u->next)
+    {
+        return UPDATE_ERROR_OFFSET;
+    }
+    if (offset + len > u->size)
+    {
+        return UPDATE_ERROR_SIZE;
+    }
+
+    if (updaterWrite(u, offset, payload, len, 0))
+    {
+        return UPDATE_ERROR_FLASH;
+    }
+    u->next += len;
+
+    return UPDATE_OK;
+}
+
+/* The image is checked as it will run, the first page from RAM, then committed */
+static uint8_t updaterEnd(updater_t* u)
+{
+    const uint32_t first = u->size < UPDATE_PAGE_SIZE ? u->size : UPDATE_PAGE_SIZE;
+    uint8_t record[8];
+    uint32_t crc;
+
+    if (u->size == 0 || u->next != u->size)
+    {
+        return UPDATE_ERROR_STATE;
+    }
+
+    CRC_ResetDR();
+    crc = CRC_CalcBlockCRC(u->first, first / 4);
+    if (u->size > first)
+    {
+        crc = CRC_CalcBlockCRC((uint32_t*)(UPDATE_APP_ADDR + first), (u->size - first) / 4);
+    }
+
+    /* Starts over with the next CMD_UPDATE_BEGIN */
+    updatePut32(record, u->size);
+    updatePut32(record + 4, crc);
+    u->size = 0;
+    if (crc != u->crc)
+    {
+        FLASH_Lock();
+        return UPDATE_ERROR_CRC;
+    }
+
+    if (updaterProgram(UPDATE_APP_ADDR, (const uint8_t*)u->first, first)
+            || updaterProgram(UPDATE_RECORD_ADDR + UPDATE_RECORD_SIZE * 4, record, sizeof(record)))
+    {
+        FLASH_Lock();
+        return UPDATE_ERROR_FLASH;
+    }
+
+    FLASH_Lock();
+    u->committed = 1;
+
+    return UPDATE_OK;
+}
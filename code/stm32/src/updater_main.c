@@ -0,0 +1,132 @@
+#include "stm32f0xx.h"
+#include "updater.h"
+
+/*
+ * Resident update stage, a bare program in front of the application,
+ * without the RTOS or the HAL. It starts the application unless the
+ * application asked for an update or is not valid, then serves the
+ * update requests on USART1, polled, until one is committed. The GUI
+ * waits for each reply, so nothing comes in while the flash stalls the
+ * CPU.
+ */
+
+#define UPDATER_CLOCK 48000000  /* HSI/2 x 12, as the application */
+#define UPDATER_BAUD_MIN 9600
+#define UPDATER_BRR_MIN 16      /* Oversampling by 16 */
+
+extern uint32_t _sidata, _sdata, _edata, _sbss, _ebss, _estack;
+
+void updaterReset(void);
+static void updaterFault(void);
+
+/* Stack, reset, NMI and hard fault, nothing else is enabled */
+__attribute__ ((section("vectors"), used))
+void (* const updater_vectors[4])(void) = {
+    (void (*)(void))&_estack, updaterReset, updaterFault, updaterFault
+};
+
+static updater_t updater;
+static uint8_t reply[UPDATER_REPLY_MAX];
+
+static void updaterFault(void)
+{
+    NVIC_SystemReset();
+}
+
+/* Straight from reset, the application sets its clocks and vectors itself */
+static void updaterStart(void)
+{
+    const uint32_t* vectors = (const uint32_t*)UPDATE_APP_ADDR;
+
+    __set_MSP(vectors[0]);
+    ((void (*)(void))vectors[1])();
+}
+
+static void updaterClock(void)
+{
+    /* One wait state before the clock goes up */
+    FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY;
+
+    RCC->CFGR = RCC_CFGR_PLLSRC_HSI_Div2 | RCC_CFGR_PLLMULL12;
+    RCC->CR |= RCC_CR_PLLON;
+    while (!(RCC->CR & RCC_CR_PLLRDY));
+
+    RCC->CFGR |= RCC_CFGR_SW_PLL;
+    while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+}
+
+/* PA9 TX and PA10 RX on AF1, as board.h has them */
+static void updaterUsart(uint32_t baud)
+{
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN;
+    RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+
+    GPIOA->AFR[1] = (GPIOA->AFR[1] & ~0x00000FF0) | 0x00000110;
+    GPIOA->OSPEEDR |= 0x3 << 18;
+    GPIOA->PUPDR = (GPIOA->PUPDR & ~(0x3 << 20)) | (0x1 << 20);
+    GPIOA->MODER = (GPIOA->MODER & ~(0xF << 18)) | (0xA << 18);
+
+    USART1->BRR = (UPDATER_CLOCK + baud / 2) / baud;
+    USART1->CR1 = USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+}
+
+void updaterReset(void)
+{
+    volatile uint32_t* const handoff = (volatile uint32_t*)UPDATE_HANDOFF_ADDR;
+    uint32_t baud = UPDATER_BAUD;
+    const uint32_t* src;
+    uint32_t* dst;
+    uint16_t len, i;
+
+    /* The image is checked by the CRC unit, .data and .bss are not set up yet */
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+
+    /* Only a reset from CMD_UPDATE leaves the magic, SRAM holds noise after a power up */
+    if (handoff[0] != UPDATE_MAGIC && updaterAppValid())
+    {
+        updaterStart();
+    }
+    if (handoff[0] == UPDATE_MAGIC && handoff[1] >= UPDATER_BAUD_MIN
+            && UPDATER_CLOCK / handoff[1] >= UPDATER_BRR_MIN)
+    {
+        baud = handoff[1];
+    }
+    handoff[0] = 0;
+
+    for (src = &_sidata, dst = &_sdata; dst < &_edata;)
+    {
+        *dst++ = *src++;
+    }
+    for (dst = &_sbss; dst < &_ebss;)
+    {
+        *dst++ = 0;
+    }
+
+    updaterClock();
+    updaterUsart(baud);
+    updaterInit(&updater, baud);
+
+    while (!updater.committed)
+    {
+        /* A glitch only costs the frame it hit */
+        if (USART1->ISR & (USART_ISR_ORE | USART_ISR_FE | USART_ISR_NE))
+        {
+            USART1->ICR = USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_NCF;
+        }
+        if (!(USART1->ISR & USART_ISR_RXNE))
+        {
+            continue;
+        }
+
+        len = updaterReceive(&updater, USART1->RDR, reply);
+        for (i = 0; i < len; i++)
+        {
+            while (!(USART1->ISR & USART_ISR_TXE));
+            USART1->TDR = reply[i];
+        }
+    }
+
+    /* The reply out, then into the new application */
+    while (!(USART1->ISR & USART_ISR_TC));
+    NVIC_SystemReset();
+}